@@ -0,0 +1,387 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <poll.h>
+#include <resolv.h>
+#include <string>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <gromox/fileio.h>
+#include <gromox/scope.hpp>
+#include <gromox/util.hpp>
+#include "dnsbl_resolver.hpp"
+
+namespace gromox {
+
+static bool dnsbl_parse_server(const char *s, struct sockaddr_storage &ss)
+{
+	std::string host = s;
+	unsigned long port = NS_DEFAULTPORT;
+	if (host.size() > 0 && host[0] == '[') {
+		auto end = host.find(']');
+		if (end == host.npos)
+			return false;
+		if (host[end+1] == ':')
+			port = strtoul(&host[end+2], nullptr, 10);
+		host = host.substr(1, end - 1);
+	} else if (std::count(host.begin(), host.end(), ':') == 1) {
+		auto colon = host.find(':');
+		port = strtoul(&host[colon+1], nullptr, 10);
+		host.erase(colon);
+	}
+	if (port == 0 || port > 65535)
+		return false;
+	/* fe80::1%eth0 */
+	unsigned int scope = 0;
+	auto pct = host.find('%');
+	if (pct != host.npos) {
+		scope = if_nametoindex(&host[pct+1]);
+		if (scope == 0)
+			return false;
+		host.erase(pct);
+	}
+	memset(&ss, 0, sizeof(ss));
+	auto v4 = reinterpret_cast<struct sockaddr_in *>(&ss);
+	auto v6 = reinterpret_cast<struct sockaddr_in6 *>(&ss);
+	if (scope == 0 && inet_pton(AF_INET, host.c_str(), &v4->sin_addr) == 1) {
+		v4->sin_family = AF_INET;
+		v4->sin_port   = htons(port);
+		return true;
+	} else if (inet_pton(AF_INET6, host.c_str(), &v6->sin6_addr) == 1) {
+		v6->sin6_family = AF_INET6;
+		v6->sin6_port   = htons(port);
+		v6->sin6_scope_id = scope;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * @list:	whitespace-separated list of addr, addr:port or [addr]:port;
+ * 		if nullptr or empty, the nameservers from /etc/resolv.conf
+ *
+ * Entries that cannot be used are skipped with a warning. Returns the number
+ * of servers, or -EINVAL if none are left.
+ */
+int dnsbl_resolver::set_servers(const char *list) try
+{
+	std::vector<struct sockaddr_storage> sv;
+	std::string words;
+	if (list != nullptr && *list != '\0') {
+		words = list;
+	} else {
+		std::unique_ptr<FILE, file_deleter> fp(fopen(_PATH_RESCONF, "r"));
+		char line[256];
+		while (fp != nullptr && fgets(line, std::size(line), fp.get()) != nullptr) {
+			char key[16], val[64];
+			if (sscanf(line, "%15s %63s", key, val) == 2 &&
+			    strcmp(key, "nameserver") == 0) {
+				words += val;
+				words += ' ';
+			}
+		}
+		if (words.empty())
+			words = "127.0.0.1";
+	}
+	for (auto tok = strtok(words.data(), " \t,"); tok != nullptr;
+	     tok = strtok(nullptr, " \t,")) {
+		struct sockaddr_storage ss;
+		if (!dnsbl_parse_server(tok, ss)) {
+			mlog(LV_WARN, "W-1760: dnsbl: ignoring unusable nameserver \"%s\"", tok);
+			continue;
+		}
+		sv.push_back(ss);
+	}
+	if (sv.empty())
+		return -EINVAL;
+	std::lock_guard lk(m_lock);
+	m_servers = std::move(sv);
+	return m_servers.size();
+} catch (const std::bad_alloc &) {
+	return -ENOMEM;
+}
+
+static std::string dnsbl_qname(const struct in6_addr &a, const std::string &zone)
+{
+	static constexpr char txt[] = "0123456789abcdef";
+	std::string s;
+	s.reserve(64 + zone.size() + 1);
+	for (unsigned int i = 16; i-- > 0; ) {
+		s += txt[a.s6_addr[i] & 0xF];
+		s += '.';
+		s += txt[(a.s6_addr[i] & 0xF0) >> 4];
+		s += '.';
+	}
+	s += zone;
+	return s;
+}
+
+/* Build a TXT query for @name into @buf; returns its length or 0. */
+static size_t dnsbl_mkquery(uint16_t id, const std::string &name,
+    uint8_t *buf, size_t bufsize)
+{
+	if (bufsize < NS_HFIXEDSZ + name.size() + 2 + NS_QFIXEDSZ)
+		return 0;
+	memset(buf, 0, NS_HFIXEDSZ);
+	buf[0] = id >> 8;
+	buf[1] = id;
+	buf[2] = 0x01; /* RD */
+	buf[5] = 1;    /* QDCOUNT */
+	size_t z = NS_HFIXEDSZ;
+	for (size_t i = 0; i < name.size(); ) {
+		auto dot = name.find('.', i);
+		if (dot == name.npos)
+			dot = name.size();
+		auto len = dot - i;
+		if (len == 0 || len > 63)
+			return 0;
+		buf[z++] = len;
+		memcpy(&buf[z], &name[i], len);
+		z += len;
+		i = dot + 1;
+	}
+	buf[z++] = 0;
+	buf[z++] = 0;
+	buf[z++] = ns_t_txt;
+	buf[z++] = 0;
+	buf[z++] = ns_c_in;
+	return z;
+}
+
+/*
+ * Send @qry to one server and wait until @deadline for a reply with the
+ * matching ID. Returns the reply length, 0 on timeout, or -errno.
+ */
+static ssize_t dnsbl_udp(const struct sockaddr_storage &srv, const uint8_t *qry,
+    size_t qlen, uint8_t *rsp, size_t rspsize,
+    std::chrono::steady_clock::time_point deadline)
+{
+	int fd = socket(srv.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+	auto cl_0 = make_scope_exit([&]() { close(fd); });
+	socklen_t sl = srv.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) :
+	               sizeof(struct sockaddr_in);
+	/* connect() so that replies from anyone else are discarded */
+	if (connect(fd, reinterpret_cast<const struct sockaddr *>(&srv), sl) != 0 ||
+	    send(fd, qry, qlen, 0) < 0)
+		return -errno;
+	while (true) {
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline -
+		            std::chrono::steady_clock::now()).count();
+		if (left <= 0)
+			return 0;
+		struct pollfd pfd = {fd, POLLIN};
+		auto ret = poll(&pfd, 1, left);
+		if (ret < 0 && errno != EINTR)
+			return -errno;
+		if (ret <= 0)
+			continue;
+		auto got = recv(fd, rsp, rspsize, 0);
+		if (got < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (got >= NS_HFIXEDSZ && rsp[0] == qry[0] && rsp[1] == qry[1] &&
+		    (rsp[2] & 0x80))
+			return got;
+	}
+}
+
+/* TTL for a negative answer per RFC 2308: min(SOA TTL, SOA MINIMUM) */
+static bool dnsbl_soa_ttl(ns_msg &handle, uint32_t &ttl)
+{
+	for (unsigned int i = 0; i < ns_msg_count(handle, ns_s_ns); ++i) {
+		ns_rr rr;
+		if (ns_parserr(&handle, ns_s_ns, i, &rr) != 0 ||
+		    ns_rr_type(rr) != ns_t_soa || ns_rr_rdlen(rr) < 4)
+			continue;
+		auto p = ns_rr_rdata(rr) + ns_rr_rdlen(rr) - 4;
+		ttl = std::min(ns_rr_ttl(rr), static_cast<uint32_t>(ns_get32(p)));
+		return true;
+	}
+	return false;
+}
+
+dnsbl_resolver::qstatus dnsbl_resolver::query(const struct in6_addr &addr,
+    entry &e) try
+{
+	std::vector<struct sockaddr_storage> servers;
+	{
+		std::lock_guard lk(m_lock);
+		servers = m_servers;
+	}
+	if (servers.empty())
+		return qstatus::error;
+	uint8_t qry[512], rsp[1500];
+	uint16_t id = gromox::rand();
+	auto qlen = dnsbl_mkquery(id, dnsbl_qname(addr, m_zone), qry, std::size(qry));
+	if (qlen == 0)
+		return qstatus::error;
+
+	/* Spread the time budget over the servers, like res_send does. */
+	auto start = clock::now();
+	auto slice = m_timeout / static_cast<long>(servers.size());
+	auto deadline = start;
+	ssize_t ret = 0;
+	for (size_t i = 0; i < servers.size() && ret <= 0; ++i) {
+		deadline = i + 1 == servers.size() ? start + m_timeout : deadline + slice;
+		ret = dnsbl_udp(servers[i], qry, qlen, rsp, std::size(rsp), deadline);
+	}
+	if (ret == 0)
+		return qstatus::timeout;
+	if (ret < 0)
+		return qstatus::error;
+
+	ns_msg handle;
+	if (ns_initparse(rsp, ret, &handle) != 0)
+		return qstatus::error;
+	auto rcode = ns_msg_getflag(handle, ns_f_rcode);
+	if (rcode == ns_r_nxdomain) {
+		uint32_t ttl = m_neg_ttl;
+		dnsbl_soa_ttl(handle, ttl);
+		e.listed = false;
+		e.reason.clear();
+		e.expire = clock::now() + std::chrono::seconds(std::min(ttl, m_max_ttl));
+		return qstatus::ok;
+	} else if (rcode != ns_r_noerror) {
+		return qstatus::error;
+	}
+	/*
+	 * NOERROR means the name exists, i.e. the address is listed, even if
+	 * the zone has no TXT record to go with it.
+	 */
+	uint32_t ttl = m_max_ttl;
+	bool have_ttl = false;
+	e.listed = true;
+	e.reason.clear();
+	auto max = ns_msg_end(handle);
+	for (unsigned int rrnum = 0; rrnum < ns_msg_count(handle, ns_s_an); ++rrnum) {
+		ns_rr rr;
+		if (ns_parserr(&handle, ns_s_an, rrnum, &rr) != 0)
+			continue;
+		if (ns_rr_type(rr) != ns_t_txt)
+			continue;
+		ttl = std::min(ttl, ns_rr_ttl(rr));
+		have_ttl = true;
+		auto len = ns_rr_rdlen(rr);
+		auto ptr = ns_rr_rdata(rr);
+		if (len > 0)
+			--len;
+		if (ptr + len >= max)
+			len = 0;
+		e.reason += std::string_view(reinterpret_cast<const char *>(ptr + 1), len);
+		e.reason += "; ";
+	}
+	if (!have_ttl && !dnsbl_soa_ttl(handle, ttl))
+		ttl = m_neg_ttl;
+	e.expire = clock::now() + std::chrono::seconds(std::min(ttl, m_max_ttl));
+	return qstatus::ok;
+} catch (const std::bad_alloc &) {
+	return qstatus::error;
+}
+
+/*
+ * Make room for one more entry by dropping the least recently used answers.
+ * In-flight queries are not on m_lru and stay. Caller holds m_lock.
+ */
+void dnsbl_resolver::evict()
+{
+	while (m_cache.size() >= m_cache_max && !m_lru.empty()) {
+		m_cache.erase(m_lru.back());
+		m_lru.pop_back();
+	}
+}
+
+/**
+ * Returns true if @addr is not listed in the zone, or if that could not be
+ * determined (timeout, SERVFAIL, ...). Returns false if it is listed, in
+ * which case @reason contains the TXT records, if any.
+ */
+bool dnsbl_resolver::check(const struct in6_addr &addr, std::string &reason) try
+{
+	std::string key(reinterpret_cast<const char *>(addr.s6_addr), 16);
+	std::unique_lock lk(m_lock);
+	auto now = clock::now();
+	auto it = m_cache.find(key);
+	if (it != m_cache.end() && !it->second.pending) {
+		if (it->second.expire > now) {
+			++m_stats.hits;
+			m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+			reason = it->second.reason;
+			return !it->second.listed;
+		}
+		m_lru.erase(it->second.lru);
+		m_cache.erase(it);
+		it = m_cache.end();
+	}
+	if (it != m_cache.end()) {
+		/* Someone else is already asking; wait for their answer. */
+		++m_stats.joined;
+		entry *ep = nullptr;
+		m_done.wait_until(lk, now + m_timeout, [&]() {
+			auto i = m_cache.find(key);
+			ep = i != m_cache.end() ? &i->second : nullptr;
+			return ep == nullptr || !ep->pending;
+		});
+		if (ep == nullptr || ep->pending)
+			/* query failed (not cached) or still outstanding */
+			return true;
+		reason = ep->reason;
+		return !ep->listed;
+	}
+
+	++m_stats.misses;
+	std::list<std::string> node{key};
+	evict();
+	m_cache.emplace(key, entry{});
+	lk.unlock();
+	entry res;
+	auto st = query(addr, res);
+	lk.lock();
+	/* Only non-throwing operations until the pending mark is gone. */
+	it = m_cache.find(key);
+	if (st != qstatus::ok || m_cache.size() > m_cache_max) {
+		if (it != m_cache.end())
+			m_cache.erase(it);
+		if (st == qstatus::timeout)
+			++m_stats.timeouts;
+		else if (st == qstatus::error)
+			++m_stats.errors;
+		m_done.notify_all();
+		if (st != qstatus::ok)
+			return true;
+		reason = std::move(res.reason);
+		return !res.listed;
+	}
+	res.pending = false;
+	m_lru.splice(m_lru.begin(), node);
+	res.lru = m_lru.begin();
+	it->second = std::move(res);
+	m_done.notify_all();
+	reason = it->second.reason;
+	return !it->second.listed;
+} catch (const std::bad_alloc &) {
+	return true;
+}
+
+dnsbl_stats dnsbl_resolver::stats() const
+{
+	std::lock_guard lk(m_lock);
+	return m_stats;
+}
+
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <gromox/defs.h>
+
+namespace gromox {
+
+struct dnsbl_stats {
+	uint64_t hits = 0, misses = 0, joined = 0, timeouts = 0, errors = 0;
+};
+
+/*
+ * DNSBL lookups with a result cache that honours the record TTLs (and the
+ * SOA minimum for NXDOMAIN), and with deduplication of in-flight queries
+ * for the same address. Queries go out over a non-blocking UDP socket, so a
+ * dead resolver costs at most m_timeout per lookup; lookups that time out or
+ * fail are treated as "not listed" and not cached. When the cache is full,
+ * the least recently used answers make room.
+ */
+class dnsbl_resolver {
+	public:
+	using clock = std::chrono::steady_clock;
+
+	int set_servers(const char *);
+	bool check(const struct in6_addr &, std::string &reason);
+	dnsbl_stats stats() const;
+
+	std::string m_zone;
+	std::chrono::milliseconds m_timeout{2000};
+	unsigned int m_neg_ttl = 300, m_max_ttl = 3600;
+	size_t m_cache_max = 65536;
+
+	private:
+	struct entry {
+		bool pending = true, listed = false;
+		std::string reason;
+		clock::time_point expire;
+		std::list<std::string>::iterator lru; /* valid once !pending */
+	};
+	enum class qstatus { ok, timeout, error };
+
+	qstatus query(const struct in6_addr &, entry &);
+	void evict();
+
+	std::vector<struct sockaddr_storage> m_servers;
+	std::unordered_map<std::string, entry> m_cache;
+	std::list<std::string> m_lru; /* completed entries, most recent first */
+	mutable std::mutex m_lock;
+	std::condition_variable m_done;
+	dnsbl_stats m_stats;
+};
+
+}
@@ -108,7 +108,7 @@ ssize_t common_util_mb_from_utf8(cpid_t cpid, const char *src,
 		return -1;
 	sprintf(temp_charset, "%s//IGNORE",
 		replace_iconv_charset(charset));
-	conv_id = iconv_open(temp_charset, "UTF-8");
+	conv_id = iconv_cached(temp_charset, "UTF-8");
 	if (conv_id == (iconv_t)-1)
 		return -1;
 	auto pin = deconst(src);
@@ -117,7 +117,6 @@ ssize_t common_util_mb_from_utf8(cpid_t cpid, const char *src,
 	memset(dst, 0, len);
 	out_len = len;
 	iconv(conv_id, &pin, &in_len, &pout, &len);
-	iconv_close(conv_id);
 	return out_len - len;
 }
 
@@ -132,7 +131,7 @@ ssize_t common_util_mb_to_utf8(cpid_t cpid, const char *src,
 	auto charset = cpid_to_cset(cpid);
 	if (charset == nullptr)
 		return -1;
-	conv_id = iconv_open("UTF-8//IGNORE",
+	conv_id = iconv_cached("UTF-8//IGNORE",
 		replace_iconv_charset(charset));
 	if (conv_id == (iconv_t)-1)
 		return -1;
@@ -142,7 +141,6 @@ ssize_t common_util_mb_to_utf8(cpid_t cpid, const char *src,
 	memset(dst, 0, len);
 	out_len = len;
 	iconv(conv_id, &pin, &in_len, &pout, &len);	
-	iconv_close(conv_id);
 	return out_len - len;
 }
 
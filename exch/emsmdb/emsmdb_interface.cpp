@@ -1,8 +1,10 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 #include <cassert>
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <climits>
+#include <condition_variable>
 #include <csignal>
 #include <cstdint>
 #include <cstdio>
@@ -84,29 +86,78 @@ struct NOTIFY_ITEM {
 	GUID guid{};
 };
 
+/*
+ * The session and notification registries are split into shards by key, so
+ * that EcDoRpcExt2/Execute calls for unrelated sessions do not serialize on
+ * one lock. Threads waiting for a busy session sleep on the shard's condvar.
+ */
+struct handle_shard {
+	std::mutex lock;
+	std::condition_variable cond;
+	std::unordered_map<GUID, HANDLE_DATA> hash;
+};
+
+struct notify_shard {
+	std::mutex lock;
+	std::unordered_map<std::string, NOTIFY_ITEM> hash;
+};
+
 }
 
 static constexpr auto HANDLE_VALID_INTERVAL = std::chrono::seconds(2000);
 static constexpr size_t TAG_SIZE = 256;
 static time_point g_start_time;
 static pthread_t g_scan_id;
-static std::mutex g_lock, g_notify_lock;
+static constexpr size_t EMS_SHARDS = 64;
+static std::mutex g_user_lock; /* protects g_user_hash */
 static gromox::atomic_bool g_notify_stop{true};
 static thread_local HANDLE_DATA *g_handle_key;
-static std::unordered_map<GUID, HANDLE_DATA> g_handle_hash;
+static handle_shard g_handle_shards[EMS_SHARDS];
+static notify_shard g_notify_shards[EMS_SHARDS];
 static std::unordered_map<std::string, std::vector<HANDLE_DATA *>> g_user_hash;
-static std::unordered_map<std::string, NOTIFY_ITEM> g_notify_hash;
+static std::atomic<size_t> g_handle_count, g_notify_count;
+/* lock acquisitions that found the lock taken; waits for a busy session */
+static std::atomic<uint64_t> g_handle_contended, g_notify_contended, g_busy_waits;
 size_t ems_max_active_sessions, ems_max_active_users, ems_max_active_notifh;
 size_t ems_max_pending_sesnotif;
-static size_t ems_high_active_sessions, ems_high_active_users;
-static size_t ems_high_active_notifh, ems_high_pending_sesnotif;
+static size_t ems_high_active_users;
+static std::atomic<size_t> ems_high_active_sessions, ems_high_active_notifh;
+static std::atomic<size_t> ems_high_pending_sesnotif;
 
 static void *emsi_scanwork(void *);
 
+static std::unique_lock<std::mutex> ems_lock(std::mutex &mtx,
+    std::atomic<uint64_t> &contended)
+{
+	std::unique_lock hold(mtx, std::try_to_lock);
+	if (!hold.owns_lock()) {
+		++contended;
+		hold.lock();
+	}
+	return hold;
+}
+
+static void ems_raise(std::atomic<size_t> &high, size_t v)
+{
+	auto old = high.load();
+	while (old < v && !high.compare_exchange_weak(old, v))
+		/* retry */;
+}
+
+static inline handle_shard &ems_shard(const GUID &guid)
+{
+	return g_handle_shards[std::hash<GUID>()(guid) % EMS_SHARDS];
+}
+
+static inline notify_shard &ems_nshard(const std::string &tag)
+{
+	return g_notify_shards[std::hash<std::string>()(tag) % EMS_SHARDS];
+}
+
 void emsmdb_report()
 {
 	size_t sessions = 0, logons = 0, pend_notif = 0;
-	std::unique_lock gl_hold(g_lock);
+	std::unique_lock uh_hold(g_user_lock);
 	mlog(LV_INFO, "EMSMDB Sessions:");
 	mlog(LV_INFO, "%-32s  %-32s  CXR CPID LCID #NF", "GUID", "USERNAME");
 	mlog(LV_INFO, "LOGON  %-32s  MBOXUSER", "MBOXGUID");
@@ -141,13 +192,17 @@ void emsmdb_report()
 	}
 	mlog(LV_INFO, "Mailboxes %zu/%zu, EMSMDB ses %zu/%zu/%zu, ROPLogons %zu",
 		g_user_hash.size(), ems_high_active_users,
-		sessions, g_handle_hash.size(), ems_high_active_sessions,
+		sessions, g_handle_count.load(), ems_high_active_sessions.load(),
 		logons);
-	gl_hold.unlock();
-	std::lock_guard gl2(g_notify_lock);
+	uh_hold.unlock();
 	mlog(LV_INFO, "NotifyHandles %zu/%zu, NotifyPending %zu/%zu",
-		g_notify_hash.size(), ems_high_active_notifh,
-		pend_notif, ems_high_pending_sesnotif);
+		g_notify_count.load(), ems_high_active_notifh.load(),
+		pend_notif, ems_high_pending_sesnotif.load());
+	mlog(LV_INFO, "Lock contention: sessions %llu, notify %llu, logons %llu; busy-session waits %llu",
+		static_cast<unsigned long long>(g_handle_contended),
+		static_cast<unsigned long long>(g_notify_contended),
+		static_cast<unsigned long long>(rop_processor_lock_contention()),
+		static_cast<unsigned long long>(g_busy_waits));
 }
 
 emsmdb_info::emsmdb_info(emsmdb_info &&o) noexcept :
@@ -170,9 +225,10 @@ BOOL emsmdb_interface_check_acxh(ACXH *pacxh,
 {
 	if (pacxh->handle_type != HANDLE_EXCHANGE_ASYNCEMSMDB)
 		return FALSE;
-	std::lock_guard gl_hold(g_lock);
-	auto iter = g_handle_hash.find(pacxh->guid);
-	if (iter == g_handle_hash.end())
+	auto &shard = ems_shard(pacxh->guid);
+	auto hold = ems_lock(shard.lock, g_handle_contended);
+	auto iter = shard.hash.find(pacxh->guid);
+	if (iter == shard.hash.end())
 		return false;
 	auto phandle = &iter->second;
 	if (b_touch)
@@ -186,9 +242,10 @@ BOOL emsmdb_interface_check_notify(ACXH *pacxh)
 {
 	if (pacxh->handle_type != HANDLE_EXCHANGE_ASYNCEMSMDB)
 		return FALSE;
-	std::lock_guard gl_hold(g_lock);
-	auto iter = g_handle_hash.find(pacxh->guid);
-	if (iter == g_handle_hash.end())
+	auto &shard = ems_shard(pacxh->guid);
+	auto hold = ems_lock(shard.lock, g_handle_contended);
+	auto iter = shard.hash.find(pacxh->guid);
+	if (iter == shard.hash.end())
 		return false;
 	auto phandle = &iter->second;
 	return double_list_get_nodes_num(&phandle->notify_list) > 0 ? TRUE : false;
@@ -200,9 +257,10 @@ void emsmdb_interface_touch_handle(const CXH &cxh)
 	auto pcxh = &cxh;
 	if (pcxh->handle_type != HANDLE_EXCHANGE_EMSMDB)
 		return;
-	std::lock_guard gl_hold(g_lock);
-	auto iter = g_handle_hash.find(pcxh->guid);
-	if (iter != g_handle_hash.end())
+	auto &shard = ems_shard(pcxh->guid);
+	auto hold = ems_lock(shard.lock, g_handle_contended);
+	auto iter = shard.hash.find(pcxh->guid);
+	if (iter != shard.hash.end())
 		iter->second.last_time = tp_now();
 }
 
@@ -210,52 +268,59 @@ static HANDLE_DATA* emsmdb_interface_get_handle_data(CXH *pcxh)
 {
 	if (pcxh->handle_type != HANDLE_EXCHANGE_EMSMDB)
 		return NULL;
+	auto &shard = ems_shard(pcxh->guid);
+	auto hold = ems_lock(shard.lock, g_handle_contended);
 	while (true) {
-		std::unique_lock gl_hold(g_lock);
-		auto iter = g_handle_hash.find(pcxh->guid);
-		if (iter == g_handle_hash.end())
+		/* the handle may have been removed while we slept */
+		auto iter = shard.hash.find(pcxh->guid);
+		if (iter == shard.hash.end())
 			return NULL;
 		auto phandle = &iter->second;
-		if (phandle->b_processing) {
-			gl_hold.unlock();
-			usleep(100000);
-		} else {
+		if (!phandle->b_processing) {
 			phandle->b_processing = TRUE;
 			return phandle;
 		}
+		++g_busy_waits;
+		shard.cond.wait(hold);
 	}
 }
 
 static void emsmdb_interface_put_handle_data(HANDLE_DATA *phandle)
 {
-	std::lock_guard gl_hold(g_lock);
+	auto &shard = ems_shard(phandle->guid);
+	auto hold = ems_lock(shard.lock, g_handle_contended);
 	phandle->b_processing = FALSE;
+	hold.unlock();
+	shard.cond.notify_all();
 }
 
 static HANDLE_DATA* emsmdb_interface_get_handle_notify_list(CXH *pcxh)
 {
 	if (pcxh->handle_type != HANDLE_EXCHANGE_EMSMDB)
 		return NULL;
+	auto &shard = ems_shard(pcxh->guid);
+	auto hold = ems_lock(shard.lock, g_handle_contended);
 	while (true) {
-		std::unique_lock gl_hold(g_lock);
-		auto iter = g_handle_hash.find(pcxh->guid);
-		if (iter == g_handle_hash.end())
+		auto iter = shard.hash.find(pcxh->guid);
+		if (iter == shard.hash.end())
 			return NULL;
 		auto phandle = &iter->second;
-		if (phandle->b_occupied) {
-			gl_hold.unlock();
-			usleep(100000);
-		} else {
+		if (!phandle->b_occupied) {
 			phandle->b_occupied = TRUE;
 			return phandle;
 		}
+		++g_busy_waits;
+		shard.cond.wait(hold);
 	}
 }
 
 static void emsmdb_interface_put_handle_notify_list(HANDLE_DATA *phandle)
 {
-	std::lock_guard gl_hold(g_lock);
+	auto &shard = ems_shard(phandle->guid);
+	auto hold = ems_lock(shard.lock, g_handle_contended);
 	phandle->b_occupied = FALSE;
+	hold.unlock();
+	shard.cond.notify_all();
 }
 
 static BOOL emsmdb_interface_alloc_cxr(std::vector<HANDLE_DATA *> &plist,
@@ -299,6 +364,15 @@ HANDLE_DATA::~HANDLE_DATA()
 	double_list_free(&notify_list);
 }
 
+/* Undo the registration of a session that was never handed out. */
+static void emsmdb_interface_drop_handle(const GUID &guid)
+{
+	auto &shard = ems_shard(guid);
+	auto hold = ems_lock(shard.lock, g_handle_contended);
+	if (shard.hash.erase(guid) > 0)
+		--g_handle_count;
+}
+
 static BOOL emsmdb_interface_create_handle(const char *username,
     uint16_t client_version[4], uint16_t client_mode, cpid_t cpid,
 	uint32_t lcid_string, uint32_t lcid_sort, uint16_t *pcxr, CXH *pcxh)
@@ -314,35 +388,46 @@ static BOOL emsmdb_interface_create_handle(const char *username,
 	temp_handle.info.client_mode = client_mode;
 	gx_strlcpy(temp_handle.username, username, std::size(temp_handle.username));
 	HX_strlower(temp_handle.username);
-	std::unique_lock gl_hold(g_lock);
-	if (ems_max_active_sessions > 0 &&
-	    g_handle_hash.size() >= ems_max_active_sessions) {
+	auto nsess = ++g_handle_count;
+	if (ems_max_active_sessions > 0 && nsess > ems_max_active_sessions) {
+		--g_handle_count;
 		mlog(LV_WARN, "W-2300: g_handle_hash full (%zu handles)",
 			ems_max_active_sessions);
 		return FALSE;
 	}
 	temp_handle.info.plogmap = rop_processor_create_logmap();
-	if (temp_handle.info.plogmap == nullptr)
+	if (temp_handle.info.plogmap == nullptr) {
+		--g_handle_count;
 		return false;
+	}
 
+	auto guid = temp_handle.guid;
+	auto &shard = ems_shard(guid);
 	HANDLE_DATA *phandle;
 
 	try {
-		auto xp = g_handle_hash.emplace(temp_handle.guid, std::move(temp_handle));
-		ems_high_active_sessions = std::max(ems_high_active_sessions, g_handle_hash.size());
+		auto hold = ems_lock(shard.lock, g_handle_contended);
+		auto xp = shard.hash.emplace(guid, std::move(temp_handle));
 		phandle = &xp.first->second;
 	} catch (const std::bad_alloc &) {
+		--g_handle_count;
 		mlog(LV_ERR, "E-1578: ENOMEM");
 		return false;
 	}
+	ems_raise(ems_high_active_sessions, nsess);
+	/*
+	 * The GUID is not known to any client yet, so nobody but the scanner
+	 * (which leaves fresh sessions alone) can get at phandle meanwhile.
+	 */
+	std::unique_lock uh_hold(g_user_lock);
 	auto uh_iter = g_user_hash.find(phandle->username);
 	if (uh_iter == g_user_hash.end()) {
 		if (ems_max_active_users > 0 &&
 		    g_user_hash.size() >= ems_max_active_users) {
+			uh_hold.unlock();
 			mlog(LV_WARN, "W-2301: g_user_hash full (%zu handles)",
 				ems_max_active_users);
-			g_handle_hash.erase(phandle->guid);
-			gl_hold.unlock();
+			emsmdb_interface_drop_handle(guid);
 			return FALSE;
 		}
 		try {
@@ -350,59 +435,66 @@ static BOOL emsmdb_interface_create_handle(const char *username,
 			ems_high_active_users = std::max(ems_high_active_users, g_user_hash.size());
 			uh_iter = xp.first;
 		} catch (const std::bad_alloc &) {
-			g_handle_hash.erase(phandle->guid);
-			gl_hold.unlock();
+			uh_hold.unlock();
 			mlog(LV_ERR, "E-1579: ENOMEM");
+			emsmdb_interface_drop_handle(guid);
 			return FALSE;
 		}
 	} else {
 		if (emsmdb_max_cxh_per_user > 0 &&
 		    uh_iter->second.size() >= emsmdb_max_cxh_per_user) {
+			uh_hold.unlock();
 			mlog(LV_WARN, "W-1580: user %s reached maximum CXH (%u)",
 			        phandle->username, emsmdb_max_cxh_per_user);
-			g_handle_hash.erase(phandle->guid);
-			gl_hold.unlock();
+			emsmdb_interface_drop_handle(guid);
 			return FALSE;
 		}
 	}
 	if (!emsmdb_interface_alloc_cxr(uh_iter->second, phandle)) {
 		if (uh_iter->second.empty())
 			g_user_hash.erase(phandle->username);
-		g_handle_hash.erase(phandle->guid);
-		gl_hold.unlock();
+		uh_hold.unlock();
+		emsmdb_interface_drop_handle(guid);
 		return FALSE;
 	}
 	*pcxr = phandle->cxr;
-	gl_hold.unlock();
+	uh_hold.unlock();
 	pcxh->handle_type = HANDLE_EXCHANGE_EMSMDB;
-	pcxh->guid = phandle->guid;
+	pcxh->guid = guid;
 	return TRUE;
 }
 
 static void emsmdb_interface_remove_handle(const CXH &cxh)
 {
 	auto pcxh = &cxh;
-	HANDLE_DATA *phandle;
 	DOUBLE_LIST_NODE *pnode;
 	
 	if (pcxh->handle_type != HANDLE_EXCHANGE_EMSMDB)
 		return;
-	std::unique_lock gl_hold(g_lock);
+	auto &shard = ems_shard(pcxh->guid);
+	decltype(shard.hash)::node_type node;
+	auto hold = ems_lock(shard.lock, g_handle_contended);
 	while (true) {
-		auto iter = g_handle_hash.find(pcxh->guid);
-		if (iter == g_handle_hash.end())
+		auto iter = shard.hash.find(pcxh->guid);
+		if (iter == shard.hash.end())
 			return;
-		phandle = &iter->second;
-		if (phandle->b_processing)
+		if (iter->second.b_processing)
 			/* this means handle is being processed
 			   in emsmdb_interface_rpc_ext2 by another
 			   rpc connection, can not be released! */
 			return;
-		if (!phandle->b_occupied)
+		if (!iter->second.b_occupied) {
+			node = shard.hash.extract(iter);
 			break;
-		gl_hold.unlock();
-		usleep(100000);
+		}
+		++g_busy_waits;
+		shard.cond.wait(hold);
 	}
+	hold.unlock();
+	--g_handle_count;
+	/* The session is unreachable now; tear it down outside the shard lock. */
+	auto phandle = &node.mapped();
+	std::unique_lock uh_hold(g_user_lock);
 	auto uh_iter = g_user_hash.find(phandle->username);
 	if (uh_iter != g_user_hash.end()) {
 		auto &uhv = uh_iter->second;
@@ -410,14 +502,12 @@ static void emsmdb_interface_remove_handle(const CXH &cxh)
 		if (uhv.empty())
 			g_user_hash.erase(phandle->username);
 	}
+	uh_hold.unlock();
 	while ((pnode = double_list_pop_front(&phandle->notify_list)) != nullptr) {
 		delete static_cast<notify_response *>(static_cast<ROP_RESPONSE *>(pnode->pdata)->ppayload);
 		free(pnode->pdata);
 		free(pnode);
 	}
-	auto plogmap = std::move(phandle->info.plogmap);
-	g_handle_hash.erase(pcxh->guid);
-	gl_hold.unlock();
 }
 
 void emsmdb_interface_init()
@@ -447,9 +537,13 @@ void emsmdb_interface_stop()
 			pthread_join(g_scan_id, NULL);
 		}
 	}
-	g_notify_hash.clear();
+	for (auto &shard : g_notify_shards)
+		shard.hash.clear();
 	g_user_hash.clear();
-	g_handle_hash.clear();
+	for (auto &shard : g_handle_shards)
+		shard.hash.clear();
+	g_notify_count = 0;
+	g_handle_count = 0;
 }
 
 int emsmdb_interface_disconnect(CXH &cxh)
@@ -740,16 +834,14 @@ DOUBLE_LIST* emsmdb_interface_get_notify_list()
 	auto phandle = g_handle_key;
 	if (phandle == nullptr)
 		return NULL;
-	while (true) {
-		std::unique_lock gl_hold(g_lock);
-		if (phandle->b_occupied) {
-			gl_hold.unlock();
-			usleep(100000);
-		} else {
-			phandle->b_occupied = TRUE;
-			return &phandle->notify_list;
-		}
+	auto &shard = ems_shard(phandle->guid);
+	auto hold = ems_lock(shard.lock, g_handle_contended);
+	while (phandle->b_occupied) {
+		++g_busy_waits;
+		shard.cond.wait(hold);
 	}
+	phandle->b_occupied = TRUE;
+	return &phandle->notify_list;
 }
 
 void emsmdb_interface_put_notify_list()
@@ -826,6 +918,43 @@ BOOL emsmdb_interface_set_rop_num(int num)
 	return TRUE;
 }
 
+/* Returns false if the registry is full. */
+static bool emsmdb_interface_insert_notify(std::string &&tag, NOTIFY_ITEM &&item)
+{
+	auto &shard = ems_nshard(tag);
+	auto hold = ems_lock(shard.lock, g_notify_contended);
+	if (ems_max_active_notifh > 0 &&
+	    g_notify_count >= ems_max_active_notifh)
+		return false;
+	if (shard.hash.emplace(std::move(tag), std::move(item)).second)
+		ems_raise(ems_high_active_notifh, ++g_notify_count);
+	return true;
+}
+
+static BOOL emsmdb_interface_find_notify(const std::string &tag,
+    uint32_t *phandle, uint8_t *plogon_id, GUID *pguid)
+{
+	auto &shard = ems_nshard(tag);
+	auto hold = ems_lock(shard.lock, g_notify_contended);
+	const auto &nh = shard.hash;
+	auto iter = nh.find(tag);
+	if (iter == nh.cend())
+		return FALSE;
+	auto pnotify = &iter->second;
+	*phandle = pnotify->handle;
+	*plogon_id = pnotify->logon_id;
+	*pguid = pnotify->guid;
+	return TRUE;
+}
+
+static void emsmdb_interface_erase_notify(const std::string &tag)
+{
+	auto &shard = ems_nshard(tag);
+	auto hold = ems_lock(shard.lock, g_notify_contended);
+	if (shard.hash.erase(tag) > 0)
+		--g_notify_count;
+}
+
 void emsmdb_interface_add_table_notify(const char *dir,
     uint32_t table_id, uint32_t handle, uint8_t logon_id, GUID *pguid) try
 {
@@ -836,15 +965,9 @@ void emsmdb_interface_add_table_notify(const char *dir,
 	tmp_notify.logon_id = logon_id;
 	tmp_notify.guid = *pguid;
 	snprintf(tag_buff, std::size(tag_buff), "%u:%s", table_id, dir);
-	std::lock_guard nt_hold(g_notify_lock);
-	if (ems_max_active_notifh > 0 &&
-	    g_notify_hash.size() >= ems_max_active_notifh) {
+	if (!emsmdb_interface_insert_notify(tag_buff, std::move(tmp_notify)))
 		mlog(LV_WARN, "W-2302: g_notify_hash full (%zu handles)",
 			ems_max_active_notifh);
-		return;
-	}
-	g_notify_hash.emplace(tag_buff, std::move(tmp_notify));
-	ems_high_active_notifh = std::max(ems_high_active_notifh, g_notify_hash.size());
 } catch (const std::bad_alloc &) {
 	mlog(LV_WARN, "W-1541: ENOMEM");
 }
@@ -854,16 +977,7 @@ static BOOL emsmdb_interface_get_table_notify(const char *dir,
 {
 	char tag_buff[TAG_SIZE];
 	snprintf(tag_buff, std::size(tag_buff), "%u:%s", table_id, dir);
-	std::lock_guard nt_hold(g_notify_lock);
-	const auto &nh = g_notify_hash;
-	auto iter = nh.find(tag_buff);
-	if (iter == nh.cend())
-		return FALSE;
-	auto pnotify = &iter->second;
-	*phandle = pnotify->handle;
-	*plogon_id = pnotify->logon_id;
-	*pguid = pnotify->guid;
-	return TRUE;
+	return emsmdb_interface_find_notify(tag_buff, phandle, plogon_id, pguid);
 }
 
 void emsmdb_interface_remove_table_notify(
@@ -872,8 +986,7 @@ void emsmdb_interface_remove_table_notify(
 	char tag_buff[TAG_SIZE];
 	
 	snprintf(tag_buff, std::size(tag_buff), "%u:%s", table_id, dir);
-	std::lock_guard nt_hold(g_notify_lock);
-	g_notify_hash.erase(tag_buff);
+	emsmdb_interface_erase_notify(tag_buff);
 }
 
 void emsmdb_interface_add_subscription_notify(const char *dir,
@@ -888,15 +1001,9 @@ void emsmdb_interface_add_subscription_notify(const char *dir,
 	tmp_notify.guid = *pguid;
 	
 	snprintf(tag_buff, std::size(tag_buff), "%u|%s", sub_id, dir);
-	std::lock_guard nt_hold(g_notify_lock);
-	if (ems_max_active_notifh > 0 &&
-	    g_notify_hash.size() >= ems_max_active_notifh) {
+	if (!emsmdb_interface_insert_notify(tag_buff, std::move(tmp_notify)))
 		mlog(LV_WARN, "W-2303: g_notify_hash full (%zu handles)",
 			ems_max_active_notifh);
-		return;
-	}
-	g_notify_hash.emplace(tag_buff, std::move(tmp_notify));
-	ems_high_active_notifh = std::max(ems_high_active_notifh, g_notify_hash.size());
 } catch (const std::bad_alloc &) {
 	mlog(LV_WARN, "W-1542: ENOMEM");
 }
@@ -907,16 +1014,7 @@ static BOOL emsmdb_interface_get_subscription_notify(
 {
 	char tag_buff[TAG_SIZE];
 	snprintf(tag_buff, std::size(tag_buff), "%u|%s", sub_id, dir);
-	std::lock_guard nt_hold(g_notify_lock);
-	const auto &nh = g_notify_hash;
-	auto iter = nh.find(tag_buff);
-	if (iter == nh.cend())
-		return FALSE;
-	auto pnotify = &iter->second;
-	*phandle = pnotify->handle;
-	*plogon_id = pnotify->logon_id;
-	*pguid = pnotify->guid;
-	return TRUE;
+	return emsmdb_interface_find_notify(tag_buff, phandle, plogon_id, pguid);
 }
 
 void emsmdb_interface_remove_subscription_notify(
@@ -925,8 +1023,7 @@ void emsmdb_interface_remove_subscription_notify(
 	char tag_buff[TAG_SIZE];
 	
 	snprintf(tag_buff, std::size(tag_buff), "%u|%s", sub_id, dir);
-	std::lock_guard nt_hold(g_notify_lock);
-	g_notify_hash.erase(tag_buff);
+	emsmdb_interface_erase_notify(tag_buff);
 }
 
 static BOOL emsmdb_interface_merge_content_row_deleted(
@@ -1101,7 +1198,7 @@ void emsmdb_interface_event_proc(const char *dir, BOOL b_table,
 		emsmdb_interface_put_handle_notify_list(phandle);
 		return;
 	}
-	ems_high_pending_sesnotif = std::max(ems_high_pending_sesnotif, notifnum);
+	ems_raise(ems_high_pending_sesnotif, notifnum);
 	cxr = phandle->cxr;
 	gx_strlcpy(username, phandle->username, std::size(username));
 	pnode = me_alloc<DOUBLE_LIST_NODE>();
@@ -1148,19 +1245,20 @@ static void *emsi_scanwork(void *pparam)
 	while (!g_notify_stop) {
 		std::vector<GUID> temp_list;
 		auto cur_time = tp_now();
-		std::unique_lock gl_hold(g_lock);
-		for (const auto &[guid, handle] : g_handle_hash) {
-			auto phandle = &handle;
-			if (phandle->b_processing || phandle->b_occupied)
-				continue;
-			if (cur_time - phandle->last_time > HANDLE_VALID_INTERVAL) try {
-				temp_list.push_back(guid);
-			} catch (const std::bad_alloc &) {
-				mlog(LV_ERR, "E-1624: ENOMEM");
-				continue;
+		for (auto &shard : g_handle_shards) {
+			auto hold = ems_lock(shard.lock, g_handle_contended);
+			for (const auto &[guid, handle] : shard.hash) {
+				auto phandle = &handle;
+				if (phandle->b_processing || phandle->b_occupied)
+					continue;
+				if (cur_time - phandle->last_time > HANDLE_VALID_INTERVAL) try {
+					temp_list.push_back(guid);
+				} catch (const std::bad_alloc &) {
+					mlog(LV_ERR, "E-1624: ENOMEM");
+					continue;
+				}
 			}
 		}
-		gl_hold.unlock();
 		for (auto &&guid : temp_list)
 			emsmdb_interface_remove_handle({HANDLE_EXCHANGE_EMSMDB, std::move(guid)});
 		sleep(3);
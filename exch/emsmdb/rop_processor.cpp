@@ -1,4 +1,5 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#include <atomic>
 #include <cassert>
 #include <climits>
 #include <csignal>
@@ -8,6 +9,7 @@
 #include <memory>
 #include <mutex>
 #include <pthread.h>
+#include <string_view>
 #include <unistd.h>
 #include <unordered_map>
 #include <utility>
@@ -41,8 +43,16 @@ static int g_scan_interval;
 static pthread_t g_scan_id;
 static int g_average_handles;
 static gromox::atomic_bool g_notify_stop{true};
-static std::mutex g_hash_lock;
-static std::unordered_map<std::string, uint32_t> g_logon_hash;
+namespace {
+/* Reference counts of logged-on stores, split up by directory */
+struct logon_shard {
+	std::mutex lock;
+	std::unordered_map<std::string, uint32_t> hash;
+};
+}
+static constexpr size_t LOGON_SHARDS = 16;
+static logon_shard g_logon_shards[LOGON_SHARDS];
+static std::atomic<uint64_t> g_logon_contended;
 static unsigned int g_emsmdb_full_parenting;
 static unsigned int g_max_rop_payloads = 96;
 
@@ -50,6 +60,26 @@ unsigned int emsmdb_max_obh_per_session = 500;
 unsigned int emsmdb_max_cxh_per_user = 100;
 unsigned int emsmdb_pvt_folder_softdel, emsmdb_rop_chaining;
 
+static inline logon_shard &logon_shard_of(const char *dir)
+{
+	return g_logon_shards[std::hash<std::string_view>()(dir) % LOGON_SHARDS];
+}
+
+static std::unique_lock<std::mutex> logon_shard_lock(logon_shard &shard)
+{
+	std::unique_lock hold(shard.lock, std::try_to_lock);
+	if (!hold.owns_lock()) {
+		++g_logon_contended;
+		hold.lock();
+	}
+	return hold;
+}
+
+uint64_t rop_processor_lock_contention()
+{
+	return g_logon_contended;
+}
+
 std::unique_ptr<LOGMAP> rop_processor_create_logmap() try
 {
 	return std::make_unique<LOGMAP>();
@@ -73,10 +103,11 @@ void object_node::clear() noexcept
 		auto logon = static_cast<logon_object *>(pobject);
 		{
 			/* Remove from pinger list */
-			std::lock_guard hl_hold(g_hash_lock);
-			auto ref = g_logon_hash.find(logon->get_dir());
-			if (ref != g_logon_hash.end() && --ref->second == 0)
-				g_logon_hash.erase(ref);
+			auto &shard = logon_shard_of(logon->get_dir());
+			auto hl_hold = logon_shard_lock(shard);
+			auto ref = shard.hash.find(logon->get_dir());
+			if (ref != shard.hash.end() && --ref->second == 0)
+				shard.hash.erase(ref);
 		}
 		delete logon;
 		break;
@@ -137,12 +168,13 @@ int32_t rop_processor_create_logon_item(LOGMAP *plogmap,
 	              {ems_objtype::logon, std::move(plogon)});
 	if (handle < 0)
 		return handle;
-	std::lock_guard hl_hold(g_hash_lock);
-	auto pref = g_logon_hash.find(rlogon->get_dir());
-	if (pref != g_logon_hash.end())
+	auto &shard = logon_shard_of(rlogon->get_dir());
+	auto hl_hold = logon_shard_lock(shard);
+	auto pref = shard.hash.find(rlogon->get_dir());
+	if (pref != shard.hash.end())
 		++pref->second;
 	else
-		g_logon_hash.emplace(rlogon->get_dir(), 1);
+		shard.hash.emplace(rlogon->get_dir(), 1);
 	return handle;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-1974: ENOMEM");
@@ -306,11 +338,12 @@ static void *emsrop_scanwork(void *param)
 			continue;
 		}
 		count = 0;
-		std::unique_lock hl_hold(g_hash_lock);
 		std::vector<std::string> dirs;
-		for (const auto &pair : g_logon_hash)
-			dirs.push_back(pair.first);
-		hl_hold.unlock();
+		for (auto &shard : g_logon_shards) {
+			std::lock_guard hl_hold(shard.lock);
+			for (const auto &pair : shard.hash)
+				dirs.push_back(pair.first);
+		}
 		while (dirs.size() > 0) {
 			exmdb_client::ping_store(dirs.back().c_str());
 			dirs.pop_back();
@@ -350,7 +383,8 @@ void rop_processor_stop()
 			pthread_join(g_scan_id, NULL);
 		}
 	}
-	g_logon_hash.clear();
+	for (auto &shard : g_logon_shards)
+		shard.hash.clear();
 }
 
 static uint32_t rpcext_cutoff = 32U << 10; /* OXCRPC v23 3.1.4.2.1.2.2 */
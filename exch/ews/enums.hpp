@@ -100,7 +100,9 @@ struct Enum
 	STR(ApplicationTimeArray);
 	STR(Appointment);
 	STR(April);
+	STR(Ascending);
 	STR(AssistantPhone);
+	STR(Associated);
 	STR(August);
 	STR(Beginning);
 	STR(Best);
@@ -137,6 +139,7 @@ struct Enum
 	STR(Default);
 	STR(DeletedEvent);
 	STR(DeliveryRestriction);
+	STR(Descending);
 	STR(Detailed);
 	STR(DetailedMerged);
 	STR(Disabled);
@@ -382,6 +385,7 @@ struct Enum
 	using LegacyFreeBusyType = StrEnum<Free, Tentative, Busy, OOF, WorkingElsewhere, NoData>; ///< Types.xsd:4352
 	using ImportanceChoicesType = StrEnum<Low, Normal, High>; ///< Types.xsd:1708
 	using IndexBasePointType = StrEnum<Beginning, End>; ///< Types.xsd:4196
+	using ItemQueryTraversalType = StrEnum<Shallow, SoftDeleted, Associated>; ///< Types.xsd:1220
 	using MailboxTypeType = StrEnum<Unknown, OneOff, Mailbox, PublicDL, PrivateDL, Contact, PublicFolder, GroupMailbox, ImplicitContact, User>; ///< Types.xsd:253
 	using MailTipTypes = StrEnum<All, OutOfOfficeMessage, MailboxFullStatus, CustomMailTip, ExternalMemberCount, TotalMemberCount, MaxMessageSize, DeliveryRestriction, ModerationStatus, InvalidRecipient, Scope, RecipientSuggestions, PreferAccessibleContent>; ///< Types.xsd:6947
 	using MapiPropertyTypeType = StrEnum<ApplicationTime, ApplicationTimeArray, Binary, BinaryArray, Boolean, CLSID, CLSIDArray, Currency, CurrencyArray, Double, DoubleArray, Error, Float, FloatArray, Integer, IntegerArray, Long, LongArray, Null, Object, ObjectArray, Short, ShortArray, SystemTime, SystemTimeArray, String, StringArray>; ///< Types.xsd:1060
@@ -395,6 +399,7 @@ struct Enum
 	using RestrictionRelop = StrEnum<IsLessThan, IsLessThanOrEqual, IsGreaterThan, IsGreaterThanOrEqual, IsEqualTo, IsNotEqualTo>; ///< Helper class, index maps directly to mapi_rtype
 	using OofState = StrEnum<Disabled, Enabled, Scheduled>; ///< Types.xsd:6522
 	using SensitivityChoicesType = StrEnum<Normal, Personal, Private, Confidential>; ///< Types.xsd:1698
+	using SortDirectionType = StrEnum<Ascending, Descending>; ///< Types.xsd:4240
 	using ServiceConfigurationType = StrEnum<MailTips, UnifiedMessagingConfiguration, ProtectionRules, PolicyNudges, SharePointURLs, OfficeIntegrationConfiguration>; ///< Types.xsd:7019
 	using SuggestionQuality = StrEnum<Excellent, Good, Fair, Poor>; ///< Types.xsd:6423
 	using SyncFolderItemsScopeType = StrEnum<NormalItems, NormalAndAssociatedItems>; ///< Types.xsd:6256
@@ -97,6 +97,7 @@ public:
 	ERR(SchemaValidation) ///< XML value is does not confirm to schema
 	ERR(SubscriptionAccessDenied) ///< Trying to access subscription from another user
 	ERR(TimeZone) ///< Invalid or missing time zone
+	ERR(UnsupportedPathForSortGroup) ///< Sort or group path does not resolve to a property tag
 	ERR(ValueOutOfRange) ///< Value cannot be interpreted correctly (only applied to dates according to official documentation)
 #undef ERR
 };
@@ -361,6 +362,10 @@ inline std::string E3238(const std::string_view& val) {return fmt::format("E-323
 inline std::string E3239(const std::string_view& val) {return fmt::format("E-3239: invalid boolean value '{}'", val);}
 inline std::string E3240(const std::string_view& val) {return fmt::format("E-3240: invalid i8 value '{}'", val);}
 inline std::string E3241(const char* type) {return fmt::format("E-3241: Constant Value of type {} is not supported", type);}
+E(3242, "cannot access target folder");
+E(3243, "failed to load content table");
+E(3244, "failed to find tag for FieldOrder path");
+E(3245, "failed to query content table");
 
 #undef E
 }
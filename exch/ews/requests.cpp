@@ -411,6 +411,84 @@ void process(mFindFolderRequest&& request, XMLElement* response, const EWSContex
 	data.serialize(response);
 }
 
+/**
+ * @brief      Process FindItem
+ *
+ * Restriction and sort order are passed on to the content table, so that only
+ * the requested page is transferred from the exmdb server.
+ *
+ * @param      request   Request data
+ * @param      response  XMLElement to store response in
+ * @param      ctx       Request context
+ */
+void process(mFindItemRequest&& request, XMLElement* response, const EWSContext& ctx)
+{
+	ctx.experimental();
+
+	response->SetName("m:FindItemResponse");
+
+	sShape shape(request.ItemShape);
+	shape.add(PidTagMid);
+	uint8_t tableFlags = request.Traversal == Enum::Associated? TABLE_FLAG_ASSOCIATED :
+	                     request.Traversal == Enum::SoftDeleted? TABLE_FLAG_SOFTDELETES : 0;
+	const RESTRICTION* res = request.Restriction? request.Restriction->build() : nullptr;
+	if(request.QueryString)
+		res = tRestriction::all(res, tRestriction::fromQueryString(*request.QueryString));
+	const SORTORDER_SET* sort = request.SortOrder? tFieldOrder::build(*request.SortOrder) : nullptr;
+
+	auto& exmdb = ctx.plugin().exmdb;
+	mFindItemResponse data;
+	data.ResponseMessages.reserve(request.ParentFolderIds.size());
+	tBasePagingType* paging = request.IndexedPageItemView? &*request.IndexedPageItemView :
+	                          request.FractionalPageItemView? &*request.FractionalPageItemView :
+	                          static_cast<tBasePagingType*>(nullptr);
+	uint32_t maxResults = paging && paging->MaxEntriesReturned? *paging->MaxEntriesReturned : 0;
+
+	for(const sFolderId& folderId : request.ParentFolderIds) try {
+		sFolderSpec folder = ctx.resolveFolder(folderId);
+		std::string dir = ctx.getDir(folder);
+		if(!(ctx.permissions(dir, folder.folderId) & frightsReadAny))
+			throw EWSError::AccessDenied(E3242);
+		const char* username = folder.location == sFolderSpec::PUBLIC? ctx.auth_info().username : nullptr;
+		uint32_t tableId, rowCount;
+		if(!exmdb.load_content_table(dir.c_str(), CP_UTF8, folder.folderId, username, tableFlags, res, sort,
+		                             &tableId, &rowCount))
+			throw EWSError::ItemPropertyRequestFailed(E3243);
+		auto unloadTable = make_scope_exit([&, tableId]{exmdb.unload_table(dir.c_str(), tableId);});
+		uint32_t offset = std::min(paging? paging->offset(rowCount) : 0, rowCount);
+		uint32_t results = maxResults? std::min(maxResults, rowCount-offset) : rowCount-offset;
+		mFindItemResponseMessage msg;
+		msg.RootFolder.emplace().Items.reserve(results);
+		if(results) {
+			ctx.getNamedTags(dir, shape);
+			PROPTAG_ARRAY tags = shape.proptags();
+			TARRAY_SET table;
+			if(!exmdb.query_table(dir.c_str(), ctx.auth_info().username, CP_UTF8, tableId, &tags, offset,
+			                      results, &table))
+				throw EWSError::ItemPropertyRequestFailed(E3245);
+			for(const TPROPVAL_ARRAY& props : table) {
+				shape.clean();
+				shape.properties(props);
+				sItem& item = msg.RootFolder->Items.emplace_back(tItem::create(shape));
+				const uint64_t* mid = props.get<const uint64_t>(PidTagMid);
+				if(shape.special && mid)
+					std::visit([&](auto& it) {ctx.loadSpecial(dir, folder.folderId, *mid, it, shape.special);}, item);
+			}
+			results = uint32_t(msg.RootFolder->Items.size());
+		}
+		if(paging)
+			paging->update(*msg.RootFolder, results, rowCount);
+		msg.RootFolder->IncludesLastItemInRange = results+offset >= rowCount;
+		msg.RootFolder->TotalItemsInView = rowCount;
+		msg.success();
+		data.ResponseMessages.emplace_back(std::move(msg));
+	} catch(const EWSError& err) {
+		data.ResponseMessages.emplace_back(err);
+	}
+
+	data.serialize(response);
+}
+
 /**
  * @brief      Process GetAttachment
  *
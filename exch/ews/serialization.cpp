@@ -612,6 +612,12 @@ void tFindFolderParent::serialize(tinyxml2::XMLElement* xml) const
 	XMLDUMPT(Folders);
 }
 
+void tFindItemParent::serialize(tinyxml2::XMLElement* xml) const
+{
+	tFindResponsePagingAttributes::serialize(xml);
+	XMLDUMPT(Items);
+}
+
 void tPhoneNumberDictionaryEntry::serialize(tinyxml2::XMLElement* xml) const
 {
 	xml->SetText(Entry.c_str());
@@ -693,6 +699,11 @@ void tFolderType::serialize(XMLElement* xml) const
 	XMLDUMPT(UnreadCount);
 }
 
+tFieldOrder::tFieldOrder(const tinyxml2::XMLElement* xml) :
+	fieldURI(fromXMLNodeVariantFind<tPath::Base>(xml)),
+	XMLINITA(Order)
+{}
+
 tFractionalPageView::tFractionalPageView(const tinyxml2::XMLElement* xml) :
 	tBasePagingType(xml),
 	XMLINITA(Numerator),
@@ -1176,6 +1187,26 @@ void mFindFolderResponseMessage::serialize(tinyxml2::XMLElement* xml) const
 void mFindFolderResponse::serialize(tinyxml2::XMLElement* xml) const
 {XMLDUMPM(ResponseMessages);}
 
+mFindItemRequest::mFindItemRequest(const tinyxml2::XMLElement* xml) :
+	XMLINIT(ItemShape),
+	XMLINIT(IndexedPageItemView),
+	XMLINIT(FractionalPageItemView),
+	XMLINIT(Restriction),
+	XMLINIT(SortOrder),
+	XMLINIT(ParentFolderIds),
+	XMLINIT(QueryString),
+	XMLINITA(Traversal)
+{}
+
+void mFindItemResponseMessage::serialize(tinyxml2::XMLElement* xml) const
+{
+	mResponseMessageType::serialize(xml);
+	XMLDUMPM(RootFolder);
+}
+
+void mFindItemResponse::serialize(tinyxml2::XMLElement* xml) const
+{XMLDUMPM(ResponseMessages);}
+
 void mFolderInfoResponseMessage::serialize(tinyxml2::XMLElement* xml) const
 {
 	mResponseMessageType::serialize(xml);
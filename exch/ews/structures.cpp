@@ -8,6 +8,8 @@
  * of (de-)serialization functions was moved to serialization.cpp.
  */
 #include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <iterator>
 #include <set>
 #include <utility>
@@ -1741,6 +1743,111 @@ const RESTRICTION* tRestriction::build() const
 	return restriction;
 }
 
+/**
+ * @brief      Combine two restrictions with logical AND
+ *
+ * @param      r1    First restriction or nullptr
+ * @param      r2    Second restriction or nullptr
+ *
+ * @return     Combined restriction or nullptr if both are empty
+ */
+const RESTRICTION* tRestriction::all(const RESTRICTION* r1, const RESTRICTION* r2)
+{
+	if(!r1 || !r2)
+		return r1? r1 : r2;
+	RESTRICTION* res = EWSContext::alloc<RESTRICTION>();
+	res->rt = mapi_rtype::r_and;
+	res->andor = EWSContext::alloc<RESTRICTION_AND_OR>();
+	res->andor->count = 2;
+	res->andor->pres = EWSContext::alloc<RESTRICTION>(2);
+	res->andor->pres[0] = *r1;
+	res->andor->pres[1] = *r2;
+	return res;
+}
+
+/**
+ * @brief      Build restriction from query string
+ *
+ * Only a small subset of AQS is supported: the query is split into terms at
+ * whitespace (double quotes group a phrase), each of which may be prefixed
+ * with `subject:`, `from:`, `to:` or `body:` to limit the properties it is
+ * matched against. All terms must be contained (case-insensitive) in at least
+ * one of their properties.
+ *
+ * @param      query  Query string
+ *
+ * @return     RESTRICTION* or nullptr if empty
+ */
+const RESTRICTION* tRestriction::fromQueryString(const std::string_view& query)
+{
+	static constexpr uint32_t anyField[] = {PR_SUBJECT, PR_BODY, PR_SENDER_NAME, PR_DISPLAY_TO};
+	static constexpr std::pair<std::string_view, uint32_t> prefixes[] = {
+		{"body", PR_BODY}, {"from", PR_SENDER_NAME}, {"subject", PR_SUBJECT}, {"to", PR_DISPLAY_TO}};
+	std::vector<std::pair<uint32_t, std::string_view>> terms; // (tag or 0 for any, term)
+	size_t pos = 0;
+	while(pos < query.size()) {
+		if(isspace(static_cast<unsigned char>(query[pos]))) {
+			++pos;
+			continue;
+		}
+		uint32_t tag = 0;
+		size_t colon = query.find(':', pos), end = query.find_first_of(" \t\r\n", pos);
+		if(colon != std::string_view::npos && colon < end)
+			for(const auto& prefix : prefixes)
+				if(query.substr(pos, colon-pos) == prefix.first) {
+					tag = prefix.second;
+					pos = colon+1;
+					break;
+				}
+		if(pos < query.size() && query[pos] == '"') {
+			end = query.find('"', ++pos);
+			if(end == std::string_view::npos)
+				end = query.size();
+		} else {
+			end = query.find_first_of(" \t\r\n", pos);
+			if(end == std::string_view::npos)
+				end = query.size();
+		}
+		if(end > pos)
+			terms.emplace_back(tag, query.substr(pos, end-pos));
+		pos = end+1;
+	}
+	if(terms.empty())
+		return nullptr;
+	auto content = [](RESTRICTION& dst, uint32_t tag, const std::string_view& term) {
+		dst.rt = mapi_rtype::content;
+		dst.cont = EWSContext::construct<RESTRICTION_CONTENT>();
+		dst.cont->fuzzy_level = FL_SUBSTRING | FL_IGNORECASE;
+		dst.cont->proptag = dst.cont->propval.proptag = tag;
+		char* value = EWSContext::alloc<char>(term.size()+1);
+		memcpy(value, term.data(), term.size());
+		value[term.size()] = '\0';
+		dst.cont->propval.pvalue = value;
+	};
+	RESTRICTION* res = EWSContext::alloc<RESTRICTION>(terms.size());
+	for(size_t i = 0; i < terms.size(); ++i) {
+		const auto& [tag, term] = terms[i];
+		if(tag) {
+			content(res[i], tag, term);
+			continue;
+		}
+		res[i].rt = mapi_rtype::r_or;
+		res[i].andor = EWSContext::alloc<RESTRICTION_AND_OR>();
+		res[i].andor->count = std::size(anyField);
+		res[i].andor->pres = EWSContext::alloc<RESTRICTION>(std::size(anyField));
+		for(size_t j = 0; j < std::size(anyField); ++j)
+			content(res[i].andor->pres[j], anyField[j], term);
+	}
+	if(terms.size() == 1)
+		return res;
+	RESTRICTION* conj = EWSContext::alloc<RESTRICTION>();
+	conj->rt = mapi_rtype::r_and;
+	conj->andor = EWSContext::alloc<RESTRICTION_AND_OR>();
+	conj->andor->count = uint32_t(terms.size());
+	conj->andor->pres = res;
+	return conj;
+}
+
 void tRestriction::deserialize(RESTRICTION& dst, const tinyxml2::XMLElement* src)
 {
 	const char* name = src->Name();
@@ -2232,6 +2339,35 @@ void tExtendedProperty::serialize(const void* data, uint16_t type, XMLElement* x
 
 ///////////////////////////////////////////////////////////////////////////////
 
+/**
+ * @brief      Build sort order from list of field orders
+ *
+ * @param      orders  Field orders in order of precedence
+ *
+ * @return     SORTORDER_SET* or nullptr if empty
+ */
+const SORTORDER_SET* tFieldOrder::build(const std::vector<tFieldOrder>& orders)
+{
+	if(orders.empty())
+		return nullptr;
+	SORTORDER_SET* sortset = EWSContext::alloc<SORTORDER_SET>();
+	sortset->count = uint16_t(orders.size());
+	sortset->ccategories = sortset->cexpanded = 0;
+	SORT_ORDER* sort = sortset->psort = EWSContext::alloc<SORT_ORDER>(orders.size());
+	for(const tFieldOrder& order : orders) {
+		uint32_t tag = order.fieldURI.tag();
+		if(!tag)
+			throw EWSError::UnsupportedPathForSortGroup(E3244);
+		sort->type = PROP_TYPE(tag);
+		sort->propid = PROP_ID(tag);
+		sort->table_sort = order.Order == Enum::Descending? TABLE_SORT_DESCEND : TABLE_SORT_ASCEND;
+		++sort;
+	}
+	return sortset;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
 decltype(tFieldURI::tagMap) tFieldURI::tagMap = {
 	{"folder:ChildFolderCount", PR_FOLDER_CHILD_COUNT},
 	{"folder:DisplayName", PR_DISPLAY_NAME},
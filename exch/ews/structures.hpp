@@ -889,6 +889,16 @@ struct tFindFolderParent : public tFindResponsePagingAttributes
 	void serialize(tinyxml2::XMLElement*) const;
 };
 
+/**
+ * Types.xsd:1962
+ */
+struct tFindItemParent : public tFindResponsePagingAttributes
+{
+	std::vector<sItem> Items;
+
+	void serialize(tinyxml2::XMLElement*) const;
+};
+
 /**
  * Types.xsd:2436
  */
@@ -980,6 +990,21 @@ struct tPath : public std::variant<tExtendedFieldURI, tFieldURI, tIndexedFieldUR
 	inline const Base& asVariant() const {return static_cast<const Base&>(*this);}
 };
 
+/**
+ * Types.xsd:4250
+ */
+struct tFieldOrder
+{
+	static constexpr char NAME[] = "FieldOrder";
+
+	explicit tFieldOrder(const tinyxml2::XMLElement*);
+
+	tPath fieldURI;
+	Enum::SortDirectionType Order; // Attribute
+
+	static const SORTORDER_SET* build(const std::vector<tFieldOrder>&);
+};
+
 /**
  * Types.xsd:2019
  */
@@ -2334,6 +2359,9 @@ public:
 	explicit tRestriction(const tinyxml2::XMLElement*);
 
 	const RESTRICTION* build() const;
+
+	static const RESTRICTION* all(const RESTRICTION*, const RESTRICTION*);
+	static const RESTRICTION* fromQueryString(const std::string_view&);
 private:
 	const tinyxml2::XMLElement* source = nullptr;  ///< XMLElement of the contained restriction
 
@@ -2678,6 +2706,50 @@ struct mFindFolderResponse
 	void serialize(tinyxml2::XMLElement*) const;
 };
 
+/**
+ * Messages.xsd:715
+ */
+struct mFindItemRequest
+{
+	explicit mFindItemRequest(const tinyxml2::XMLElement*);
+
+	tItemResponseShape ItemShape;
+	std::optional<tIndexedPageView> IndexedPageItemView; // Specified as variant, but easier to handle this way
+	std::optional<tFractionalPageView> FractionalPageItemView;
+	//<xs:element name="CalendarView" type="t:CalendarViewType"/>
+	//<xs:element name="ContactsView" type="t:ContactsViewType"/>
+	//<xs:group ref="t:GroupingChoice" minOccurs="0"/>
+	std::optional<tRestriction> Restriction;
+	std::optional<std::vector<tFieldOrder>> SortOrder;
+	std::vector<sFolderId> ParentFolderIds;
+	std::optional<std::string> QueryString;
+	Enum::ItemQueryTraversalType Traversal; // Attribute
+};
+
+/**
+ * Messages.xsd:741
+ */
+struct mFindItemResponseMessage : public mResponseMessageType
+{
+	static constexpr char NAME[] = "FindItemResponseMessage";
+
+	using mResponseMessageType::mResponseMessageType;
+
+	std::optional<tFindItemParent> RootFolder;
+
+	void serialize(tinyxml2::XMLElement*) const;
+};
+
+/**
+ * Messages.xsd:750
+ */
+struct mFindItemResponse
+{
+	std::vector<mFindItemResponseMessage> ResponseMessages;
+
+	void serialize(tinyxml2::XMLElement*) const;
+};
+
 /**
  * Messages.xsd:1482
  */
@@ -235,14 +235,14 @@ char *common_util_convert_copy(BOOL to_utf8, cpid_t cpid, const char *pstring)
 	if (pstr_out == nullptr)
 		return NULL;
 	if (to_utf8) {
-		conv_id = iconv_open("UTF-8//IGNORE", charset);
+		conv_id = iconv_cached("UTF-8//IGNORE", charset);
 		if (conv_id == (iconv_t)-1)
-			conv_id = iconv_open("UTF-8//IGNORE", "windows-1252");
+			conv_id = iconv_cached("UTF-8//IGNORE", "windows-1252");
 	} else {
 		sprintf(temp_charset, "%s//IGNORE", charset);
-		conv_id = iconv_open(temp_charset, "UTF-8");
+		conv_id = iconv_cached(temp_charset, "UTF-8");
 		if (conv_id == (iconv_t)-1)
-			conv_id = iconv_open("windows-1252//IGNORE", "UTF-8");
+			conv_id = iconv_cached("windows-1252//IGNORE", "UTF-8");
 	}
 	if (conv_id == (iconv_t)-1) {
 		free(pstr_out);
@@ -252,7 +252,6 @@ char *common_util_convert_copy(BOOL to_utf8, cpid_t cpid, const char *pstring)
 	auto pout = pstr_out;
 	memset(pstr_out, 0, out_len);
 	iconv(conv_id, &pin, &in_len, &pout, &out_len);
-	iconv_close(conv_id);
 	return pstr_out;
 }
 
@@ -395,6 +394,21 @@ ec_error_t cu_allocate_cn(sqlite3 *psqlite, uint64_t *pcn)
 	return ecSuccess;
 }
 
+/**
+ * Note that the rule set of a folder (rules table or extended rule messages)
+ * changed, so that ruleproc can tell whether its compiled copy is current.
+ */
+BOOL cu_bump_rules_cn(sqlite3 *psqlite, uint64_t folder_id)
+{
+	uint64_t cn = 0;
+	BOOL b_result = false;
+	if (cu_allocate_cn(psqlite, &cn) != ecSuccess)
+		return false;
+	auto cn_eid = rop_util_make_eid_ex(1, cn);
+	return cu_set_property(MAPI_FOLDER, folder_id, CP_ACP, psqlite,
+	       PR_RULES_CHANGE_NUM, &cn_eid, &b_result);
+}
+
 BOOL common_util_allocate_folder_art(sqlite3 *psqlite, uint32_t *part)
 {
 	char sql_string[128];
@@ -2788,11 +2802,14 @@ static errno_t cu_cid_writeout(const char *maildir, std::string_view data,
 		return -ret;
 	}
 
-	/* See if the object already exists. (Skip compression.) */
+	/*
+	 * See if the object already exists. (Skip compression.) Its mtime is
+	 * refreshed, since purge_datafiles spares files touched while it runs.
+	 */
 	wrapfd check_fd = open(path.c_str(), O_RDONLY);
 	struct stat sb;
 	if (check_fd.get() >= 0 && fstat(check_fd.get(), &sb) == 0 &&
-	    sb.st_size > 0)
+	    sb.st_size > 0 && utimensat(AT_FDCWD, path.c_str(), nullptr, 0) == 0)
 		return 0;
 	check_fd.close_rd();
 
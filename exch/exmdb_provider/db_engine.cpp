@@ -106,10 +106,15 @@ static std::list<POPULATING_NODE> g_populating_list, g_populating_list_active;
 unsigned int g_exmdb_schema_upgrades, g_exmdb_search_pacing;
 unsigned long long g_exmdb_search_pacing_time = 2000000000;
 unsigned int g_exmdb_search_yield, g_exmdb_search_nice;
+size_t g_exmdb_vacuum_free_pages = 4096, g_exmdb_vacuum_step = 256;
 unsigned int g_exmdb_pvt_folder_softdel;
 static constexpr auto DB_LOCK_TIMEOUT = std::chrono::seconds(60);
+/* stores unused for this long are candidates for background reclamation */
+static constexpr time_t DB_RECLAIM_IDLE = 10;
+static constexpr auto DB_RECLAIM_SLICE = std::chrono::seconds(1);
 
 static bool remove_from_hash(const decltype(g_hash_table)::value_type &, time_t);
+static bool db_engine_lock(DB_ITEM *);
 static void db_engine_notify_content_table_modify_row(db_item_ptr &, uint64_t folder_id, uint64_t message_id);
 
 static void db_engine_load_dynamic_list(DB_ITEM *pdb) try
@@ -210,7 +215,7 @@ db_item_ptr db_engine_get_db(const char *path)
 			mlog(LV_WARN, "W-1620: contention on %s (%u uses)", path, refs);
 		++pdb->reference;
 		hhold.unlock();
-		if (!pdb->giant_lock.try_lock_for(DB_LOCK_TIMEOUT)) {
+		if (!db_engine_lock(pdb)) {
 			--pdb->reference;
 			mlog(LV_DEBUG, "D-2207: rejecting access to %s because of DB contention", path);
 			return NULL;
@@ -233,7 +238,7 @@ db_item_ptr db_engine_get_db(const char *path)
 	pdb->last_time = time(nullptr);
 	pdb->reference ++;
 	hhold.unlock();
-	if (!pdb->giant_lock.try_lock_for(DB_LOCK_TIMEOUT)) {
+	if (!db_engine_lock(pdb)) {
 		pdb->reference --;
 		return NULL;
 	}
@@ -254,24 +259,56 @@ db_item_ptr db_engine_get_db(const char *path)
 		return db_item_ptr(pdb);
 	}
 	gx_sql_exec(pdb->psqlite, "PRAGMA foreign_keys=ON");
-	if (exmdb_server::is_private())
+	pdb->b_private = exmdb_server::is_private();
+	if (pdb->b_private)
 		db_engine_load_dynamic_list(pdb);
 	return db_item_ptr(pdb);
 }
 
+static bool db_engine_lock(DB_ITEM *pdb)
+{
+	auto start = std::chrono::steady_clock::now();
+	if (!pdb->giant_lock.try_lock_for(DB_LOCK_TIMEOUT))
+		return false;
+	pdb->lock_since = std::chrono::steady_clock::now();
+	auto wait = pdb->lock_since - start;
+	pdb->lock_count.fetch_add(1, std::memory_order_relaxed);
+	pdb->lock_wait_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count(), std::memory_order_relaxed);
+	exmdb_lock_stat_add(wait);
+	return true;
+}
+
 void db_item_deleter::operator()(DB_ITEM *pdb) const
 {
 	pdb->last_time = time(nullptr);
+	auto held = std::chrono::steady_clock::now() - pdb->lock_since;
+	pdb->lock_hold_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(held).count(), std::memory_order_relaxed);
 	pdb->giant_lock.unlock();
 	pdb->reference --;
 }
 
+static int64_t db_engine_pragma(sqlite3 *psqlite, const char *q)
+{
+	auto stm = gx_sql_prep(psqlite, q);
+	if (stm == nullptr || stm.step() != SQLITE_ROW)
+		return -1;
+	return stm.col_int64(0);
+}
+
 BOOL db_engine_vacuum(const char *path)
 {
 	auto db = db_engine_get_db(path);
 	if (db == nullptr || db->psqlite == nullptr)
 		return false;
 	mlog(LV_INFO, "I-2102: Vacuuming %s (exchange.sqlite3)", path);
+	/*
+	 * Stores created before auto_vacuum=INCREMENTAL became the default
+	 * are converted by this VACUUM; afterwards, db_engine_reclaim can
+	 * return free pages without a full rebuild.
+	 */
+	if (db_engine_pragma(db->psqlite, "PRAGMA auto_vacuum") != 2 &&
+	    gx_sql_exec(db->psqlite, "PRAGMA auto_vacuum=INCREMENTAL") != SQLITE_OK)
+		return false;
 	if (gx_sql_exec(db->psqlite, "VACUUM") != SQLITE_OK)
 		return false;
 	mlog(LV_INFO, "I-2102: Vacuuming %s ended", path);
@@ -297,6 +334,49 @@ BOOL db_engine_unload_db(const char *path)
 	return FALSE;
 }
 
+/* Stores with the highest giant_lock wait time, for the metrics dump */
+std::vector<db_lock_stat> db_engine_lock_stats(size_t max) try
+{
+	std::vector<db_lock_stat> v;
+	std::unique_lock hhold(g_hash_lock);
+	v.reserve(g_hash_table.size());
+	for (const auto &[dir, db] : g_hash_table)
+		v.push_back({dir, db.lock_count.load(std::memory_order_relaxed),
+			db.lock_wait_ns.load(std::memory_order_relaxed),
+			db.lock_hold_ns.load(std::memory_order_relaxed)});
+	hhold.unlock();
+	if (v.size() > max) {
+		std::partial_sort(v.begin(), v.begin() + max, v.end(),
+			[](const db_lock_stat &a, const db_lock_stat &b) { return a.wait_ns > b.wait_ns; });
+		v.resize(max);
+	}
+	return v;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1223: ENOMEM");
+	return {};
+}
+
+/* Open stores by number of lock acquisitions, for the warm-up list */
+std::vector<db_warm_store> db_engine_hot_stores(size_t max) try
+{
+	std::vector<db_warm_store> v;
+	std::unique_lock hhold(g_hash_lock);
+	v.reserve(g_hash_table.size());
+	for (const auto &[dir, db] : g_hash_table)
+		if (db.psqlite != nullptr)
+			v.push_back({dir, db.b_private,
+				db.lock_count.load(std::memory_order_relaxed)});
+	hhold.unlock();
+	std::sort(v.begin(), v.end(),
+		[](const db_warm_store &a, const db_warm_store &b) { return a.score > b.score; });
+	if (v.size() > max)
+		v.resize(max);
+	return v;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1744: ENOMEM");
+	return {};
+}
+
 dynamic_node::dynamic_node(dynamic_node &&o) noexcept :
 	folder_id(o.folder_id), search_flags(o.search_flags),
 	prestriction(o.prestriction), folder_ids(o.folder_ids)
@@ -381,6 +461,53 @@ static bool remove_from_hash(const decltype(g_hash_table)::value_type &it, time_
 	return true;
 }
 
+/**
+ * Give free pages of an idle store back to the filesystem with
+ * "PRAGMA incremental_vacuum", a few pages at a time. Once the freelist has
+ * grown past exmdb_vacuum_free_pages, it is shrunk to half of that. The
+ * giant lock is only tried, never waited for, and released after every step,
+ * so a request for the store stops reclamation after at most one step.
+ * The caller holds a reference on @pdb.
+ */
+static void db_engine_reclaim(DB_ITEM *pdb, const char *dir)
+{
+	auto budget = static_cast<int64_t>(g_exmdb_vacuum_free_pages);
+	auto step = std::max(g_exmdb_vacuum_step, static_cast<size_t>(1));
+	auto until = std::chrono::steady_clock::now() + DB_RECLAIM_SLICE;
+	int64_t first = -1, left = -1;
+
+	while (!g_notify_stop && std::chrono::steady_clock::now() < until) {
+		if (pdb->reference != 1 || !pdb->giant_lock.try_lock())
+			break;
+		std::unique_lock gl(pdb->giant_lock, std::adopt_lock);
+		if (pdb->psqlite == nullptr)
+			break;
+		if (first < 0) {
+			if (db_engine_pragma(pdb->psqlite, "PRAGMA auto_vacuum") != 2)
+				break;
+			first = db_engine_pragma(pdb->psqlite, "PRAGMA freelist_count");
+			if (first <= budget)
+				break;
+			left = first;
+		}
+		auto n = std::min(static_cast<int64_t>(step), left - budget / 2);
+		if (n <= 0)
+			break;
+		char qstr[48];
+		snprintf(qstr, std::size(qstr), "PRAGMA incremental_vacuum(%lld)",
+		         static_cast<long long>(n));
+		if (gx_sql_exec(pdb->psqlite, qstr) != SQLITE_OK)
+			break;
+		left = db_engine_pragma(pdb->psqlite, "PRAGMA freelist_count");
+		if (left < 0)
+			break;
+	}
+	if (first > budget && left >= 0)
+		mlog(LV_DEBUG, "D-1743: %s: reclaimed %lld of %lld free pages", dir,
+		     static_cast<long long>(first - left),
+		     static_cast<long long>(first));
+}
+
 static void *mdpeng_scanwork(void *param)
 {
 	int count;
@@ -393,7 +520,8 @@ static void *mdpeng_scanwork(void *param)
 			continue;
 		}
 		count = 0;
-		std::lock_guard hhold(g_hash_lock);
+		std::vector<std::pair<DB_ITEM *, std::string>> idle;
+		std::unique_lock hhold(g_hash_lock);
 		auto now_time = time(nullptr);
 
 #if __cplusplus >= 202000L
@@ -406,7 +534,25 @@ static void *mdpeng_scanwork(void *param)
 				++it;
 		}
 #endif
+		if (g_exmdb_vacuum_free_pages > 0) try {
+			for (auto &[dir, db] : g_hash_table) {
+				if (db.reference != 0 || db.psqlite == nullptr ||
+				    now_time - db.last_time < DB_RECLAIM_IDLE)
+					continue;
+				idle.emplace_back(&db, dir);
+				++db.reference;
+			}
+		} catch (const std::bad_alloc &) {
+			/* reclaim what made it into the list */
+		}
+		hhold.unlock();
+		/* The reference keeps the items in g_hash_table. */
+		for (const auto &[pdb, dir] : idle) {
+			db_engine_reclaim(pdb, dir.c_str());
+			--pdb->reference;
+		}
 	}
+	db_warmup_save();
 	std::lock_guard hhold(g_hash_lock);
 	g_hash_table.clear();
 	return nullptr;
@@ -737,11 +883,14 @@ int db_engine_run()
 		pthread_setname_np(tid, buf);
 		g_thread_ids.push_back(tid);
 	}
+	if (db_warmup_run() != 0)
+		mlog(LV_WARN, "W-1745: exmdb_provider: starting without store warm-up");
 	return 0;
 }
 
 void db_engine_stop()
 {
+	db_warmup_stop();
 	if (!g_notify_stop) {
 		g_notify_stop = true;
 		if (!pthread_equal(g_scan_tid, {})) {
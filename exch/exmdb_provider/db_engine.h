@@ -1,5 +1,6 @@
 #pragma once
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <list>
 #include <memory>
@@ -112,7 +113,11 @@ struct DB_ITEM {
 	std::atomic<int> reference{0};
 	time_t last_time = 0;
 	std::timed_mutex giant_lock; /* should be broken up */
+	/* giant_lock accounting for exmdb_server::get_metrics */
+	std::atomic<uint64_t> lock_count{0}, lock_wait_ns{0}, lock_hold_ns{0};
+	std::chrono::steady_clock::time_point lock_since; /* under giant_lock */
 	sqlite3 *psqlite = nullptr;
+	bool b_private = false; /* as opened; for the warm-up list */
 	std::vector<dynamic_node> dynamic_list; /* dynamic searches */
 	std::vector<nsub_node> nsub_list;
 	std::vector<instance_node> instance_list;
@@ -137,9 +142,27 @@ class db_item_deleter {
 
 using db_item_ptr = std::unique_ptr<DB_ITEM, db_item_deleter>;
 
+struct db_lock_stat {
+	std::string dir;
+	uint64_t count = 0, wait_ns = 0, hold_ns = 0;
+};
+
+struct db_warm_store {
+	std::string dir;
+	bool b_private = false;
+	uint64_t score = 0;
+};
+
+struct db_warmup_stat {
+	uint64_t planned = 0, opened = 0, failed = 0, bytes = 0;
+	bool running = false;
+};
+
 extern db_item_ptr db_engine_get_db(const char *dir);
 extern BOOL db_engine_vacuum(const char *path);
 BOOL db_engine_unload_db(const char *path);
+extern std::vector<db_lock_stat> db_engine_lock_stats(size_t max);
+extern std::vector<db_warm_store> db_engine_hot_stores(size_t max);
 extern BOOL db_engine_enqueue_populating_criteria(const char *dir, cpid_t, uint64_t folder_id, BOOL recursive, const RESTRICTION *, const LONGLONG_ARRAY *folder_ids);
 extern bool db_engine_check_populating(const char *dir, uint64_t folder_id);
 extern void db_engine_update_dynamic(db_item_ptr &, uint64_t folder_id, uint32_t search_flags, const RESTRICTION *prestriction, const LONGLONG_ARRAY *pfolder_ids);
@@ -162,8 +185,15 @@ extern void db_engine_begin_batch_mode(db_item_ptr &);
 /* pdb will also be put */
 extern void db_engine_commit_batch_mode(db_item_ptr &&);
 extern void db_engine_cancel_batch_mode(db_item_ptr &);
+extern int db_warmup_run();
+extern void db_warmup_stop();
+extern void db_warmup_save();
+extern db_warmup_stat db_warmup_stats();
 
 extern unsigned int g_exmdb_schema_upgrades, g_exmdb_search_pacing;
 extern unsigned long long g_exmdb_search_pacing_time;
 extern unsigned int g_exmdb_search_yield, g_exmdb_search_nice;
+extern size_t g_exmdb_vacuum_free_pages, g_exmdb_vacuum_step;
+extern size_t g_exmdb_warmup_stores;
+extern unsigned int g_exmdb_warmup_threads, g_exmdb_warmup_rate;
 extern unsigned int g_exmdb_pvt_folder_softdel;
@@ -2,6 +2,8 @@
 #include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
+#include <climits>
 #include <csignal>
 #include <cstdint>
 #include <cstdio>
@@ -10,6 +12,7 @@
 #include <memory>
 #include <mutex>
 #include <netdb.h>
+#include <optional>
 #include <poll.h>
 #include <pthread.h>
 #include <string>
@@ -20,6 +23,7 @@
 #include <libHX/string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <libHX/socket.h>
 #include <gromox/defs.h>
 #include <gromox/exmdb_common_util.hpp>
@@ -54,8 +58,8 @@ ROUTER_CONNECTION::~ROUTER_CONNECTION()
 {
 	if (sockd >= 0)
 		close(sockd);
-	for (auto &&bin : datagram_list)
-		free(bin.pb);
+	for (auto &&dg : datagram_list)
+		free(dg.bin.pb);
 }
 
 void exmdb_parser_init(size_t max_threads, size_t max_routers)
@@ -149,7 +153,9 @@ static BOOL exmdb_parser_dispatch(const exreq *prequest, exresp *&presponse)
 			exmdb_rpc_idtoname(prequest->call_id),
 		       prequest->dir, strerror(errno));
 	exmdb_server::set_dir(prequest->dir);
+	exmdb_rpc_stat_set_callid(static_cast<uint8_t>(prequest->call_id));
 	auto ret = exmdb_parser_dispatch2(prequest, presponse);
+	exmdb_rpc_stat_set_callid(-1);
 	if (ret)
 		presponse->call_id = prequest->call_id;
 	if (g_exrpc_debug == 0)
@@ -162,6 +168,43 @@ static BOOL exmdb_parser_dispatch(const exreq *prequest, exresp *&presponse)
 	return ret;
 }
 
+/*
+ * Responses whose values are all allocated in the request's env. Others,
+ * like read_message_instance or get_instance_properties, point into objects
+ * that other requests can modify or free once the store is released.
+ */
+static bool exmdb_parser_env_owned(exmdb_callid call_id)
+{
+	switch (call_id) {
+	case exmdb_callid::query_table:
+	case exmdb_callid::read_message:
+	case exmdb_callid::get_message_properties:
+	case exmdb_callid::get_folder_properties:
+	case exmdb_callid::get_store_properties:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * For env-owned responses, large values are not copied but referenced, and
+ * written from where they are with writev, so the caller must hold off
+ * free_env until the response has been sent.
+ */
+static bool exmdb_parser_push(const exresp *response,
+    std::optional<EXT_PUSH> &ep, std::vector<struct iovec> &iov) try
+{
+	ep.emplace();
+	auto flags = exmdb_parser_env_owned(response->call_id) ? EXT_FLAG_IOVREF : 0;
+	if (exmdb_ext_push_response(response, *ep, flags) != EXT_ERR_SUCCESS)
+		return false;
+	ep->get_iov(iov);
+	return true;
+} catch (const std::bad_alloc &) {
+	return false;
+}
+
 static void *mdpps_thrwork(void *pparam)
 {
 	int tv_msec;
@@ -170,12 +213,15 @@ static void *mdpps_thrwork(void *pparam)
 	BOOL b_private;
 	BINARY tmp_bin;
 	uint32_t offset;
-	int written_len;
+	ssize_t written_len;
 	BOOL is_writing;
 	BOOL is_connected;
 	uint32_t buff_len;
 	uint8_t resp_buff[5]{};
 	struct pollfd pfd_read;
+	std::optional<EXT_PUSH> resp_push;
+	std::vector<struct iovec> resp_iov;
+	size_t iov_pos = 0;
 	
 	b_private = FALSE; /* whatever for connect request */
 	/* unordered_set currently owns it, now take another ref */
@@ -188,18 +234,26 @@ static void *mdpps_thrwork(void *pparam)
 	is_connected = FALSE;
 	while (!pconnection->b_stop) {
 		if (is_writing) {
-			written_len = write(pconnection->sockd,
-			              static_cast<char *>(pbuff) + offset, buff_len - offset);
+			written_len = writev(pconnection->sockd, &resp_iov[iov_pos],
+			              std::min(resp_iov.size() - iov_pos, static_cast<size_t>(IOV_MAX)));
 			if (written_len <= 0)
 				break;
-			offset += written_len;
-			if (offset == buff_len) {
-				free(pbuff);
-				pbuff = NULL;
-				buff_len = 0;
-				offset = 0;
-				is_writing = FALSE;
+			while (iov_pos < resp_iov.size() &&
+			    static_cast<size_t>(written_len) >= resp_iov[iov_pos].iov_len) {
+				written_len -= resp_iov[iov_pos].iov_len;
+				++iov_pos;
+			}
+			if (iov_pos < resp_iov.size()) {
+				auto &v = resp_iov[iov_pos];
+				v.iov_base = static_cast<char *>(v.iov_base) + written_len;
+				v.iov_len -= written_len;
+				continue;
 			}
+			resp_push.reset();
+			resp_iov.clear();
+			iov_pos = 0;
+			exmdb_server::free_env();
+			is_writing = FALSE;
 			continue;
 		}
 		tv_msec = SOCKET_TIMEOUT * 1000;
@@ -237,6 +291,8 @@ static void *mdpps_thrwork(void *pparam)
 		if (offset < buff_len)
 			continue;
 		exmdb_server::build_env(b_private ? EM_PRIVATE : 0, nullptr);
+		auto rq_start = std::chrono::steady_clock::now();
+		auto rq_bytes = buff_len;
 		tmp_bin.pv = pbuff;
 		tmp_bin.cb = buff_len;
 		exreq *request = nullptr;
@@ -301,14 +357,17 @@ static void *mdpps_thrwork(void *pparam)
 				tmp_byte = exmdb_response::connect_incomplete;
 			}
 		} else if (!exmdb_parser_dispatch(request, response)) {
+			exmdb_rpc_stat_add(static_cast<uint8_t>(request->call_id),
+				std::chrono::steady_clock::now() - rq_start, false, rq_bytes, 0);
 			tmp_byte = exmdb_response::dispatch_error;
-		} else if (EXT_ERR_SUCCESS != exmdb_ext_push_response(response, &tmp_bin)) {
+		} else if (!exmdb_parser_push(response, resp_push, resp_iov)) {
 			tmp_byte = exmdb_response::push_error;
 		} else {
-			exmdb_server::free_env();
-			offset = 0;
-			pbuff = tmp_bin.pb;
-			buff_len = tmp_bin.cb;
+			exmdb_rpc_stat_add(static_cast<uint8_t>(request->call_id),
+				std::chrono::steady_clock::now() - rq_start, true,
+				rq_bytes, resp_push->total_size());
+			/* free_env happens once the response is out */
+			iov_pos = 0;
 			is_writing = TRUE;
 			continue;
 		}
@@ -319,6 +378,8 @@ static void *mdpps_thrwork(void *pparam)
 	close(pconnection->sockd);
 	pconnection->sockd = -1;
 	free(pbuff);
+	resp_push.reset();
+	exmdb_server::free_env();
 	if (!pconnection->b_stop) {
 		pconnection->thr_id = {};
 		pthread_detach(pthread_self());
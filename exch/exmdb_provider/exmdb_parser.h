@@ -1,12 +1,16 @@
 #pragma once
 #include <condition_variable>
+#include <cstdint>
 #include <list>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <pthread.h>
 #include <string>
+#include <utility>
 #include <gromox/atomic.hpp>
 #include <gromox/common_types.hpp>
+#include <gromox/mapi_types.hpp>
 
 class EXMDB_CONNECTION : public std::enable_shared_from_this<EXMDB_CONNECTION> {
 	public:
@@ -20,6 +24,24 @@ class EXMDB_CONNECTION : public std::enable_shared_from_this<EXMDB_CONNECTION> {
 	int sockd = -1;
 };
 
+/* A serialized DB_NOTIFY_DATAGRAM waiting to be sent to a router */
+struct router_datagram {
+	BINARY bin{}; /* manual (de)allocation of .pb */
+	/* Table events only: the table and row the event is about */
+	bool b_row = false, b_reload = false;
+	enum db_notify_type type{};
+	std::string dir;
+	uint32_t table_id = 0;
+	uint64_t row[3]{};
+};
+
+/* Queued events of one table, for coalescing */
+struct router_table {
+	unsigned int rows = 0;
+	bool b_reload = false, b_last = false;
+	std::list<router_datagram>::iterator last; /* valid if b_last */
+};
+
 struct ROUTER_CONNECTION {
 	ROUTER_CONNECTION() = default;
 	NOMOVE(ROUTER_CONNECTION);
@@ -32,7 +54,8 @@ struct ROUTER_CONNECTION {
 	time_t last_time = 0;
 	std::mutex lock, cond_mutex;
 	std::condition_variable waken_cond;
-	std::list<BINARY> datagram_list; /* manual (de)allocation of .pb */
+	std::list<router_datagram> datagram_list;
+	std::map<std::pair<std::string, uint32_t>, router_table> table_list;
 };
 
 extern void exmdb_parser_init(size_t max_threads, size_t max_routers);
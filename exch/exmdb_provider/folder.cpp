@@ -2132,7 +2132,7 @@ BOOL exmdb_server::empty_folder_rule(const char *dir, uint64_t folder_id)
 	         "folder_id=%llu", LLU{rop_util_get_gc_value(folder_id)});
 	if (gx_sql_exec(pdb->psqlite, sql_string) != SQLITE_OK)
 		return FALSE;
-	return TRUE;
+	return cu_bump_rules_cn(pdb->psqlite, rop_util_get_gc_value(folder_id));
 }
 
 /* after updating the database, update the table too! */
@@ -2366,6 +2366,8 @@ BOOL exmdb_server::update_folder_rule(const char *dir, uint64_t folder_id,
 		}
 		}
 	}
+	if (count > 0 && !cu_bump_rules_cn(pdb->psqlite, fid_val))
+		return false;
 	return sql_transact.commit() == 0 ? TRUE : false;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-1199: ENOMEM");
@@ -657,7 +657,7 @@ BOOL exmdb_server::get_hierarchy_sync(const char *dir,
 			return t == PR_HAS_RULES || t == PidTagChangeNumber ||
 			       t == PR_LOCAL_COMMIT_TIME || t == PR_DELETED_COUNT_TOTAL ||
 			       t == PR_NORMAL_MESSAGE_SIZE || t == PR_LOCAL_COMMIT_TIME_MAX ||
-			       t == PR_HIERARCHY_CHANGE_NUM;
+			       t == PR_HIERARCHY_CHANGE_NUM || t == PR_RULES_CHANGE_NUM;
 		}), tags.end());
 		tags.push_back(PidTagParentFolderId);
 		proptags.count = tags.size();
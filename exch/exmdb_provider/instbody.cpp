@@ -1,11 +1,22 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later, OR GPL-2.0-or-later WITH linking exception
 // SPDX-FileCopyrightText: 2020–2021 grommunio GmbH
 // This file is part of Gromox.
+#include <condition_variable>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fcntl.h>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <fmt/core.h>
 #include <libHX/defs.h>
+#include <gromox/database.h>
+#include <gromox/endian.hpp>
 #include <gromox/exmdb_common_util.hpp>
 #include <gromox/exmdb_server.hpp>
 #include <gromox/fileio.h>
@@ -24,7 +35,88 @@ struct instbody_delete : public stdlib_delete {
 };
 }
 
-unsigned int exmdb_body_autosynthesis;
+namespace {
+struct presynth_job {
+	std::string dir, html_cid, rtf_cid;
+	bool has_body = false;
+};
+}
+
+unsigned int exmdb_body_autosynthesis, exmdb_body_cache, exmdb_body_presynthesis;
+static std::mutex g_presynth_lock;
+static std::condition_variable g_presynth_cond;
+static std::deque<presynth_job> g_presynth_queue;
+static std::thread g_presynth_thr;
+static bool g_presynth_stop;
+static constexpr size_t PRESYNTH_QUEUE_MAX = 4096;
+
+/*
+ * Synthesized bodies are kept as files next to the content file they were
+ * derived from, cid/<source>.x-<kind>. Content files are named after their
+ * content and never change, so a message whose source body is replaced
+ * refers to a new CID, and derivations of the old one are simply not looked
+ * up anymore; purge_datafiles collects them together with their source.
+ */
+static std::string derived_path(const char *dir, const char *srccid,
+    const char *kind)
+{
+	auto path = cu_cid_path(dir, srccid, 0);
+	if (path.empty())
+		return path;
+	return path + ".x-" + kind;
+}
+
+static int derived_read(const char *srccid, const char *kind, BINARY *&bin) try
+{
+	if (!exmdb_body_cache || srccid == nullptr)
+		return 0;
+	BINARY dxbin;
+	auto path = derived_path(nullptr, srccid, kind);
+	if (path.empty() || gx_decompress_file(path.c_str(), dxbin,
+	    common_util_alloc, [](void *, size_t z) { return common_util_alloc(z); }) != 0)
+		return 0;
+	bin = cu_alloc<BINARY>();
+	if (bin == nullptr)
+		return -1;
+	*bin = dxbin;
+	return 1;
+} catch (const std::bad_alloc &) {
+	return 0;
+}
+
+static void derived_write(const char *dir, const char *srccid,
+    const char *kind, std::string_view data) try
+{
+	if (!exmdb_body_cache || srccid == nullptr)
+		return;
+	if (dir == nullptr)
+		dir = exmdb_server::get_dir();
+	auto path = derived_path(dir, srccid, kind);
+	if (path.empty())
+		return;
+	gromox::tmpfile tmf;
+	auto ret = tmf.open_linkable(dir, O_RDWR | O_TRUNC);
+	if (ret < 0) {
+		mlog(LV_ERR, "E-1232: open(%s)[%s]: %s", dir, tmf.m_path.c_str(), strerror(-ret));
+		return;
+	}
+	auto err = gx_compress_tofd(data, tmf, g_cid_compression);
+	if (err == 0)
+		err = tmf.link_to(path.c_str());
+	if (err != 0)
+		mlog(LV_ERR, "E-1233: cannot write derived body %s: %s",
+			path.c_str(), strerror(err));
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1234: ENOMEM");
+}
+
+/* Stored plaintext derivations carry the cpid reported by html_to_plain. */
+static std::string derived_plain(int cpid, const std::string &text)
+{
+	std::string s(sizeof(uint32_t), '\0');
+	cpu_to_le32p(s.data(), cpid);
+	return s + text;
+}
 
 /* Get an arbitrary body, no fallbacks. */
 static int instance_get_raw(MESSAGE_CONTENT *mc, BINARY *&bin, unsigned int tag)
@@ -66,6 +158,9 @@ static int instance_get_rtf(MESSAGE_CONTENT *mc, BINARY *&bin)
 
 static int instance_conv_htmlfromhigher(MESSAGE_CONTENT *mc, BINARY *&bin)
 {
+	auto srccid = mc->proplist.get<const char>(ID_TAG_RTFCOMPRESSED);
+	if (derived_read(srccid, "html", bin) > 0)
+		return 1;
 	auto ret = instance_get_rtf(mc, bin);
 	if (ret <= 0)
 		return ret;
@@ -74,6 +169,7 @@ static int instance_conv_htmlfromhigher(MESSAGE_CONTENT *mc, BINARY *&bin)
 	auto at_clean = make_scope_exit([&]() { attachment_list_free(at); });
 	if (!rtf_to_html(bin->pc, bin->cb, "utf-8", outbuf, at))
 		return -1;
+	derived_write(nullptr, srccid, "html", outbuf);
 	bin->cb = outbuf.size() < UINT32_MAX ? outbuf.size() : UINT32_MAX;
 	bin->pv = common_util_alloc(bin->cb);
 	if (bin->pv == nullptr)
@@ -85,15 +181,29 @@ static int instance_conv_htmlfromhigher(MESSAGE_CONTENT *mc, BINARY *&bin)
 /* Always yields UTF-8 */
 static int instance_conv_textfromhigher(MESSAGE_CONTENT *mc, BINARY *&bin)
 {
-	auto ret = instance_get_raw(mc, bin, ID_TAG_HTML);
-	if (exmdb_body_autosynthesis && ret == 0)
-		ret = instance_conv_htmlfromhigher(mc, bin);
-	if (ret <= 0)
-		return ret;
+	/* plain from HTML keyed by the HTML CID, plain from RTF by the RTF CID */
+	auto srccid = mc->proplist.get<const char>(ID_TAG_HTML);
+	auto kind = "plain";
+	if (srccid == nullptr && exmdb_body_autosynthesis) {
+		srccid = mc->proplist.get<const char>(ID_TAG_RTFCOMPRESSED);
+		kind = "rplain";
+	}
 	std::string plainbuf;
-	ret = html_to_plain(bin->pc, bin->cb, plainbuf);
-	if (ret < 0)
-		return 0;
+	int ret;
+	if (derived_read(srccid, kind, bin) > 0 && bin->cb >= sizeof(uint32_t)) {
+		ret = le32p_to_cpu(bin->pv);
+		plainbuf.assign(bin->pc + sizeof(uint32_t), bin->cb - sizeof(uint32_t));
+	} else {
+		ret = instance_get_raw(mc, bin, ID_TAG_HTML);
+		if (exmdb_body_autosynthesis && ret == 0)
+			ret = instance_conv_htmlfromhigher(mc, bin);
+		if (ret <= 0)
+			return ret;
+		ret = html_to_plain(bin->pc, bin->cb, plainbuf);
+		if (ret < 0)
+			return 0;
+		derived_write(nullptr, srccid, kind, derived_plain(ret, plainbuf));
+	}
 	auto cpraw = mc->proplist.get<const uint32_t>(PR_INTERNET_CPID);
 	cpid_t orig_cpid = cpraw != nullptr ? static_cast<cpid_t>(*cpraw) : CP_UTF8;
 	if (ret != CP_UTF8 && orig_cpid != CP_UTF8) {
@@ -136,6 +246,14 @@ static int instance_conv_htmlfromlower(MESSAGE_CONTENT *mc,
 static int instance_conv_rtfcpfromlower(MESSAGE_CONTENT *mc,
     cpid_t cpid, BINARY *&bin)
 {
+	auto srccid = mc->proplist.get<const char>(ID_TAG_BODY);
+	if (srccid == nullptr)
+		srccid = mc->proplist.get<const char>(ID_TAG_BODY_STRING8);
+	/* Output depends on the codepage as well */
+	char kind[24];
+	snprintf(kind, std::size(kind), "rtfcp-%u", static_cast<unsigned int>(cpid));
+	if (derived_read(srccid, kind, bin) > 0)
+		return 1;
 	auto ret = instance_conv_htmlfromlower(mc, cpid, bin);
 	if (ret <= 0)
 		return ret;
@@ -146,6 +264,7 @@ static int instance_conv_rtfcpfromlower(MESSAGE_CONTENT *mc,
 	std::unique_ptr<BINARY, instbody_delete> rtfcpbin(rtfcp_compress(rtfout.get(), rtflen));
 	if (rtfcpbin == nullptr)
 		return -1;
+	derived_write(nullptr, srccid, kind, std::string_view(rtfcpbin->pc, rtfcpbin->cb));
 	bin->cb = rtfcpbin->cb;
 	bin->pv = common_util_alloc(rtfcpbin->cb);
 	if (bin->pv == nullptr)
@@ -315,3 +434,147 @@ int instance_get_message_body(MESSAGE_CONTENT *mc, unsigned int tag,
 	}
 	return -1;
 }
+
+static void *presynth_realloc(void *p, size_t z) { return realloc(p, z); }
+
+/* Read a (v3) content file into malloc'd memory */
+static bool presynth_load(const presynth_job &job, const std::string &cid,
+    BINARY &bin)
+{
+	auto path = cu_cid_path(job.dir.c_str(), cid.c_str(), 0);
+	return !path.empty() &&
+	       gx_decompress_file(path.c_str(), bin, malloc, presynth_realloc) == 0;
+}
+
+static void presynth_plain(const presynth_job &job, const std::string &srccid,
+    const char *kind, const char *html, size_t hlen)
+{
+	std::string plainbuf;
+	auto ret = html_to_plain(html, hlen, plainbuf);
+	if (ret >= 0)
+		derived_write(job.dir.c_str(), srccid.c_str(), kind,
+			derived_plain(ret, plainbuf));
+}
+
+static void presynth_one(const presynth_job &job)
+{
+	if (!job.html_cid.empty()) {
+		if (job.has_body)
+			return;
+		BINARY html{};
+		if (!presynth_load(job, job.html_cid, html))
+			return;
+		auto cl_0 = make_scope_exit([&]() { free(html.pv); });
+		presynth_plain(job, job.html_cid, "plain", html.pc, html.cb);
+		return;
+	}
+	BINARY rtfcp{};
+	if (!presynth_load(job, job.rtf_cid, rtfcp))
+		return;
+	auto cl_0 = make_scope_exit([&]() { free(rtfcp.pv); });
+	auto unc_size = rtfcp_uncompressed_size(&rtfcp);
+	if (unc_size < 0)
+		return;
+	auto rtf = std::make_unique<char[]>(unc_size);
+	size_t unc_size2 = unc_size;
+	if (!rtfcp_uncompress(&rtfcp, rtf.get(), &unc_size2))
+		return;
+	std::string outbuf;
+	auto at = attachment_list_init();
+	auto at_clean = make_scope_exit([&]() { attachment_list_free(at); });
+	if (!rtf_to_html(rtf.get(), unc_size2, "utf-8", outbuf, at))
+		return;
+	derived_write(job.dir.c_str(), job.rtf_cid.c_str(), "html", outbuf);
+	if (!job.has_body)
+		presynth_plain(job, job.rtf_cid, "rplain", outbuf.c_str(), outbuf.size());
+}
+
+static void presynth_thrwork()
+{
+	std::unique_lock lk(g_presynth_lock);
+	while (true) {
+		g_presynth_cond.wait(lk, []() { return g_presynth_stop || !g_presynth_queue.empty(); });
+		if (g_presynth_stop)
+			break;
+		auto job = std::move(g_presynth_queue.front());
+		g_presynth_queue.pop_front();
+		lk.unlock();
+		try {
+			presynth_one(job);
+		} catch (const std::bad_alloc &) {
+			mlog(LV_ERR, "E-1235: ENOMEM");
+		}
+		lk.lock();
+	}
+}
+
+/**
+ * Queue the body formats that readers will likely ask for and which are
+ * not stored with the just-delivered message @message_id, so that the
+ * conversion happens off the request path.
+ */
+void instbody_presynth_enqueue(sqlite3 *psqlite, uint64_t message_id) try
+{
+	if (!exmdb_body_cache || !exmdb_body_presynthesis ||
+	    !exmdb_body_autosynthesis || !g_presynth_thr.joinable())
+		return;
+	auto stm = gx_sql_prep(psqlite, fmt::format("SELECT proptag, propval "
+	           "FROM message_properties WHERE message_id={} AND proptag "
+	           "IN ({},{},{},{})", message_id, PR_BODY, PR_BODY_A, PR_HTML,
+	           PR_RTF_COMPRESSED).c_str());
+	if (stm == nullptr)
+		return;
+	presynth_job job;
+	while (stm.step() == SQLITE_ROW) {
+		auto tag = stm.col_uint64(0);
+		auto cid = stm.col_text(1);
+		if (cid == nullptr)
+			continue;
+		if (tag == PR_HTML)
+			job.html_cid = cid;
+		else if (tag == PR_RTF_COMPRESSED)
+			job.rtf_cid = cid;
+		else
+			job.has_body = true;
+	}
+	/* Nothing to do; or not a v3 content file as produced by delivery */
+	auto &src = job.html_cid.empty() ? job.rtf_cid : job.html_cid;
+	if (src.find('/') == src.npos || (src == job.html_cid && job.has_body))
+		return;
+	job.dir = exmdb_server::get_dir();
+	std::unique_lock lk(g_presynth_lock);
+	if (g_presynth_queue.size() >= PRESYNTH_QUEUE_MAX)
+		return;
+	g_presynth_queue.push_back(std::move(job));
+	lk.unlock();
+	g_presynth_cond.notify_one();
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1236: ENOMEM");
+}
+
+int instbody_presynth_run()
+{
+	if (!exmdb_body_presynthesis)
+		return 0;
+	g_presynth_stop = false;
+	try {
+		g_presynth_thr = std::thread(presynth_thrwork);
+	} catch (const std::system_error &e) {
+		mlog(LV_ERR, "exmdb_provider: presynthesis thread: %s", e.what());
+		return -1;
+	}
+	return 0;
+}
+
+void instbody_presynth_stop()
+{
+	if (!g_presynth_thr.joinable())
+		return;
+	{
+		std::lock_guard lk(g_presynth_lock);
+		g_presynth_stop = true;
+		g_presynth_queue.clear();
+	}
+	g_presynth_cond.notify_one();
+	g_presynth_thr.join();
+}
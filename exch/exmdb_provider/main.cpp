@@ -24,6 +24,7 @@
 #include "db_engine.h"
 #include "exmdb_listener.h"
 #include "exmdb_parser.h"
+#include "notification_agent.h"
 
 using namespace std::string_literals;
 using namespace gromox;
@@ -37,9 +38,14 @@ static constexpr cfg_directive exmdb_cfg_defaults[] = {
 	{"dbg_synthesize_content", "0"},
 	{"enable_dam", "1", CFG_BOOL},
 	{"exmdb_body_autosynthesis", "1", CFG_BOOL},
+	{"exmdb_body_cache", "1", CFG_BOOL},
+	{"exmdb_body_presynthesis", "0", CFG_BOOL},
 	{"exmdb_file_compression", "zstd-6"},
 	{"exmdb_hosts_allow", ""}, /* ::1 default set later during startup */
 	{"exmdb_listen_port", "5000"},
+	{"exmdb_notify_batch", "256", CFG_SIZE, "1"},
+	{"exmdb_notify_collapse", "512", CFG_SIZE},
+	{"exmdb_notify_delay", "20ms", CFG_TIME_NS, "0", "1s"},
 	{"exmdb_pf_read_per_user", "1"},
 	{"exmdb_pf_read_states", "2"},
 	{"exmdb_private_folder_softdelete", "0", CFG_BOOL},
@@ -48,6 +54,11 @@ static constexpr cfg_directive exmdb_cfg_defaults[] = {
 	{"exmdb_search_pacing", "250", CFG_SIZE},
 	{"exmdb_search_pacing_time", "0.5s", CFG_TIME_NS},
 	{"exmdb_search_yield", "0", CFG_BOOL},
+	{"exmdb_vacuum_free_pages", "4096", CFG_SIZE},
+	{"exmdb_vacuum_step", "256", CFG_SIZE, "1"},
+	{"exmdb_warmup_rate", "20", CFG_SIZE, "1"},
+	{"exmdb_warmup_stores", "100", CFG_SIZE},
+	{"exmdb_warmup_threads", "2", CFG_SIZE, "1", "16"},
 	{"exrpc_debug", "0"},
 	{"listen_ip", "::1"},
 	{"listen_port", "exmdb_listen_port", CFG_ALIAS},
@@ -87,6 +98,10 @@ static bool exmdb_provider_reload(std::shared_ptr<CONFIG_FILE> pconfig)
 	g_mbox_contention_warning = pconfig->get_ll("mbox_contention_warning");
 	g_mbox_contention_reject = pconfig->get_ll("mbox_contention_reject");
 	exmdb_body_autosynthesis = pconfig->get_ll("exmdb_body_autosynthesis");
+	exmdb_body_cache = pconfig->get_ll("exmdb_body_cache");
+	g_exmdb_notify_batch = pconfig->get_ll("exmdb_notify_batch");
+	g_exmdb_notify_collapse = pconfig->get_ll("exmdb_notify_collapse");
+	g_exmdb_notify_delay = pconfig->get_ll("exmdb_notify_delay");
 	exmdb_pf_read_per_user = pconfig->get_ll("exmdb_pf_read_per_user");
 	exmdb_pf_read_states = pconfig->get_ll("exmdb_pf_read_states");
 	g_exmdb_pvt_folder_softdel = pconfig->get_ll("exmdb_private_folder_softdelete");
@@ -94,6 +109,11 @@ static bool exmdb_provider_reload(std::shared_ptr<CONFIG_FILE> pconfig)
 	g_exmdb_search_yield = pconfig->get_ll("exmdb_search_yield");
 	g_exmdb_search_nice = pconfig->get_ll("exmdb_search_nice");
 	g_exmdb_search_pacing_time = pconfig->get_ll("exmdb_search_pacing_time");
+	g_exmdb_vacuum_free_pages = pconfig->get_ll("exmdb_vacuum_free_pages");
+	g_exmdb_vacuum_step = pconfig->get_ll("exmdb_vacuum_step");
+	g_exmdb_warmup_stores = pconfig->get_ll("exmdb_warmup_stores");
+	g_exmdb_warmup_threads = pconfig->get_ll("exmdb_warmup_threads");
+	g_exmdb_warmup_rate = pconfig->get_ll("exmdb_warmup_rate");
 	auto s = pconfig->get_value("exmdb_schema_upgrades");
 	if (strcmp(s, "auto") == 0)
 		g_exmdb_schema_upgrades = EXMDB_UPGRADE_AUTO;
@@ -175,6 +195,7 @@ static BOOL svc_exmdb_provider(int reason, void **ppdata)
 		else
 			mlog(LV_INFO, "Content File Compression: zstd-%d", g_cid_compression);
 
+		exmdb_body_presynthesis = pconfig->get_ll("exmdb_body_presynthesis");
 		common_util_init(org_name, max_msg_count, max_rule, max_ext_rule);
 		db_engine_init(table_size, cache_interval, populating_num);
 		uint16_t listen_port = pconfig->get_ll("exmdb_listen_port");
@@ -195,8 +216,13 @@ static BOOL svc_exmdb_provider(int reason, void **ppdata)
 			db_engine_stop();
 			return FALSE;
 		}
+		if (instbody_presynth_run() != 0) {
+			db_engine_stop();
+			return FALSE;
+		}
 		if (exmdb_parser_run(get_config_path()) != 0) {
 			mlog(LV_ERR, "exmdb_provider: failed to start exmdb parser");
+			instbody_presynth_stop();
 			db_engine_stop();
 			return FALSE;
 		}
@@ -204,6 +230,7 @@ static BOOL svc_exmdb_provider(int reason, void **ppdata)
 			mlog(LV_ERR, "exmdb_provider: failed to start exmdb listener");
 			exmdb_listener_stop();
 			exmdb_parser_stop();
+			instbody_presynth_stop();
 			db_engine_stop();
 			return FALSE;
 		}
@@ -211,6 +238,7 @@ static BOOL svc_exmdb_provider(int reason, void **ppdata)
 			mlog(LV_ERR, "exmdb_provider: failed to start exmdb client");
 			exmdb_listener_stop();
 			exmdb_parser_stop();
+			instbody_presynth_stop();
 			db_engine_stop();
 			return FALSE;
 		}
@@ -251,6 +279,7 @@ static BOOL svc_exmdb_provider(int reason, void **ppdata)
 		exmdb_client_stop();
 		exmdb_listener_stop();
 		exmdb_parser_stop();
+		instbody_presynth_stop();
 		db_engine_stop();
 		return TRUE;
 	}
@@ -31,6 +31,7 @@
 #include <gromox/fileio.h>
 #include <gromox/json.hpp>
 #include <gromox/mapidefs.h>
+#include <gromox/mime_view.hpp>
 #include <gromox/oxcmail.hpp>
 #include <gromox/proptag_array.hpp>
 #include <gromox/rop_util.hpp>
@@ -2027,6 +2028,12 @@ static BOOL message_write_message(BOOL b_internal, sqlite3 *psqlite,
 	}
 	if (b_embedded)
 		return TRUE;
+	if (is_associated) {
+		auto cls = pmsgctnt->proplist.get<const char>(PR_MESSAGE_CLASS);
+		if (cls != nullptr && strcasecmp(cls, "IPM.ExtendedRule.Message") == 0 &&
+		    !cu_bump_rules_cn(psqlite, parent_id))
+			return FALSE;
+	}
 	nt_time = rop_util_current_nttime();
 	return cu_set_property(MAPI_FOLDER, parent_id, CP_ACP, psqlite,
 	       PR_LOCAL_COMMIT_TIME_MAX, &nt_time, &b_result);
@@ -2625,17 +2632,16 @@ static ec_error_t message_forward_message(const rulexec_in &rp,
 			return ecServerOOM;
 		if (read(fd.get(), pbuff.get(), node_stat.st_size) != node_stat.st_size)
 			return ecError;
+		/* The loop check only needs the header, not the MIME tree */
+		mime_view head(pbuff.get(), node_stat.st_size);
+		std::string dlvto;
+		for (unsigned int i = 0; head.get_field("Delivered-To", dlvto, i); ++i)
+			if (strcasecmp(dlvto.c_str(), rp.ev_to) == 0)
+				return ecSuccess;
 		imail.clear();
-		if (!imail.load_from_str_move(pbuff.get(), node_stat.st_size))
+		if (!imail.load_from_str_move(pbuff.get(), node_stat.st_size) ||
+		    imail.get_head() == nullptr)
 			return ecError;
-		auto pmime = imail.get_head();
-		if (pmime == nullptr)
-			return ecError;
-		auto num = pmime->get_field_num("Delivered-To");
-		for (int i = 0; i < num; ++i)
-			if (pmime->search_field("Delivered-To", i, tmp_buff, 256) &&
-			    strcasecmp(tmp_buff, rp.ev_to) == 0)
-				return ecSuccess;
 	} else {
 		if (!message_read_message(rp.sqlite, rp.cpid, rp.message_id,
 		    &pmsgctnt) || pmsgctnt == nullptr)
@@ -3724,6 +3730,7 @@ BOOL exmdb_server::deliver_message(const char *dir, const char *from_address,
 	}
 	if (sql_transact.commit() != 0)
 		return false;
+	instbody_presynth_enqueue(pdb->psqlite, message_id);
 	if (dlflags & DELIVERY_DO_NOTIF) {
 		for (const auto &mn : seen.msg) {
 			db_engine_proc_dynamic_event(
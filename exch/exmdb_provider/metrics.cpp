@@ -0,0 +1,193 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <fmt/core.h>
+#include <gromox/exmdb_common_util.hpp>
+#include <gromox/exmdb_rpc.hpp>
+#include <gromox/exmdb_server.hpp>
+#include <gromox/util.hpp>
+#include "db_engine.h"
+
+using namespace gromox;
+
+namespace {
+
+/*
+ * Latency histogram with power-of-two bucket bounds (1µs, 2µs, 4µs, …,
+ * 2^25µs ≈ 33s, +Inf). Writers only do relaxed increments; the readout is
+ * not an atomic snapshot, which is fine for monitoring purposes.
+ */
+struct lat_histogram {
+	static constexpr unsigned int NBUCKETS = 26;
+
+	void add(time_duration);
+	uint64_t count() const;
+	void emit(std::string &, const char *name, const std::string &labels) const;
+
+	std::atomic<uint64_t> bucket[NBUCKETS+1]{}, sum_ns{0};
+};
+
+struct rpc_stat {
+	lat_histogram latency, lock_wait;
+	std::atomic<uint64_t> failures{0}, rq_bytes{0}, rsp_bytes{0};
+};
+
+}
+
+static constexpr size_t METRICS_TOP_STORES = 32;
+static rpc_stat g_rpc_stats[256];
+static lat_histogram g_lock_wait;
+/* RPC being processed by this thread, for attributing lock waits */
+static thread_local int g_rpc_current = -1;
+
+void lat_histogram::add(time_duration d)
+{
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+	if (ns < 0)
+		ns = 0;
+	uint64_t us = ns / 1000;
+	unsigned int i = 0;
+	while (i < NBUCKETS && us > (UINT64_C(1) << i))
+		++i;
+	bucket[i].fetch_add(1, std::memory_order_relaxed);
+	sum_ns.fetch_add(ns, std::memory_order_relaxed);
+}
+
+uint64_t lat_histogram::count() const
+{
+	uint64_t n = 0;
+	for (const auto &b : bucket)
+		n += b.load(std::memory_order_relaxed);
+	return n;
+}
+
+void lat_histogram::emit(std::string &out, const char *name,
+    const std::string &labels) const
+{
+	auto sep = labels.empty() ? "" : ",";
+	uint64_t cum = 0;
+	for (unsigned int i = 0; i < NBUCKETS; ++i) {
+		cum += bucket[i].load(std::memory_order_relaxed);
+		out += fmt::format("{}_bucket{{{}{}le=\"{}\"}} {}\n", name,
+		       labels, sep, std::ldexp(1e-6, i), cum);
+	}
+	cum += bucket[NBUCKETS].load(std::memory_order_relaxed);
+	out += fmt::format("{}_bucket{{{}{}le=\"+Inf\"}} {}\n", name, labels, sep, cum);
+	auto lb = labels.empty() ? std::string() : "{" + labels + "}";
+	out += fmt::format("{}_sum{} {}\n", name, lb,
+	       sum_ns.load(std::memory_order_relaxed) / 1e9);
+	out += fmt::format("{}_count{} {}\n", name, lb, cum);
+}
+
+void exmdb_rpc_stat_add(uint8_t callid, time_duration d, bool ok,
+    size_t rq_bytes, size_t rsp_bytes)
+{
+	auto &st = g_rpc_stats[callid];
+	st.latency.add(d);
+	if (!ok)
+		st.failures.fetch_add(1, std::memory_order_relaxed);
+	if (rq_bytes > 0)
+		st.rq_bytes.fetch_add(rq_bytes, std::memory_order_relaxed);
+	if (rsp_bytes > 0)
+		st.rsp_bytes.fetch_add(rsp_bytes, std::memory_order_relaxed);
+}
+
+void exmdb_rpc_stat_set_callid(int callid)
+{
+	g_rpc_current = callid;
+}
+
+void exmdb_lock_stat_add(time_duration wait)
+{
+	g_lock_wait.add(wait);
+	if (g_rpc_current >= 0)
+		g_rpc_stats[g_rpc_current].lock_wait.add(wait);
+}
+
+static std::string prom_escape(const std::string &in)
+{
+	std::string out;
+	out.reserve(in.size());
+	for (auto c : in) {
+		if (c == '\n') {
+			out += "\\n";
+			continue;
+		}
+		if (c == '\\' || c == '"')
+			out += '\\';
+		out += c;
+	}
+	return out;
+}
+
+/**
+ * Produce a dump of the RPC and store lock statistics in the Prometheus text
+ * exposition format. @dir is only used for routing the request to this
+ * server; the figures cover the whole exmdb_provider instance.
+ */
+BOOL exmdb_server::get_metrics(const char *dir, char **text) try
+{
+	std::string out, fail, rqb, rsb, lkw;
+	out = "# HELP gromox_exmdb_rpc_duration_seconds Time spent processing exmdb RPCs\n"
+	      "# TYPE gromox_exmdb_rpc_duration_seconds histogram\n";
+	for (unsigned int i = 0; i < std::size(g_rpc_stats); ++i) {
+		auto &st = g_rpc_stats[i];
+		if (st.latency.count() == 0)
+			continue;
+		auto labels = fmt::format("rpc=\"{}\"", exmdb_rpc_idtoname(static_cast<exmdb_callid>(i)));
+		st.latency.emit(out, "gromox_exmdb_rpc_duration_seconds", labels);
+		fail += fmt::format("gromox_exmdb_rpc_failures_total{{{}}} {}\n", labels, st.failures.load(std::memory_order_relaxed));
+		rqb  += fmt::format("gromox_exmdb_rpc_request_bytes_total{{{}}} {}\n", labels, st.rq_bytes.load(std::memory_order_relaxed));
+		rsb  += fmt::format("gromox_exmdb_rpc_response_bytes_total{{{}}} {}\n", labels, st.rsp_bytes.load(std::memory_order_relaxed));
+		if (st.lock_wait.count() > 0)
+			st.lock_wait.emit(lkw, "gromox_exmdb_rpc_lock_wait_seconds", labels);
+	}
+	out += "# HELP gromox_exmdb_rpc_failures_total RPCs that returned an error\n"
+	       "# TYPE gromox_exmdb_rpc_failures_total counter\n" + fail;
+	out += "# HELP gromox_exmdb_rpc_request_bytes_total Request bytes received over the network\n"
+	       "# TYPE gromox_exmdb_rpc_request_bytes_total counter\n" + rqb;
+	out += "# HELP gromox_exmdb_rpc_response_bytes_total Response bytes sent over the network\n"
+	       "# TYPE gromox_exmdb_rpc_response_bytes_total counter\n" + rsb;
+	out += "# HELP gromox_exmdb_rpc_lock_wait_seconds Time network RPCs spent waiting for store database locks\n"
+	       "# TYPE gromox_exmdb_rpc_lock_wait_seconds histogram\n" + lkw;
+	out += "# HELP gromox_exmdb_lock_wait_seconds Time spent waiting for a store's database lock\n"
+	       "# TYPE gromox_exmdb_lock_wait_seconds histogram\n";
+	g_lock_wait.emit(out, "gromox_exmdb_lock_wait_seconds", {});
+
+	std::string acq, wait, hold;
+	for (const auto &s : db_engine_lock_stats(METRICS_TOP_STORES)) {
+		auto dl = prom_escape(s.dir);
+		acq  += fmt::format("gromox_exmdb_store_lock_acquisitions_total{{dir=\"{}\"}} {}\n", dl, s.count);
+		wait += fmt::format("gromox_exmdb_store_lock_wait_seconds_total{{dir=\"{}\"}} {}\n", dl, s.wait_ns / 1e9);
+		hold += fmt::format("gromox_exmdb_store_lock_hold_seconds_total{{dir=\"{}\"}} {}\n", dl, s.hold_ns / 1e9);
+	}
+	out += "# HELP gromox_exmdb_store_lock_acquisitions_total Database lock acquisitions of a loaded store\n"
+	       "# TYPE gromox_exmdb_store_lock_acquisitions_total counter\n" + acq;
+	out += "# HELP gromox_exmdb_store_lock_wait_seconds_total Time spent waiting for the database lock of a loaded store\n"
+	       "# TYPE gromox_exmdb_store_lock_wait_seconds_total counter\n" + wait;
+	out += "# HELP gromox_exmdb_store_lock_hold_seconds_total Time the database lock of a loaded store was held\n"
+	       "# TYPE gromox_exmdb_store_lock_hold_seconds_total counter\n" + hold;
+	auto ws = db_warmup_stats();
+	out += fmt::format("# HELP gromox_exmdb_warmup_stores Stores handled by the startup warm-up\n"
+	       "# TYPE gromox_exmdb_warmup_stores gauge\n"
+	       "gromox_exmdb_warmup_stores{{state=\"planned\"}} {}\n"
+	       "gromox_exmdb_warmup_stores{{state=\"opened\"}} {}\n"
+	       "gromox_exmdb_warmup_stores{{state=\"failed\"}} {}\n"
+	       "# HELP gromox_exmdb_warmup_prefetch_bytes Bytes of store databases prefetched by the startup warm-up\n"
+	       "# TYPE gromox_exmdb_warmup_prefetch_bytes gauge\n"
+	       "gromox_exmdb_warmup_prefetch_bytes {}\n"
+	       "# HELP gromox_exmdb_warmup_running Whether the startup warm-up is still in progress\n"
+	       "# TYPE gromox_exmdb_warmup_running gauge\n"
+	       "gromox_exmdb_warmup_running {}\n",
+	       ws.planned, ws.opened, ws.failed, ws.bytes, ws.running ? 1 : 0);
+	*text = common_util_dup(out.c_str());
+	return *text != nullptr ? TRUE : false;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1225: ENOMEM");
+	return false;
+}
@@ -1,12 +1,19 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#include <algorithm>
 #include <chrono>
+#include <climits>
 #include <cstdint>
+#include <cstring>
 #include <ctime>
+#include <iterator>
 #include <memory>
 #include <mutex>
 #include <poll.h>
+#include <thread>
 #include <unistd.h>
 #include <utility>
+#include <vector>
+#include <sys/uio.h>
 #include <gromox/exmdb_common_util.hpp>
 #include <gromox/exmdb_ext.hpp>
 #include <gromox/exmdb_rpc.hpp>
@@ -14,6 +21,160 @@
 #include "exmdb_parser.h"
 #include "notification_agent.h"
 
+unsigned long long g_exmdb_notify_delay = 20000000;
+size_t g_exmdb_notify_batch = 256, g_exmdb_notify_collapse = 512;
+
+/*
+ * The "table changed" type for the kind of table that @t is about, or 0 if
+ * it is not a table event.
+ */
+static enum db_notify_type na_table_kind(enum db_notify_type t)
+{
+	switch (t) {
+	case db_notify_type::hierarchy_table_changed:
+	case db_notify_type::hierarchy_table_row_added:
+	case db_notify_type::hierarchy_table_row_deleted:
+	case db_notify_type::hierarchy_table_row_modified:
+		return db_notify_type::hierarchy_table_changed;
+	case db_notify_type::content_table_changed:
+	case db_notify_type::content_table_row_added:
+	case db_notify_type::content_table_row_deleted:
+	case db_notify_type::content_table_row_modified:
+		return db_notify_type::content_table_changed;
+	default:
+		return {};
+	}
+}
+
+static void na_row_key(const DB_NOTIFY &n, uint64_t (&row)[3])
+{
+	switch (n.type) {
+	case db_notify_type::hierarchy_table_row_added:
+	case db_notify_type::hierarchy_table_row_modified:
+		row[0] = static_cast<const DB_NOTIFY_HIERARCHY_TABLE_ROW_MODIFIED *>(n.pdata)->row_folder_id;
+		break;
+	case db_notify_type::hierarchy_table_row_deleted:
+		row[0] = static_cast<const DB_NOTIFY_HIERARCHY_TABLE_ROW_DELETED *>(n.pdata)->row_folder_id;
+		break;
+	case db_notify_type::content_table_row_added:
+	case db_notify_type::content_table_row_modified: {
+		auto r = static_cast<const DB_NOTIFY_CONTENT_TABLE_ROW_MODIFIED *>(n.pdata);
+		row[0] = r->row_folder_id;
+		row[1] = r->row_message_id;
+		row[2] = r->row_instance;
+		break;
+	}
+	case db_notify_type::content_table_row_deleted: {
+		auto r = static_cast<const DB_NOTIFY_CONTENT_TABLE_ROW_DELETED *>(n.pdata);
+		row[0] = r->row_folder_id;
+		row[1] = r->row_message_id;
+		row[2] = r->row_instance;
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+/* Remove all queued row events of a table. */
+static void na_drop_rows(ROUTER_CONNECTION &rt, const router_datagram &dg)
+{
+	for (auto it = rt.datagram_list.begin(); it != rt.datagram_list.end(); ) {
+		if (!it->b_row || it->table_id != dg.table_id || it->dir != dg.dir) {
+			++it;
+			continue;
+		}
+		free(it->bin.pb);
+		it = rt.datagram_list.erase(it);
+	}
+}
+
+/*
+ * Append to the router's queue (with rt.lock held). Events for the same
+ * table are coalesced while they wait:
+ *
+ * - a row_modified directly following a row_modified of the same row
+ *   (with no other row event of that table in between) replaces it;
+ * - a queued table_changed makes the client reload the table, so it
+ *   supersedes all queued row events of that table, and absorbs new ones
+ *   until it has been sent;
+ * - with more than g_exmdb_notify_collapse row events of a table queued,
+ *   they are replaced by one table_changed.
+ */
+static void na_enqueue(ROUTER_CONNECTION &rt, router_datagram &&dg)
+{
+	if (!dg.b_row && !dg.b_reload) {
+		rt.datagram_list.push_back(std::move(dg));
+		return;
+	}
+	auto &tbl = rt.table_list[{dg.dir, dg.table_id}];
+	if (tbl.b_reload) {
+		free(dg.bin.pb);
+		return;
+	}
+	if (dg.b_row && tbl.b_last &&
+	    (dg.type == db_notify_type::hierarchy_table_row_modified ||
+	    dg.type == db_notify_type::content_table_row_modified) &&
+	    tbl.last->type == dg.type &&
+	    memcmp(tbl.last->row, dg.row, sizeof(dg.row)) == 0) {
+		free(tbl.last->bin.pb);
+		tbl.last->bin = dg.bin;
+		return;
+	}
+	if (dg.b_row && g_exmdb_notify_collapse > 0 &&
+	    tbl.rows >= g_exmdb_notify_collapse) {
+		DB_NOTIFY_DATAGRAM reload;
+		reload.dir = dg.dir.data();
+		reload.b_table = TRUE;
+		reload.id_array = {1, &dg.table_id};
+		reload.db_notify.type = na_table_kind(dg.type);
+		BINARY bin{};
+		if (exmdb_ext_push_db_notify(&reload, &bin) == EXT_ERR_SUCCESS) {
+			free(dg.bin.pb);
+			dg.bin = bin;
+			dg.type = reload.db_notify.type;
+			dg.b_row = false;
+			dg.b_reload = true;
+		}
+	}
+	if (dg.b_reload) {
+		if (tbl.rows > 0)
+			na_drop_rows(rt, dg);
+		tbl.rows = 0;
+		tbl.b_last = false;
+		tbl.b_reload = true;
+		rt.datagram_list.push_back(std::move(dg));
+		return;
+	}
+	rt.datagram_list.push_back(std::move(dg));
+	tbl.last = std::prev(rt.datagram_list.end());
+	tbl.b_last = true;
+	++tbl.rows;
+}
+
+/* Take the front datagram off the queue (with rt.lock held). */
+static BINARY na_dequeue(ROUTER_CONNECTION &rt)
+{
+	auto it = rt.datagram_list.begin();
+	auto bin = it->bin;
+	if (it->b_row || it->b_reload) {
+		auto ti = rt.table_list.find({it->dir, it->table_id});
+		if (ti != rt.table_list.end()) {
+			auto &tbl = ti->second;
+			if (it->b_reload)
+				tbl.b_reload = false;
+			else if (tbl.rows > 0)
+				--tbl.rows;
+			if (tbl.b_last && tbl.last == it)
+				tbl.b_last = false;
+			if (tbl.rows == 0 && !tbl.b_reload)
+				rt.table_list.erase(ti);
+		}
+	}
+	rt.datagram_list.pop_front();
+	return bin;
+}
+
 void notification_agent_backward_notify(const char *remote_id,
     const DB_NOTIFY_DATAGRAM *pnotify)
 {
@@ -27,91 +188,137 @@ void notification_agent_backward_notify(const char *remote_id,
 	if (NULL == prouter) {
 		return;
 	}
-	BINARY bin{};
-	if (exmdb_ext_push_db_notify(pnotify, &bin) != EXT_ERR_SUCCESS) {
+	router_datagram dg;
+	if (exmdb_ext_push_db_notify(pnotify, &dg.bin) != EXT_ERR_SUCCESS) {
 		exmdb_parser_put_router(std::move(prouter));
-		return;	
+		return;
 	}
 	try {
+		dg.type = pnotify->db_notify.type;
+		auto kind = pnotify->b_table && pnotify->id_array.count == 1 ?
+		            na_table_kind(dg.type) : db_notify_type{};
+		if (kind != db_notify_type{}) {
+			dg.b_reload = dg.type == kind;
+			dg.b_row = !dg.b_reload;
+			dg.dir = pnotify->dir;
+			dg.table_id = pnotify->id_array.pl[0];
+			na_row_key(pnotify->db_notify, dg.row);
+		}
 		std::unique_lock rt_hold(prouter->lock);
-		prouter->datagram_list.push_back(bin);
+		na_enqueue(*prouter, std::move(dg));
 	} catch (...) {
-		free(bin.pb);
+		free(dg.bin.pb);
 		return;
 	}
 	prouter->waken_cond.notify_one();
 	exmdb_parser_put_router(std::move(prouter));
 }
 
-static BOOL notification_agent_read_response(std::shared_ptr<ROUTER_CONNECTION> prouter)
+/* Read one response byte for each of @count datagrams. */
+static BOOL notification_agent_read_response(const ROUTER_CONNECTION &rt,
+    size_t count)
 {
-	int tv_msec;
-	exmdb_response resp_code;
+	exmdb_response resp_code[64];
 	struct pollfd pfd_read;
-	
-	tv_msec = SOCKET_TIMEOUT * 1000;
-	pfd_read.fd = prouter->sockd;
-	pfd_read.events = POLLIN|POLLPRI;
-	if (1 != poll(&pfd_read, 1, tv_msec) ||
-		1 != read(prouter->sockd, &resp_code, 1) ||
-	    resp_code != exmdb_response::success)
-		return FALSE;
+
+	while (count > 0) {
+		pfd_read.fd = rt.sockd;
+		pfd_read.events = POLLIN|POLLPRI;
+		if (poll(&pfd_read, 1, SOCKET_TIMEOUT * 1000) != 1)
+			return FALSE;
+		auto ret = read(rt.sockd, resp_code, std::min(count, std::size(resp_code)));
+		if (ret <= 0)
+			return FALSE;
+		for (ssize_t i = 0; i < ret; ++i)
+			if (resp_code[i] != exmdb_response::success)
+				return FALSE;
+		count -= ret;
+	}
 	return TRUE;
 }
 
+static bool notification_agent_writev(int fd, std::vector<struct iovec> &iov)
+{
+	size_t pos = 0;
+	while (pos < iov.size()) {
+		auto ret = writev(fd, &iov[pos], std::min(iov.size() - pos,
+		           static_cast<size_t>(IOV_MAX)));
+		if (ret <= 0)
+			return false;
+		while (pos < iov.size() && static_cast<size_t>(ret) >= iov[pos].iov_len) {
+			ret -= iov[pos].iov_len;
+			++pos;
+		}
+		if (pos < iov.size()) {
+			iov[pos].iov_base = static_cast<char *>(iov[pos].iov_base) + ret;
+			iov[pos].iov_len -= ret;
+		}
+	}
+	return true;
+}
+
+/*
+ * Datagrams are sent in batches: up to g_exmdb_notify_batch of them are
+ * written in one go, and the client's responses are collected afterwards.
+ * The client still sees the usual length-prefixed packets. Before a batch
+ * is taken, the thread waits g_exmdb_notify_delay, so that events arriving
+ * close together can be coalesced by na_enqueue.
+ */
 void notification_agent_thread_work(std::shared_ptr<ROUTER_CONNECTION> &&prouter)
 {
 	uint32_t ping_buff;
-	
+	std::vector<BINARY> batch;
+	std::vector<struct iovec> iov;
+
 	while (!prouter->b_stop) {
-		BINARY dg;
 		std::unique_lock cn_hold(prouter->cond_mutex);
 		static_assert(SOCKET_TIMEOUT >= 3, "integer underflow");
 		prouter->waken_cond.wait_for(cn_hold, std::chrono::seconds(SOCKET_TIMEOUT - 3));
 		cn_hold.unlock();
 
 		std::unique_lock rt_hold(prouter->lock);
-		if (prouter->datagram_list.size() > 0) {
-			dg = prouter->datagram_list.front();
-			prouter->datagram_list.pop_front();
-		} else {
-			dg.cb = 0;
-			dg.pb = nullptr;
-		}
+		bool b_empty = prouter->datagram_list.empty();
 		rt_hold.unlock();
-		if (dg.pb == nullptr) {
+		if (b_empty) {
 			ping_buff = 0;
 			if (write(prouter->sockd, &ping_buff, sizeof(uint32_t)) != sizeof(uint32_t) ||
-			    !notification_agent_read_response(prouter))
+			    !notification_agent_read_response(*prouter, 1))
 				goto EXIT_THREAD;
 			continue;
 		}
-		while (dg.pb != nullptr) {
-			auto bytes_written = write(prouter->sockd, dg.pb, dg.cb);
-			free(dg.pb);
-			if (bytes_written < 0 ||
-			    static_cast<size_t>(bytes_written) != dg.cb ||
-			    !notification_agent_read_response(prouter))
+		if (g_exmdb_notify_delay > 0)
+			std::this_thread::sleep_for(std::chrono::nanoseconds(g_exmdb_notify_delay));
+		while (!prouter->b_stop) {
+			rt_hold.lock();
+			while (prouter->datagram_list.size() > 0 &&
+			    batch.size() < std::max(g_exmdb_notify_batch, static_cast<size_t>(1)))
+				batch.push_back(na_dequeue(*prouter));
+			rt_hold.unlock();
+			if (batch.empty())
+				break;
+			iov.clear();
+			for (const auto &bin : batch)
+				iov.push_back({bin.pb, bin.cb});
+			auto ok = notification_agent_writev(prouter->sockd, iov);
+			auto count = batch.size();
+			for (const auto &bin : batch)
+				free(bin.pb);
+			batch.clear();
+			if (!ok || !notification_agent_read_response(*prouter, count))
 				goto EXIT_THREAD;
-			std::unique_lock rt_lock(prouter->lock);
-			if (prouter->datagram_list.size() > 0) {
-				dg = prouter->datagram_list.front();
-				prouter->datagram_list.pop_front();
-			} else {
-				rt_lock.unlock();
-				dg.cb = 0;
-				dg.pb = nullptr;
-			}
 		}
 	}
  EXIT_THREAD:
+	for (const auto &bin : batch)
+		free(bin.pb);
 	while (!exmdb_parser_remove_router(prouter))
 		sleep(1);
 	close(prouter->sockd);
 	prouter->sockd = -1;
-	for (auto &&bin : prouter->datagram_list)
-		free(bin.pb);
+	for (auto &&dg : prouter->datagram_list)
+		free(dg.bin.pb);
 	prouter->datagram_list.clear();
+	prouter->table_list.clear();
 	if (!prouter->b_stop) {
 		prouter->thr_id = {};
 		pthread_detach(pthread_self());
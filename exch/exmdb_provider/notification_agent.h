@@ -1,6 +1,10 @@
 #pragma once
+#include <cstddef>
 #include <memory>
 #include <gromox/exmdb_common_util.hpp>
 #include "exmdb_parser.h"
 extern void notification_agent_backward_notify(const char *remote_id, const DB_NOTIFY_DATAGRAM *);
 extern void notification_agent_thread_work(std::shared_ptr<ROUTER_CONNECTION> &&);
+
+extern unsigned long long g_exmdb_notify_delay;
+extern size_t g_exmdb_notify_batch, g_exmdb_notify_collapse;
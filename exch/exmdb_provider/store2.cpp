@@ -12,6 +12,7 @@
 #include <memory>
 #include <sqlite3.h>
 #include <string>
+#include <thread>
 #include <unistd.h>
 #include <utility>
 #include <vector>
@@ -36,6 +37,9 @@ struct sql_del {
 	void operator()(sqlite3 *x) const { sqlite3_close(x); }
 };
 
+/* rows per batch for purg_discover_ids_batched */
+static constexpr size_t PURGE_BATCH = 4096;
+
 BOOL exmdb_server::vacuum(const char *dir)
 {
 	sleep(305);
@@ -332,21 +336,54 @@ unsigned int format_as(proptag_t x) { return x; }
 }
 #endif
 
-static bool purg_discover_cids(sqlite3 *db, const char *dir,
+/**
+ * Like purg_discover_ids, but for a query on the store's exchange.sqlite3
+ * that yields (rowid, propval) and has a "rowid>?" condition. The rows are
+ * fetched in batches and the store is released in between, so that other
+ * requests are not held up for the duration of a full table scan. Rows
+ * added in the meantime get a higher rowid and are seen by a later batch.
+ */
+static bool purg_discover_ids_batched(const char *dir, const std::string &query,
     std::vector<std::string> &used)
+{
+	int64_t last = 0;
+	while (true) {
+		auto db = db_engine_get_db(dir);
+		if (db == nullptr || db->psqlite == nullptr)
+			return false;
+		auto stm = gx_sql_prep(db->psqlite, query.c_str());
+		if (stm == nullptr)
+			return false;
+		stm.bind_int64(1, last);
+		size_t rows = 0;
+		while (stm.step() == SQLITE_ROW) {
+			last = stm.col_int64(0);
+			used.push_back(stm.col_text(1));
+			++rows;
+		}
+		if (rows < PURGE_BATCH)
+			return true;
+		stm.finalize();
+		db.reset();
+		std::this_thread::yield();
+	}
+}
+
+static bool purg_discover_cids(const char *dir, std::vector<std::string> &used)
 {
 	used.clear();
-	auto query = fmt::format("SELECT propval FROM message_properties "
-	             "WHERE proptag IN ({},{},{},{},{},{})",
+	auto query = fmt::format("SELECT rowid, propval FROM message_properties "
+	             "WHERE rowid>? AND proptag IN ({},{},{},{},{},{}) "
+	             "ORDER BY rowid LIMIT {}",
 	             PR_TRANSPORT_MESSAGE_HEADERS,
 	             PR_TRANSPORT_MESSAGE_HEADERS_A,
-	             PR_BODY, PR_BODY_A, PR_HTML, PR_RTF_COMPRESSED);
-	if (!purg_discover_ids(db, query, used))
+	             PR_BODY, PR_BODY_A, PR_HTML, PR_RTF_COMPRESSED, PURGE_BATCH);
+	if (!purg_discover_ids_batched(dir, query, used))
 		return false;
-	query = fmt::format("SELECT propval FROM attachment_properties "
-	        "WHERE proptag IN ({},{})",
-	        PR_ATTACH_DATA_BIN, PR_ATTACH_DATA_OBJ);
-	return purg_discover_ids(db, query, used);
+	query = fmt::format("SELECT rowid, propval FROM attachment_properties "
+	        "WHERE rowid>? AND proptag IN ({},{}) ORDER BY rowid LIMIT {}",
+	        PR_ATTACH_DATA_BIN, PR_ATTACH_DATA_OBJ, PURGE_BATCH);
+	return purg_discover_ids_batched(dir, query, used);
 }
 
 static bool purg_discover_mids(const char *dir, std::vector<std::string> &used)
@@ -367,36 +404,47 @@ static bool purg_discover_mids(const char *dir, std::vector<std::string> &used)
 	return purg_discover_ids(db.get(), "SELECT mid_string FROM messages", used);
 }
 
-static std::pair<uint64_t, size_t>
-purg_delete_unused_files4(const std::string &cid_dir, const std::string &subdir,
-    const std::vector<std::string> &used_ids, time_t upper_bound_ts)
+struct purg_file {
+	std::string name; /* relative to the data directory */
+	bool b_dir = false;
+};
+
+/*
+ * Collect the files below @cid_dir/@subdir that are not referenced by
+ * @used_ids. Directories are listed after their contents.
+ */
+static bool purg_find_unused_files(const std::string &cid_dir,
+    const std::string &subdir, const std::vector<std::string> &used_ids,
+    time_t upper_bound_ts, std::vector<purg_file> &unused)
 {
 	std::unique_ptr<DIR, file_deleter> dh(opendir((cid_dir + "/" + subdir).c_str()));
 	if (dh == nullptr) {
 		if (errno == ENOENT)
-			return {0, 0};
+			return true;
 		mlog(LV_ERR, "E-2387: cannot open %s/%s: %s",
 			cid_dir.c_str(), subdir.c_str(), strerror(errno));
-		return {UINT64_MAX, 0};
+		return false;
 	}
 
 	struct dirent *de;
 	auto dfd = dirfd(dh.get());
-	uint64_t bytes = 0;
-	size_t filecount = 0;
 	while ((de = readdir(dh.get())) != nullptr) {
 		if (*de->d_name == '.')
 			continue;
-		std::string defix;
+		std::string defix, name;
 		if (subdir.empty()) {
-			defix = de->d_name;
+			name = defix = de->d_name;
 			if (defix.size() > 4 &&
 			    (defix.compare(defix.size() - 4, 4, ".zst") == 0 ||
 			    defix.compare(defix.size() - 4, 4, ".v1z") == 0))
 				defix.erase(defix.size() - 4);
 		} else {
-			defix = subdir + "/" + de->d_name;
+			name = defix = subdir + "/" + de->d_name;
 		}
+		/* Synthesized bodies (see instbody.cpp) live as long as their source */
+		auto dx = defix.find(".x-");
+		if (dx != defix.npos)
+			defix.erase(dx);
 		if (std::binary_search(used_ids.begin(), used_ids.end(), defix))
 			continue;
 		struct stat sb;
@@ -404,36 +452,61 @@ purg_delete_unused_files4(const std::string &cid_dir, const std::string &subdir,
 			/* e.g. removal by another racing entity, just don't bother */
 			continue;
 		if (S_ISDIR(sb.st_mode)) {
-			auto [a, b] = purg_delete_unused_files4(cid_dir, defix.c_str(),
-			              used_ids, upper_bound_ts);
-			if (a != UINT64_MAX) {
-				bytes += a;
-				filecount += b;
-			}
-			if (unlinkat(dfd, de->d_name, AT_REMOVEDIR) != 0 && errno != ENOTEMPTY)
-				mlog(LV_ERR, "E-2399: unlink %s/%s: %s",
-					subdir.c_str(), de->d_name, strerror(errno));
+			purg_find_unused_files(cid_dir, name, used_ids,
+				upper_bound_ts, unused);
+			unused.push_back({std::move(name), true});
 			continue;
 		}
-		if (sb.st_mtime >= upper_bound_ts)
-			continue;
-		if (unlinkat(dfd, de->d_name, 0) != 0) {
-			mlog(LV_ERR, "E-2392: unlink %s/%s: %s", subdir.c_str(), de->d_name, strerror(errno));
-		} else {
-			bytes += sb.st_size;
-			++filecount;
-		}
+		if (sb.st_mtime < upper_bound_ts)
+			unused.push_back({std::move(name), false});
 	}
-	return {bytes, filecount};
+	return true;
 }
 
-static uint64_t purg_delete_unused_files(const std::string &cid_dir,
-    const std::vector<std::string> &used_ids, time_t upper_bound_ts)
+/*
+ * The files are removed with the store held. cu_cid_writeout also runs
+ * with the store held and refreshes the mtime of a file that it reuses,
+ * so a file that is (still) older than @upper_bound_ts at this point has
+ * not been referenced since the purge started, and a directory cannot be
+ * removed between its mkdir and link in cu_cid_writeout.
+ */
+static uint64_t purg_delete_unused_files(const char *dir,
+    const std::string &cid_dir, const std::vector<std::string> &used_ids,
+    time_t upper_bound_ts)
 {
 	mlog(LV_INFO, "I-2388: purge_data: processing %s...", cid_dir.c_str());
-	auto [bytes, filecount] = purg_delete_unused_files4(cid_dir, {}, used_ids, upper_bound_ts);
-	if (bytes == UINT64_MAX)
-		return bytes;
+	std::vector<purg_file> unused;
+	if (!purg_find_unused_files(cid_dir, {}, used_ids, upper_bound_ts, unused))
+		return UINT64_MAX;
+	uint64_t bytes = 0;
+	size_t filecount = 0;
+	for (size_t i = 0; i < unused.size(); ) {
+		auto db = db_engine_get_db(dir);
+		if (db == nullptr || db->psqlite == nullptr)
+			return UINT64_MAX;
+		for (auto end = std::min(i + PURGE_BATCH, unused.size()); i < end; ++i) {
+			auto path = cid_dir + "/" + unused[i].name;
+			if (unused[i].b_dir) {
+				if (rmdir(path.c_str()) != 0 && errno != ENOTEMPTY &&
+				    errno != ENOENT)
+					mlog(LV_ERR, "E-2399: unlink %s: %s",
+						path.c_str(), strerror(errno));
+				continue;
+			}
+			struct stat sb;
+			if (lstat(path.c_str(), &sb) != 0 ||
+			    sb.st_mtime >= upper_bound_ts)
+				continue;
+			if (unlink(path.c_str()) != 0) {
+				mlog(LV_ERR, "E-2392: unlink %s: %s", path.c_str(), strerror(errno));
+			} else {
+				bytes += sb.st_size;
+				++filecount;
+			}
+		}
+		db.reset();
+		std::this_thread::yield();
+	}
 	char buf[32];
 	HX_unit_size(buf, std::size(buf), bytes, 0, 0);
 	mlog(LV_NOTICE, "I-2393: Purged %zu files (%sB) from %s",
@@ -447,14 +520,14 @@ static void sort_unique(std::vector<std::string> &c)
 	c.erase(std::unique(c.begin(), c.end()), c.end());
 }
 
-static bool purg_clean_cid(sqlite3 *db, const char *maildir, time_t upper_bound_ts)
+static bool purg_clean_cid(const char *maildir, time_t upper_bound_ts)
 {
 	std::vector<std::string> used;
-	if (!purg_discover_cids(db, maildir, used))
+	if (!purg_discover_cids(maildir, used))
 		return false;
 	sort_unique(used);
-	return purg_delete_unused_files(maildir + "/cid"s,
-	       std::move(used), upper_bound_ts) < UINT64_MAX;
+	return purg_delete_unused_files(maildir, maildir + "/cid"s,
+	       used, upper_bound_ts) < UINT64_MAX;
 }
 
 static bool purg_clean_mid(const char *maildir, time_t upper_bound_ts)
@@ -463,20 +536,25 @@ static bool purg_clean_mid(const char *maildir, time_t upper_bound_ts)
 	if (!purg_discover_mids(maildir, used))
 		return false;
 	sort_unique(used);
-	if (purg_delete_unused_files(maildir + "/eml"s, used, upper_bound_ts) == UINT64_MAX)
+	if (purg_delete_unused_files(maildir, maildir + "/eml"s, used,
+	    upper_bound_ts) == UINT64_MAX)
 		return false;
-	if (purg_delete_unused_files(maildir + "/ext"s, used, upper_bound_ts) == UINT64_MAX)
+	if (purg_delete_unused_files(maildir, maildir + "/ext"s, used,
+	    upper_bound_ts) == UINT64_MAX)
 		return false;
 	return true;
 }
 
+/*
+ * The store is held while reading references and while removing files (in
+ * batches each), but not for the directory walk. Files created or reused
+ * after upper_bound_ts are left alone, which covers content written while
+ * the purge is running.
+ */
 BOOL exmdb_server::purge_datafiles(const char *dir)
 {
-	auto db = db_engine_get_db(dir);
-	if (db == nullptr || db->psqlite == nullptr)
-		return false;
 	auto upper_bound_ts = time(nullptr) - 60;
-	return purg_clean_cid(db->psqlite, dir, upper_bound_ts) &&
+	return purg_clean_cid(dir, upper_bound_ts) &&
 	       purg_clean_mid(dir, upper_bound_ts) ? TRUE : false;
 }
 
@@ -0,0 +1,305 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Store warm-up after restart. At shutdown, the most used stores and the
+ * ranges of their exchange.sqlite3 that are resident in the page cache are
+ * recorded in ${state_path}/exmdb_warmup.txt. At startup, a few threads walk
+ * that list, ask the kernel to read the ranges back (POSIX_FADV_WILLNEED) and
+ * open the stores' DB_ITEMs, at a bounded rate so that the prefetch does not
+ * itself become the I/O spike it is meant to avoid.
+ */
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <fmt/core.h>
+#include <libHX/io.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <gromox/exmdb_server.hpp>
+#include <gromox/fileio.h>
+#include <gromox/scope.hpp>
+#include <gromox/svc_common.h>
+#include <gromox/util.hpp>
+#include "db_engine.h"
+
+using namespace gromox;
+
+namespace {
+
+struct warm_range {
+	uint64_t off = 0, len = 0;
+};
+
+struct warm_entry {
+	std::string dir;
+	bool b_private = false;
+	std::vector<warm_range> ranges;
+};
+
+}
+
+/* Resident pages less than this many pages apart are merged into one range */
+static constexpr size_t WARMUP_GAP_PAGES = 16;
+static constexpr size_t WARMUP_MAX_RANGES = 256;
+
+size_t g_exmdb_warmup_stores = 100;
+unsigned int g_exmdb_warmup_threads = 2, g_exmdb_warmup_rate = 20;
+static std::thread g_warmup_thr;
+static std::mutex g_warmup_lock;
+static std::condition_variable g_warmup_cond;
+static bool g_warmup_stop;
+static std::chrono::steady_clock::time_point g_warmup_slot; /* under g_warmup_lock */
+static std::atomic<uint64_t> g_warm_planned, g_warm_opened, g_warm_failed, g_warm_bytes;
+static std::atomic<bool> g_warm_running;
+
+static std::string warmup_path()
+{
+	auto sp = get_state_path != nullptr ? get_state_path() : nullptr;
+	if (sp == nullptr || *sp == '\0')
+		return {};
+	return sp + std::string("/exmdb_warmup.txt");
+}
+
+/**
+ * Determine which parts of @dir's exchange.sqlite3 are in the page cache
+ * (mincore(2)), as a list of at most WARMUP_MAX_RANGES byte ranges.
+ */
+static std::vector<warm_range> warmup_resident(const std::string &dir)
+{
+	std::vector<warm_range> out;
+	auto path = dir + "/exmdb/exchange.sqlite3";
+	wrapfd fd = open(path.c_str(), O_RDONLY);
+	struct stat sb;
+	if (fd.get() < 0 || fstat(fd.get(), &sb) != 0 || sb.st_size == 0)
+		return out;
+	auto map = mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, fd.get(), 0);
+	if (map == MAP_FAILED)
+		return out;
+	auto cl_0 = make_scope_exit([&]() { munmap(map, sb.st_size); });
+	uint64_t pgsz = sysconf(_SC_PAGESIZE);
+	std::vector<unsigned char> vec((sb.st_size + pgsz - 1) / pgsz);
+	if (mincore(map, sb.st_size, vec.data()) != 0)
+		return out;
+	for (size_t gap = WARMUP_GAP_PAGES; ; gap *= 4) {
+		out.clear();
+		size_t end = 0;
+		for (size_t i = 0; i < vec.size(); ++i) {
+			if (!(vec[i] & 1))
+				continue;
+			if (out.empty() || i > end + gap)
+				out.push_back({i * pgsz, 0});
+			end = i + 1;
+			out.back().len = end * pgsz - out.back().off;
+		}
+		if (out.size() <= WARMUP_MAX_RANGES)
+			break;
+	}
+	return out;
+}
+
+/**
+ * Record the busiest currently-open stores for the next startup. Called by
+ * the db_engine scan thread as it shuts down.
+ */
+void db_warmup_save() try
+{
+	if (g_exmdb_warmup_stores == 0)
+		return;
+	auto file = warmup_path();
+	if (file.empty())
+		return;
+	auto list = db_engine_hot_stores(g_exmdb_warmup_stores);
+	if (list.empty())
+		return;
+	std::string out = "# exmdb_provider warm-up list\n";
+	size_t nranges = 0;
+	for (const auto &s : list) {
+		out += fmt::format("store {} {} {}\n", s.b_private ? "pvt" : "pub",
+		       s.score, s.dir);
+		for (const auto &r : warmup_resident(s.dir)) {
+			out += fmt::format("range {} {}\n", r.off, r.len);
+			++nranges;
+		}
+	}
+	auto sp = get_state_path();
+	gromox::tmpfile tmf;
+	auto ret = tmf.open_linkable(sp, O_WRONLY | O_TRUNC);
+	if (ret < 0) {
+		mlog(LV_ERR, "E-1746: open(%s)[%s]: %s", sp, tmf.m_path.c_str(), strerror(-ret));
+		return;
+	}
+	errno_t err = 0;
+	if (HXio_fullwrite(tmf, out.c_str(), out.size()) < 0)
+		err = errno;
+	else
+		err = tmf.link_to(file.c_str());
+	if (err != 0) {
+		mlog(LV_ERR, "E-1747: write %s: %s", file.c_str(), strerror(err));
+		return;
+	}
+	mlog(LV_INFO, "I-1748: exmdb_provider: recorded %zu stores (%zu ranges) for warm-up",
+		list.size(), nranges);
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1749: ENOMEM");
+}
+
+static std::vector<warm_entry> warmup_load(const std::string &file)
+{
+	std::vector<warm_entry> list;
+	std::ifstream in(file);
+	std::string line, kw;
+	while (std::getline(in, line)) {
+		std::istringstream ls(line);
+		if (!(ls >> kw))
+			continue;
+		if (kw == "store") {
+			if (list.size() >= g_exmdb_warmup_stores)
+				break;
+			std::string kind;
+			uint64_t score;
+			warm_entry e;
+			if (!(ls >> kind >> score) || !std::getline(ls >> std::ws, e.dir) ||
+			    e.dir.empty())
+				continue;
+			e.b_private = kind == "pvt";
+			list.push_back(std::move(e));
+		} else if (kw == "range" && !list.empty()) {
+			warm_range r;
+			if (ls >> r.off >> r.len)
+				list.back().ranges.push_back(r);
+		}
+	}
+	return list;
+}
+
+static void warmup_one(const warm_entry &e)
+{
+	auto path = e.dir + "/exmdb/exchange.sqlite3";
+	wrapfd fd = open(path.c_str(), O_RDONLY);
+	struct stat sb;
+	if (fd.get() < 0 || fstat(fd.get(), &sb) != 0) {
+		mlog(LV_DEBUG, "D-1750: warm-up: %s: %s", path.c_str(), strerror(errno));
+		++g_warm_failed;
+		return;
+	}
+	uint64_t size = sb.st_size;
+	for (const auto &r : e.ranges) {
+		if (r.off >= size)
+			continue;
+		auto len = std::min(r.len, size - r.off);
+		if (posix_fadvise(fd.get(), r.off, len, POSIX_FADV_WILLNEED) == 0)
+			g_warm_bytes += len;
+	}
+	fd.close_rd();
+	exmdb_server::build_env(e.b_private ? EM_PRIVATE : 0, e.dir.c_str());
+	auto cl_0 = make_scope_exit(exmdb_server::free_env);
+	auto db = db_engine_get_db(e.dir.c_str());
+	if (db == nullptr || db->psqlite == nullptr)
+		++g_warm_failed;
+	else
+		++g_warm_opened;
+}
+
+static void warmup_thrwork(const std::vector<warm_entry> &list,
+    std::atomic<size_t> &next)
+{
+	auto interval = std::chrono::microseconds(1000000 / std::max(g_exmdb_warmup_rate, 1U));
+	while (true) {
+		auto i = next++;
+		if (i >= list.size())
+			break;
+		std::unique_lock lk(g_warmup_lock);
+		auto slot = std::max(g_warmup_slot, std::chrono::steady_clock::now());
+		g_warmup_slot = slot + interval;
+		if (g_warmup_cond.wait_until(lk, slot, []() { return g_warmup_stop; }))
+			break;
+		lk.unlock();
+		warmup_one(list[i]);
+	}
+}
+
+static void warmup_main(std::vector<warm_entry> &&list)
+{
+	auto start = tp_now();
+	std::atomic<size_t> next{0};
+	std::vector<std::thread> thr;
+	auto nthr = std::min(static_cast<size_t>(std::max(g_exmdb_warmup_threads, 1U)), list.size());
+	try {
+		for (size_t i = 0; i < nthr; ++i)
+			thr.emplace_back(warmup_thrwork, std::cref(list), std::ref(next));
+	} catch (const std::system_error &e) {
+		mlog(LV_ERR, "exmdb_provider: warm-up thread: %s", e.what());
+	}
+	for (auto &t : thr)
+		t.join();
+	auto d = std::chrono::duration<double>(tp_now() - start).count();
+	mlog(LV_NOTICE, "exmdb_provider: warm-up opened %llu of %zu stores "
+		"(%llu failed), prefetched %llu MB in %.1fs",
+		static_cast<unsigned long long>(g_warm_opened.load()), list.size(),
+		static_cast<unsigned long long>(g_warm_failed.load()),
+		static_cast<unsigned long long>(g_warm_bytes.load() >> 20), d);
+	g_warm_running = false;
+}
+
+int db_warmup_run() try
+{
+	if (g_exmdb_warmup_stores == 0)
+		return 0;
+	auto file = warmup_path();
+	if (file.empty())
+		return 0;
+	auto list = warmup_load(file);
+	if (list.empty())
+		return 0;
+	g_warm_planned = list.size();
+	g_warmup_stop = false;
+	g_warmup_slot = {};
+	g_warm_running = true;
+	mlog(LV_NOTICE, "exmdb_provider: warming up %zu stores from %s",
+		list.size(), file.c_str());
+	try {
+		g_warmup_thr = std::thread(warmup_main, std::move(list));
+	} catch (const std::system_error &e) {
+		g_warm_running = false;
+		mlog(LV_ERR, "exmdb_provider: warm-up thread: %s", e.what());
+		return -1;
+	}
+	pthread_setname_np(g_warmup_thr.native_handle(), "exmdbeng/warm");
+	return 0;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1751: ENOMEM");
+	return -1;
+}
+
+void db_warmup_stop()
+{
+	if (!g_warmup_thr.joinable())
+		return;
+	{
+		std::lock_guard lk(g_warmup_lock);
+		g_warmup_stop = true;
+	}
+	g_warmup_cond.notify_all();
+	g_warmup_thr.join();
+}
+
+db_warmup_stat db_warmup_stats()
+{
+	return {g_warm_planned.load(), g_warm_opened.load(), g_warm_failed.load(),
+	        g_warm_bytes.load(), g_warm_running.load()};
+}
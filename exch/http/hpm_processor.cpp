@@ -163,7 +163,7 @@ static void *hpm_processor_queryservice(const char *service, const std::type_inf
 	if (strcmp(service, "write_response") == 0)
 		return reinterpret_cast<void *>(+[](unsigned int id, const void *b, size_t z) -> http_status {
 			auto h = static_cast<http_context *>(http_parser_get_contexts_list()[id]);
-			return h->stream_out.write(b, z) == STREAM_WRITE_OK ?
+			return h->ofilter.write(h->stream_out, b, z) ?
 			       http_status::ok : http_status::none;
 		});
 	if (strcmp(service, "wakeup_context") == 0)
@@ -311,6 +311,9 @@ http_status hpm_processor_take_request(http_context *phttp)
 			rq.chunk_offset = 0;
 		}
 		rq.b_end = false;
+		/* Chunked transfer is needed for compressing, so HTTP/1.1 only */
+		if (rq.imethod != http_method::head && strcmp(rq.version, "1.1") == 0)
+			phttp->ofilter.start(http_coding_negotiate(rq.f_accept_encoding));
 		phpm_ctx->b_preproc = TRUE;
 		phpm_ctx->pinterface = &pplugin->interface;
 		return http_status::ok;
@@ -523,6 +526,7 @@ void hpm_processor_put_context(HTTP_CONTEXT *phttp)
 		phpm_ctx->pinterface->term(phttp->context_id);
 	rq.body_fd.close();
 	rq.content_len = 0;
+	phttp->ofilter.reset();
 	phpm_ctx->b_preproc = FALSE;
 	phpm_ctx->pinterface = NULL;
 }
@@ -0,0 +1,420 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+// SPDX-FileCopyrightText: 2023 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Content-Encoding support for HTTP responses (RFC 9110 §8.4).
+ */
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <zlib.h>
+#include <zstd.h>
+#include <gromox/stream.hpp>
+#include <gromox/util.hpp>
+#include "http_compress.hpp"
+
+using namespace gromox;
+
+size_t g_http_compress_min = 1024;
+/* Server preference order, one coding per nibble, lowest nibble first */
+static std::atomic<unsigned int> g_coding_pref{
+	static_cast<unsigned int>(http_coding::zstd) |
+	(static_cast<unsigned int>(http_coding::gzip) << 4)};
+
+void http_compress_setup(const char *codings, size_t min_size)
+{
+	unsigned int pref = 0, shift = 0;
+	std::string_view sv = codings != nullptr ? codings : "";
+	while (!sv.empty() && shift < 8) {
+		auto pos = sv.find_first_of(" \t,");
+		auto tok = sv.substr(0, pos);
+		sv = pos == sv.npos ? std::string_view{} : sv.substr(pos + 1);
+		http_coding c;
+		if (tok.empty())
+			continue;
+		else if (strncasecmp(tok.data(), "gzip", tok.size()) == 0 && tok.size() == 4)
+			c = http_coding::gzip;
+		else if (strncasecmp(tok.data(), "zstd", tok.size()) == 0 && tok.size() == 4)
+			c = http_coding::zstd;
+		else
+			continue;
+		pref |= static_cast<unsigned int>(c) << shift;
+		shift += 4;
+	}
+	g_coding_pref = pref;
+	g_http_compress_min = min_size;
+}
+
+const char *http_coding_name(http_coding c)
+{
+	switch (c) {
+	case http_coding::gzip: return "gzip";
+	case http_coding::zstd: return "zstd";
+	default: return "identity";
+	}
+}
+
+static std::string_view sv_trim(std::string_view s)
+{
+	while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+		s.remove_prefix(1);
+	while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+		s.remove_suffix(1);
+	return s;
+}
+
+static bool sv_ieq(std::string_view a, std::string_view b)
+{
+	return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+/**
+ * Pick the best coding from the client's Accept-Encoding that the server is
+ * configured for. The client's q-values take priority, server preference
+ * order breaks ties.
+ */
+http_coding http_coding_negotiate(std::string_view ae)
+{
+	unsigned int pref = g_coding_pref;
+	if (pref == 0 || ae.empty())
+		return http_coding::identity;
+	/* q-values in thousandths, -1 for "not mentioned" */
+	int q_gzip = -1, q_zstd = -1, q_star = -1;
+	while (!ae.empty()) {
+		auto pos = ae.find(',');
+		auto item = ae.substr(0, pos);
+		ae = pos == ae.npos ? std::string_view{} : ae.substr(pos + 1);
+		auto semi = item.find(';');
+		auto name = sv_trim(item.substr(0, semi));
+		int q = 1000;
+		if (semi != item.npos) {
+			auto param = sv_trim(item.substr(semi + 1));
+			if (param.size() >= 2 && (param[0] == 'q' || param[0] == 'Q') &&
+			    param[1] == '=') {
+				std::string v(param.substr(2));
+				q = strtod(v.c_str(), nullptr) * 1000;
+			}
+		}
+		if (sv_ieq(name, "gzip") || sv_ieq(name, "x-gzip"))
+			q_gzip = q;
+		else if (sv_ieq(name, "zstd"))
+			q_zstd = q;
+		else if (name == "*")
+			q_star = q;
+	}
+	http_coding best = http_coding::identity;
+	int best_q = 0;
+	for (; pref != 0; pref >>= 4) {
+		auto c = static_cast<http_coding>(pref & 0xF);
+		int q = c == http_coding::gzip ? q_gzip : c == http_coding::zstd ? q_zstd : -1;
+		if (q < 0)
+			q = q_star;
+		if (q > best_q) {
+			best = c;
+			best_q = q;
+		}
+	}
+	return best;
+}
+
+bool http_coding_eligible(std::string_view ct)
+{
+	auto semi = ct.find(';');
+	ct = sv_trim(ct.substr(0, semi));
+	if (ct.size() > 5 && strncasecmp(ct.data(), "text/", 5) == 0)
+		return true;
+	auto ends_with = [&](std::string_view sfx) {
+		return ct.size() > sfx.size() &&
+		       sv_ieq(ct.substr(ct.size() - sfx.size()), sfx);
+	};
+	if (ends_with("+xml") || ends_with("+json"))
+		return true;
+	static constexpr std::string_view types[] = {
+		"application/ecmascript", "application/javascript",
+		"application/json", "application/x-javascript",
+		"application/xml", "image/x-icon",
+	};
+	return std::any_of(std::begin(types), std::end(types),
+	       [&](std::string_view t) { return sv_ieq(ct, t); });
+}
+
+bool http_coding_eligible(unsigned int status)
+{
+	/* No body, or partial content whose ranges refer to the identity coding */
+	if (status < 200 || status == 204 || status == 206 ||
+	    (status >= 300 && status < 400))
+		return false;
+	return true;
+}
+
+bool http_compressor::start(http_coding c, int level)
+{
+	reset();
+	if (c == http_coding::gzip) {
+		/* windowBits 15+16 selects the gzip wrapper */
+		if (deflateInit2(&m_zs, level < 0 ? Z_DEFAULT_COMPRESSION : level,
+		    Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return false;
+	} else if (c == http_coding::zstd) {
+		m_zc = ZSTD_createCCtx();
+		if (m_zc == nullptr)
+			return false;
+		/* 0 selects the library default */
+		ZSTD_CCtx_setParameter(m_zc, ZSTD_c_compressionLevel,
+			level < 0 ? 0 : level);
+	} else {
+		return false;
+	}
+	coding = c;
+	return true;
+}
+
+void http_compressor::reset()
+{
+	if (coding == http_coding::gzip)
+		deflateEnd(&m_zs);
+	if (m_zc != nullptr) {
+		ZSTD_freeCCtx(m_zc);
+		m_zc = nullptr;
+	}
+	m_zs = {};
+	coding = http_coding::identity;
+}
+
+/**
+ * @flush:	make all input so far decodable by the peer (sync flush).
+ * 		Used for streamed bodies so that nothing is held back
+ * 		between writes.
+ */
+bool http_compressor::feed(const void *data, size_t size, bool flush,
+    std::string &out)
+{
+	char buf[16384];
+	if (coding == http_coding::gzip) {
+		m_zs.next_in  = static_cast<Bytef *>(const_cast<void *>(data));
+		m_zs.avail_in = size;
+		do {
+			m_zs.next_out  = reinterpret_cast<Bytef *>(buf);
+			m_zs.avail_out = sizeof(buf);
+			if (deflate(&m_zs, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH) == Z_STREAM_ERROR)
+				return false;
+			out.append(buf, sizeof(buf) - m_zs.avail_out);
+		} while (m_zs.avail_out == 0);
+		return true;
+	} else if (coding == http_coding::zstd) {
+		ZSTD_inBuffer in{data, size, 0};
+		auto mode = flush ? ZSTD_e_flush : ZSTD_e_continue;
+		size_t rem;
+		do {
+			ZSTD_outBuffer ob{buf, sizeof(buf), 0};
+			rem = ZSTD_compressStream2(m_zc, &ob, &in, mode);
+			if (ZSTD_isError(rem))
+				return false;
+			out.append(buf, ob.pos);
+		} while (flush ? rem != 0 : in.pos < in.size);
+		return true;
+	}
+	return false;
+}
+
+bool http_compressor::finish(std::string &out)
+{
+	char buf[16384];
+	if (coding == http_coding::gzip) {
+		m_zs.next_in  = nullptr;
+		m_zs.avail_in = 0;
+		int ret;
+		do {
+			m_zs.next_out  = reinterpret_cast<Bytef *>(buf);
+			m_zs.avail_out = sizeof(buf);
+			ret = deflate(&m_zs, Z_FINISH);
+			if (ret == Z_STREAM_ERROR)
+				return false;
+			out.append(buf, sizeof(buf) - m_zs.avail_out);
+		} while (ret != Z_STREAM_END);
+		return true;
+	} else if (coding == http_coding::zstd) {
+		ZSTD_inBuffer in{nullptr, 0, 0};
+		size_t rem;
+		do {
+			ZSTD_outBuffer ob{buf, sizeof(buf), 0};
+			rem = ZSTD_compressStream2(m_zc, &ob, &in, ZSTD_e_end);
+			if (ZSTD_isError(rem))
+				return false;
+			out.append(buf, ob.pos);
+		} while (rem != 0);
+		return true;
+	}
+	return false;
+}
+
+bool http_compress_blob(http_coding c, int level, const void *data,
+    size_t size, std::string &out) try
+{
+	http_compressor comp;
+	out.clear();
+	return comp.start(c, level) && comp.feed(data, size, false, out) &&
+	       comp.finish(out);
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1201: ENOMEM");
+	return false;
+}
+
+bool http_write_chunk(STREAM &st, const void *data, size_t size)
+{
+	char lenbuf[24];
+	auto len = snprintf(lenbuf, std::size(lenbuf), "%zx\r\n", size);
+	return st.write(lenbuf, len) == STREAM_WRITE_OK &&
+	       st.write(data, size) == STREAM_WRITE_OK &&
+	       st.write("\r\n", 2) == STREAM_WRITE_OK;
+}
+
+/**
+ * @hdrs:	header block, lines terminated by CRLF (status line allowed)
+ */
+bool http_hdr_value(std::string_view hdrs, std::string_view name,
+    std::string_view &value)
+{
+	while (!hdrs.empty()) {
+		auto eol = hdrs.find("\r\n");
+		auto line = hdrs.substr(0, eol);
+		hdrs = eol == hdrs.npos ? std::string_view{} : hdrs.substr(eol + 2);
+		auto colon = line.find(':');
+		if (colon == line.npos || !sv_ieq(sv_trim(line.substr(0, colon)), name))
+			continue;
+		value = sv_trim(line.substr(colon + 1));
+		return true;
+	}
+	return false;
+}
+
+std::string http_hdr_remove(std::string_view hdrs, std::string_view name)
+{
+	std::string out;
+	out.reserve(hdrs.size());
+	while (!hdrs.empty()) {
+		auto eol = hdrs.find("\r\n");
+		auto line = hdrs.substr(0, eol == hdrs.npos ? hdrs.size() : eol + 2);
+		hdrs.remove_prefix(line.size());
+		auto colon = line.find(':');
+		if (colon != line.npos && sv_ieq(sv_trim(line.substr(0, colon)), name))
+			continue;
+		out += line;
+	}
+	return out;
+}
+
+void http_ofilter::start(http_coding c)
+{
+	reset();
+	m_coding = c;
+	if (c != http_coding::identity)
+		m_state = fstate::head;
+}
+
+void http_ofilter::reset()
+{
+	m_state = fstate::pass;
+	m_coding = http_coding::identity;
+	m_body_left = 0;
+	m_hdr.clear();
+	m_comp.reset();
+}
+
+/**
+ * Produce the rewritten header in @out if the response described by @hdr
+ * should be compressed.
+ */
+bool http_ofilter::rewrite_header(std::string_view hdr, std::string &out)
+{
+	if (hdr.size() < 12 || strncasecmp(hdr.data(), "HTTP/1.", 7) != 0)
+		return false;
+	if (!http_coding_eligible(strtoul(std::string(hdr.substr(9, 3)).c_str(), nullptr, 10)))
+		return false;
+	std::string_view val;
+	if (http_hdr_value(hdr, "Content-Encoding", val) ||
+	    http_hdr_value(hdr, "Transfer-Encoding", val))
+		return false;
+	if (!http_hdr_value(hdr, "Content-Type", val) || !http_coding_eligible(val))
+		return false;
+	/*
+	 * The end of the entity is only known from Content-Length; unbounded
+	 * streams (e.g. EWS streaming notifications) are left alone.
+	 */
+	if (!http_hdr_value(hdr, "Content-Length", val))
+		return false;
+	m_body_left = strtoull(std::string(val).c_str(), nullptr, 10);
+	if (m_body_left < g_http_compress_min)
+		return false;
+	if (!m_comp.start(m_coding))
+		return false;
+	/* drop the final empty line, re-add after our fields */
+	out = http_hdr_remove(hdr.substr(0, hdr.size() - 2), "Content-Length");
+	out += "Content-Encoding: ";
+	out += http_coding_name(m_coding);
+	out += "\r\nTransfer-Encoding: chunked\r\nVary: Accept-Encoding\r\n\r\n";
+	return true;
+}
+
+bool http_ofilter::write_body(STREAM &st, const char *data, size_t size)
+{
+	auto take = std::min(static_cast<uint64_t>(size), m_body_left);
+	std::string zout;
+	if (!m_comp.feed(data, take, true, zout))
+		return false;
+	m_body_left -= take;
+	if (m_body_left == 0 && !m_comp.finish(zout))
+		return false;
+	if (!zout.empty() && !http_write_chunk(st, zout.data(), zout.size()))
+		return false;
+	if (m_body_left > 0)
+		return true;
+	m_comp.reset();
+	m_state = fstate::pass;
+	if (st.write("0\r\n\r\n", 5) != STREAM_WRITE_OK)
+		return false;
+	return take == size ? true :
+	       st.write(&data[take], size - take) == STREAM_WRITE_OK;
+}
+
+bool http_ofilter::write(STREAM &st, const void *vdata, size_t size) try
+{
+	auto data = static_cast<const char *>(vdata);
+	if (m_state == fstate::pass)
+		return st.write(data, size) == STREAM_WRITE_OK;
+	if (m_state == fstate::body)
+		return write_body(st, data, size);
+	m_hdr.append(data, size);
+	auto eoh = m_hdr.find("\r\n\r\n");
+	if (eoh == m_hdr.npos) {
+		/* Plugins write the header in one go; do not hold back forever. */
+		if (m_hdr.size() < 16384)
+			return true;
+		m_state = fstate::pass;
+		auto ret = st.write(m_hdr.data(), m_hdr.size()) == STREAM_WRITE_OK;
+		m_hdr.clear();
+		return ret;
+	}
+	eoh += 4;
+	std::string newhdr;
+	if (!rewrite_header(std::string_view(m_hdr).substr(0, eoh), newhdr)) {
+		m_state = fstate::pass;
+		auto ret = st.write(m_hdr.data(), m_hdr.size()) == STREAM_WRITE_OK;
+		m_hdr.clear();
+		return ret;
+	}
+	m_state = fstate::body;
+	if (st.write(newhdr.data(), newhdr.size()) != STREAM_WRITE_OK)
+		return false;
+	auto rest = std::move(m_hdr);
+	m_hdr.clear();
+	return rest.size() == eoh ? true :
+	       write_body(st, &rest[eoh], rest.size() - eoh);
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1202: ENOMEM");
+	return false;
+}
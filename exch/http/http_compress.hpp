@@ -0,0 +1,68 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <zlib.h>
+#include <gromox/defs.h>
+
+struct STREAM;
+struct ZSTD_CCtx_s;
+
+enum class http_coding : uint8_t {
+	identity = 0, gzip, zstd,
+};
+
+/**
+ * Streaming encoder for one response body. After start(), feed() may be
+ * called any number of times; finish() emits the stream trailer.
+ */
+struct http_compressor {
+	http_compressor() = default;
+	~http_compressor() { reset(); }
+	NOMOVE(http_compressor);
+	bool start(http_coding, int level = -1);
+	bool feed(const void *, size_t, bool flush, std::string &out);
+	bool finish(std::string &out);
+	void reset();
+	bool active() const { return coding != http_coding::identity; }
+
+	http_coding coding = http_coding::identity;
+	private:
+	z_stream m_zs{};
+	ZSTD_CCtx_s *m_zc = nullptr;
+};
+
+/**
+ * Output filter for HPM responses. Plugins emit a complete HTTP header
+ * followed by the body; if the header announces a compressible entity of
+ * known length, the filter rewrites the header for chunked transfer and
+ * compresses the body as it is written.
+ */
+struct http_ofilter {
+	void start(http_coding);
+	bool write(STREAM &, const void *, size_t);
+	void reset();
+
+	private:
+	enum class fstate : uint8_t { pass, head, body };
+	bool rewrite_header(std::string_view, std::string &);
+	bool write_body(STREAM &, const char *, size_t);
+
+	fstate m_state = fstate::pass;
+	http_coding m_coding = http_coding::identity;
+	uint64_t m_body_left = 0;
+	std::string m_hdr;
+	http_compressor m_comp;
+};
+
+extern void http_compress_setup(const char *codings, size_t min_size);
+extern http_coding http_coding_negotiate(std::string_view accept_encoding);
+extern const char *http_coding_name(http_coding);
+extern bool http_coding_eligible(std::string_view content_type);
+extern bool http_coding_eligible(unsigned int status);
+extern bool http_compress_blob(http_coding, int level, const void *, size_t, std::string &);
+extern bool http_write_chunk(STREAM &, const void *, size_t);
+extern bool http_hdr_value(std::string_view hdrs, std::string_view name, std::string_view &value);
+extern std::string http_hdr_remove(std::string_view hdrs, std::string_view name);
+
+extern size_t g_http_compress_min;
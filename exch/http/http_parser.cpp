@@ -292,12 +292,23 @@ int http_parser_threads_event_proc(int action)
 
 int http_parser_get_context_socket(const schedule_context *ctx)
 {
-	return static_cast<const http_context *>(ctx)->connection.sockd;
+	auto hctx = static_cast<const http_context *>(ctx);
+	/* A context waiting on php-fpm is polled on the backend socket */
+	auto fd = mod_fastcgi_get_socket(hctx);
+	return fd >= 0 ? fd : hctx->connection.sockd;
 }
 
 time_point http_parser_get_context_timestamp(const schedule_context *ctx)
 {
-	return static_cast<const http_context *>(ctx)->connection.last_timestamp;
+	auto hctx = static_cast<const http_context *>(ctx);
+	/*
+	 * The client connection is legitimately quiet while php-fpm works;
+	 * have the scanner hand the context back only when
+	 * fastcgi_exec_timeout has passed without backend output.
+	 */
+	if (mod_fastcgi_get_socket(hctx) >= 0)
+		return mod_fastcgi_get_deadline(hctx) - g_timeout;
+	return hctx->connection.last_timestamp;
 }
 
 static VCONN_REF http_parser_get_vconnection(const char *host,
@@ -1404,11 +1415,15 @@ static tproc_status htparse_wrrep_nobuf(http_context *pcontext)
 	} else if (mod_fastcgi_is_in_charge(pcontext)) {
 		switch (mod_fastcgi_check_response(pcontext)) {
 		case RESPONSE_WAITING:
-			return tproc_status::cont;
+			return tproc_status::polling_rdonly;
 		case RESPONSE_TIMEOUT:
 			pcontext->log(LV_DEBUG,
 				"fastcgi execution timeout");
 			return http_done(pcontext, http_status::gateway_timeout);
+		case RESPONSE_AVAILABLE:
+			/* Backend progress counts as activity for the client side */
+			pcontext->connection.last_timestamp = tp_now();
+			break;
 		}
 		if (mod_fastcgi_check_responded(pcontext)) {
 			if (!mod_fastcgi_read_response(pcontext) &&
@@ -1423,6 +1438,9 @@ static tproc_status htparse_wrrep_nobuf(http_context *pcontext)
 		} else if (!mod_fastcgi_read_response(pcontext)) {
 			return http_done(pcontext, http_status::bad_gateway);
 		}
+		if (pcontext->stream_out.get_total_length() == 0)
+			/* only partial records so far */
+			return tproc_status::polling_rdonly;
 	} else if (mod_cache_is_in_charge(pcontext) &&
 	    !mod_cache_read_response(pcontext)) {
 		if (!mod_cache_check_responded(pcontext))
@@ -2166,6 +2184,7 @@ static void http_parser_context_clear(HTTP_CONTEXT *pcontext)
 	pcontext->request.clear();
 	pcontext->stream_in.clear();
 	pcontext->stream_out.clear();
+	pcontext->ofilter.reset();
 	pcontext->write_buff = NULL;
 	pcontext->write_offset = 0;
 	pcontext->write_length = 0;
@@ -20,6 +20,7 @@
 #include <gromox/stream.hpp>
 #include <gromox/threads_pool.hpp>
 #include <gromox/util.hpp>
+#include "http_compress.hpp"
 #include "pdu_processor.h"
 
 enum class auth_method {
@@ -66,6 +67,7 @@ struct http_context final : public schedule_context {
 	uint64_t total_length = 0, bytes_rw = 0;
 	hsched_stat sched_stat = hsched_stat::initssl;
 	STREAM stream_in, stream_out;
+	http_ofilter ofilter;
 	void *write_buff = nullptr;
 	int write_offset = 0, write_length = 0;
 	BOOL b_close = TRUE; /* Connection MIME Header for indicating closing */
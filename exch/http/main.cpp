@@ -31,6 +31,7 @@
 #include <gromox/threads_pool.hpp>
 #include <gromox/util.hpp>
 #include "hpm_processor.h"
+#include "http_compress.hpp"
 #include "http_parser.h"
 #include "listener.h"
 #include "mod_cache.hpp"
@@ -84,10 +85,14 @@ static constexpr cfg_directive http_cfg_defaults[] = {
 	{"context_num", "400", CFG_SIZE},
 	{"data_file_path", PKGDATADIR "/http:" PKGDATADIR},
 	{"fastcgi_exec_timeout", "10min", CFG_TIME, "1min"},
+	{"fastcgi_idle_conns", "4", CFG_SIZE, "0"},
+	{"fastcgi_idle_timeout", "15s", CFG_TIME, "1s"},
 	{"gss_program", "internal-gss"},
 	{"http_auth_basic", "1", CFG_BOOL},
 	{"http_auth_spnego", "0", CFG_BOOL},
 	{"http_auth_times", "10", CFG_SIZE, "1"},
+	{"http_compression", "zstd gzip"},
+	{"http_compression_min_size", "1K", CFG_SIZE},
 	{"http_conn_timeout", "3min", CFG_TIME, "30s"},
 	{"http_debug", "0"},
 	{"http_enforce_auth", "0", CFG_BOOL},
@@ -98,6 +103,7 @@ static constexpr cfg_directive http_cfg_defaults[] = {
 	{"http_log_file", "-"},
 	{"http_log_level", "4" /* LV_NOTICE */},
 	{"http_old_php_handler", "0", CFG_BOOL},
+	{"http_reactor_num", "1", CFG_SIZE},
 	{"http_rqbody_flush_size", "512K", CFG_SIZE, "0"},
 	{"http_rqbody_max_size", "4M", CFG_SIZE, "1"},
 	{"http_support_ssl", "http_support_tls", CFG_ALIAS},
@@ -134,6 +140,8 @@ static bool http_reload_config(std::shared_ptr<CONFIG_FILE> cfg)
 	g_msrpc_debug = cfg->get_ll("msrpc_debug");
 	g_oxcical_allday_ymd = cfg->get_ll("oxcical_allday_ymd");
 	g_http_php = cfg->get_ll("http_old_php_handler");
+	http_compress_setup(cfg->get_value("http_compression"),
+		cfg->get_ll("http_compression_min_size"));
 	return true;
 }
 
@@ -201,6 +209,7 @@ int main(int argc, const char **argv)
 	}
 	mlog(LV_INFO, "system: one thread is in charge of %d contexts",
 		thread_charge_num);
+	unsigned int reactor_num = g_config_file->get_ll("http_reactor_num");
 
 	unsigned int context_num = g_config_file->get_ll("context_num");
 	unsigned int thread_init_num = g_config_file->get_ll("http_thread_init_num");
@@ -273,6 +282,11 @@ int main(int argc, const char **argv)
 	std::chrono::seconds fastcgi_exec_timeout{g_config_file->get_ll("fastcgi_exec_timeout")};
 	HX_unit_seconds(temp_buff, std::size(temp_buff), fastcgi_exec_timeout.count(), 0);
 	mlog(LV_INFO, "http: fastcgi execution timeout is %s", temp_buff);
+	size_t fastcgi_idle_conns = g_config_file->get_ll("fastcgi_idle_conns");
+	std::chrono::seconds fastcgi_idle_timeout{g_config_file->get_ll("fastcgi_idle_timeout")};
+	HX_unit_seconds(temp_buff, std::size(temp_buff), fastcgi_idle_timeout.count(), 0);
+	mlog(LV_INFO, "http: keeping up to %zu idle fastcgi connections per backend for %s",
+		fastcgi_idle_conns, temp_buff);
 	uint16_t listen_port = g_config_file->get_ll("http_listen_port");
 	unsigned int mss_size = g_config_file->get_ll("tcp_max_segment");
 	listener_init(g_config_file->get_value("http_listen_addr"),
@@ -335,7 +349,8 @@ int main(int argc, const char **argv)
 		mlog(LV_ERR, "system: failed to start mod_rewrite");
 		return EXIT_FAILURE;
 	}
-	mod_fastcgi_init(context_num, fastcgi_exec_timeout); 
+	mod_fastcgi_init(context_num, fastcgi_exec_timeout,
+		fastcgi_idle_conns, fastcgi_idle_timeout);
 	auto cleanup_18 = make_scope_exit(mod_fastcgi_stop);
 	if (0 != mod_fastcgi_run()) { 
 		mlog(LV_ERR, "system: failed to start mod_fastcgi");
@@ -362,7 +377,7 @@ int main(int argc, const char **argv)
 		context_num,
 		http_parser_get_context_socket,
 		http_parser_get_context_timestamp,
-		thread_charge_num, http_conn_timeout); 
+		thread_charge_num, http_conn_timeout, reactor_num);
 	auto cleanup_24 = make_scope_exit(contexts_pool_stop);
 	if (0 != contexts_pool_run()) { 
 		mlog(LV_ERR, "system: failed to start context_pool");
@@ -4,11 +4,13 @@
 #include <algorithm>
 #include <cerrno>
 #include <climits>
+#include <condition_variable>
 #include <csignal>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <fcntl.h>
 #include <list>
 #include <memory>
@@ -32,6 +34,7 @@
 #include <gromox/paths.h>
 #include <gromox/textmaps.hpp>
 #include <gromox/util.hpp>
+#include "http_compress.hpp"
 #include "http_parser.h"
 #include "mod_cache.hpp"
 #include "resource.h"
@@ -46,10 +49,22 @@ struct cache_item {
 	cache_item(cache_item &&) = delete;
 	~cache_item();
 
+	const std::string *get_variant(http_coding);
+	void build_variant(http_coding);
+
 	const char *content_type = nullptr;
 	void *mblk = nullptr;
 	struct stat sb{};
+	/*
+	 * Precompressed representations, built by the compression thread after
+	 * first demand and living as long as the mapping does. An empty string
+	 * in state z_done means compression did not pay off.
+	 */
+	std::mutex z_lock;
+	std::string z_gzip, z_zstd;
+	uint8_t z_state_gzip = 0, z_state_zstd = 0;
 };
+enum { z_none, z_queued, z_done };
 using CACHE_ITEM = cache_item;
 
 struct RANGE {
@@ -59,6 +74,8 @@ struct RANGE {
 
 struct cache_context {
 	std::shared_ptr<cache_item> pitem;
+	const std::string *zbody = nullptr; /* selected compressed variant */
+	http_coding coding = http_coding::identity;
 	BOOL b_header = false;
 	uint32_t offset = 0, until = 0;
 	ssize_t range_pos = -1;
@@ -72,9 +89,18 @@ struct DIRECTORY_NODE {
 
 }
 
+/*
+ * Compressing a static file happens once per cache lifetime and off the
+ * request path; be thorough.
+ */
+static constexpr int MOD_CACHE_GZIP_LEVEL = 9, MOD_CACHE_ZSTD_LEVEL = 19;
+static constexpr size_t MOD_CACHE_ZMAX = 32U << 20;
 static int g_context_num;
 static gromox::atomic_bool g_notify_stop;
-static pthread_t g_scan_tid;
+static pthread_t g_scan_tid, g_zip_tid;
+static std::mutex g_zip_lock;
+static std::condition_variable g_zip_cond;
+static std::deque<std::pair<std::shared_ptr<cache_item>, http_coding>> g_zip_queue;
 static std::mutex g_hash_lock;
 static std::vector<DIRECTORY_NODE> g_directory_list;
 static std::unordered_map<std::string, std::shared_ptr<cache_item>> g_cache_hash;
@@ -86,6 +112,71 @@ cache_item::~cache_item()
 		munmap(mblk, static_cast<size_t>(sb.st_size));
 }
 
+/**
+ * Return the compressed variant if it has been built. Otherwise, the caller
+ * serves the identity coding; the variant is not produced here.
+ */
+const std::string *cache_item::get_variant(http_coding c)
+{
+	std::lock_guard lk(z_lock);
+	auto state = c == http_coding::zstd ? z_state_zstd : z_state_gzip;
+	auto &blob = c == http_coding::zstd ? z_zstd : z_gzip;
+	return state != z_done || blob.empty() ? nullptr : &blob;
+}
+
+void cache_item::build_variant(http_coding c) try
+{
+	std::string blob;
+	auto size = static_cast<size_t>(sb.st_size);
+	if (!http_compress_blob(c, c == http_coding::zstd ?
+	    MOD_CACHE_ZSTD_LEVEL : MOD_CACHE_GZIP_LEVEL, mblk, size, blob) ||
+	    blob.size() >= size)
+		blob = {};
+	std::lock_guard lk(z_lock);
+	(c == http_coding::zstd ? z_zstd : z_gzip) = std::move(blob);
+	(c == http_coding::zstd ? z_state_zstd : z_state_gzip) = z_done;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1211: ENOMEM");
+	std::lock_guard lk(z_lock);
+	(c == http_coding::zstd ? z_state_zstd : z_state_gzip) = z_done;
+}
+
+/* Hand @c of @pitem to the compression thread, unless done or pending. */
+static void mod_cache_zip_request(const std::shared_ptr<cache_item> &pitem,
+    http_coding c) try
+{
+	std::unique_lock lk(pitem->z_lock);
+	auto &state = c == http_coding::zstd ? pitem->z_state_zstd : pitem->z_state_gzip;
+	if (state != z_none)
+		return;
+	std::lock_guard zhold(g_zip_lock);
+	g_zip_queue.emplace_back(pitem, c);
+	state = z_queued;
+	g_zip_cond.notify_one();
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1759: ENOMEM");
+}
+
+static void *mod_cache_zipwork(void *)
+{
+	std::unique_lock hold(g_zip_lock);
+	while (!g_notify_stop) {
+		if (g_zip_queue.empty()) {
+			g_zip_cond.wait(hold);
+			continue;
+		}
+		auto [pitem, c] = std::move(g_zip_queue.front());
+		g_zip_queue.pop_front();
+		hold.unlock();
+		/* Skip items that were dropped from the cache in the meantime. */
+		if (pitem.use_count() > 1)
+			pitem->build_variant(c);
+		pitem.reset();
+		hold.lock();
+	}
+	return nullptr;
+}
+
 static bool stat4_eq(const struct stat &a, const struct stat &b)
 {
 	return a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
@@ -181,6 +272,13 @@ int mod_cache_run() try
 		return -4;
 	}
 	pthread_setname_np(g_scan_tid, "mod_cache");
+	ret = pthread_create4(&g_zip_tid, nullptr, mod_cache_zipwork, nullptr);
+	if (ret != 0) {
+		mlog(LV_ERR, "mod_cache: failed to create compression thread: %s", strerror(ret));
+		mod_cache_stop();
+		return -4;
+	}
+	pthread_setname_np(g_zip_tid, "mod_cache/z");
 	return 0;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "mod_cache: failed to allocate context list");
@@ -195,7 +293,16 @@ void mod_cache_stop()
 			pthread_kill(g_scan_tid, SIGALRM);
 			pthread_join(g_scan_tid, NULL);
 		}
+		if (!pthread_equal(g_zip_tid, {})) {
+			std::unique_lock zhold(g_zip_lock);
+			g_zip_cond.notify_all();
+			zhold.unlock();
+			pthread_join(g_zip_tid, nullptr);
+			g_zip_tid = {};
+		}
+		g_scan_tid = {};
 	}
+	g_zip_queue.clear();
 	g_directory_list.clear();
 	g_context_list.reset();
 	g_cache_hash.clear();
@@ -271,8 +378,8 @@ static BOOL mod_cache_response_single_header(HTTP_CONTEXT *phttp)
 	rfc1123_dstring(modified_string, std::size(modified_string), tmp_tm);
 	mod_cache_serialize_etag(pcontext->pitem->sb, etag, std::size(etag));
 	auto pcontent_type = pcontext->pitem->content_type;
-	bool emit_206 = pcontext->offset != 0 ||
-	                pcontext->until != static_cast<uint64_t>(pcontext->pitem->sb.st_size);
+	bool emit_206 = pcontext->zbody == nullptr && (pcontext->offset != 0 ||
+	                pcontext->until != static_cast<uint64_t>(pcontext->pitem->sb.st_size));
 	strcpy(response_buff, emit_206 ?
 	       "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n");
 	response_len = strlen(response_buff);
@@ -282,14 +389,25 @@ static BOOL mod_cache_response_single_header(HTTP_CONTEXT *phttp)
 					"Content-Length: %u\r\n"
 					"Accept-Ranges: bytes\r\n"
 					"Last-Modified: %s\r\n"
-					"ETag: \"%s\"\r\n",
+					"ETag: \"%s%s\"\r\n",
 					date_string,
 					pcontext->until - pcontext->offset,
-					modified_string, etag);
+					modified_string, etag,
+					pcontext->zbody == nullptr ? "" :
+					pcontext->coding == http_coding::zstd ? "-zst" : "-gz");
 	if (pcontent_type != nullptr)
 		response_len += gx_snprintf(&response_buff[response_len],
 				std::size(response_buff) - response_len,
 				"Content-Type: %s\r\n", pcontent_type);
+	if (pcontent_type != nullptr && http_coding_eligible(pcontent_type))
+		response_len += gx_snprintf(&response_buff[response_len],
+		                std::size(response_buff) - response_len,
+		                "Vary: Accept-Encoding\r\n");
+	if (pcontext->zbody != nullptr)
+		response_len += gx_snprintf(&response_buff[response_len],
+		                std::size(response_buff) - response_len,
+		                "Content-Encoding: %s\r\n",
+		                http_coding_name(pcontext->coding));
 	if (emit_206) {
 		response_len += gx_snprintf(response_buff + response_len,
 		                std::size(response_buff) - response_len,
@@ -441,6 +559,33 @@ static http_status mod_cache_parse_range_value(char *value,
 	return http_status::service_unavailable;
 }
 
+/**
+ * Switch the context over to a compressed representation if the client
+ * accepts one. Range requests always refer to the identity coding.
+ */
+static void mod_cache_select_variant(const http_context *phttp,
+    cache_context &ctx, bool whole_file)
+{
+	auto &item = *ctx.pitem;
+	auto size = static_cast<size_t>(item.sb.st_size);
+	if (!whole_file || item.content_type == nullptr ||
+	    size < g_http_compress_min || size > MOD_CACHE_ZMAX ||
+	    !http_coding_eligible(item.content_type))
+		return;
+	auto coding = http_coding_negotiate(phttp->request.f_accept_encoding);
+	if (coding == http_coding::identity)
+		return;
+	auto z = item.get_variant(coding);
+	if (z == nullptr) {
+		mod_cache_zip_request(ctx.pitem, coding);
+		return;
+	}
+	ctx.zbody  = z;
+	ctx.coding = coding;
+	ctx.offset = 0;
+	ctx.until  = z->size();
+}
+
 http_status mod_cache_take_request(http_context *phttp)
 {
 	char *ptoken;
@@ -515,6 +660,7 @@ http_status mod_cache_take_request(http_context *phttp)
 	*pcontext = {};
 	phttp->request.posted_size = 0;
 	val = mod_cache_get_others_field(phttp->request.f_others, "Range");
+	bool whole_file = val == nullptr;
 	if (val != nullptr) {
 		gx_strlcpy(tmp_buff, val, std::size(tmp_buff));
 		auto status = mod_cache_parse_range_value(tmp_buff,
@@ -540,6 +686,8 @@ http_status mod_cache_take_request(http_context *phttp)
 			}
 			posix_madvise(pitem->mblk, static_cast<size_t>(node_stat.st_size), POSIX_MADV_SEQUENTIAL);
 			pcontext->pitem = std::move(pitem);
+			hhold.unlock();
+			mod_cache_select_variant(phttp, *pcontext, whole_file);
 			return http_status::ok;
 		}
 	}
@@ -561,6 +709,8 @@ http_status mod_cache_take_request(http_context *phttp)
 		posix_madvise(pitem->mblk, static_cast<size_t>(node_stat.st_size), POSIX_MADV_SEQUENTIAL);
 		g_cache_hash.emplace(tmp_path, pitem);
 		pcontext->pitem = std::move(pitem);
+		hhold.unlock();
+		mod_cache_select_variant(phttp, *pcontext, whole_file);
 		return http_status::ok;
 	}
 	} catch (const std::bad_alloc &) {
@@ -577,6 +727,8 @@ void mod_cache_put_context(HTTP_CONTEXT *phttp)
 	
 	pcontext = mod_cache_get_cache_context(phttp);
 	pcontext->pitem.reset();
+	pcontext->zbody = nullptr;
+	pcontext->coding = http_coding::identity;
 	pcontext->range.clear();
 	rq.b_end = false;
 	rq.chunk_size = rq.chunk_offset = 0;
@@ -618,17 +770,21 @@ BOOL mod_cache_read_response(HTTP_CONTEXT *phttp)
 		}
 	}
 	auto &item = *pcontext->pitem;
+	auto body = pcontext->zbody != nullptr ? pcontext->zbody->data() :
+	            static_cast<const char *>(item.mblk);
+	uint64_t body_size = pcontext->zbody != nullptr ? pcontext->zbody->size() :
+	                     static_cast<uint64_t>(item.sb.st_size);
 	uint32_t writeout_size = std::min(pcontext->until - pcontext->offset, static_cast<uint32_t>(STREAM_BLOCK_SIZE) - 1);
-	auto rem_to_eof = pcontext->offset < static_cast<uint64_t>(item.sb.st_size) ?
-	                  static_cast<uint64_t>(item.sb.st_size) - pcontext->offset : 0;
+	auto rem_to_eof = pcontext->offset < body_size ?
+	                  body_size - pcontext->offset : 0;
 	writeout_size = std::min(static_cast<uint64_t>(writeout_size), rem_to_eof);
-	if (item.mblk == nullptr) {
+	if (body == nullptr) {
 		mlog(LV_DEBUG, "%s called without active memory mapping", __func__);
 		mod_cache_put_context(phttp);
 		return FALSE;
 	}
-	if (phttp->stream_out.write(static_cast<const char *>(item.mblk) +
-	    pcontext->offset, writeout_size) != STREAM_WRITE_OK) {
+	if (phttp->stream_out.write(body + pcontext->offset,
+	    writeout_size) != STREAM_WRITE_OK) {
 		mod_cache_put_context(phttp);
 		return false;
 	}
@@ -1,17 +1,21 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2021 grommunio GmbH
 // This file is part of Gromox.
-#include <atomic>
 #include <cerrno>
+#include <csignal>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
+#include <mutex>
 #include <poll.h>
+#include <pthread.h>
 #include <string>
+#include <string_view>
 #include <unistd.h>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 #include <libHX/io.h>
@@ -21,7 +25,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
-#include <gromox/contexts_pool.hpp>
+#include <gromox/atomic.hpp>
 #include <gromox/defs.h>
 #include <gromox/fileio.h>
 #include <gromox/http.hpp>
@@ -29,7 +33,6 @@
 #include <gromox/mail_func.hpp>
 #include <gromox/ndr.hpp>
 #include <gromox/paths.h>
-#include <gromox/threads_pool.hpp>
 #include <gromox/util.hpp>
 #include "http_parser.h"
 #include "mod_fastcgi.h"
@@ -37,8 +40,6 @@
 #define TRY(expr) do { pack_result klfdv{expr}; if (klfdv != EXT_ERR_SUCCESS) return klfdv; } while (false)
 #define QRF(expr) do { if (pack_result{expr} != EXT_ERR_SUCCESS) return false; } while (false)
 
-#define POLL_MILLISECONDS_FOR_CHECK				50
-
 #define FCGI_VERSION							1
 
 #define FCGI_REQUEST_ID							1
@@ -61,6 +62,8 @@
 #define ROLE_AUTHORIZER							2
 #define ROLE_FILTER								3
 
+#define FCGI_KEEP_CONN							1
+
 
 #define PROTOCOL_STATUS_REQUEST_COMPLETE		0
 #define PROTOCOL_STATUS_CANT_MPX_CONN			1
@@ -69,10 +72,26 @@
 
 using namespace gromox;
 
+namespace {
+
+struct fcgi_idle_conn {
+	int sockd = -1;
+	gromox::time_point since{};
+};
+
+/* Connections to one php-fpm socket that are kept open between requests */
+struct fcgi_backend {
+	std::mutex lock;
+	std::vector<fcgi_idle_conn> idle;
+};
+
+}
+
 struct FASTCGI_NODE {
 	std::string domain, path, dir, suffix, index;
 	std::vector<std::string> header_list;
 	std::string sock_path;
+	fcgi_backend *backend = nullptr;
 };
 
 struct fastcgi_context {
@@ -82,6 +101,12 @@ struct fastcgi_context {
 	gromox::time_point last_time{};
 	int cli_sockd = -1;
 	bool b_active = false;
+	bool b_polling = false; /* waiting for the backend to become readable */
+	bool b_eof = false; /* backend closed the connection */
+	size_t rbuf_off = 0;
+	std::string rbuf; /* records received from the backend */
+	std::string hdr; /* response header being collected */
+	http_compressor comp; /* Content-Encoding of the response body */
 };
 
 namespace {
@@ -92,11 +117,6 @@ struct FCGI_ENDREQUESTBODY {
 	uint8_t reserved[3];
 };
 
-struct FCGI_STDSTREAM {
-	uint8_t buffer[0xFFFF];
-	uint16_t length;
-};
-
 struct RECORD_HEADER {
 	uint8_t version;
 	uint8_t type;
@@ -109,10 +129,13 @@ struct RECORD_HEADER {
 }
 
 static int g_context_num;
-static time_duration g_exec_timeout;
+static size_t g_idle_conns;
+static time_duration g_exec_timeout, g_idle_timeout;
 static std::vector<FASTCGI_NODE> g_fastcgi_list;
+static std::unordered_map<std::string, fcgi_backend> g_backend_list;
 static std::unique_ptr<FASTCGI_CONTEXT[]> g_context_list;
-static std::atomic<int> g_unavailable_times;
+static gromox::atomic_bool g_notify_stop{true};
+static pthread_t g_scan_tid;
 
 static const FASTCGI_NODE *mod_fastcgi_find_backend(const char *domain,
     const char *uri_path, const char *file_name, const char *suffix,
@@ -138,11 +161,54 @@ static const FASTCGI_NODE *mod_fastcgi_find_backend(const char *domain,
 	return NULL;
 }
 
-void mod_fastcgi_init(int context_num, time_duration exec_timeout)
+void mod_fastcgi_init(int context_num, time_duration exec_timeout,
+    size_t idle_conns, time_duration idle_timeout)
 {
 	g_context_num = context_num;
-	g_unavailable_times = 0;
 	g_exec_timeout = exec_timeout;
+	g_idle_conns = idle_conns;
+	g_idle_timeout = idle_timeout;
+}
+
+/**
+ * An idle FCGI_KEEP_CONN connection must not have anything to say; if it
+ * is readable, the backend has closed it (or is out of sync with us).
+ */
+static bool mod_fastcgi_conn_alive(int sockd)
+{
+	struct pollfd pfd;
+	pfd.fd = sockd;
+	pfd.events = POLLIN | POLLPRI;
+	return poll(&pfd, 1, 0) == 0;
+}
+
+static void mod_fastcgi_prune_idle(fcgi_backend &be)
+{
+	auto now = tp_now();
+	std::lock_guard bhold(be.lock);
+	for (auto it = be.idle.begin(); it != be.idle.end(); ) {
+		if (now - it->since < g_idle_timeout &&
+		    mod_fastcgi_conn_alive(it->sockd)) {
+			++it;
+			continue;
+		}
+		close(it->sockd);
+		it = be.idle.erase(it);
+	}
+}
+
+static void *mod_fastcgi_scanwork(void *param)
+{
+	while (!g_notify_stop) {
+		sleep(1);
+		/*
+		 * Every idle connection occupies a php-fpm worker, so do not
+		 * wait for the next request to give them back.
+		 */
+		for (auto &[path, be] : g_backend_list)
+			mod_fastcgi_prune_idle(be);
+	}
+	return nullptr;
 }
 
 static int mod_fastcgi_defaults()
@@ -215,7 +281,19 @@ int mod_fastcgi_run() try
 	auto ret = mod_fastcgi_read_txt();
 	if (ret < 0)
 		return ret;
+	for (auto &node : g_fastcgi_list)
+		node.backend = &g_backend_list[node.sock_path];
 	g_context_list = std::make_unique<FASTCGI_CONTEXT[]>(g_context_num);
+	if (g_idle_conns == 0)
+		return 0;
+	g_notify_stop = false;
+	ret = pthread_create4(&g_scan_tid, nullptr, mod_fastcgi_scanwork, nullptr);
+	if (ret != 0) {
+		mlog(LV_ERR, "mod_fastcgi: failed to create scanning thread: %s", strerror(ret));
+		g_notify_stop = true;
+		return -4;
+	}
+	pthread_setname_np(g_scan_tid, "mod_fastcgi");
 	return 0;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-1654: ENOMEM");
@@ -224,7 +302,19 @@ int mod_fastcgi_run() try
 
 void mod_fastcgi_stop()
 {
+	if (!g_notify_stop) {
+		g_notify_stop = true;
+		if (!pthread_equal(g_scan_tid, {})) {
+			pthread_kill(g_scan_tid, SIGALRM);
+			pthread_join(g_scan_tid, NULL);
+		}
+	}
 	g_context_list.reset();
+	for (auto &[path, be] : g_backend_list)
+		for (const auto &c : be.idle)
+			close(c.sockd);
+	g_backend_list.clear();
+	g_fastcgi_list.clear();
 }
 
 static pack_result mod_fastcgi_push_name_value(NDR_PUSH *pndr,
@@ -252,7 +342,7 @@ static pack_result mod_fastcgi_push_name_value(NDR_PUSH *pndr,
 	return pndr->p_uint8_a(reinterpret_cast<const uint8_t *>(pvalue), val_len);
 }
 
-static pack_result mod_fastcgi_push_begin_request(NDR_PUSH *pndr)
+static pack_result mod_fastcgi_push_begin_request(NDR_PUSH *pndr, uint8_t flags)
 {
 	TRY(pndr->p_uint8(FCGI_VERSION));
 	TRY(pndr->p_uint8(RECORD_TYPE_BEGIN_REQUEST));
@@ -266,7 +356,7 @@ static pack_result mod_fastcgi_push_begin_request(NDR_PUSH *pndr)
 	/* begin request role */
 	TRY(pndr->p_uint16(ROLE_RESPONDER));
 	/* begin request flags */
-	TRY(pndr->p_uint8(0));
+	TRY(pndr->p_uint8(flags));
 	/* begin request reserved bytes */
 	return pndr->p_zero(5);
 }
@@ -334,13 +424,6 @@ static pack_result mod_fastcgi_pull_end_request(NDR_PULL *pndr,
 	return pndr->advance(padding_len);
 }
 
-static pack_result mod_fastcgi_pull_stdstream(NDR_PULL *pndr,
-	uint8_t padding_len, FCGI_STDSTREAM *pstd_stream)
-{
-	TRY(pndr->g_uint8_a(pstd_stream->buffer, pstd_stream->length));
-	return pndr->advance(padding_len);
-}
-
 static pack_result mod_fastcgi_pull_record_header(
 	NDR_PULL *pndr, RECORD_HEADER *pheader)
 {
@@ -380,6 +463,67 @@ static int mod_fastcgi_connect_backend(const char *path)
 	return sockd;
 }
 
+/**
+ * Send the BEGIN_REQUEST and PARAMS records, preferably over a connection
+ * that was kept from an earlier request. Returns the socket or -errno.
+ */
+static int mod_fastcgi_open_request(const FASTCGI_NODE &node,
+    const void *begin, size_t begin_len, const void *params, size_t params_len)
+{
+	auto &be = *node.backend;
+	bool b_reused = false;
+	int sockd = -1;
+	if (g_idle_conns > 0) {
+		std::lock_guard bhold(be.lock);
+		while (!be.idle.empty()) {
+			auto c = be.idle.back();
+			be.idle.pop_back();
+			if (tp_now() - c.since < g_idle_timeout &&
+			    mod_fastcgi_conn_alive(c.sockd)) {
+				sockd = c.sockd;
+				b_reused = true;
+				break;
+			}
+			close(c.sockd);
+		}
+	}
+	if (sockd < 0)
+		sockd = mod_fastcgi_connect_backend(node.sock_path.c_str());
+	while (sockd >= 0) {
+		if (HXio_fullwrite(sockd, begin, begin_len) >= 0 &&
+		    HXio_fullwrite(sockd, params, params_len) >= 0)
+			return sockd;
+		auto se = errno;
+		close(sockd);
+		if (!b_reused)
+			return -se;
+		/* php-fpm may have dropped the connection in the meantime */
+		b_reused = false;
+		sockd = mod_fastcgi_connect_backend(node.sock_path.c_str());
+	}
+	return sockd;
+}
+
+/**
+ * Hand the connection back for reuse. Only called once END_REQUEST has been
+ * seen and nothing else is pending on the socket.
+ */
+static void mod_fastcgi_release_conn(const FASTCGI_NODE &node, int sockd)
+{
+	auto &be = *node.backend;
+	std::unique_lock bhold(be.lock);
+	if (be.idle.size() >= g_idle_conns) {
+		bhold.unlock();
+		close(sockd);
+		return;
+	}
+	try {
+		be.idle.push_back({sockd, tp_now()});
+	} catch (const std::bad_alloc &) {
+		close(sockd);
+	}
+}
+
 http_status mod_fastcgi_take_request(http_context *phttp)
 {
 	auto &rq = phttp->request;
@@ -464,6 +608,11 @@ http_status mod_fastcgi_take_request(http_context *phttp)
 	rq.b_end = false;
 	pcontext->cli_sockd = -1;
 	pcontext->b_header = FALSE;
+	pcontext->b_polling = false;
+	pcontext->b_eof = false;
+	pcontext->rbuf.clear();
+	pcontext->rbuf_off = 0;
+	pcontext->hdr.clear();
 	pcontext->b_active = true;
 	return http_status::ok;
 }
@@ -630,7 +779,8 @@ BOOL mod_fastcgi_relay_content(HTTP_CONTEXT *phttp)
 	uint8_t ndr_buff[65800];
 	
 	ndr_push.init(tmp_buff, 16, NDR_FLAG_NOALIGN | NDR_FLAG_BIGENDIAN);
-	if (mod_fastcgi_push_begin_request(&ndr_push) != NDR_ERR_SUCCESS ||
+	if (mod_fastcgi_push_begin_request(&ndr_push,
+	    g_idle_conns > 0 ? FCGI_KEEP_CONN : 0) != NDR_ERR_SUCCESS ||
 	    ndr_push.offset != 16)
 		return FALSE;
 	ndr_length = sizeof(ndr_buff);
@@ -638,20 +788,13 @@ BOOL mod_fastcgi_relay_content(HTTP_CONTEXT *phttp)
 		return FALSE;	
 	auto &fctx = g_context_list[phttp->context_id];
 	auto sk_path = fctx.pfnode->sock_path.c_str();
-	cli_sockd = mod_fastcgi_connect_backend(sk_path);
+	cli_sockd = mod_fastcgi_open_request(*fctx.pfnode, tmp_buff, 16,
+	            ndr_buff, ndr_length);
 	if (cli_sockd < 0) {
-		phttp->log(LV_ERR, "Failed to connect to fastcgi back-end %s: %s",
+		phttp->log(LV_ERR, "Failed to send request to fastcgi back-end %s: %s",
 			sk_path, strerror(-cli_sockd));
 		return FALSE;
 	}
-	if (HXio_fullwrite(cli_sockd, tmp_buff, 16) < 0 ||
-	    HXio_fullwrite(cli_sockd, ndr_buff, ndr_length) < 0) {
-		auto se = errno;
-		close(cli_sockd);
-		phttp->log(LV_ERR, "Failed to write record to fastcgi back-end %s: %s",
-			sk_path, strerror(se));
-		return FALSE;
-	}
 	ndr_push.init(tmp_buff, 8, NDR_FLAG_NOALIGN | NDR_FLAG_BIGENDIAN);
 	if (NDR_ERR_SUCCESS != mod_fastcgi_push_params_begin(&ndr_push) ||
 		NDR_ERR_SUCCESS != mod_fastcgi_push_params_end(&ndr_push) ||
@@ -744,6 +887,7 @@ BOOL mod_fastcgi_relay_content(HTTP_CONTEXT *phttp)
 		return FALSE;
 	}
 	fctx.cli_sockd = cli_sockd;
+	fctx.last_time = tp_now();
 	return TRUE;
 }
 
@@ -755,73 +899,155 @@ void mod_fastcgi_put_context(HTTP_CONTEXT *phttp)
 		close(fctx.cli_sockd);
 		fctx.cli_sockd = -1;
 	}
+	fctx.comp.reset();
+	fctx.rbuf.clear();
+	fctx.rbuf_off = 0;
+	fctx.hdr.clear();
+	fctx.b_polling = false;
 	fctx.b_active = false;
 }
 
-static BOOL mod_fastcgi_safe_read(FASTCGI_CONTEXT *pfast_context,
-    void *pbuff, int length)
+/**
+ * Returns the length of the record at the head of the receive buffer, or 0
+ * if it has not been received completely yet.
+ */
+static size_t mod_fastcgi_record_size(const fastcgi_context &fctx)
 {
-	int offset;
-	int tv_msec;
-	int read_len;
-	struct pollfd pfd_read;
-	
-	offset = 0;
-	while (true) {
-		tv_msec = SOCKET_TIMEOUT * 1000;
-		pfd_read.fd = pfast_context->cli_sockd;
-		pfd_read.events = POLLIN|POLLPRI;
-		if (poll(&pfd_read, 1, tv_msec) != 1)
-			return FALSE;
-		read_len = read(pfast_context->cli_sockd,
-		           static_cast<char *>(pbuff) + offset,
-		           length - offset);
-		if (read_len <= 0)
-			return FALSE;
-		offset += read_len;
-		if (length == offset) {
-			pfast_context->last_time = tp_now();
-			return TRUE;
+	auto avail = fctx.rbuf.size() - fctx.rbuf_off;
+	if (avail < 8)
+		return 0;
+	auto p = reinterpret_cast<const uint8_t *>(&fctx.rbuf[fctx.rbuf_off]);
+	size_t len = 8 + (p[4] << 8 | p[5]) + p[6];
+	return avail >= len ? len : 0;
+}
+
+/**
+ * Collect what the backend has sent so far, without blocking.
+ * Returns true if a record can be processed or the stream has ended.
+ */
+static bool mod_fastcgi_fill(fastcgi_context &fctx) try
+{
+	char buff[65536];
+
+	if (fctx.rbuf_off > 0) {
+		fctx.rbuf.erase(0, fctx.rbuf_off);
+		fctx.rbuf_off = 0;
+	}
+	while (!fctx.b_eof && mod_fastcgi_record_size(fctx) == 0) {
+		auto ret = recv(fctx.cli_sockd, buff, std::size(buff), MSG_DONTWAIT);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return false;
+		if (ret <= 0) {
+			fctx.b_eof = true;
+			break;
 		}
+		fctx.rbuf.append(buff, ret);
+		fctx.last_time = tp_now();
 	}
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1214: ENOMEM");
+	fctx.b_eof = true;
+	return true;
 }
 
 int mod_fastcgi_check_response(HTTP_CONTEXT *phttp)
 {
-	int tv_msec;
-	int context_num;
-	struct pollfd pfd_read;
-	
-	context_num = contexts_pool_get_param(CUR_SCHEDULING_CONTEXTS)
-				+ threads_pool_get_param(THREADS_POOL_CUR_THR_NUM);
-	tv_msec = POLL_MILLISECONDS_FOR_CHECK *
-			(g_unavailable_times / context_num);
-	if (tv_msec > 999)
-		tv_msec = 999;
 	auto &fctx = g_context_list[phttp->context_id];
-	pfd_read.fd = fctx.cli_sockd;
-	pfd_read.events = POLLIN|POLLPRI;
-	if (1 == poll(&pfd_read, 1, tv_msec)) {
-		g_unavailable_times = 0;
+	fctx.b_polling = false;
+	if (mod_fastcgi_fill(fctx))
 		return RESPONSE_AVAILABLE;
-	}
-	g_unavailable_times ++;
 	if (tp_now() - fctx.last_time > g_exec_timeout)
 		return RESPONSE_TIMEOUT;
+	/* http_parser_get_context_socket now hands out the backend socket */
+	fctx.b_polling = true;
 	return RESPONSE_WAITING;
 }
 
+int mod_fastcgi_get_socket(const http_context *hctx)
+{
+	if (g_context_list == nullptr)
+		return -1;
+	auto &fctx = g_context_list[hctx->context_id];
+	return fctx.b_active && fctx.b_polling ? fctx.cli_sockd : -1;
+}
+
+/* When a context waiting on the backend is due for RESPONSE_TIMEOUT */
+time_point mod_fastcgi_get_deadline(const http_context *hctx)
+{
+	return g_context_list[hctx->context_id].last_time + g_exec_timeout;
+}
+
+static http_coding mod_fastcgi_coding(const http_context *phttp,
+    const char *status_line, std::string_view hdrs)
+{
+	auto &rq = phttp->request;
+	std::string_view val;
+	if (rq.imethod == http_method::head || strcmp(rq.version, "1.1") != 0 ||
+	    !http_coding_eligible(strtoul(status_line, nullptr, 10)) ||
+	    http_hdr_value(hdrs, "Content-Encoding", val) ||
+	    !http_hdr_value(hdrs, "Content-Type", val) ||
+	    !http_coding_eligible(val))
+		return http_coding::identity;
+	if (http_hdr_value(hdrs, "Content-Length", val) &&
+	    strtoull(std::string(val).c_str(), nullptr, 10) < g_http_compress_min)
+		return http_coding::identity;
+	return http_coding_negotiate(rq.f_accept_encoding);
+}
+
+/**
+ * Emit one piece of response body, applying the content and transfer
+ * coding that was decided on when the response header was seen.
+ */
+static bool mod_fastcgi_write_body(http_context *phttp,
+    fastcgi_context &fctx, const void *data, size_t size) try
+{
+	auto &out = phttp->stream_out;
+	if (fctx.comp.active()) {
+		std::string z;
+		/* flush so that long-polling scripts still get through */
+		if (!fctx.comp.feed(data, size, true, z))
+			return false;
+		return z.empty() || http_write_chunk(out, z.data(), z.size());
+	}
+	if (phttp->request.b_chunked)
+		return http_write_chunk(out, data, size);
+	return out.write(data, size) == STREAM_WRITE_OK;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1203: ENOMEM");
+	return false;
+}
+
+static bool mod_fastcgi_write_trailer(http_context *phttp,
+    fastcgi_context &fctx) try
+{
+	auto &out = phttp->stream_out;
+	if (fctx.comp.active()) {
+		std::string z;
+		if (!fctx.comp.finish(z) ||
+		    (!z.empty() && !http_write_chunk(out, z.data(), z.size())))
+			return false;
+	}
+	return out.write("0\r\n\r\n", 5) == STREAM_WRITE_OK;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1209: ENOMEM");
+	return false;
+}
+
 BOOL mod_fastcgi_read_response(HTTP_CONTEXT *phttp)
 {
 	auto &rq = phttp->request;
+	size_t rec_len;
 	unsigned int tmp_len;
 	NDR_PULL ndr_pull;
-	char dstring[128], tmp_buff[80000], response_buff[65536];
+	char dstring[128], tmp_buff[80000];
 	char status_line[1024], *pbody, *ptoken, *ptoken1;
+	const char *hdr_fields;
+	std::string zhdr;
+	http_coding coding;
 	RECORD_HEADER header;
-	uint8_t header_buff[8];
-	uint32_t response_offset;
-	FCGI_STDSTREAM std_stream;
 	FCGI_ENDREQUESTBODY end_request;
 	auto &fctx = g_context_list[phttp->context_id];
 	
@@ -829,16 +1055,10 @@ BOOL mod_fastcgi_read_response(HTTP_CONTEXT *phttp)
 		mod_fastcgi_put_context(phttp);
 		return FALSE;	
 	}
-	response_offset = 0;
-	while (true) {
-		if (!mod_fastcgi_safe_read(&fctx, header_buff, std::size(header_buff))) {
-			phttp->log(LV_DEBUG, "failed to read"
-				" record header from fastcgi back-end %s",
-				fctx.pfnode->sock_path.c_str());
-			mod_fastcgi_put_context(phttp);
-			return FALSE;	
-		}
-		ndr_pull.init(header_buff, 8, NDR_FLAG_NOALIGN | NDR_FLAG_BIGENDIAN);
+	while ((rec_len = mod_fastcgi_record_size(fctx)) > 0) {
+		auto rec = &fctx.rbuf[fctx.rbuf_off];
+		fctx.rbuf_off += rec_len;
+		ndr_pull.init(rec, rec_len, NDR_FLAG_NOALIGN | NDR_FLAG_BIGENDIAN);
 		if (NDR_ERR_SUCCESS != mod_fastcgi_pull_record_header(
 			&ndr_pull, &header)) {
 			phttp->log(LV_DEBUG, "failed to "
@@ -846,8 +1066,9 @@ BOOL mod_fastcgi_read_response(HTTP_CONTEXT *phttp)
 			mod_fastcgi_put_context(phttp);
 			return FALSE;
 		}
+		auto data = rec + 8;
 		switch (header.type) {
-		case RECORD_TYPE_END_REQUEST:
+		case RECORD_TYPE_END_REQUEST: {
 			if (8 != header.content_len) {
 				phttp->log(LV_DEBUG, "record header"
 					" format error from fastcgi back-end %s",
@@ -855,18 +1076,9 @@ BOOL mod_fastcgi_read_response(HTTP_CONTEXT *phttp)
 				mod_fastcgi_put_context(phttp);
 				return FALSE;
 			}
-			tmp_len = header.padding_len + 8;
-			if (!mod_fastcgi_safe_read(&fctx,
-			    tmp_buff, tmp_len)) {
-				phttp->log(LV_DEBUG, "failed to read"
-				" record header from fastcgi back-end %s",
-				fctx.pfnode->sock_path.c_str());
-				mod_fastcgi_put_context(phttp);
-				return FALSE;
-			}
-			ndr_pull.init(tmp_buff, tmp_len, NDR_FLAG_NOALIGN | NDR_FLAG_BIGENDIAN);
-			if (mod_fastcgi_pull_end_request(&ndr_pull,
-			    header.padding_len, &end_request) != NDR_ERR_SUCCESS)
+			bool b_done = mod_fastcgi_pull_end_request(&ndr_pull,
+			              header.padding_len, &end_request) == NDR_ERR_SUCCESS;
+			if (!b_done)
 				phttp->log(LV_DEBUG, "failed to"
 					" pull record body in mod_fastcgi");
 			else
@@ -876,76 +1088,55 @@ BOOL mod_fastcgi_read_response(HTTP_CONTEXT *phttp)
 						(int)end_request.protocol_status,
 						fctx.pfnode->sock_path.c_str());
 			if (fctx.b_header && rq.b_chunked)
-				phttp->stream_out.write("0\r\n\r\n", 5);
+				mod_fastcgi_write_trailer(phttp, fctx);
+			if (b_done && g_idle_conns > 0 &&
+			    end_request.protocol_status == PROTOCOL_STATUS_REQUEST_COMPLETE &&
+			    fctx.rbuf_off == fctx.rbuf.size() && !fctx.b_eof) {
+				mod_fastcgi_release_conn(*fctx.pfnode, fctx.cli_sockd);
+				fctx.cli_sockd = -1;
+			}
 			mod_fastcgi_put_context(phttp);
 			return FALSE;
+		}
 		case RECORD_TYPE_STDOUT:
 		case RECORD_TYPE_STDERR:
-			tmp_len = header.content_len + header.padding_len;
-			if (!mod_fastcgi_safe_read(&fctx,
-			    tmp_buff, tmp_len)) {
-				phttp->log(LV_DEBUG, "failed to read"
-					" record header from fastcgi back-end %s",
-					fctx.pfnode->sock_path.c_str());
-				mod_fastcgi_put_context(phttp);
-				return FALSE;
-			}
-			ndr_pull.init(tmp_buff, tmp_len, NDR_FLAG_NOALIGN | NDR_FLAG_BIGENDIAN);
-			std_stream.length = header.content_len;
-			if (NDR_ERR_SUCCESS != mod_fastcgi_pull_stdstream(
-				&ndr_pull, header.padding_len, &std_stream)) {
-				phttp->log(LV_DEBUG, "failed to"
-					" pull record body in mod_fastcgi");
-				mod_fastcgi_put_context(phttp);
-				return FALSE;	
-			}
 			if (RECORD_TYPE_STDERR == header.type) {
-				memcpy(tmp_buff, std_stream.buffer, std_stream.length);
-				tmp_buff[std_stream.length] = '\0';
 				phttp->log(LV_DEBUG, "stderr message "
-					"\"%s\" from fastcgi back-end %s", tmp_buff,
+					"\"%.*s\" from fastcgi back-end %s",
+					static_cast<int>(header.content_len), data,
 					fctx.pfnode->sock_path.c_str());
 				continue;
 			}
+			/* An empty record terminates the stream; END_REQUEST follows. */
+			if (header.content_len == 0)
+				continue;
 			if (fctx.b_header) {
-				if (0 == std_stream.length) {
-					phttp->log(LV_DEBUG, "empty stdout "
-						"record is not supported by mod_fastcgi");
+				if (!mod_fastcgi_write_body(phttp, fctx,
+				    data, header.content_len)) {
+					phttp->log(LV_DEBUG, "failed to write"
+							" stdin into stream in mod_fastcgi");
 					mod_fastcgi_put_context(phttp);
 					return FALSE;
 				}
-				if (rq.b_chunked) {
-					tmp_len = snprintf(tmp_buff, std::size(tmp_buff),
-					          "%x\r\n", std_stream.length);
-					if (phttp->stream_out.write(tmp_buff, tmp_len) != STREAM_WRITE_OK ||
-					    phttp->stream_out.write(std_stream.buffer, std_stream.length) != STREAM_WRITE_OK ||
-					    phttp->stream_out.write("\r\n", 2) != STREAM_WRITE_OK) {
-						phttp->log(LV_DEBUG, "failed to write"
-								" stdin into stream in mod_fastcgi");
-						mod_fastcgi_put_context(phttp);
-						return FALSE;
-					}
-				} else {
-					if (phttp->stream_out.write(std_stream.buffer,
-					    std_stream.length) != STREAM_WRITE_OK) {
-						phttp->log(LV_DEBUG, "failed to write"
-								" stdin into stream in mod_fastcgi");
-						mod_fastcgi_put_context(phttp);
-						return FALSE;
-					}
-				}
 				return TRUE;
 			}
-			if (response_offset + std_stream.length > sizeof(response_buff)) {
+			if (fctx.hdr.size() + header.content_len > 65536) {
 				phttp->log(LV_DEBUG, "response "
 					"header too long from fastcgi back-end %s",
 					fctx.pfnode->sock_path.c_str());
 				mod_fastcgi_put_context(phttp);
 				return FALSE;
 			}
-			memcpy(response_buff + response_offset,
-				std_stream.buffer, std_stream.length);
-			response_offset += std_stream.length;
+			try {
+				fctx.hdr.append(data, header.content_len);
+			} catch (const std::bad_alloc &) {
+				mlog(LV_ERR, "E-1217: ENOMEM");
+				mod_fastcgi_put_context(phttp);
+				return FALSE;
+			}
+			{
+			auto response_buff = fctx.hdr.data();
+			auto response_offset = fctx.hdr.size();
 			pbody = static_cast<char *>(memmem(response_buff,
 			        response_offset, "\r\n\r\n", 4));
 			if (pbody == nullptr)
@@ -987,26 +1178,39 @@ BOOL mod_fastcgi_read_response(HTTP_CONTEXT *phttp)
 			rq.b_chunked =
 				strncasecmp(response_buff, "Content-Length:", 15) != 0 &&
 				strcasestr(response_buff, "\r\nContent-Length:") == nullptr;
+			hdr_fields = response_buff;
+			coding = mod_fastcgi_coding(phttp, status_line, response_buff);
+			if (coding != http_coding::identity && fctx.comp.start(coding)) try {
+				/* The compressed length is not known in advance */
+				zhdr = http_hdr_remove(response_buff, "Content-Length");
+				zhdr += "Content-Encoding: ";
+				zhdr += http_coding_name(coding);
+				zhdr += "\r\nVary: Accept-Encoding\r\n";
+				hdr_fields = zhdr.c_str();
+				rq.b_chunked = true;
+			} catch (const std::bad_alloc &) {
+				fctx.comp.reset();
+			}
 			rfc1123_dstring(dstring, std::size(dstring));
 			if (phttp->request.imethod == http_method::head)
 				tmp_len = gx_snprintf(tmp_buff, std::size(tmp_buff),
 								"HTTP/1.1 %s\r\n"
 								"Date: %s\r\n"
 								"%s\r\n", status_line,
-								dstring, response_buff);
+								dstring, hdr_fields);
 			else if (rq.b_chunked)
 				tmp_len = gx_snprintf(tmp_buff, std::size(tmp_buff),
 				          "HTTP/1.1 %s\r\n"
 				          "Date: %s\r\n"
 				          "Transfer-Encoding: chunked\r\n"
 				          "%s\r\n", status_line,
-				          dstring, response_buff);
+				          dstring, hdr_fields);
 			else
 				tmp_len = gx_snprintf(tmp_buff, std::size(tmp_buff),
 				          "HTTP/1.1 %s\r\n"
 				          "Date: %s\r\n"
 				          "%s\r\n", status_line,
-				          dstring, response_buff);
+				          dstring, hdr_fields);
 			if (phttp->stream_out.write(tmp_buff, tmp_len) != STREAM_WRITE_OK) {
 				phttp->log(LV_DEBUG, "failed to write "
 					"response header into stream in mod_fastcgi");
@@ -1017,44 +1221,32 @@ BOOL mod_fastcgi_read_response(HTTP_CONTEXT *phttp)
 			if (phttp->request.imethod == http_method::head)
 				return TRUE;
 			response_offset = response_buff + response_offset - pbody;
-			if (response_offset > 0) {
-				if (rq.b_chunked) {
-					tmp_len = snprintf(tmp_buff, std::size(tmp_buff),
-					          "%x\r\n", response_offset);
-					if (phttp->stream_out.write(tmp_buff, tmp_len) != STREAM_WRITE_OK ||
-					    phttp->stream_out.write(pbody, response_offset) != STREAM_WRITE_OK ||
-					    phttp->stream_out.write("\r\n", 2) != STREAM_WRITE_OK) {
-						phttp->log(LV_DEBUG, "failed to write"
-								" stdin into stream in mod_fastcgi");
-						mod_fastcgi_put_context(phttp);
-						return FALSE;
-					}
-				} else {
-					if (phttp->stream_out.write(pbody, response_offset) != STREAM_WRITE_OK) {
-						phttp->log(LV_DEBUG, "failed to write"
-								" stdin into stream in mod_fastcgi");
-						mod_fastcgi_put_context(phttp);
-						return FALSE;	
-					}
-				}
-			}
-			return TRUE;
-		default:
-			tmp_len = header.content_len + header.padding_len;
-			if (!mod_fastcgi_safe_read(&fctx,
-			    tmp_buff, tmp_len)) {
-				phttp->log(LV_DEBUG, "failed to read"
-				" record header from fastcgi back-end %s",
-				fctx.pfnode->sock_path.c_str());
+			if (response_offset > 0 &&
+			    !mod_fastcgi_write_body(phttp, fctx, pbody, response_offset)) {
+				phttp->log(LV_DEBUG, "failed to write"
+						" stdin into stream in mod_fastcgi");
 				mod_fastcgi_put_context(phttp);
 				return FALSE;
 			}
+			fctx.hdr.clear();
+			return TRUE;
+			}
+		default:
 			phttp->log(LV_DEBUG, "ignore record %d"
 				" from fastcgi back-end %s", (int)header.type,
 				fctx.pfnode->sock_path.c_str());
 			continue;
 		}
 	}
+	if (fctx.b_eof) {
+		phttp->log(LV_DEBUG, "fastcgi back-end %s closed the "
+			"connection prematurely", fctx.pfnode->sock_path.c_str());
+		mod_fastcgi_put_context(phttp);
+		return FALSE;
+	}
+	/* Need more records; the caller goes back to polling the backend. */
+	fctx.b_polling = true;
+	return TRUE;
 }
 
 bool mod_fastcgi_is_in_charge(const http_context *hctx)
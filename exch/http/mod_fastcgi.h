@@ -1,4 +1,5 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
 #include <ctime>
 #include <gromox/clock.hpp>
@@ -15,7 +16,7 @@ struct http_context;
 using HTTP_CONTEXT = http_context;
 using FASTCGI_CONTEXT = fastcgi_context;
 
-extern void mod_fastcgi_init(int context_num, gromox::time_duration exec_timeout);
+extern void mod_fastcgi_init(int context_num, gromox::time_duration exec_timeout, size_t idle_conns, gromox::time_duration idle_timeout);
 extern int mod_fastcgi_run();
 extern void mod_fastcgi_stop();
 extern http_status mod_fastcgi_take_request(http_context *);
@@ -25,3 +26,5 @@ void mod_fastcgi_put_context(HTTP_CONTEXT *phttp);
 int mod_fastcgi_check_response(HTTP_CONTEXT *phttp);
 BOOL mod_fastcgi_read_response(HTTP_CONTEXT *phttp);
 extern bool mod_fastcgi_is_in_charge(const http_context *);
+extern int mod_fastcgi_get_socket(const http_context *);
+extern gromox::time_point mod_fastcgi_get_deadline(const http_context *);
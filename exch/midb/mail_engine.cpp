@@ -16,6 +16,7 @@
 #include <ctime>
 #include <fcntl.h>
 #include <iconv.h>
+#include <list>
 #include <memory>
 #include <mutex>
 #include <optional>
@@ -120,6 +121,23 @@ struct KEYWORD_ENUM {
 	const char *keyword;
 };
 
+/*
+ * Parsed digests (without the flag fields) of one store, most recently used
+ * first. Searches run on a sqlite handle of their own after releasing the
+ * IDB, so this has its own lock and is shared with them.
+ */
+struct digest_cache {
+	bool get(const std::string &mid, Json::Value &);
+	void put(const std::string &mid, const Json::Value &);
+
+	std::mutex lock;
+	std::list<std::pair<std::string, Json::Value>> lru;
+	std::unordered_map<std::string, decltype(lru)::iterator> index;
+	/* binary digests yet to be written to midb.sqlite3 */
+	std::vector<std::pair<std::string, std::string>> pending;
+	bool has_table = false; /* midb.sqlite3 has the digests table */
+};
+
 struct IDB_ITEM {
 	IDB_ITEM() = default;
 	~IDB_ITEM();
@@ -132,6 +150,7 @@ struct IDB_ITEM {
 	uint32_t sub_id = 0;
 	std::atomic<int> reference{0};
 	std::timed_mutex lock;
+	std::shared_ptr<digest_cache> digests;
 };
 
 struct idb_item_del {
@@ -149,6 +168,7 @@ enum {
 
 unsigned int g_midb_schema_upgrades;
 unsigned int g_midb_cache_interval, g_midb_reload_interval;
+size_t g_midb_digest_cache_size;
 
 static constexpr auto DB_LOCK_TIMEOUT = std::chrono::seconds(60);
 static size_t g_table_size;
@@ -211,36 +231,90 @@ static std::unique_ptr<char[]> mail_engine_ct_to_utf8(const char *charset,
 	return nullptr;
 }
 
-static uint64_t mail_engine_get_digest(sqlite3 *psqlite, const char *mid_string,
-    Json::Value &digest) try
+bool digest_cache::get(const std::string &mid, Json::Value &digest)
+{
+	std::lock_guard hold(lock);
+	auto i = index.find(mid);
+	if (i == index.end())
+		return false;
+	lru.splice(lru.begin(), lru, i->second);
+	digest = i->second->second;
+	return true;
+}
+
+void digest_cache::put(const std::string &mid, const Json::Value &digest)
+{
+	if (g_midb_digest_cache_size == 0)
+		return;
+	std::lock_guard hold(lock);
+	auto i = index.find(mid);
+	if (i != index.end()) {
+		i->second->second = digest;
+		lru.splice(lru.begin(), lru, i->second);
+		return;
+	}
+	lru.emplace_front(mid, digest);
+	try {
+		index.emplace(mid, lru.begin());
+	} catch (const std::bad_alloc &) {
+		lru.pop_front();
+		throw;
+	}
+	while (lru.size() > g_midb_digest_cache_size) {
+		index.erase(lru.back().first);
+		lru.pop_back();
+	}
+}
+
+/*
+ * Obtain the static part of a digest: from its binary copy in midb.sqlite3,
+ * else from ext/<mid> (queueing a binary copy), else by parsing eml/<mid>
+ * (and writing ext/<mid>).
+ */
+static bool mail_engine_read_digest(sqlite3 *psqlite, digest_cache *dc,
+    const char *mid_string, Json::Value &digest)
 {
 	size_t size;
 	char temp_path[256];
 	
+	if (dc != nullptr && dc->has_table) {
+		auto pstmt = gx_sql_prep(psqlite, "SELECT digest FROM digests WHERE mid_string=?");
+		if (pstmt == nullptr)
+			return false;
+		sqlite3_bind_text(pstmt, 1, mid_string, -1, SQLITE_STATIC);
+		if (pstmt.step() == SQLITE_ROW) {
+			auto blob = static_cast<const char *>(sqlite3_column_blob(pstmt, 0));
+			auto blen = sqlite3_column_bytes(pstmt, 0);
+			if (blob != nullptr && json_from_bin({blob, static_cast<size_t>(blen)}, digest))
+				return true;
+			/* unreadable, rederive and replace it */
+			digest = Json::Value();
+		}
+	}
 	snprintf(temp_path, 256, "%s/ext/%s",
 		common_util_get_maildir(), mid_string);
 	size_t slurp_size = 0;
 	std::unique_ptr<char[], stdlib_delete> slurp_data(HX_slurp_file(temp_path, &slurp_size));
 	if (slurp_data != nullptr) {
 		if (!json_from_str(slurp_data.get(), digest))
-			return 0;
+			return false;
 	} else if (errno != ENOENT) {
 		mlog(LV_ERR, "E-1131: read %s: %s", temp_path, strerror(errno));
-		return 0;
+		return false;
 	} else {
 		snprintf(temp_path, 256, "%s/eml/%s",
 			common_util_get_maildir(), mid_string);
 		slurp_data.reset(HX_slurp_file(temp_path, &slurp_size));
 		if (slurp_data == nullptr) {
 			mlog(LV_ERR, "E-1252: %s: %s", temp_path, strerror(errno));
-			return 0;
+			return false;
 		}
 		MAIL imail;
 		if (!imail.load_from_str_move(slurp_data.get(), slurp_size))
-			return 0;
+			return false;
 		slurp_data.reset();
 		if (imail.get_digest(&size, digest) <= 0)
-			return 0;
+			return false;
 		imail.clear();
 		digest["file"] = "";
 		auto djson = json_to_str(digest);
@@ -255,6 +329,18 @@ static uint64_t mail_engine_get_digest(sqlite3 *psqlite, const char *mid_string,
 			mlog(LV_ERR, "E-1137: open %s for write: %s", temp_path, strerror(errno));
 		}
 	}
+	if (dc != nullptr && dc->has_table) {
+		/* written in batches by mail_engine_flush_digests */
+		std::lock_guard hold(dc->lock);
+		if (dc->pending.size() < std::max(g_midb_digest_cache_size, static_cast<size_t>(64)))
+			dc->pending.emplace_back(mid_string, json_to_bin(digest));
+	}
+	return true;
+}
+
+static uint64_t mail_engine_get_digest(sqlite3 *psqlite, digest_cache *dc,
+    const char *mid_string, Json::Value &digest) try
+{
 	auto pstmt = gx_sql_prep(psqlite, "SELECT uid, recent, read,"
 	             " unsent, flagged, replied, forwarded, deleted,"
 	             " folder_id FROM messages WHERE mid_string=?");
@@ -263,6 +349,12 @@ static uint64_t mail_engine_get_digest(sqlite3 *psqlite, const char *mid_string,
 	sqlite3_bind_text(pstmt, 1, mid_string, -1, SQLITE_STATIC);
 	if (pstmt.step() != SQLITE_ROW)
 		return 0;
+	if (dc == nullptr || !dc->get(mid_string, digest)) {
+		if (!mail_engine_read_digest(psqlite, dc, mid_string, digest))
+			return 0;
+		if (dc != nullptr)
+			dc->put(mid_string, digest);
+	}
 	auto folder_id = pstmt.col_uint64(8);
 	digest["file"]      = mid_string;
 	digest["uid"]       = Json::Value::UInt64(pstmt.col_int64(0));
@@ -470,8 +562,8 @@ enum ctm_field {
 	CTM_FOLDERID, CTM_SIZE,
 };
 
-static bool mail_engine_ct_match_mail(sqlite3 *psqlite, const char *charset,
-    sqlite3_stmt *pstmt_message, const char *mid_string, int id, int total_mail,
+static bool mail_engine_ct_match_mail(sqlite3 *psqlite, digest_cache *dc,
+    const char *charset, sqlite3_stmt *pstmt_message, const char *mid_string, int id, int total_mail,
     uint32_t uidnext, const CONDITION_TREE *ptree) try
 {
 	int sp = 0;
@@ -543,7 +635,7 @@ static bool mail_engine_ct_match_mail(sqlite3 *psqlite, const char *charset,
 				break;
 			case midb_cond::body: {
 				if (!b_loaded) {
-					if (mail_engine_get_digest(psqlite, mid_string,
+					if (mail_engine_get_digest(psqlite, dc, mid_string,
 					    digest) == 0)
 						break;
 					b_loaded = true;
@@ -564,7 +656,7 @@ static bool mail_engine_ct_match_mail(sqlite3 *psqlite, const char *charset,
 			}
 			case midb_cond::cc: {
 				if (!b_loaded) {
-					if (mail_engine_get_digest(psqlite, mid_string,
+					if (mail_engine_get_digest(psqlite, dc, mid_string,
 					    digest) == 0)
 						break;
 					b_loaded = true;
@@ -610,7 +702,7 @@ static bool mail_engine_ct_match_mail(sqlite3 *psqlite, const char *charset,
 				break;
 			case midb_cond::from: {
 				if (!b_loaded) {
-					if (mail_engine_get_digest(psqlite, mid_string,
+					if (mail_engine_get_digest(psqlite, dc, mid_string,
 					    digest) == 0)
 						break;
 					b_loaded = true;
@@ -752,7 +844,7 @@ static bool mail_engine_ct_match_mail(sqlite3 *psqlite, const char *charset,
 				break;
 			case midb_cond::subject: {
 				if (!b_loaded) {
-					if (mail_engine_get_digest(psqlite, mid_string,
+					if (mail_engine_get_digest(psqlite, dc, mid_string,
 					    digest) == 0)
 						break;
 					b_loaded = true;
@@ -771,7 +863,7 @@ static bool mail_engine_ct_match_mail(sqlite3 *psqlite, const char *charset,
 			}
 			case midb_cond::text: {
 				if (!b_loaded) {
-					if (mail_engine_get_digest(psqlite, mid_string,
+					if (mail_engine_get_digest(psqlite, dc, mid_string,
 					    digest) == 0)
 						break;
 					b_loaded = true;
@@ -840,7 +932,7 @@ static bool mail_engine_ct_match_mail(sqlite3 *psqlite, const char *charset,
 			}
 			case midb_cond::to: {
 				if (!b_loaded) {
-					if (mail_engine_get_digest(psqlite, mid_string,
+					if (mail_engine_get_digest(psqlite, dc, mid_string,
 					    digest) == 0)
 						break;
 					b_loaded = true;
@@ -1267,8 +1359,8 @@ static bool ct_hint_seq(const imap_seq_list &list,
 }
 
 static std::optional<std::vector<int>> mail_engine_ct_match(const char *charset,
-    sqlite3 *psqlite, uint64_t folder_id, const CONDITION_TREE *ptree,
-    BOOL b_uid) try
+    sqlite3 *psqlite, digest_cache *dc, uint64_t folder_id,
+    const CONDITION_TREE *ptree, BOOL b_uid) try
 {
 	uint32_t uid;
 	uint32_t uidnext;
@@ -1305,7 +1397,7 @@ static std::optional<std::vector<int>> mail_engine_ct_match(const char *charset,
 	for (size_t i = 1; pstmt.step() == SQLITE_ROW; ++i) {
 		auto mid_string = pstmt.col_text(0);
 		uid = sqlite3_column_int64(pstmt, 1);
-		if (mail_engine_ct_match_mail(psqlite, charset, pstmt_message,
+		if (mail_engine_ct_match_mail(psqlite, dc, charset, pstmt_message,
 		    mid_string, i, total_mail, uidnext, ptree))
 			presult->push_back(b_uid ? uid : i);
 	}
@@ -2100,6 +2192,9 @@ static IDB_REF mail_engine_get_idb(const char *path, bool force_resync = false)
 				return {};
 			}
 			pidb->username.resize(strlen(pidb->username.c_str()));
+			pidb->digests = std::make_shared<digest_cache>();
+			pidb->digests->has_table = dbop_sqlite_schemaversion(pidb->psqlite,
+			                           sqlite_kind::midb) >= 2;
 		} catch (const std::bad_alloc &) {
 			g_hash_table.erase(xp.first);
 			mlog(LV_ERR, "E-2401: ENOMEM");
@@ -2135,8 +2230,43 @@ static IDB_REF mail_engine_get_idb(const char *path, bool force_resync = false)
 	return IDB_REF(pidb);
 }
 
+/* Write out the binary digests which lookups have queued, in one go. */
+static void mail_engine_flush_digests(IDB_ITEM *pidb) try
+{
+	auto dc = pidb->digests.get();
+	if (dc == nullptr || pidb->psqlite == nullptr ||
+	    !sqlite3_get_autocommit(pidb->psqlite))
+		return;
+	std::vector<std::pair<std::string, std::string>> todo;
+	{
+		std::lock_guard hold(dc->lock);
+		todo.swap(dc->pending);
+	}
+	if (todo.empty())
+		return;
+	auto sql_transact = gx_sql_begin_trans(pidb->psqlite);
+	if (!sql_transact)
+		return;
+	auto pstmt = gx_sql_prep(pidb->psqlite, "INSERT OR REPLACE"
+	             " INTO digests (mid_string, digest) VALUES (?, ?)");
+	if (pstmt == nullptr)
+		return;
+	for (const auto &[mid, bin] : todo) {
+		sqlite3_bind_text(pstmt, 1, mid.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_blob(pstmt, 2, bin.data(), bin.size(), SQLITE_STATIC);
+		/* The message may have gone in the meantime (foreign key). */
+		pstmt.step(SQLEXEC_SILENT_CONSTRAINT);
+		pstmt.reset();
+	}
+	pstmt.finalize();
+	sql_transact.commit();
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1231: ENOMEM");
+}
+
 void idb_item_del::operator()(IDB_ITEM *pidb)
 {
+	mail_engine_flush_digests(pidb);
 	pidb->last_time = time(nullptr);
 	pidb->lock.unlock();
 	std::lock_guard hhold(g_hash_lock);
@@ -2145,6 +2275,7 @@ void idb_item_del::operator()(IDB_ITEM *pidb)
 
 IDB_ITEM::~IDB_ITEM()
 {
+	mail_engine_flush_digests(this);
 	if (psqlite != nullptr)
 		sqlite3_close(psqlite);
 }
@@ -3340,7 +3471,8 @@ static int mail_engine_pdtlu(int argc, char **argv, int sockd) try
 	for (const auto &dt : temp_list) {
 		temp_len = gx_snprintf(temp_buff, std::size(temp_buff), "- ");
 		Json::Value digest;
-		if (mail_engine_get_digest(pidb->psqlite, dt.c_str(), digest) == 0)
+		if (mail_engine_get_digest(pidb->psqlite, pidb->digests.get(),
+		    dt.c_str(), digest) == 0)
 			digest = Json::objectValue;
 		auto djson = json_to_str(digest);
 		djson.insert(0, temp_buff);
@@ -3631,6 +3763,7 @@ static int mail_engine_psrhl(int argc, char **argv, int sockd)
 	auto folder_id = mail_engine_get_folder_id(pidb.get(), argv[2]);
 	if (folder_id == 0)
 		return MIDB_E_NO_FOLDER;
+	auto dc = pidb->digests;
 	pidb.reset();
 	sprintf(temp_path, "%s/exmdb/midb.sqlite3", argv[1]);
 	auto ret = sqlite3_open_v2(temp_path, &psqlite, SQLITE_OPEN_READWRITE, nullptr);
@@ -3638,7 +3771,8 @@ static int mail_engine_psrhl(int argc, char **argv, int sockd)
 		mlog(LV_ERR, "E-1439: sqlite3_open %s: %s", temp_path, sqlite3_errstr(ret));
 		return MIDB_E_HASHTABLE_FULL;
 	}
-	auto presult = mail_engine_ct_match(argv[3], psqlite, folder_id, ptree.get(), false);
+	auto presult = mail_engine_ct_match(argv[3], psqlite, dc.get(),
+	               folder_id, ptree.get(), false);
 	if (!presult.has_value()) {
 		sqlite3_close(psqlite);
 		return MIDB_E_MNG_CTMATCH;
@@ -3708,6 +3842,7 @@ static int mail_engine_psrhu(int argc, char **argv, int sockd)
 	auto folder_id = mail_engine_get_folder_id(pidb.get(), argv[2]);
 	if (folder_id == 0)
 		return MIDB_E_NO_FOLDER;
+	auto dc = pidb->digests;
 	pidb.reset();
 	sprintf(temp_path, "%s/exmdb/midb.sqlite3", argv[1]);
 	auto ret = sqlite3_open_v2(temp_path, &psqlite, SQLITE_OPEN_READWRITE, nullptr);
@@ -3715,7 +3850,8 @@ static int mail_engine_psrhu(int argc, char **argv, int sockd)
 		mlog(LV_ERR, "E-1505: sqlite3_open %s: %s", temp_path, sqlite3_errstr(ret));
 		return MIDB_E_HASHTABLE_FULL;
 	}
-	auto presult = mail_engine_ct_match(argv[3], psqlite, folder_id, ptree.get(), TRUE);
+	auto presult = mail_engine_ct_match(argv[3], psqlite, dc.get(),
+	               folder_id, ptree.get(), TRUE);
 	if (!presult.has_value()) {
 		sqlite3_close(psqlite);
 		return MIDB_E_MNG_CTMATCH;
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstddef>
 
 enum {
 	MIDB_UPGRADE_NO = 0,
@@ -12,3 +13,4 @@ extern void mail_engine_stop();
 
 extern unsigned int g_midb_schema_upgrades;
 extern unsigned int g_midb_cache_interval, g_midb_reload_interval;
+extern size_t g_midb_digest_cache_size;
@@ -85,6 +85,7 @@ static constexpr cfg_directive midb_cfg_defaults[] = {
 	{"default_charset", "windows-1252"},
 	{"midb_cache_interval", "30min", CFG_TIME, "1min", "1year"},
 	{"midb_cmd_debug", "0"},
+	{"midb_digest_cache_size", "4096", CFG_SIZE, "0", "1048576"},
 	{"midb_hosts_allow", ""}, /* ::1 default set later during startup */
 	{"midb_listen_ip", "::1"},
 	{"midb_listen_port", "5555"},
@@ -120,6 +121,7 @@ static bool midb_reload_config(std::shared_ptr<CONFIG_FILE> pconfig)
 	g_cmd_debug = pconfig->get_ll("midb_cmd_debug");
 	g_midb_cache_interval = pconfig->get_ll("midb_cache_interval");
 	g_midb_reload_interval = pconfig->get_ll("midb_reload_interval");
+	g_midb_digest_cache_size = pconfig->get_ll("midb_digest_cache_size");
 	auto s = pconfig->get_value("midb_schema_upgrades");
 	if (strcmp(s, "auto") == 0)
 		g_midb_schema_upgrades = MIDB_UPGRADE_AUTO;
@@ -733,6 +733,61 @@ BOOL mysql_adaptor_get_domain_groups(unsigned int domain_id,
 	return false;
 }
 
+/**
+ * Produce a fingerprint over everything that the address book shows of a
+ * domain (domain row, groups, users, their properties, aliases, mailing
+ * lists, classes). The string changes whenever any of that changes, so
+ * address book caches can skip reloading a domain when it stays the same.
+ * The aggregation happens on the server; only one short row is returned.
+ */
+bool mysql_adaptor_get_domain_digest(unsigned int domain_id,
+    std::string &digest) try
+{
+	char query[1536];
+	snprintf(query, std::size(query),
+	         "SELECT (SELECT CONCAT_WS(',',COUNT(*),BIT_XOR(CRC32(CONCAT_WS(',',"
+	           "domainname,title,address,homedir)))) FROM domains WHERE id=%u),"
+	         "(SELECT CONCAT_WS(',',COUNT(*),BIT_XOR(CRC32(CONCAT_WS(',',"
+	           "id,groupname,title)))) FROM `groups` WHERE domain_id=%u),"
+	         "(SELECT CONCAT_WS(',',COUNT(*),BIT_XOR(CRC32(CONCAT_WS(',',"
+	           "id,username,group_id,address_status,maildir)))) "
+	           "FROM users WHERE domain_id=%u),"
+	         "(SELECT CONCAT_WS(',',COUNT(*),BIT_XOR(CRC32(CONCAT_WS(',',"
+	           "p.user_id,p.proptag,p.order_id,p.propval_str,HEX(p.propval_bin))))) "
+	           "FROM users AS u INNER JOIN user_properties AS p "
+	           "ON u.domain_id=%u AND u.id=p.user_id),"
+	         "(SELECT CONCAT_WS(',',COUNT(*),BIT_XOR(CRC32(CONCAT_WS(',',"
+	           "a.aliasname,a.mainname)))) FROM users AS u INNER JOIN aliases AS a "
+	           "ON u.domain_id=%u AND u.username=a.mainname),"
+	         "(SELECT CONCAT_WS(',',COUNT(*),BIT_XOR(CRC32(CONCAT_WS(',',"
+	           "z.listname,z.list_type,z.list_privilege)))) FROM users AS u "
+	           "INNER JOIN mlists AS z ON u.domain_id=%u AND u.username=z.listname),"
+	         "(SELECT CONCAT_WS(',',COUNT(*),BIT_XOR(CRC32(CONCAT_WS(',',"
+	           "cl.classname,cl.listname)))) FROM users AS u "
+	           "INNER JOIN classes AS cl ON u.domain_id=%u AND u.username=cl.listname)",
+	         domain_id, domain_id, domain_id, domain_id, domain_id, domain_id,
+	         domain_id);
+	auto conn = g_sqlconn_pool.get_wait();
+	if (!conn->query(query))
+		return false;
+	DB_RESULT pmyres = mysql_store_result(conn->get());
+	if (pmyres == nullptr)
+		return false;
+	conn.finish();
+	auto myrow = pmyres.fetch_row();
+	if (myrow == nullptr)
+		return false;
+	digest.clear();
+	for (unsigned int i = 0; i < mysql_num_fields(pmyres.get()); ++i) {
+		digest += myrow[i] != nullptr ? myrow[i] : "-";
+		digest += ';';
+	}
+	return true;
+} catch (const std::exception &e) {
+	mlog(LV_ERR, "%s: %s", "E-1741", e.what());
+	return false;
+}
+
 BOOL mysql_adaptor_check_mlist_include(const char *mlist_name,
     const char *account) try
 {
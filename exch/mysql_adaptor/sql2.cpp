@@ -671,6 +671,7 @@ static BOOL svc_mysql_adaptor(int reason, void **data)
 	E(get_domain_info, "get_domain_info");
 	E(check_same_org, "check_same_org");
 	E(get_domain_groups, "get_domain_groups");
+	E(get_domain_digest, "get_domain_digest");
 	E(get_group_users, "get_group_users");
 	E(get_domain_users, "get_domain_users");
 	E(check_mlist_include, "check_mlist_include");
@@ -2,6 +2,7 @@
 // SPDX-FileCopyrightText: 2022 grommunio GmbH
 // This file is part of Gromox.
 #include <algorithm>
+#include <cerrno>
 #include <csignal>
 #include <cstddef>
 #include <cstdint>
@@ -30,6 +31,7 @@
 #include <gromox/cryptoutil.hpp>
 #include <gromox/defs.h>
 #include <gromox/fileio.h>
+#include <gromox/gal_snapshot.hpp>
 #include <gromox/mapidefs.h>
 #include <gromox/mysql_adaptor.hpp>
 #include <gromox/proc_common.h>
@@ -75,17 +77,19 @@ static int g_ab_cache_interval;
 static gromox::atomic_bool g_notify_stop;
 static pthread_t g_scan_id;
 static char g_nsp_org_name[256];
+static std::string g_gal_dir; /* shared GAL load cache; empty if off */
 
 /*
  * Negative keys: lookup by domain id
  * Positive keys: lookup by organization id (effectively contains domain objects again)
  */
-static std::unordered_map<int, AB_BASE> g_base_hash;
+static std::unordered_map<int, AB_BASE_REF> g_base_hash;
 static std::mutex g_base_lock;
 
 static decltype(mysql_adaptor_get_org_domains) *get_org_domains;
 static decltype(mysql_adaptor_get_domain_info) *get_domain_info;
 static decltype(mysql_adaptor_get_domain_groups) *get_domain_groups;
+static decltype(mysql_adaptor_get_domain_digest) *get_domain_digest;
 static decltype(mysql_adaptor_get_group_users) *get_group_users;
 static decltype(mysql_adaptor_get_domain_users) *get_domain_users;
 static decltype(mysql_adaptor_get_mlist_ids) *get_mlist_ids;
@@ -166,9 +170,15 @@ const SIMPLE_TREE_NODE *ab_tree_minid_to_node(AB_BASE *pbase, uint32_t minid)
 	return NULL;
 }
 
-void ab_tree_init(const char *org_name, size_t base_size, int cache_interval)
+void ab_tree_init(const char *org_name, size_t base_size, int cache_interval,
+    const char *gal_dir)
 {
 	gx_strlcpy(g_nsp_org_name, org_name, std::size(g_nsp_org_name));
+	g_gal_dir = gal_dir;
+	if (!g_gal_dir.empty() && mkdir(gal_dir, 0770) != 0 && errno != EEXIST) {
+		mlog(LV_WARN, "nsp: mkdir %s: %s; not using GAL snapshots", gal_dir, strerror(errno));
+		g_gal_dir.clear();
+	}
 	g_base_size = base_size;
 	g_ab_cache_interval = cache_interval;
 	g_notify_stop = true;
@@ -187,6 +197,7 @@ int ab_tree_run()
 	E(get_org_domains, "get_org_domains");
 	E(get_domain_info, "get_domain_info");
 	E(get_domain_groups, "get_domain_groups");
+	E(get_domain_digest, "get_domain_digest");
 	E(get_group_users, "get_group_users");
 	E(get_domain_users, "get_domain_users");
 	E(get_mlist_ids, "get_mlist_ids");
@@ -215,17 +226,10 @@ static void ab_tree_destruct_tree(SIMPLE_TREE *ptree)
 void AB_BASE::unload()
 {
 	gal_list.clear();
-	for (auto &domain : domain_list)
-		ab_tree_destruct_tree(&domain.tree);
+	phash.clear();
 	domain_list.clear();
 }
 
-domain_node::domain_node(domain_node &&o) noexcept :
-	domain_id(o.domain_id), tree(std::move(o.tree))
-{
-	o.tree = {};
-}
-
 domain_node::~domain_node()
 {
 	ab_tree_destruct_tree(&tree);
@@ -243,9 +247,9 @@ void ab_tree_stop()
 	g_base_hash.clear();
 }
 
-static bool ab_tree_cache_node(AB_BASE *pbase, AB_NODE *pabnode) try
+static bool ab_tree_cache_node(domain_node *pdomain, AB_NODE *pabnode) try
 {
-	pbase->phash.emplace(pabnode->minid, pabnode);
+	pdomain->phash.emplace(pabnode->minid, pabnode);
 	return true;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-1551: ENOMEM");
@@ -253,14 +257,14 @@ static bool ab_tree_cache_node(AB_BASE *pbase, AB_NODE *pabnode) try
 }
 
 static BOOL ab_tree_load_user(AB_NODE *pabnode,
-    sql_user &&usr, AB_BASE *pbase)
+    sql_user &&usr, domain_node *pdomain)
 {
 	pabnode->node_type = abnode_type::user;
 	pabnode->id = usr.id;
 	pabnode->minid = ab_tree_make_minid(minid_type::address, usr.id);
-	auto iter = pbase->phash.find(pabnode->minid);
-	pabnode->stree.pdata = iter != pbase->phash.end() ? &iter->second->stree : nullptr;
-	if (pabnode->stree.pdata == nullptr && !ab_tree_cache_node(pbase, pabnode))
+	auto iter = pdomain->phash.find(pabnode->minid);
+	pabnode->stree.pdata = iter != pdomain->phash.end() ? &iter->second->stree : nullptr;
+	if (pabnode->stree.pdata == nullptr && !ab_tree_cache_node(pdomain, pabnode))
 		return FALSE;
 	pabnode->d_info = new(std::nothrow) sql_user(std::move(usr));
 	if (pabnode->d_info == nullptr)
@@ -269,14 +273,14 @@ static BOOL ab_tree_load_user(AB_NODE *pabnode,
 }
 
 static BOOL ab_tree_load_mlist(AB_NODE *pabnode,
-    sql_user &&usr, AB_BASE *pbase)
+    sql_user &&usr, domain_node *pdomain)
 {
 	pabnode->node_type = abnode_type::mlist;
 	pabnode->id = usr.id;
 	pabnode->minid = ab_tree_make_minid(minid_type::address, usr.id);
-	auto iter = pbase->phash.find(pabnode->minid);
-	pabnode->stree.pdata = iter != pbase->phash.end() ? &iter->second->stree : nullptr;
-	if (pabnode->stree.pdata == nullptr && !ab_tree_cache_node(pbase, pabnode))
+	auto iter = pdomain->phash.find(pabnode->minid);
+	pabnode->stree.pdata = iter != pdomain->phash.end() ? &iter->second->stree : nullptr;
+	if (pabnode->stree.pdata == nullptr && !ab_tree_cache_node(pdomain, pabnode))
 		return FALSE;
 	pabnode->d_info = new(std::nothrow) sql_user(std::move(usr));
 	if (pabnode->d_info == nullptr)
@@ -284,14 +288,33 @@ static BOOL ab_tree_load_mlist(AB_NODE *pabnode,
 	return TRUE;
 }
 
-static BOOL ab_tree_load_tree(int domain_id,
-	SIMPLE_TREE *ptree, AB_BASE *pbase)
+/* Query the directory data of @domain_id from SQL */
+static bool ab_tree_fetch_domain(unsigned int domain_id, gal_domain_data &d)
+{
+	std::vector<sql_group> file_group;
+	if (!get_domain_info(domain_id, d.info) ||
+	    !get_domain_groups(domain_id, file_group))
+		return false;
+	for (auto &&grp : file_group) {
+		std::vector<sql_user> file_user;
+		if (get_group_users(grp.id, file_user) < 0)
+			return false;
+		d.groups.emplace_back(std::move(grp), std::move(file_user));
+	}
+	return get_domain_users(domain_id, d.users) >= 0;
+}
+
+static BOOL ab_tree_load_tree(domain_node *pdnode) try
 {
 	int rows;
-	sql_domain dinfo;
+	gal_domain_data data;
+	auto domain_id = pdnode->domain_id;
+	auto ptree = &pdnode->tree;
 	
-	if (!get_domain_info(domain_id, dinfo))
+	if (!gal_snapshot_obtain(g_gal_dir.c_str(), domain_id, pdnode->digest,
+	    ab_tree_fetch_domain, data))
 		return FALSE;
+	auto &dinfo = data.info;
 	auto abnode_uq = ab_tree_get_abnode();
 	auto pabnode = abnode_uq.get();
 	if (pabnode == nullptr)
@@ -309,13 +332,10 @@ static BOOL ab_tree_load_tree(int domain_id,
 	}
 	auto pdomain = &pabnode->stree;
 	ptree->set_root(std::move(abnode_uq));
-	if (!ab_tree_cache_node(pbase, pabnode))
+	if (!ab_tree_cache_node(pdnode, pabnode))
 		return false;
 
-	std::vector<sql_group> file_group;
-	if (!get_domain_groups(domain_id, file_group))
-		return FALSE;
-	for (auto &&grp : file_group) {
+	for (auto &&[grp, file_user] : data.groups) {
 		abnode_uq = ab_tree_get_abnode();
 		pabnode = abnode_uq.get();
 		if (pabnode == nullptr)
@@ -323,7 +343,6 @@ static BOOL ab_tree_load_tree(int domain_id,
 		pabnode->node_type = abnode_type::group;
 		pabnode->id = grp.id;
 		pabnode->minid = ab_tree_make_minid(minid_type::group, grp.id);
-		auto grp_id = grp.id;
 		pabnode->d_info = new(std::nothrow) sql_group(std::move(grp));
 		if (pabnode->d_info == nullptr) {
 			delete pabnode;
@@ -331,14 +350,11 @@ static BOOL ab_tree_load_tree(int domain_id,
 		}
 		auto pgroup = &pabnode->stree;
 		ptree->add_child(pdomain, std::move(abnode_uq), SIMPLE_TREE_ADD_LAST);
-		if (!ab_tree_cache_node(pbase, pabnode))
+		if (!ab_tree_cache_node(pdnode, pabnode))
 			return false;
 		
-		std::vector<sql_user> file_user;
-		rows = get_group_users(grp_id, file_user);
-		if (rows == -1)
-			return FALSE;
-		else if (rows == 0)
+		rows = file_user.size();
+		if (rows == 0)
 			continue;
 		std::vector<sort_item<std::unique_ptr<NSAB_NODE>>> parray;
 		for (auto &&usr : file_user) {
@@ -347,10 +363,10 @@ static BOOL ab_tree_load_tree(int domain_id,
 			if (pabnode == nullptr)
 				return false;
 			if (usr.dtypx == DT_DISTLIST) {
-				if (!ab_tree_load_mlist(pabnode, std::move(usr), pbase))
+				if (!ab_tree_load_mlist(pabnode, std::move(usr), pdnode))
 					return false;
 			} else {
-				if (!ab_tree_load_user(pabnode, std::move(usr), pbase))
+				if (!ab_tree_load_user(pabnode, std::move(usr), pdnode))
 					return false;
 			}
 			char temp_buff[1024];
@@ -368,23 +384,20 @@ static BOOL ab_tree_load_tree(int domain_id,
 			ptree->add_child(pgroup, std::move(parray[i].obj), SIMPLE_TREE_ADD_LAST);
 	}
 	
-	std::vector<sql_user> file_user;
-	rows = get_domain_users(domain_id, file_user);
-	if (rows == -1)
-		return FALSE;
-	else if (rows == 0)
+	rows = data.users.size();
+	if (rows == 0)
 		return TRUE;
 	std::vector<sort_item<std::unique_ptr<NSAB_NODE>>> parray;
-	for (auto &&usr : file_user) {
+	for (auto &&usr : data.users) {
 		abnode_uq = ab_tree_get_abnode();
 		pabnode = abnode_uq.get();
 		if (pabnode == nullptr)
 			return false;
 		if (usr.dtypx == DT_DISTLIST) {
-			if (!ab_tree_load_mlist(pabnode, std::move(usr), pbase))
+			if (!ab_tree_load_mlist(pabnode, std::move(usr), pdnode))
 				return false;
 		} else {
-			if (!ab_tree_load_user(pabnode, std::move(usr), pbase))
+			if (!ab_tree_load_user(pabnode, std::move(usr), pdnode))
 				return false;
 		}
 		char temp_buff[1024];
@@ -401,6 +414,9 @@ static BOOL ab_tree_load_tree(int domain_id,
 	for (int i = 0; i < rows; ++i)
 		ptree->add_child(pdomain, std::move(parray[i].obj), SIMPLE_TREE_ADD_LAST);
 	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1756: ENOMEM");
+	return false;
 }
 
 uint32_t ab_tree_hidden(const tree_node *node)
@@ -412,28 +428,54 @@ uint32_t ab_tree_hidden(const tree_node *node)
 	return static_cast<const sql_user *>(xab->d_info)->hidden;
 }
 
-static BOOL ab_tree_load_base(AB_BASE *pbase) try
+/**
+ * Obtain the domain_node for @domain_id, either by reusing the one from the
+ * previous snapshot @prev (if the domain's digest has not changed since) or
+ * by loading it from SQL.
+ */
+static std::shared_ptr<domain_node>
+ab_tree_get_domain(unsigned int domain_id, const AB_BASE *prev)
+{
+	std::string digest;
+	if (!get_domain_digest(domain_id, digest))
+		digest.clear();
+	if (prev != nullptr && !digest.empty())
+		for (const auto &d : prev->domain_list)
+			if (d->domain_id == static_cast<int>(domain_id) &&
+			    d->digest == digest)
+				return d;
+	auto dnode = std::make_shared<domain_node>(domain_id);
+	dnode->digest = std::move(digest);
+	if (!ab_tree_load_tree(dnode.get()))
+		return nullptr;
+	return dnode;
+}
+
+/**
+ * Populate @pbase. If @prev is given, domains that have not changed since
+ * @prev was built are shared with it rather than reloaded.
+ */
+static BOOL ab_tree_load_base(AB_BASE *pbase, const AB_BASE *prev = nullptr) try
 {
 	char temp_buff[1024];
+	std::vector<unsigned int> temp_file;
 	
 	if (pbase->base_id > 0) {
-		std::vector<unsigned int> temp_file;
 		if (!get_org_domains(pbase->base_id, temp_file))
 			return FALSE;
-		for (auto domain_id : temp_file) {
-			domain_node dnode(domain_id);
-			if (!ab_tree_load_tree(dnode.domain_id, &dnode.tree, pbase))
-				return FALSE;
-			pbase->domain_list.push_back(std::move(dnode));
-		}
 	} else {
-		domain_node dnode(-pbase->base_id);
-		if (!ab_tree_load_tree(dnode.domain_id, &dnode.tree, pbase))
+		temp_file.push_back(-pbase->base_id);
+	}
+	for (auto domain_id : temp_file) {
+		auto dnode = ab_tree_get_domain(domain_id, prev);
+		if (dnode == nullptr)
 			return FALSE;
 		pbase->domain_list.push_back(std::move(dnode));
 	}
 	for (auto &domain : pbase->domain_list) {
-		auto pdomain = &domain;
+		auto pdomain = domain.get();
+		for (const auto &e : pdomain->phash)
+			pbase->phash.emplace(e);
 		auto proot = pdomain->tree.get_root();
 		if (proot == nullptr)
 			continue;
@@ -461,13 +503,13 @@ static BOOL ab_tree_load_base(AB_BASE *pbase) try
 	return TRUE;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-1677: ENOMEM");
-	return TRUE;
+	return FALSE;
 }
 
 AB_BASE_REF ab_tree_get_base(int base_id)
 {
 	int count;
-	AB_BASE *pbase;
+	AB_BASE_REF pbase;
 	
 	count = 0;
  RETRY_LOAD_BASE:
@@ -479,11 +521,9 @@ AB_BASE_REF ab_tree_get_base(int base_id)
 			return nullptr;
 		}
 		try {
-			auto xp = g_base_hash.try_emplace(base_id);
-			if (!xp.second)
+			pbase = std::make_shared<AB_BASE>();
+			if (!g_base_hash.emplace(base_id, pbase).second)
 				return nullptr;
-			it = xp.first;
-			pbase = &xp.first->second;
 		} catch (const std::bad_alloc &) {
 			return nullptr;
 		}
@@ -491,12 +531,11 @@ AB_BASE_REF ab_tree_get_base(int base_id)
 		pbase->status = BASE_STATUS_CONSTRUCTING;
 		pbase->guid = GUID::random_new();
 		memcpy(pbase->guid.node, &base_id, sizeof(uint32_t));
-		pbase->phash.clear();
 		bhold.unlock();
-		if (!ab_tree_load_base(pbase)) {
+		if (!ab_tree_load_base(pbase.get())) {
 			pbase->unload();
 			bhold.lock();
-			g_base_hash.erase(it);
+			g_base_hash.erase(base_id);
 			bhold.unlock();
 			return nullptr;
 		}
@@ -504,7 +543,7 @@ AB_BASE_REF ab_tree_get_base(int base_id)
 		bhold.lock();
 		pbase->status = BASE_STATUS_LIVING;
 	} else {
-		pbase = &it->second;
+		pbase = it->second;
 		if (pbase->status != BASE_STATUS_LIVING) {
 			bhold.unlock();
 			count ++;
@@ -514,55 +553,77 @@ AB_BASE_REF ab_tree_get_base(int base_id)
 			goto RETRY_LOAD_BASE;
 		}
 	}
-	pbase->reference ++;
-	return AB_BASE_REF(pbase);
-}
-
-void ab_tree_del::operator()(AB_BASE *pbase)
-{
-	std::lock_guard bhold(g_base_lock);
-	pbase->reference --;
+	return pbase;
 }
 
+/*
+ * Rebuild expired bases. The new snapshot is built without holding
+ * g_base_lock and then swapped in; users of the old one are not disturbed.
+ */
 static void *nspab_scanwork(void *param)
 {
-	AB_BASE *pbase;
-	
 	while (!g_notify_stop) {
-		pbase = NULL;
+		AB_BASE_REF prev;
+		bool forced = false;
 		std::unique_lock bhold(g_base_lock);
-		for (auto &kvpair : g_base_hash) {
-			auto &base = kvpair.second;
+		for (const auto &kvpair : g_base_hash) {
+			auto &base = *kvpair.second;
 			if (base.status != BASE_STATUS_LIVING ||
-			    base.reference != 0 ||
 			    time(nullptr) - base.load_time < g_ab_cache_interval)
 				continue;
-			pbase = &base;
-			pbase->status = BASE_STATUS_CONSTRUCTING;
+			prev = kvpair.second;
+			/* ab_tree_invalidate_cache: reload everything */
+			forced = base.load_time == 0;
 			break;
 		}
 		bhold.unlock();
-		if (NULL == pbase) {
+		if (prev == nullptr) {
 			sleep(1);
 			continue;
 		}
-		pbase->gal_list.clear();
-		for (auto &domain : pbase->domain_list)
-			ab_tree_destruct_tree(&domain.tree);
-		pbase->domain_list.clear();
-		pbase->remote_list.clear();
-		pbase->phash.clear();
-		if (!ab_tree_load_base(pbase)) {
+		AB_BASE_REF pbase;
+		try {
+			pbase = std::make_shared<AB_BASE>();
+		} catch (const std::bad_alloc &) {
+			mlog(LV_ERR, "E-1742: ENOMEM");
+			sleep(1);
+			continue;
+		}
+		pbase->base_id = prev->base_id;
+		pbase->guid = prev->guid;
+		pbase->status = BASE_STATUS_LIVING;
+		if (!ab_tree_load_base(pbase.get(), forced ? nullptr : prev.get())) {
 			pbase->unload();
 			bhold.lock();
-			g_base_hash.erase(pbase->base_id);
-			bhold.unlock();
-		} else {
-			bhold.lock();
-			pbase->load_time = time(nullptr);
-			pbase->status = BASE_STATUS_LIVING;
+			auto it = g_base_hash.find(prev->base_id);
+			if (it != g_base_hash.end() && it->second == prev)
+				g_base_hash.erase(it);
 			bhold.unlock();
+			continue;
+		}
+		auto unchanged = pbase->domain_list == prev->domain_list;
+		if (unchanged) {
+			/*
+			 * remote_list holds copies of objects from other
+			 * domains, which may have changed; those are only
+			 * refreshed by installing @pbase (which shares the
+			 * domain nodes, so that is cheap).
+			 */
+			std::lock_guard rhold(prev->remote_lock);
+			unchanged = prev->remote_list.empty();
 		}
+		bhold.lock();
+		if (unchanged) {
+			/* Keep the old snapshot */
+			prev->load_time = time(nullptr);
+			continue;
+		}
+		pbase->load_time = time(nullptr);
+		auto it = g_base_hash.find(prev->base_id);
+		if (it != g_base_hash.end() && it->second == prev)
+			it->second = std::move(pbase);
+		bhold.unlock();
+		/* @prev (and @pbase if it was not installed) die outside the lock */
 	}
 	return NULL;
 }
@@ -795,7 +856,7 @@ const SIMPLE_TREE_NODE *ab_tree_dn_to_node(AB_BASE *pbase, const char *pdn)
 			return &xab->stree;
 	rhold.unlock();
 	for (auto &domain : pbase->domain_list)
-		if (domain.domain_id == domain_id)
+		if (domain->domain_id == domain_id)
 			return NULL;
 	auto pbase1 = ab_tree_get_base(-domain_id);
 	if (pbase1 == nullptr)
@@ -1152,7 +1213,7 @@ void ab_tree_invalidate_cache()
 	mlog(LV_NOTICE, "nsp: Invalidating AB caches");
 	std::unique_lock bl_hold(g_base_lock);
 	for (auto &kvpair : g_base_hash)
-		kvpair.second.load_time = 0;
+		kvpair.second->load_time = 0;
 }
 
 uint32_t ab_tree_get_dtyp(const tree_node *n)
@@ -1233,7 +1294,7 @@ void ab_tree_dump_base(const AB_BASE &b)
 	        b.base_id < 0 ? "Domain" : "Organization",
 	        b.base_id, gtxt);
 	for (const auto &d : b.domain_list) {
-		fprintf(stderr, "    Domain %d\n", d.domain_id);
-		simple_tree_node_enum(d.tree.root, ab_tree_dump_node, 2);
+		fprintf(stderr, "    Domain %d\n", d->domain_id);
+		simple_tree_node_enum(d->tree.root, ab_tree_dump_node, 2);
 	}
 }
@@ -22,13 +22,21 @@
 #define USER_HOME_ADDRESS					7
 #define USER_STORE_PATH						9
 
+struct NSAB_NODE;
 struct PROPERTY_VALUE;
 
 struct domain_node {
 	domain_node(int d) : domain_id(d) {}
-	domain_node(domain_node &&) noexcept;
 	~domain_node();
+	NOMOVE(domain_node);
+
 	int domain_id = -1;
+	/*
+	 * Fingerprint of the domain's SQL rows at load time
+	 * (mysql_adaptor_get_domain_digest); empty if it could not be
+	 * obtained. A rebuild reuses the domain_node when this is unchanged.
+	 */
+	std::string digest;
 	/*
 	 * All NSAB_NODE objects created for a domain are owned by this domain,
 	 * or more specially, @tree. ~domain_node is in charge of destruction
@@ -39,6 +47,11 @@ struct domain_node {
 	 * domain.
 	 */
 	SIMPLE_TREE tree{};
+	/*
+	 * A phash entry for a minid will point to _any one_ NSAB_NODE in this
+	 * domain that has this minid.
+	 */
+	std::unordered_map<int, NSAB_NODE *> phash;
 };
 using DOMAIN_NODE = domain_node;
 
@@ -56,6 +69,11 @@ struct NSAB_NODE {
 	gromox::abnode_type node_type = gromox::abnode_type::remote;
 };
 
+/*
+ * An AB_BASE is an immutable snapshot (except for @remote_list). Rebuilds
+ * construct a new AB_BASE and replace the g_base_hash entry with it; holders
+ * of an AB_BASE_REF keep using the old snapshot until they let go.
+ */
 struct AB_BASE {
 	AB_BASE() = default;
 	NOMOVE(AB_BASE);
@@ -63,7 +81,7 @@ struct AB_BASE {
 	void unload();
 
 	GUID guid{};
-	std::atomic<int> status{0}, reference{0};
+	std::atomic<int> status{0};
 	time_t load_time = 0;
 	/*
 	 * base_id==0: not permitted (contains e.g. the AAPI administrator)
@@ -76,8 +94,9 @@ struct AB_BASE {
 	 * domain_node / domain_node::tree owns all the NSAB_NODEs
 	 * that tree references.
 	 * AB_BASE::gal_list and AB_BASE::phash can reference those nodes.
+	 * Unchanged domain_nodes are shared between successive snapshots.
 	 */
-	std::vector<domain_node> domain_list;
+	std::vector<std::shared_ptr<domain_node>> domain_list;
 	/*
 	 * @remote_list owns all the NSAB_NODEs it references.
 	 * No other AB_BASE members references these nodes.
@@ -90,19 +109,15 @@ struct AB_BASE {
 	gal_list_t gal_list;
 	/*
 	 * A phash entry for a minid will point to _any one_ NSAB_NODE in this
-	 * base that has this minid.
+	 * base that has this minid (union of the domain_node::phash maps).
 	 */
 	std::unordered_map<int, NSAB_NODE *> phash;
 	std::mutex remote_lock;
 };
 
-struct ab_tree_del {
-	void operator()(AB_BASE *);
-};
-
-using AB_BASE_REF = std::unique_ptr<AB_BASE, ab_tree_del>;
+using AB_BASE_REF = std::shared_ptr<AB_BASE>;
 
-extern void ab_tree_init(const char *org_name, size_t base_size, int cache_interval);
+extern void ab_tree_init(const char *org_name, size_t base_size, int cache_interval, const char *gal_dir);
 extern int ab_tree_run();
 extern void ab_tree_stop();
 extern AB_BASE_REF ab_tree_get_base(int base_id);
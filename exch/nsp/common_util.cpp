@@ -53,7 +53,7 @@ int common_util_from_utf8(cpid_t codepage, const char *src, char *dst, size_t le
 	auto charset = cpid_to_cset(codepage);
 	if (charset == nullptr)
 		return -1;
-	conv_id = iconv_open(charset, "UTF-8");
+	conv_id = iconv_cached(charset, "UTF-8");
 	if (conv_id == (iconv_t)-1)
 		return -1;
 	auto pin = deconst(src);
@@ -61,13 +61,9 @@ int common_util_from_utf8(cpid_t codepage, const char *src, char *dst, size_t le
 	in_len = strlen(src) + 1;
 	memset(dst, 0, len);
 	out_len = len;
-	if (iconv(conv_id, &pin, &in_len, &pout, &len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
+	if (iconv(conv_id, &pin, &in_len, &pout, &len) == static_cast<size_t>(-1))
 		return -1;
-	} else {
-		iconv_close(conv_id);
-		return out_len - len;
-	}
+	return out_len - len;
 }
 
 int common_util_to_utf8(cpid_t codepage, const char *src, char *dst, size_t len)
@@ -80,7 +76,7 @@ int common_util_to_utf8(cpid_t codepage, const char *src, char *dst, size_t len)
 	auto charset = cpid_to_cset(codepage);
 	if (charset == nullptr)
 		return -1;
-	conv_id = iconv_open("UTF-8", charset);
+	conv_id = iconv_cached("UTF-8", charset);
 	if (conv_id == (iconv_t)-1)
 		return -1;
 	auto pin = deconst(src);
@@ -88,13 +84,9 @@ int common_util_to_utf8(cpid_t codepage, const char *src, char *dst, size_t len)
 	in_len = strlen(src) + 1;
 	memset(dst, 0, len);
 	out_len = len;
-	if (iconv(conv_id, &pin, &in_len, &pout, &len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
+	if (iconv(conv_id, &pin, &in_len, &pout, &len) == static_cast<size_t>(-1))
 		return -1;
-	} else {
-		iconv_close(conv_id);
-		return out_len - len;
-	}
+	return out_len - len;
 }
 
 void common_util_guid_to_binary(GUID *pguid, BINARY *pbin)
@@ -26,6 +26,7 @@ static DCERPC_ENDPOINT *ep_6001, *ep_6004;
 
 static constexpr cfg_directive nsp_cfg_defaults[] = {
 	{"cache_interval", "5min", CFG_TIME, "1s", "1d"},
+	{"gal_snapshot", "0", CFG_BOOL},
 	{"hash_table_size", "3000", CFG_SIZE, "1"},
 	{"nsp_trace", "0"},
 	{"session_check", "1", CFG_BOOL},
@@ -88,7 +89,10 @@ static BOOL proc_exchange_nsp(int reason, void **ppdata)
 		b_check = pfile->get_ll("session_check");
 		if (b_check)
 			mlog(LV_INFO, "nsp: bind session will be checked");
-		ab_tree_init(org_name, table_size, cache_interval);
+		std::string gal_dir;
+		if (parse_bool(pfile->get_value("gal_snapshot")))
+			gal_dir = std::string(get_state_path()) + "/gal";
+		ab_tree_init(org_name, table_size, cache_interval, gal_dir.c_str());
 
 		query_service2("exmdb_client_get_named_propids", get_named_propids);
 		query_service2("exmdb_client_get_store_properties", get_store_properties);
@@ -2050,7 +2050,7 @@ int nsp_interface_get_specialtable(NSPI_HANDLE handle, uint32_t flags,
 	if (pbase == nullptr || (g_session_check && pbase->guid != handle.guid))
 		return ecError;
 	for (auto &domain : pbase->domain_list) {
-		auto pdomain = &domain;
+		auto pdomain = domain.get();
 		result = nsp_interface_get_tree_specialtables(
 		         &pdomain->tree, b_unicode, codepage, rowset);
 		if (result != ecSuccess)
@@ -2,6 +2,7 @@
 // SPDX-FileCopyrightText: 2022 grommunio GmbH
 // This file is part of Gromox.
 #include <algorithm>
+#include <cerrno>
 #include <climits>
 #include <csignal>
 #include <cstddef>
@@ -31,6 +32,7 @@
 #include <gromox/cryptoutil.hpp>
 #include <gromox/defs.h>
 #include <gromox/ext_buffer.hpp>
+#include <gromox/gal_snapshot.hpp>
 #include <gromox/mapidefs.h>
 #include <gromox/mysql_adaptor.hpp>
 #include <gromox/propval.hpp>
@@ -99,6 +101,7 @@ static int g_ab_cache_interval;
 static gromox::atomic_bool g_notify_stop;
 static pthread_t g_scan_id;
 static char g_zcab_org_name[256];
+static std::string g_gal_dir; /* shared GAL load cache; empty if off */
 static std::unordered_map<int, AB_BASE> g_base_hash;
 static std::mutex g_base_lock;
 
@@ -165,9 +168,15 @@ ab_tree_minid_to_node(const AB_BASE *pbase, uint32_t minid)
 	return iter != pbase->phash.end() ? &iter->second->stree : nullptr;
 }
 
-void ab_tree_init(const char *org_name, int base_size, int cache_interval)
+void ab_tree_init(const char *org_name, int base_size, int cache_interval,
+    const char *gal_dir)
 {
 	gx_strlcpy(g_zcab_org_name, org_name, std::size(g_zcab_org_name));
+	g_gal_dir = gal_dir;
+	if (!g_gal_dir.empty() && mkdir(gal_dir, 0770) != 0 && errno != EEXIST) {
+		mlog(LV_WARN, "zcore: mkdir %s: %s; not using GAL snapshots", gal_dir, strerror(errno));
+		g_gal_dir.clear();
+	}
 	g_base_size = base_size;
 	g_ab_cache_interval = cache_interval;
 	g_notify_stop = true;
@@ -264,15 +273,36 @@ static BOOL ab_tree_load_mlist(AB_NODE *pabnode, sql_user &&usr, AB_BASE *pbase)
 	return pabnode->d_info != nullptr ? TRUE : false;
 }
 
+/* Query the directory data of @domain_id from SQL */
+static bool ab_tree_fetch_domain(unsigned int domain_id, gal_domain_data &d)
+{
+	std::vector<sql_group> file_group;
+	if (!system_services_get_domain_info(domain_id, d.info) ||
+	    !system_services_get_domain_groups(domain_id, file_group))
+		return false;
+	for (auto &&grp : file_group) {
+		std::vector<sql_user> file_user;
+		if (system_services_get_group_users(grp.id, file_user) < 0)
+			return false;
+		d.groups.emplace_back(std::move(grp), std::move(file_user));
+	}
+	return system_services_get_domain_users(domain_id, d.users) >= 0;
+}
+
 static BOOL ab_tree_load_tree(int domain_id,
-	SIMPLE_TREE *ptree, AB_BASE *pbase)
+	SIMPLE_TREE *ptree, AB_BASE *pbase) try
 {
 	int rows;
 	AB_NODE *pabnode;
-	sql_domain dinfo;
+	gal_domain_data data;
+	std::string digest;
 	
-	if (!system_services_get_domain_info(domain_id, dinfo))
+	if (!system_services_get_domain_digest(domain_id, digest))
+		digest.clear();
+	if (!gal_snapshot_obtain(g_gal_dir.c_str(), domain_id, digest,
+	    ab_tree_fetch_domain, data))
 		return FALSE;
+	auto &dinfo = data.info;
 	pabnode = ab_tree_get_abnode();
 	if (pabnode == nullptr)
 		return FALSE;
@@ -292,17 +322,13 @@ static BOOL ab_tree_load_tree(int domain_id,
 	if (!ab_tree_cache_node(pbase, pabnode))
 		return false;
 
-	std::vector<sql_group> file_group;
-	if (!system_services_get_domain_groups(domain_id, file_group))
-		return FALSE;
-	for (auto &&grp : file_group) {
+	for (auto &&[grp, file_user] : data.groups) {
 		pabnode = ab_tree_get_abnode();
 		if (pabnode == nullptr)
 			return FALSE;
 		pabnode->node_type = abnode_type::group;
 		pabnode->id = grp.id;
 		pabnode->minid = ab_tree_make_minid(minid_type::group, grp.id);
-		auto grp_id = grp.id;
 		pabnode->d_info = new(std::nothrow) sql_group(std::move(grp));
 		if (pabnode->d_info == nullptr) {
 			delete pabnode;
@@ -313,11 +339,8 @@ static BOOL ab_tree_load_tree(int domain_id,
 		if (!ab_tree_cache_node(pbase, pabnode))
 			return false;
 		
-		std::vector<sql_user> file_user;
-		rows = system_services_get_group_users(grp_id, file_user);
-		if (rows == -1)
-			return FALSE;
-		else if (rows == 0)
+		rows = file_user.size();
+		if (rows == 0)
 			continue;
 		std::vector<sort_item> parray;
 		auto cl_array = make_scope_exit([&parray]() {
@@ -356,18 +379,15 @@ static BOOL ab_tree_load_tree(int domain_id,
 		cl_array.release();
 	}
 
-	std::vector<sql_user> file_user;
-	rows = system_services_get_domain_users(domain_id, file_user);
-	if (rows == -1)
-		return FALSE;
-	else if (rows == 0)
+	rows = data.users.size();
+	if (rows == 0)
 		return TRUE;
 	std::vector<sort_item> parray;
 	auto cl_array = make_scope_exit([&parray]() {
 		for (const auto &e : parray)
 			delete containerof(e.pnode, AB_NODE, stree);
 	});
-	for (auto &&usr : file_user) {
+	for (auto &&usr : data.users) {
 		pabnode = ab_tree_get_abnode();
 		if (pabnode == nullptr)
 			return false;
@@ -398,6 +418,9 @@ static BOOL ab_tree_load_tree(int domain_id,
 		ptree->add_child(pdomain, parray[i].pnode, SIMPLE_TREE_ADD_LAST);
 	cl_array.release();
 	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1757: ENOMEM");
+	return false;
 }
 
 static BOOL ab_tree_load_base(AB_BASE *pbase) try
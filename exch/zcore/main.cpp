@@ -54,6 +54,7 @@ decltype(system_services_auth_login) system_services_auth_login;
 decltype(system_services_auth_login_token) system_services_auth_login_token;
 #define E(s) decltype(system_services_ ## s) system_services_ ## s;
 E(check_same_org)
+E(get_domain_digest)
 E(get_domain_groups)
 E(get_domain_ids)
 E(get_domain_info)
@@ -114,6 +115,7 @@ static constexpr cfg_directive zcore_cfg_defaults[] = {
 	{"config_file_path", PKGSYSCONFDIR "/zcore:" PKGSYSCONFDIR},
 	{"data_file_path", PKGDATADIR "/zcore:" PKGDATADIR},
 	{"default_charset", "utf-8"},
+	{"gal_snapshot", "0", CFG_BOOL},
 	{"mail_max_length", "64M", CFG_SIZE, "1"},
 	{"mailbox_ping_interval", "5min", CFG_TIME, "1min", "1h"},
 	{"max_ext_rule_length", "510K", CFG_SIZE, "1"},
@@ -196,6 +198,7 @@ static int system_services_run()
 	E(system_services_get_org_domains, "get_org_domains");
 	E(system_services_get_domain_info, "get_domain_info");
 	E(system_services_get_domain_groups, "get_domain_groups");
+	E(system_services_get_domain_digest, "get_domain_digest");
 	E(system_services_get_group_users, "get_group_users");
 	E(system_services_get_domain_users, "get_domain_users");
 	E(system_services_get_mlist_ids, "get_mlist_ids");
@@ -228,6 +231,7 @@ static void system_services_stop()
 	E("get_org_domains");
 	E("get_domain_info");
 	E("get_domain_groups");
+	E("get_domain_digest");
 	E("get_group_users");
 	E("get_domain_users");
 	E("get_mlist_ids");
@@ -350,7 +354,11 @@ int main(int argc, const char **argv)
 	mlog(LV_INFO, "system: address book tree item"
 		" cache interval is %s", temp_buff);
 
-	ab_tree_init(g_config_file->get_value("x500_org_name"), table_size, cache_interval);
+	std::string gal_dir;
+	if (parse_bool(pconfig->get_value("gal_snapshot")))
+		gal_dir = std::string(g_config_file->get_value("state_path")) + "/gal";
+	ab_tree_init(g_config_file->get_value("x500_org_name"), table_size,
+		cache_interval, gal_dir.c_str());
 	auto cl_5 = make_scope_exit(ab_tree_stop);
 
 	auto max_rcpt = pconfig->get_ll("max_rcpt_num");
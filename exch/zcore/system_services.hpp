@@ -10,6 +10,7 @@ extern authmgr_login_t system_services_auth_login;
 extern authmgr_login_t2 system_services_auth_login_token;
 #define E(s) extern decltype(mysql_adaptor_ ## s) *system_services_ ## s;
 E(check_same_org)
+E(get_domain_digest)
 E(get_domain_groups)
 E(get_domain_ids)
 E(get_domain_info)
@@ -25,6 +25,7 @@ enum{
 	CUR_VALID_CONTEXTS,
 	CUR_SLEEPING_CONTEXTS,
 	CUR_SCHEDULING_CONTEXTS,
+	REACTOR_NUM,
 };
 
 #define POLLING_READ						0x1
@@ -36,10 +37,11 @@ struct schedule_context {
 	BOOL b_waiting = false; /* is still in epoll queue */
 	int polling_mask = 0;
 	unsigned int context_id = 0;
+	unsigned int reactor = 0; /* index of the reactor owning this context */
 };
 using SCHEDULE_CONTEXT = schedule_context;
 
-extern GX_EXPORT void contexts_pool_init(schedule_context **, unsigned int context_num, int (*get_socket)(const schedule_context *), gromox::time_point (*get_ts)(const schedule_context *), unsigned int contexts_per_thr, gromox::time_duration timeout);
+extern GX_EXPORT void contexts_pool_init(schedule_context **, unsigned int context_num, int (*get_socket)(const schedule_context *), gromox::time_point (*get_ts)(const schedule_context *), unsigned int contexts_per_thr, gromox::time_duration timeout, unsigned int reactors = 1);
 extern int contexts_pool_run();
 extern void contexts_pool_stop();
 SCHEDULE_CONTEXT* contexts_pool_get_context(int type);
@@ -164,6 +164,7 @@ enum class exmdb_callid : uint8_t {
 	recalc_store_size = 0x8a,
 	movecopy_folder = 0x8b,
 	create_folder = 0x8c,
+	get_metrics = 0x8d,
 	/* update exch/exmdb_provider/names.cpp:exmdb_rpc_idtoname! */
 };
 
@@ -1295,6 +1296,10 @@ struct exresp_autoreply_tsquery : public exresp {
 	uint64_t tdiff = 0;
 };
 
+struct exresp_get_metrics : public exresp {
+	char *text = nullptr;
+};
+
 using exreq_ping_store = exreq;
 using exreq_get_all_named_propids = exreq;
 using exreq_get_store_all_proptags = exreq;
@@ -1303,6 +1308,7 @@ using exreq_allocate_cn = exreq;
 using exreq_vacuum = exreq;
 using exreq_unload_store = exreq;
 using exreq_purge_datafiles = exreq;
+using exreq_get_metrics = exreq;
 using exreq_create_folder_v1 = exreq_create_folder;
 using exresp_remove_folder_properties = exresp;
 using exresp_reload_content_table = exresp;
@@ -1351,6 +1357,7 @@ extern GX_EXPORT pack_result exmdb_ext_pull_request(const BINARY *, exreq *&);
 extern GX_EXPORT pack_result exmdb_ext_push_request(const exreq *, BINARY *);
 extern GX_EXPORT pack_result exmdb_ext_pull_response(const BINARY *, exresp *);
 extern GX_EXPORT pack_result exmdb_ext_push_response(const exresp *presponse, BINARY *);
+extern GX_EXPORT pack_result exmdb_ext_push_response(const exresp *, EXT_PUSH &, uint32_t flags);
 extern GX_EXPORT pack_result exmdb_ext_pull_db_notify(const BINARY *, DB_NOTIFY_DATAGRAM *);
 extern GX_EXPORT pack_result exmdb_ext_push_db_notify(const DB_NOTIFY_DATAGRAM *, BINARY *);
 extern GX_EXPORT const char *exmdb_rpc_strerror(exmdb_response);
@@ -1,10 +1,14 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
+#include <gromox/clock.hpp>
 #include <gromox/defs.h>
 #include <gromox/element_data.hpp>
 #include <gromox/mapi_types.hpp>
 #include <gromox/util.hpp>
 
+struct sqlite3;
+
 enum { /* exmdb_server_build_env flags */
 	EM_LOCAL = 0x1,
 	EM_PRIVATE = 0x2,
@@ -43,7 +47,13 @@ extern void event_proc(const char *dir, BOOL is_table, uint32_t notify_id, const
 
 extern void *instance_read_cid_content(const char *cid, uint32_t *plen, uint32_t tag);
 extern int instance_get_message_body(MESSAGE_CONTENT *, unsigned int tag, cpid_t, TPROPVAL_ARRAY *);
+extern void instbody_presynth_enqueue(sqlite3 *, uint64_t message_id);
+extern int instbody_presynth_run();
+extern void instbody_presynth_stop();
+extern void exmdb_rpc_stat_add(uint8_t callid, gromox::time_duration, bool ok, size_t rq_bytes, size_t rsp_bytes);
+extern void exmdb_rpc_stat_set_callid(int);
+extern void exmdb_lock_stat_add(gromox::time_duration wait);
 
 extern unsigned int g_dbg_synth_content;
-extern unsigned int exmdb_body_autosynthesis;
+extern unsigned int exmdb_body_autosynthesis, exmdb_body_cache, exmdb_body_presynthesis;
 extern unsigned int exmdb_pf_read_per_user, exmdb_pf_read_states;
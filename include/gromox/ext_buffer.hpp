@@ -1,6 +1,8 @@
 #pragma once
 #include <cstddef>
 #include <cstdint>
+#include <vector>
+#include <sys/uio.h>
 #include <gromox/common_types.hpp>
 #include <gromox/defs.h>
 #include <gromox/mapi_types.hpp>
@@ -38,6 +40,8 @@ enum class pack_result {
  * 			(GetContentsTable / GetHierarchyTable)
  * %EXT_FLAG_ABK:	packed rep includes extra set/unset flags
  * %EXT_FLAG_ZCORE:	unpacked rep uses zcore types for rule element pointers
+ * %EXT_FLAG_IOVREF:	(push only) large strings/binaries are not copied, but
+ * 			referenced from EXT_PUSH::m_refs; see EXT_PUSH::get_iov
  *
  * The Exchange protocols use UTF-16, but the Gromox exmdb and zcore RPC
  * protocols use UTF-8. This may require using more than one context to process
@@ -52,6 +56,7 @@ enum {
 	EXT_FLAG_TBLLMT = 1U << 2,
 	EXT_FLAG_ABK = 1U << 3,
 	EXT_FLAG_ZCORE = 1U << 4,
+	EXT_FLAG_IOVREF = 1U << 5,
 };
 
 using EXT_BUFFER_ALLOC = void *(*)(size_t);
@@ -202,13 +207,29 @@ struct EXT_PULL {
 	uint32_t m_data_size = 0, m_offset = 0, m_flags = 0;
 };
 
+/**
+ * With pdata==nullptr, init() allocates the buffer itself; alloc_size is then
+ * taken as a hint for the initial size. Without a custom EXT_BUFFER_MGT, such
+ * buffers come from (and go back to) a small per-thread cache, see
+ * ext_pushbuf_put.
+ */
 struct EXT_PUSH {
+	/* A block of caller memory that belongs before m_udata[offset] */
+	struct ref_block {
+		uint32_t offset, size;
+		const void *data;
+	};
+
 	EXT_PUSH() = default;
 	~EXT_PUSH();
 	NOMOVE(EXT_PUSH);
 	BOOL init(void *, uint32_t, uint32_t, const EXT_BUFFER_MGT * = nullptr);
 	uint8_t *release();
 	BOOL check_ovf(uint32_t);
+	/* Size of the serialized data including referenced blocks */
+	size_t total_size() const { return m_offset + m_ref_bytes; }
+	void get_iov(std::vector<struct iovec> &) const;
+	pack_result p_ref(const void *, uint32_t);
 	pack_result advance(uint32_t);
 	pack_result p_bytes(const void *, uint32_t);
 	pack_result p_uint8(uint8_t);
@@ -293,7 +314,19 @@ struct EXT_PUSH {
 	};
 	uint32_t m_alloc_size = 0, m_offset = 0, m_flags = 0;
 	EXT_BUFFER_MGT m_mgt{};
+	bool m_pooled = false;
+	/* EXT_FLAG_IOVREF: the referenced blocks, ordered by offset */
+	std::vector<ref_block> m_refs;
+	size_t m_ref_bytes = 0;
 };
 
+/* Minimum size for a string/binary to be referenced under EXT_FLAG_IOVREF */
+static constexpr uint32_t EXT_PUSH_REF_MIN = 65536;
+
+extern void ext_pushbuf_put(void *, size_t);
+extern size_t ext_push_estimate(const TPROPVAL_ARRAY &);
+extern size_t ext_push_estimate(const TARRAY_SET &);
+extern size_t ext_push_estimate(const MESSAGE_CONTENT &);
+
 extern bool emsab_to_parts(EXT_PULL &, char *type, size_t tsize, char *addr, size_t asize);
 extern bool oneoff_to_parts(EXT_PULL &, char *type, size_t tsize, char *addr, size_t asize);
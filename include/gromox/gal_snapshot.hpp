@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+#include <gromox/defs.h>
+#include <gromox/mysql_adaptor.hpp>
+
+namespace gromox {
+
+/**
+ * Directory data of one domain, as obtained by the address books from the
+ * mysql_adaptor get_domain_info/get_domain_groups/get_group_users/
+ * get_domain_users calls.
+ */
+struct gal_domain_data {
+	sql_domain info;
+	std::vector<std::pair<sql_group, std::vector<sql_user>>> groups;
+	std::vector<sql_user> users;
+};
+
+/**
+ * Read-only view of a GAL snapshot file, a cache of the SQL results for one
+ * domain. The file consists of fixed-size records (groups, users, aliases,
+ * properties, member lists, and a user-id index) which refer to a string pool
+ * by offset, so single records can be read from the mapping. Files are
+ * replaced as a whole by rename(2); a mapping stays valid for the generation
+ * it was made from.
+ */
+class GX_EXPORT gal_snapshot {
+	public:
+	~gal_snapshot();
+	NOMOVE(gal_snapshot);
+	static std::unique_ptr<gal_snapshot> map(const char *path);
+
+	uint64_t generation() const { return m_gen; }
+	unsigned int domain_id() const { return m_domain_id; }
+	std::string_view digest() const { return m_digest; }
+	size_t user_count() const { return m_nusers; }
+	/* Index of the user with the given id, or -1 */
+	ssize_t find_user(unsigned int id) const;
+	bool decode_user(size_t idx, sql_user &) const;
+	bool decode(gal_domain_data &) const;
+
+	private:
+	gal_snapshot() = default;
+	bool validate();
+	bool str(const unsigned char *ref, std::string &) const;
+
+	const unsigned char *m_base = nullptr;
+	size_t m_size = 0;
+	uint64_t m_gen = 0;
+	unsigned int m_domain_id = 0;
+	std::string m_digest;
+	/* section offsets and record counts */
+	size_t m_ngroups = 0, m_nusers = 0, m_nmembers = 0, m_naliases = 0;
+	size_t m_nprops = 0, m_pool_size = 0, m_dom_first = 0, m_dom_count = 0;
+	const unsigned char *m_groups = nullptr, *m_users = nullptr;
+	const unsigned char *m_members = nullptr, *m_aliases = nullptr;
+	const unsigned char *m_props = nullptr, *m_idmap = nullptr;
+	const unsigned char *m_pool = nullptr, *m_dominfo = nullptr;
+};
+
+using gal_fetch_fn = std::function<bool(unsigned int domain_id, gal_domain_data &)>;
+
+extern GX_EXPORT errno_t gal_snapshot_write(const char *dir, unsigned int domain_id, uint64_t generation, std::string_view digest, const gal_domain_data &);
+extern GX_EXPORT bool gal_snapshot_obtain(const char *dir, unsigned int domain_id, const std::string &digest, const gal_fetch_fn &, gal_domain_data &);
+
+}
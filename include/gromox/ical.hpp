@@ -153,6 +153,36 @@ struct GX_EXPORT ical_rrule {
 };
 using ICAL_RRULE = ical_rrule;
 
+/**
+ * UTC offsets of a VTIMEZONE, evaluated once for the years
+ * [first_year, last_year] and kept as a sorted list of change points, so that
+ * conversions are a binary search instead of a walk over the STANDARD/DAYLIGHT
+ * rules. Results are the same as those of ical_itime_to_utc and
+ * ical_utc_to_datetime with the VTIMEZONE; times outside the span are handed
+ * to those.
+ */
+class GX_EXPORT ical_tztable {
+	public:
+	ical_tztable(const ical_component &vtz, int first_year = 1970, int last_year = 2100);
+	bool itime_to_utc(ICAL_TIME, time_t *) const;
+	bool utc_to_datetime(time_t, ICAL_TIME *) const;
+	const ical_component &vtimezone() const { return m_vtz; }
+	size_t size() const { return m_change.size(); }
+
+	private:
+	/* @offset is added to local time to get UTC; @valid=false: no rule applies */
+	struct change {
+		time_t local;
+		int offset;
+		bool valid;
+	};
+	ical_component m_vtz;
+	time_t m_first = 0, m_end = 0;
+	std::vector<change> m_change;
+	/* TZOFFSETTO of the subcomponents, up to the first unusable one */
+	std::vector<int> m_offset_to;
+};
+
 extern GX_EXPORT bool ical_parse_utc_offset(const char *str_offset, int *phour, int *pminute);
 extern GX_EXPORT bool ical_parse_date(const char *str_date, int *pyear, int *pmonth, int *pday);
 extern GX_EXPORT bool ical_parse_datetime(const char *str_datetime, bool *pb_utc, ICAL_TIME *pitime);
@@ -0,0 +1,87 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <gromox/defs.h>
+#include <gromox/mime.hpp>
+
+namespace gromox {
+
+/**
+ * Streaming decoder for the body of a MIME part. It yields the same bytes
+ * as MIME::read_content (trailing newline dropped, leading dots unstuffed,
+ * base64/quoted-printable decoded), but reads straight from the message
+ * buffer and produces output in caller-sized pieces.
+ */
+class GX_EXPORT mime_decoder {
+	public:
+	mime_decoder(std::string_view content, enum mime_encoding);
+	/* Returns the number of bytes produced; 0 means end of data. */
+	size_t read(void *buf, size_t len);
+	bool eof() const { return m_outpos == m_nout && (m_done || m_pos >= m_in.size()); }
+	/* Set when base64 input contained characters outside the alphabet */
+	bool error() const { return m_error; }
+
+	private:
+	size_t next_skip(size_t from) const;
+	size_t step_qp(char *out, size_t len);
+	size_t step_base64(char *out, size_t len);
+
+	std::string_view m_in;
+	size_t m_pos = 0, m_skip = 0;
+	enum mime_encoding m_enc;
+	unsigned char m_quad[4]{}, m_out[3]{};
+	unsigned int m_nquad = 0, m_nout = 0, m_outpos = 0;
+	bool m_done = false, m_error = false;
+};
+
+/**
+ * Read-only view of a MIME entity in a buffer that outlives it. In contrast
+ * to MIME/MAIL, construction copies nothing and only locates the header
+ * fields and the body. The parts of a multipart body, an embedded
+ * message/rfc822 and decoded content are produced only when asked for, so
+ * looking at the headers of a large message costs as much as the headers.
+ * Field lookups and the part structure follow MIME::load_from_str_move and
+ * MAIL::load_from_str_move.
+ */
+class GX_EXPORT mime_view {
+	public:
+	mime_view() = default;
+	mime_view(const char *data, size_t len);
+	mime_view(std::string_view s) : mime_view(s.data(), s.size()) {}
+
+	std::string_view raw() const { return {m_data, m_len}; }
+	std::string_view head() const { return {m_data, m_head_len}; }
+	std::string_view content() const { return {m_data + m_content_off, m_len - m_content_off}; }
+	const std::string &content_type() const { return m_ctype; }
+	bool is_multipart() const { return m_first_boundary != nullptr; }
+	bool is_message() const;
+	size_t field_count() const { return m_fields.size(); }
+	/* Unfolded value of the @order'th field named @tag */
+	bool get_field(const char *tag, std::string &value, unsigned int order = 0) const;
+	unsigned int get_field_num(const char *tag) const;
+	bool get_content_param(const char *tag, std::string &value) const;
+	enum mime_encoding encoding() const;
+	/* The parts of a multipart entity, each a view of its own */
+	std::vector<mime_view> parts() const;
+	/* The embedded message of a message/rfc822 entity (unencoded only) */
+	mime_view message() const;
+	mime_decoder decoder() const { return mime_decoder(content(), encoding()); }
+
+	private:
+	struct field {
+		size_t off, len, name_len;
+	};
+	bool locate_boundaries();
+
+	const char *m_data = nullptr;
+	size_t m_len = 0, m_head_len = 0, m_content_off = 0;
+	std::vector<field> m_fields;
+	std::string m_ctype;
+	std::vector<kvpair> m_ctparams;
+	std::string m_boundary;
+	const char *m_first_boundary = nullptr, *m_last_boundary = nullptr;
+};
+
+}
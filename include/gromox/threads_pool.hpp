@@ -1,4 +1,5 @@
 #pragma once
+#include <cstddef>
 
 enum{
 	THREADS_POOL_MIN_NUM,
@@ -43,4 +44,5 @@ extern void threads_pool_stop();
 int threads_pool_get_param(int type);
 THREADS_EVENT_PROC threads_pool_register_event_proc(THREADS_EVENT_PROC proc);
 extern void threads_pool_wakeup_thread();
+extern void threads_pool_wakeup_threads(size_t);
 extern void threads_pool_wakeup_all_threads();
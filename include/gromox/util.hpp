@@ -2,6 +2,7 @@
 #include <atomic>
 #include <cstdint>
 #include <ctime>
+#include <iconv.h>
 #include <memory>
 #include <string>
 #include <vector>
@@ -109,6 +110,11 @@ extern GX_EXPORT size_t utf8_to_mb_len(const char *);
 extern GX_EXPORT size_t utf8_to_utf16_len(const char *);
 inline size_t utf16_to_utf8_len(size_t z) { return z / 2 * 3 + 1; }
 extern GX_EXPORT int iconv_validate();
+extern GX_EXPORT iconv_t iconv_cached(const char *to, const char *from);
+extern GX_EXPORT unsigned int codec_simd_level(unsigned int cap);
+extern GX_EXPORT bool str_isascii(const char *, size_t);
+extern GX_EXPORT bool cset_ascii_compatible(const char *);
+extern GX_EXPORT ssize_t sbcs_to_utf8(const char *cs, const char *in, size_t inlen, char *out, size_t outmax, bool skip);
 extern GX_EXPORT const std::string *ianatz_to_tzdef(const char *, const char * = nullptr);
 extern GX_EXPORT const std::string *wintz_to_tzdef(const char *, const char * = nullptr);
 extern GX_EXPORT bool get_digest(const char *src, const char *tag, char *out, size_t outmax);
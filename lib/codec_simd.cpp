@@ -0,0 +1,355 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+/*
+ * Base64 kernels after W. Muła and D. Lemire, "Faster Base64 Encoding and
+ * Decoding Using AVX2 Instructions" (2018) and the aklomp/base64 library.
+ */
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <gromox/util.hpp>
+#include "codec_simd.hpp"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define HAVE_X86_SIMD 1
+#	include <immintrin.h>
+#	define TGT_SSE __attribute__((target("sse4.1")))
+#	define TGT_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace {
+
+struct codec_ops {
+	size_t (*b64_enc)(const uint8_t *, size_t, char *);
+	size_t (*b64_dec)(const char *, size_t, uint8_t *);
+	size_t (*qp_plain)(const char *, size_t);
+	size_t (*qp_literal)(const char *, size_t, bool);
+};
+
+}
+
+static std::atomic<unsigned int> g_simd_cap{UINT_MAX};
+
+static size_t b64_enc_none(const uint8_t *, size_t, char *)
+{
+	return 0;
+}
+
+static size_t b64_dec_none(const char *, size_t, uint8_t *)
+{
+	return 0;
+}
+
+/*
+ * The scalar variants do nothing, which leaves util.cpp running its original
+ * byte-at-a-time loops.
+ */
+static size_t qp_plain_none(const char *, size_t)
+{
+	return 0;
+}
+
+static size_t qp_literal_none(const char *, size_t, bool)
+{
+	return 0;
+}
+
+#ifdef HAVE_X86_SIMD
+static inline bool qp_is_plain(unsigned char c)
+{
+	return c >= 0x20 && c <= 0x7E && c != '=';
+}
+
+static size_t qp_plain_tail(const char *in, size_t z)
+{
+	size_t i = 0;
+	while (i < z && qp_is_plain(in[i]))
+		++i;
+	return i;
+}
+
+static size_t qp_literal_tail(const char *in, size_t z, bool mime)
+{
+	size_t i = 0;
+	while (i < z && in[i] != '=' && (!mime || in[i] != '_'))
+		++i;
+	return i;
+}
+
+TGT_SSE static inline __m128i b64_enc_reg(__m128i in)
+{
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+	     4, 5, 3, 4, 1, 2, 0, 1));
+	auto t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	auto t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	auto t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	auto t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	auto idx = _mm_or_si128(t1, t3);
+	/* 6-bit indices to ASCII */
+	auto r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+	auto lt = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+	r = _mm_or_si128(r, _mm_and_si128(lt, _mm_set1_epi8(13)));
+	auto shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+	             '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	             '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	return _mm_add_epi8(_mm_shuffle_epi8(shift, r), idx);
+}
+
+TGT_AVX2 static inline __m256i b64_enc_reg(__m256i in)
+{
+	in = _mm256_shuffle_epi8(in, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+	     4, 5, 3, 4, 1, 2, 0, 1, 10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4,
+	     1, 2, 0, 1));
+	auto t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+	auto t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+	auto t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+	auto t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+	auto idx = _mm256_or_si256(t1, t3);
+	auto r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+	auto lt = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+	r = _mm256_or_si256(r, _mm256_and_si256(lt, _mm256_set1_epi8(13)));
+	auto shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+	             '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	             '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+	             'a' - 26, '0' - 52, '0' - 52, '0' - 52,
+	             '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	             '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	return _mm256_add_epi8(_mm256_shuffle_epi8(shift, r), idx);
+}
+
+/*
+ * Translate 16 base64 characters to 6-bit values in place. Returns false if
+ * any byte is not in the base64 alphabet.
+ */
+TGT_SSE static inline bool b64_dec_reg(__m128i &v)
+{
+	auto lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	              0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	auto lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04,
+	              0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	auto lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+	                0, 0, 0, 0, 0, 0, 0, 0);
+	auto m2f = _mm_set1_epi8(0x2F);
+	auto hi = _mm_and_si128(_mm_srli_epi32(v, 4), m2f);
+	auto lo = _mm_and_si128(v, m2f);
+	auto bad = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo),
+	           _mm_shuffle_epi8(lut_hi, hi));
+	if (_mm_movemask_epi8(_mm_cmpgt_epi8(bad, _mm_setzero_si128())) != 0)
+		return false;
+	auto roll = _mm_shuffle_epi8(lut_roll,
+	            _mm_add_epi8(_mm_cmpeq_epi8(v, m2f), hi));
+	v = _mm_add_epi8(v, roll);
+	/* pack 4x6 bits into 3 bytes, 12 bytes at the start of the register */
+	v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+	v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+	v = _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+	    14, 13, 12, -1, -1, -1, -1));
+	return true;
+}
+
+TGT_AVX2 static inline bool b64_dec_reg(__m256i &v)
+{
+	auto lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	              0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+	              0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	              0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	auto lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04,
+	              0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	              0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04,
+	              0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	auto lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+	                0, 0, 0, 0, 0, 0, 0, 0, 0, 16, 19, 4, -65, -65, -71, -71,
+	                0, 0, 0, 0, 0, 0, 0, 0);
+	auto m2f = _mm256_set1_epi8(0x2F);
+	auto hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), m2f);
+	auto lo = _mm256_and_si256(v, m2f);
+	auto bad = _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo),
+	           _mm256_shuffle_epi8(lut_hi, hi));
+	if (!_mm256_testz_si256(bad, bad))
+		return false;
+	auto roll = _mm256_shuffle_epi8(lut_roll,
+	            _mm256_add_epi8(_mm256_cmpeq_epi8(v, m2f), hi));
+	v = _mm256_add_epi8(v, roll);
+	v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+	v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+	v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+	    14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6, 5, 4, 10, 9, 8,
+	    14, 13, 12, -1, -1, -1, -1));
+	return true;
+}
+
+TGT_SSE static inline size_t b64_enc_sse(const uint8_t *in, size_t inlen, char *out)
+{
+	size_t done = 0;
+	for (; inlen - done >= 16; done += 12, out += 16) {
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&in[done]));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out), b64_enc_reg(v));
+	}
+	return done;
+}
+
+TGT_AVX2 static size_t b64_enc_avx2(const uint8_t *in, size_t inlen, char *out)
+{
+	size_t done = 0;
+	for (; inlen - done >= 28; done += 24, out += 32) {
+		auto lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&in[done]));
+		auto hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&in[done+12]));
+		auto v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(out), b64_enc_reg(v));
+	}
+	return done + b64_enc_sse(&in[done], inlen - done, out);
+}
+
+TGT_SSE static inline size_t b64_dec_sse(const char *in, size_t inlen, uint8_t *out)
+{
+	size_t done = 0;
+	for (; inlen - done >= 16; done += 16, out += 12) {
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&in[done]));
+		if (!b64_dec_reg(v))
+			break;
+		uint8_t tmp[16];
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(tmp), v);
+		memcpy(out, tmp, 12);
+	}
+	return done;
+}
+
+TGT_AVX2 static size_t b64_dec_avx2(const char *in, size_t inlen, uint8_t *out)
+{
+	size_t done = 0;
+	for (; inlen - done >= 32; done += 32, out += 24) {
+		auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&in[done]));
+		if (!b64_dec_reg(v))
+			break;
+		uint8_t tmp[32];
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(tmp), v);
+		memcpy(out, tmp, 12);
+		memcpy(out + 12, tmp + 16, 12);
+	}
+	return done + b64_dec_sse(&in[done], inlen - done, out);
+}
+
+TGT_SSE static inline size_t qp_plain_sse(const char *in, size_t z)
+{
+	size_t i = 0;
+	for (; z - i >= 16; i += 16) {
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&in[i]));
+		auto ok = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1F)),
+		          _mm_cmplt_epi8(v, _mm_set1_epi8(0x7F)));
+		ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('=')), ok);
+		unsigned int m = ~_mm_movemask_epi8(ok) & 0xFFFF;
+		if (m != 0)
+			return i + __builtin_ctz(m);
+	}
+	return i + qp_plain_tail(&in[i], z - i);
+}
+
+TGT_AVX2 static size_t qp_plain_avx2(const char *in, size_t z)
+{
+	size_t i = 0;
+	for (; z - i >= 32; i += 32) {
+		auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&in[i]));
+		auto ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(0x1F)),
+		          _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7F), v));
+		ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('=')), ok);
+		auto m = ~static_cast<uint32_t>(_mm256_movemask_epi8(ok));
+		if (m != 0)
+			return i + __builtin_ctz(m);
+	}
+	return i + qp_plain_sse(&in[i], z - i);
+}
+
+TGT_SSE static inline size_t qp_literal_sse(const char *in, size_t z, bool mime)
+{
+	size_t i = 0;
+	auto eq = _mm_set1_epi8('='), us = _mm_set1_epi8(mime ? '_' : '=');
+	for (; z - i >= 16; i += 16) {
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&in[i]));
+		auto m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, eq),
+		         _mm_cmpeq_epi8(v, us)));
+		if (m != 0)
+			return i + __builtin_ctz(m);
+	}
+	return i + qp_literal_tail(&in[i], z - i, mime);
+}
+
+TGT_AVX2 static size_t qp_literal_avx2(const char *in, size_t z, bool mime)
+{
+	size_t i = 0;
+	auto eq = _mm256_set1_epi8('='), us = _mm256_set1_epi8(mime ? '_' : '=');
+	for (; z - i >= 32; i += 32) {
+		auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&in[i]));
+		auto m = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(
+		         _mm256_cmpeq_epi8(v, eq), _mm256_cmpeq_epi8(v, us))));
+		if (m != 0)
+			return i + __builtin_ctz(m);
+	}
+	return i + qp_literal_sse(&in[i], z - i, mime);
+}
+#endif
+
+static constexpr codec_ops g_codec_ops[] = {
+	{b64_enc_none, b64_dec_none, qp_plain_none, qp_literal_none},
+#ifdef HAVE_X86_SIMD
+	{b64_enc_sse, b64_dec_sse, qp_plain_sse, qp_literal_sse},
+	{b64_enc_avx2, b64_dec_avx2, qp_plain_avx2, qp_literal_avx2},
+#endif
+};
+
+static unsigned int codec_detect()
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return 2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return 1;
+#endif
+	return 0;
+}
+
+static unsigned int codec_best()
+{
+	static const unsigned int best = codec_detect();
+	return best;
+}
+
+static inline const codec_ops &codec_get()
+{
+	return g_codec_ops[std::min(codec_best(), g_simd_cap.load(std::memory_order_relaxed))];
+}
+
+namespace gromox {
+
+/**
+ * Cap the instruction set used by the base64/QP codecs (0: scalar,
+ * 1: SSE4.1, 2: AVX2) and return the level now in effect.
+ * Meant for tests and benchmarks.
+ */
+unsigned int codec_simd_level(unsigned int cap)
+{
+	g_simd_cap = cap;
+	return std::min(codec_best(), cap);
+}
+
+size_t b64_encode_blocks(const uint8_t *in, size_t inlen, char *out)
+{
+	return codec_get().b64_enc(in, inlen, out);
+}
+
+size_t b64_decode_blocks(const char *in, size_t inlen, uint8_t *out)
+{
+	return codec_get().b64_dec(in, inlen, out);
+}
+
+size_t qp_plain_span(const char *in, size_t inlen)
+{
+	return codec_get().qp_plain(in, inlen);
+}
+
+size_t qp_literal_span(const char *in, size_t inlen, bool mime)
+{
+	return codec_get().qp_literal(in, inlen, mime);
+}
+
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Vectorized inner loops for the base64 and quoted-printable codecs in
+ * util.cpp. The callers keep all the framing (line wrapping, padding,
+ * whitespace, soft breaks); these only process runs of input that need no
+ * special treatment, and may process nothing at all (scalar fallback).
+ */
+namespace gromox {
+
+/*
+ * Encode whole 3-byte groups of @in to @out. Returns the number of input
+ * bytes consumed (a multiple of 12, possibly 0). Up to 4 bytes past the
+ * consumed part of @in may be read, but never beyond @inlen.
+ */
+extern size_t b64_encode_blocks(const uint8_t *in, size_t inlen, char *out);
+/*
+ * Decode leading runs of 16 base64 alphabet characters (no padding,
+ * whitespace or other bytes) from @in. Returns the number of characters
+ * consumed (a multiple of 16); exactly 3/4 of that is written to @out.
+ */
+extern size_t b64_decode_blocks(const char *in, size_t inlen, uint8_t *out);
+/*
+ * Length of the leading run of @in consisting of bytes that qp_encode_ex
+ * emits verbatim (0x20..0x7E except '='). The scalar variant returns 0.
+ */
+extern size_t qp_plain_span(const char *in, size_t inlen);
+/*
+ * Length of the leading run of @in without '=' (and without '_' if @mime),
+ * i.e. bytes that qp_decode passes through unchanged. The scalar variant
+ * returns 0.
+ */
+extern size_t qp_literal_span(const char *in, size_t inlen, bool mime);
+
+}
@@ -2,11 +2,14 @@
 #ifdef HAVE_CONFIG_H
 #	include "config.h"
 #endif
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 #include <mutex>
 #include <pthread.h>
 #include <unistd.h>
@@ -45,14 +48,26 @@ struct evqueue {
 	errno_t del(SCHEDULE_CONTEXT *);
 	void reset();
 };
+
+/*
+ * Each reactor owns an event queue, the thread waiting on it, and the
+ * POLLING/TURNING queues of the contexts assigned to it. The FREE, IDLING
+ * and SLEEPING queues are shared by all reactors.
+ */
+struct reactor {
+	evqueue poll_ctx;
+	pthread_t thread_id{};
+	DOUBLE_LIST polling_list{}, turning_list{};
+	std::mutex polling_lock, turning_lock;
+};
 }
 
 static time_duration g_time_out;
-static unsigned int g_context_num, g_contexts_per_thr;
-static evqueue g_poll_ctx;
+static unsigned int g_context_num, g_contexts_per_thr, g_reactor_num;
+static std::unique_ptr<reactor[]> g_reactors;
+static std::atomic<unsigned int> g_next_reactor, g_rr_reactor;
 static pthread_t g_scan_id;
 static SCHEDULE_CONTEXT **g_context_ptr;
-static pthread_t g_thread_id;
 static gromox::atomic_bool g_notify_stop{true};
 static DOUBLE_LIST g_context_lists[CONTEXT_TYPES];
 static std::mutex g_context_locks[CONTEXT_TYPES];
@@ -150,6 +165,24 @@ errno_t evqueue::del(SCHEDULE_CONTEXT *ctx)
 #endif
 }
 
+static DOUBLE_LIST &ctx_list(unsigned int r, int type)
+{
+	if (type == CONTEXT_POLLING)
+		return g_reactors[r].polling_list;
+	else if (type == CONTEXT_TURNING)
+		return g_reactors[r].turning_list;
+	return g_context_lists[type];
+}
+
+static std::mutex &ctx_lock(unsigned int r, int type)
+{
+	if (type == CONTEXT_POLLING)
+		return g_reactors[r].polling_lock;
+	else if (type == CONTEXT_TURNING)
+		return g_reactors[r].turning_lock;
+	return g_context_locks[type];
+}
+
 static void context_init(SCHEDULE_CONTEXT *pcontext)
 {
 	if (NULL == pcontext) {
@@ -157,6 +190,7 @@ static void context_init(SCHEDULE_CONTEXT *pcontext)
 		return;
 	}
 	pcontext->type = CONTEXT_FREE;
+	pcontext->reactor = 0;
 	pcontext->node.pdata = pcontext;
 }
 
@@ -184,9 +218,14 @@ int contexts_pool_get_param(int type)
 	case CUR_SLEEPING_CONTEXTS:
 		return double_list_get_nodes_num(
 			&g_context_lists[CONTEXT_SLEEPING]);
-	case CUR_SCHEDULING_CONTEXTS:
-		return double_list_get_nodes_num(
-			&g_context_lists[CONTEXT_TURNING]);
+	case CUR_SCHEDULING_CONTEXTS: {
+		size_t num = 0;
+		for (size_t r = 0; r < g_reactor_num; ++r)
+			num += double_list_get_nodes_num(&g_reactors[r].turning_list);
+		return num;
+	}
+	case REACTOR_NUM:
+		return g_reactor_num;
 	default:
 		return -1;
 	}
@@ -194,14 +233,15 @@ int contexts_pool_get_param(int type)
 
 static void *ctxp_thrwork(void *pparam)
 {
+	auto &rt = *static_cast<reactor *>(pparam);
 	while (!g_notify_stop) {
-		auto num = g_poll_ctx.wait();
+		auto num = rt.poll_ctx.wait();
 		if (num <= 0) {
 			continue;
 		}
 		for (unsigned int i = 0; i < static_cast<unsigned int>(num); ++i) {
-			auto pcontext = g_poll_ctx.get_data(i);
-			std::unique_lock poll_hold(g_context_locks[CONTEXT_POLLING]);
+			auto pcontext = rt.poll_ctx.get_data(i);
+			std::unique_lock poll_hold(rt.polling_lock);
 			if (CONTEXT_POLLING != pcontext->type) {
 				/* context may be waked up and modified by
 				scan_work_func or context_pool_activate_context */
@@ -213,60 +253,59 @@ static void *ctxp_thrwork(void *pparam)
 					" context: %p", pcontext);
 				continue;
 			}
-			double_list_remove(&g_context_lists[CONTEXT_POLLING],
-				&pcontext->node);
+			double_list_remove(&rt.polling_list, &pcontext->node);
 			pcontext->type = CONTEXT_SWITCHING;
 			poll_hold.unlock();
 			contexts_pool_put_context(pcontext, CONTEXT_TURNING);
 		}
-		if (1 == num) {
-			threads_pool_wakeup_thread();
-		} else {
-			threads_pool_wakeup_all_threads();
-		}
+		threads_pool_wakeup_threads(num);
 	}
 	return nullptr;
 }
 
+/* move timed-out and dequeued contexts of one reactor to @temp_list */
+static void ctxp_scan_polling(reactor &rt, DOUBLE_LIST *temp_list)
+{
+	DOUBLE_LIST_NODE *pnode;
+	std::unique_lock poll_hold(rt.polling_lock);
+	auto current_time = tp_now();
+	auto ptail = double_list_get_tail(&rt.polling_list);
+	while ((pnode = double_list_pop_front(&rt.polling_list)) != nullptr) {
+		auto pcontext = static_cast<SCHEDULE_CONTEXT *>(pnode->pdata);
+		if (!pcontext->b_waiting) {
+			pcontext->type = CONTEXT_SWITCHING;
+			double_list_append_as_tail(temp_list, pnode);
+			goto CHECK_TAIL;
+		}
+		if (current_time - contexts_pool_get_context_timestamp(pcontext) >= g_time_out) {
+			if (rt.poll_ctx.del(pcontext) != 0) {
+				mlog(LV_DEBUG, "contexts_pool: failed to remove event from epoll");
+			} else {
+				pcontext->b_waiting = FALSE;
+				pcontext->type = CONTEXT_SWITCHING;
+				double_list_append_as_tail(temp_list, pnode);
+				goto CHECK_TAIL;
+			}
+		}
+		double_list_append_as_tail(&rt.polling_list, pnode);
+ CHECK_TAIL:
+		if (pnode == ptail) {
+			break;
+		}
+	}
+}
+
 static void *ctxp_scanwork(void *pparam)
 {
 	int num;
 	DOUBLE_LIST temp_list;
 	DOUBLE_LIST_NODE *pnode;
-	DOUBLE_LIST_NODE *ptail;
 	SCHEDULE_CONTEXT *pcontext;
 	
 	double_list_init(&temp_list);
 	while (!g_notify_stop) {
-		std::unique_lock poll_hold(g_context_locks[CONTEXT_POLLING]);
-		auto current_time = tp_now();
-		ptail = double_list_get_tail(
-			&g_context_lists[CONTEXT_POLLING]);
-		while ((pnode = double_list_pop_front(&g_context_lists[CONTEXT_POLLING])) != nullptr) {
-			pcontext = (SCHEDULE_CONTEXT*)pnode->pdata;
-			if (!pcontext->b_waiting) {
-				pcontext->type = CONTEXT_SWITCHING;
-				double_list_append_as_tail(&temp_list, pnode);
-				goto CHECK_TAIL;
-			}
-			if (current_time - contexts_pool_get_context_timestamp(pcontext) >= g_time_out) {
-				if (g_poll_ctx.del(pcontext) != 0) {
-					mlog(LV_DEBUG, "contexts_pool: failed to remove event from epoll");
-				} else {
-					pcontext->b_waiting = FALSE;
-					pcontext->type = CONTEXT_SWITCHING;
-					double_list_append_as_tail(&temp_list, pnode);
-					goto CHECK_TAIL;
-				}
-			}
-			double_list_append_as_tail(
-				&g_context_lists[CONTEXT_POLLING], pnode);
- CHECK_TAIL:
-			if (pnode == ptail) {
-				break;
-			}
-		}
-		poll_hold.unlock();
+		for (size_t r = 0; r < g_reactor_num; ++r)
+			ctxp_scan_polling(g_reactors[r], &temp_list);
 		std::unique_lock idle_hold(g_context_locks[CONTEXT_IDLING]);
 		while ((pnode = double_list_pop_front(&g_context_lists[CONTEXT_IDLING])) != nullptr) {
 			pcontext = (SCHEDULE_CONTEXT*)pnode->pdata;
@@ -275,19 +314,15 @@ static void *ctxp_scanwork(void *pparam)
 		}
 		idle_hold.unlock();
 		num = 0;
-		std::unique_lock turn_hold(g_context_locks[CONTEXT_TURNING]);
 		while ((pnode = double_list_pop_front(&temp_list)) != nullptr) {
-			((SCHEDULE_CONTEXT*)pnode->pdata)->type = CONTEXT_TURNING;
-			double_list_append_as_tail(
-				&g_context_lists[CONTEXT_TURNING], pnode);
+			pcontext = static_cast<SCHEDULE_CONTEXT *>(pnode->pdata);
+			auto &rt = g_reactors[pcontext->reactor];
+			std::lock_guard turn_hold(rt.turning_lock);
+			pcontext->type = CONTEXT_TURNING;
+			double_list_append_as_tail(&rt.turning_list, pnode);
 			num ++;
 		}
-		turn_hold.unlock();
-		if (1 == num) {
-			threads_pool_wakeup_thread();
-		} else if (num > 1) {
-			threads_pool_wakeup_all_threads();
-		}
+		threads_pool_wakeup_threads(num);
 		sleep(1);
 	}
 	double_list_free(&temp_list);
@@ -297,9 +332,21 @@ static void *ctxp_scanwork(void *pparam)
 void contexts_pool_init(SCHEDULE_CONTEXT **pcontexts, unsigned int context_num,
     int (*get_socket)(const schedule_context *),
     time_point (*get_timestamp)(const schedule_context *),
-    unsigned int contexts_per_thr, time_duration timeout)
+    unsigned int contexts_per_thr, time_duration timeout, unsigned int reactors) try
 {
 	setup_sigalrm();
+	if (reactors == 0) {
+		auto ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		reactors = ncpu > 0 ? ncpu : 1;
+	}
+	if (reactors > context_num)
+		reactors = std::max(context_num, 1U);
+	g_reactor_num = reactors;
+	g_reactors = std::make_unique<reactor[]>(reactors);
+	for (size_t r = 0; r < reactors; ++r) {
+		double_list_init(&g_reactors[r].polling_list);
+		double_list_init(&g_reactors[r].turning_list);
+	}
 	g_context_ptr = pcontexts;
 	g_context_num = context_num;
 	contexts_pool_get_context_socket = get_socket;
@@ -314,31 +361,58 @@ void contexts_pool_init(SCHEDULE_CONTEXT **pcontexts, unsigned int context_num,
 		double_list_append_as_tail(
 			&g_context_lists[CONTEXT_FREE], &pcontext->node);
 	}
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1221: ENOMEM");
+	g_reactor_num = 0;
+}
+
+static void ctxp_stop_reactors()
+{
+	for (size_t r = 0; r < g_reactor_num; ++r)
+		if (!pthread_equal(g_reactors[r].thread_id, {}))
+			pthread_kill(g_reactors[r].thread_id, SIGALRM);
+	for (size_t r = 0; r < g_reactor_num; ++r) {
+		if (!pthread_equal(g_reactors[r].thread_id, {}))
+			pthread_join(g_reactors[r].thread_id, NULL);
+		g_reactors[r].thread_id = {};
+	}
 }
 
 int contexts_pool_run()
 {    
-	auto ret = g_poll_ctx.init(g_context_num);
-	if (ret != 0) {
-		mlog(LV_ERR, "contexts_pool: evqueue: %s", strerror(ret));
+	if (g_reactor_num == 0)
 		return -1;
+	unsigned int events_per_reactor = (g_context_num + g_reactor_num - 1) / g_reactor_num;
+	for (size_t r = 0; r < g_reactor_num; ++r) {
+		auto ret = g_reactors[r].poll_ctx.init(events_per_reactor);
+		if (ret != 0) {
+			mlog(LV_ERR, "contexts_pool: evqueue: %s", strerror(ret));
+			return -1;
+		}
 	}
 	g_notify_stop = false;
-	ret = pthread_create4(&g_thread_id, nullptr, ctxp_thrwork, nullptr);
-	if (ret != 0) {
-		mlog(LV_ERR, "contexts_pool: failed to create epoll thread: %s", strerror(ret));
-		g_notify_stop = true;
-		return -3;
+	for (size_t r = 0; r < g_reactor_num; ++r) {
+		auto ret = pthread_create4(&g_reactors[r].thread_id, nullptr,
+		           ctxp_thrwork, &g_reactors[r]);
+		if (ret != 0) {
+			mlog(LV_ERR, "contexts_pool: failed to create epoll thread: %s", strerror(ret));
+			g_notify_stop = true;
+			ctxp_stop_reactors();
+			return -3;
+		}
+		if (g_reactor_num == 1) {
+			pthread_setname_np(g_reactors[r].thread_id, "epollctx/work");
+		} else {
+			char buf[32];
+			snprintf(buf, sizeof(buf), "epollctx/%zu", r);
+			pthread_setname_np(g_reactors[r].thread_id, buf);
+		}
 	}
-	pthread_setname_np(g_thread_id, "epollctx/work");
-	ret = pthread_create4(&g_scan_id, nullptr, ctxp_scanwork, nullptr);
+	auto ret = pthread_create4(&g_scan_id, nullptr, ctxp_scanwork, nullptr);
 	if (ret != 0) {
 		mlog(LV_ERR, "contexts_pool: failed to create scan thread: %s", strerror(ret));
 		g_notify_stop = true;
-		if (!pthread_equal(g_thread_id, {})) {
-			pthread_kill(g_thread_id, SIGALRM);
-			pthread_join(g_thread_id, NULL);
-		}
+		ctxp_stop_reactors();
 		return -4;
 	}
 	pthread_setname_np(g_scan_id, "epollctx/scan");
@@ -348,15 +422,18 @@ int contexts_pool_run()
 void contexts_pool_stop()
 {
 	g_notify_stop = true;
-	if (!pthread_equal(g_thread_id, {}))
-		pthread_kill(g_thread_id, SIGALRM);
 	if (!pthread_equal(g_scan_id, {}))
 		pthread_kill(g_scan_id, SIGALRM);
-	if (!pthread_equal(g_thread_id, {}))
-		pthread_join(g_thread_id, NULL);
+	ctxp_stop_reactors();
 	if (!pthread_equal(g_scan_id, {}))
 		pthread_join(g_scan_id, NULL);
-	g_poll_ctx.reset();
+	for (size_t r = 0; r < g_reactor_num; ++r) {
+		g_reactors[r].poll_ctx.reset();
+		double_list_free(&g_reactors[r].polling_list);
+		double_list_free(&g_reactors[r].turning_list);
+	}
+	g_reactors.reset();
+	g_reactor_num = 0;
 	for (size_t i = 0; i < g_context_num; ++i)
 		context_free(g_context_ptr[i]);
 	for (size_t i = CONTEXT_BEGIN; i < CONTEXT_TYPES; ++i)
@@ -366,6 +443,25 @@ void contexts_pool_stop()
 	g_contexts_per_thr = 0;
 }
 
+/*
+ * Place new connections on the reactor of the CPU that received them, which
+ * keeps a connection's softirq, epoll and socket buffers on one core when
+ * RSS/RPS spreads the NIC queues. Fall back to round-robin.
+ */
+static unsigned int ctxp_pick_reactor(const SCHEDULE_CONTEXT *pcontext)
+{
+	if (g_reactor_num == 1)
+		return 0;
+#ifdef SO_INCOMING_CPU
+	int cpu = -1;
+	socklen_t optlen = sizeof(cpu);
+	if (getsockopt(contexts_pool_get_context_socket(pcontext), SOL_SOCKET,
+	    SO_INCOMING_CPU, &cpu, &optlen) == 0 && cpu >= 0)
+		return static_cast<unsigned int>(cpu) % g_reactor_num;
+#endif
+	return g_rr_reactor++ % g_reactor_num;
+}
+
 /*
  *	@param    
  *		type	type can only be one of CONTEXT_FREE OR CONTEXT_TURNING
@@ -375,13 +471,27 @@ void contexts_pool_stop()
 SCHEDULE_CONTEXT* contexts_pool_get_context(int type)
 {
 	DOUBLE_LIST_NODE *pnode;
-	if (CONTEXT_FREE != type && CONTEXT_TURNING != type) {
+	if (CONTEXT_FREE == type) {
+		std::lock_guard xhold(g_context_locks[type]);
+		pnode = double_list_pop_front(&g_context_lists[type]);
+		/* do not change context type under this circumstance */
+		return pnode != nullptr ? static_cast<SCHEDULE_CONTEXT *>(pnode->pdata) : nullptr;
+	} else if (CONTEXT_TURNING != type) {
 		return NULL;
 	}
-	std::lock_guard xhold(g_context_locks[type]);
-	pnode = double_list_pop_front(&g_context_lists[type]);
-	/* do not change context type under this circumstance */
-	return pnode != nullptr ? static_cast<SCHEDULE_CONTEXT *>(pnode->pdata) : nullptr;
+	/*
+	 * Each pool thread drains the run queue of "its" reactor first and
+	 * only then looks at the other ones.
+	 */
+	static thread_local unsigned int home = g_next_reactor++;
+	for (size_t i = 0; i < g_reactor_num; ++i) {
+		auto &rt = g_reactors[(home + i) % g_reactor_num];
+		std::lock_guard xhold(rt.turning_lock);
+		pnode = double_list_pop_front(&rt.turning_list);
+		if (pnode != nullptr)
+			return static_cast<SCHEDULE_CONTEXT *>(pnode->pdata);
+	}
+	return nullptr;
 }
 
 /*
@@ -409,21 +519,24 @@ void contexts_pool_put_context(SCHEDULE_CONTEXT *pcontext, int type)
 		return;
 	}
 	
+	if (pcontext->type == CONTEXT_CONSTRUCTING)
+		pcontext->reactor = ctxp_pick_reactor(pcontext);
+	auto &rt = g_reactors[pcontext->reactor];
 	/* append the context at the tail of the corresponding list */
-	std::lock_guard xhold(g_context_locks[type]);
+	std::lock_guard xhold(ctx_lock(pcontext->reactor, type));
 	auto original_type = pcontext->type;
 	pcontext->type = type;
 	if (CONTEXT_POLLING == type) {
 		if (original_type == CONTEXT_CONSTRUCTING) {
-			if (g_poll_ctx.mod(pcontext, true) != 0) {
+			if (rt.poll_ctx.mod(pcontext, true) != 0) {
 				pcontext->b_waiting = FALSE;
 				mlog(LV_DEBUG, "contexts_pool: failed to add event to epoll");
 			} else {
 				pcontext->b_waiting = TRUE;
 			}
-		} else if (g_poll_ctx.mod(pcontext, false) != 0) {
+		} else if (rt.poll_ctx.mod(pcontext, false) != 0) {
 			int se = errno;
-			if (errno == ENOENT && g_poll_ctx.mod(pcontext, true) != 0) {
+			if (se == ENOENT && rt.poll_ctx.mod(pcontext, true) == 0) {
 				/* sometimes, fd will be removed by scanning
 				thread because of timeout, add it back
 				into epoll queue again */
@@ -441,7 +554,7 @@ void contexts_pool_put_context(SCHEDULE_CONTEXT *pcontext, int type)
 				no need to call epoll_ctl with EPOLL_CTL_DEL */
 			pcontext->b_waiting = FALSE;
 	}
-	double_list_append_as_tail(&g_context_lists[type], &pcontext->node);
+	double_list_append_as_tail(&ctx_list(pcontext->reactor, type), &pcontext->node);
 }
 
 void contexts_pool_signal(SCHEDULE_CONTEXT *pcontext)
@@ -500,18 +613,17 @@ BOOL contexts_pool_wakeup_context(SCHEDULE_CONTEXT *pcontext, int type)
  */
 void context_pool_activate_context(SCHEDULE_CONTEXT *pcontext)
 {
-	std::unique_lock poll_hold(g_context_locks[CONTEXT_POLLING]);
+	auto &rt = g_reactors[pcontext->reactor];
+	std::unique_lock poll_hold(rt.polling_lock);
 	if (CONTEXT_POLLING != pcontext->type) {
 		return;
 	}
-	double_list_remove(&g_context_lists[CONTEXT_POLLING], &pcontext->node);
+	double_list_remove(&rt.polling_list, &pcontext->node);
 	pcontext->type = CONTEXT_SWITCHING;
 	poll_hold.unlock();
-	std::unique_lock turn_hold(g_context_locks[CONTEXT_TURNING]);
+	std::unique_lock turn_hold(rt.turning_lock);
 	pcontext->type = CONTEXT_TURNING;
-	double_list_append_as_tail(
-		&g_context_lists[CONTEXT_TURNING],
-		&pcontext->node);
+	double_list_append_as_tail(&rt.turning_list, &pcontext->node);
 	turn_hold.unlock();
 	threads_pool_wakeup_thread();
 }
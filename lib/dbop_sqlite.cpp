@@ -527,6 +527,16 @@ static constexpr char tbl_midb_mapping_0[] =
 "  mid_string TEXT NOT NULL,"
 "  flag_string TEXT)";
 
+/* Binary copies of ext/ digests (cf. json_to_bin) */
+static constexpr char tbl_midb_digests_2[] =
+"CREATE TABLE digests ("
+"  mid_string TEXT PRIMARY KEY,"
+"  digest BLOB NOT NULL,"
+"  FOREIGN KEY (mid_string)"
+"  	REFERENCES messages (mid_string)"
+"  	ON DELETE CASCADE"
+"  	ON UPDATE CASCADE)";
+
 static constexpr tbl_init tbl_midb_init_0[] = {
 	{"configurations", tbl_config_0},
 	{"folders", tbl_midb_folders_0},
@@ -540,6 +550,7 @@ static constexpr tbl_init tbl_midb_init_top[] = {
 	{"folders", tbl_midb_folders_0},
 	{"messages", tbl_midb_msgs_0},
 	{"mapping", tbl_midb_mapping_0},
+	{"digests", tbl_midb_digests_2},
 	TABLE_END,
 };
 
@@ -583,6 +594,7 @@ static constexpr tblite_upgradefn tbl_pub_upgrade_list[] = {
 
 static constexpr tblite_upgradefn tbl_midb_upgrade_list[] = {
 	{1, nullptr, "configurations", tbl_config_1, tbl_config_move1},
+	{2, tbl_midb_digests_2},
 	TABLE_END,
 };
 
@@ -635,6 +647,13 @@ int dbop_sqlite_create(sqlite3 *db, sqlite_kind k, unsigned int flags)
 	default:
 		return -EINVAL;
 	}
+	/*
+	 * Must precede table creation. Lets exmdb_provider return free pages
+	 * with incremental_vacuum instead of a full VACUUM.
+	 */
+	if (k != sqlite_kind::midb &&
+	    gx_sql_exec(db, "PRAGMA auto_vacuum=INCREMENTAL") != SQLITE_OK)
+		return -1;
 	auto ret = dbop_sqlite_create_int(db, tbl, flags);
 	if (ret != 0)
 		return ret;
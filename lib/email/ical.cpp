@@ -1216,26 +1216,140 @@ bool ical_parse_duration(const char *str_duration, long *pseconds)
 	return true;
 }
 
+/*
+ * End of validity (RRULE UNTIL) of a STANDARD/DAYLIGHT component, as local
+ * time. Returns 1 if @pend was filled, 0 if the component has no end, and -1
+ * if it is malformed.
+ */
+static int ical_tzcom_until(const ical_component &comp, ICAL_TIME *pend)
+{
+	bool b_utc;
+	int hour, minute;
+	time_t tmp_time;
+	struct tm tmp_tm;
+
+	auto piline = comp.get_line("RRULE");
+	if (piline == nullptr)
+		return 0;
+	auto pvalue = piline->get_first_subvalue_by_name("UNTIL");
+	if (pvalue == nullptr)
+		return 0;
+	if (!ical_parse_datetime(pvalue, &b_utc, pend)) {
+		pend->hour = 0;
+		pend->minute = 0;
+		pend->second = 0;
+		pend->leap_second = 0;
+		return ical_parse_date(pvalue, &pend->year,
+		       &pend->month, &pend->day) ? 1 : -1;
+	}
+	if (!ical_datetime_to_utc(nullptr, pvalue, &tmp_time))
+		return -1;
+	piline = comp.get_line("TZOFFSETTO");
+	if (piline == nullptr)
+		return -1;
+	pvalue = piline->get_first_subvalue();
+	if (pvalue == nullptr)
+		return -1;
+	if (!ical_parse_utc_offset(pvalue, &hour, &minute))
+		return -1;
+	tmp_time -= 60*60*hour + 60*minute;
+	make_gmtm(tmp_time, &tmp_tm);
+	pend->year = tmp_tm.tm_year + 1900;
+	pend->month = tmp_tm.tm_mon + 1;
+	pend->day = tmp_tm.tm_mday;
+	pend->hour = tmp_tm.tm_hour;
+	pend->minute = tmp_tm.tm_min;
+	pend->second = tmp_tm.tm_sec;
+	pend->leap_second = 0;
+	return 1;
+}
+
+/*
+ * Local time in @year at which the yearly @rrule of a STANDARD/DAYLIGHT
+ * component (which started at @dtstart) takes effect. The day of a BYDAY
+ * rule is looked up in @dom_month, or in the rule's own month if 0.
+ */
+static bool ical_tzcom_onset(const ical_line &rrule, const ICAL_TIME &dtstart,
+    int year, int dom_month, ICAL_TIME *ponset)
+{
+	int month, weekorder, dayofweek, dayofmonth, hour, minute, second;
+
+	auto pvalue = rrule.get_first_subvalue_by_name("FREQ");
+	if (pvalue == nullptr || strcasecmp(pvalue, "YEARLY") != 0)
+		return false;
+	pvalue = rrule.get_first_subvalue_by_name("BYDAY");
+	auto pvalue1 = rrule.get_first_subvalue_by_name("BYMONTHDAY");
+	if ((pvalue == nullptr && pvalue1 == nullptr) ||
+	    (pvalue != nullptr && pvalue1 != nullptr))
+		return false;
+	auto pvalue2 = rrule.get_first_subvalue_by_name("BYMONTH");
+	if (NULL == pvalue2) {
+		month = dtstart.month;
+	} else {
+		month = strtol(pvalue2, nullptr, 0);
+		if (month < 1 || month > 12)
+			return false;
+	}
+	if (NULL != pvalue) {
+		if (!ical_parse_byday(pvalue, &dayofweek, &weekorder))
+			return false;
+		if (weekorder > 5 || weekorder < -5 || 0 == weekorder)
+			return false;
+		dayofmonth = ical_get_dayofmonth(year, dom_month != 0 ?
+		             dom_month : month, weekorder, dayofweek);
+	} else {
+		dayofmonth = strtol(pvalue1, nullptr, 0);
+		if (abs(dayofmonth) < 1 || abs(dayofmonth) > 31)
+			return false;
+		if (dayofmonth < 0)
+			dayofmonth += ical_get_monthdays(year, month) + 1;
+		if (dayofmonth <= 0)
+			return false;
+	}
+	pvalue = rrule.get_first_subvalue_by_name("BYHOUR");
+	if (NULL == pvalue) {
+		hour = dtstart.hour;
+	} else {
+		hour = strtol(pvalue, nullptr, 0);
+		if (hour < 0 || hour > 23)
+			return false;
+	}
+	pvalue = rrule.get_first_subvalue_by_name("BYMINUTE");
+	if (NULL == pvalue) {
+		minute = dtstart.minute;
+	} else {
+		minute = strtol(pvalue, nullptr, 0);
+		if (minute < 0 || minute > 59)
+			return false;
+	}
+	pvalue = rrule.get_first_subvalue_by_name("BYSECOND");
+	if (NULL == pvalue) {
+		second = dtstart.second;
+	} else {
+		second = strtol(pvalue, nullptr, 0);
+		if (second < 0 || second > 59)
+			return false;
+	}
+	*ponset = dtstart;
+	ponset->year = year;
+	ponset->month = month;
+	ponset->day = dayofmonth;
+	ponset->hour = hour;
+	ponset->minute = minute;
+	ponset->second = second;
+	ponset->leap_second = 0;
+	return true;
+}
+
 static const char *ical_get_datetime_offset(const ical_component &ptz_component,
     ICAL_TIME itime)
 {
-	int hour;
-	int month;
-	int minute;
-	int second;
 	bool b_utc;
-	int weekorder;
-	int dayofweek;
-	int dayofmonth;
-	time_t tmp_time;
 	BOOL b_standard;
 	BOOL b_daylight;
 	ICAL_TIME itime1;
 	ICAL_TIME itime2;
-	struct tm tmp_tm;
 	const char *pvalue;
-	const char *pvalue1;
-	const char *pvalue2;
 	ICAL_TIME itime_standard;
 	ICAL_TIME itime_daylight;
 	const char *standard_offset = nullptr, *daylight_offset = nullptr;
@@ -1259,143 +1373,34 @@ static const char *ical_get_datetime_offset(const ical_component &ptz_component,
 			return NULL;
 		if (itime < itime1)
 			continue;
-		piline = pcomponent->get_line("RRULE");
-		if (piline == nullptr)
-			goto FOUND_COMPONENT;
-		pvalue = piline->get_first_subvalue_by_name("UNTIL");
-		if (pvalue == nullptr)
-			goto FOUND_COMPONENT;
-		if (!ical_parse_datetime(pvalue, &b_utc, &itime2)) {
-			itime2.hour = 0;
-			itime2.minute = 0;
-			itime2.second = 0;
-			itime2.leap_second = 0;
-			if (!ical_parse_date(pvalue, &itime2.year,
-			    &itime2.month, &itime2.day))
-				return nullptr;
-		} else {
-			if (!ical_datetime_to_utc(nullptr, pvalue, &tmp_time))
-				return nullptr;
-			piline = pcomponent->get_line("TZOFFSETTO");
-			if (piline == nullptr)
-				return NULL;
-			pvalue = piline->get_first_subvalue();
-			if (pvalue == nullptr)
-				return NULL;
-			if (!ical_parse_utc_offset(pvalue, &hour, &minute))
-				return nullptr;
-			tmp_time -= 60*60*hour + 60*minute;
-			make_gmtm(tmp_time, &tmp_tm);
-			itime2.year = tmp_tm.tm_year + 1900;
-			itime2.month = tmp_tm.tm_mon + 1;
-			itime2.day = tmp_tm.tm_mday;
-			itime2.hour = tmp_tm.tm_hour;
-			itime2.minute = tmp_tm.tm_min;
-			itime2.second = tmp_tm.tm_sec;
-			itime2.leap_second = 0;
-		}
-		if (itime > itime2)
+		auto ret = ical_tzcom_until(*pcomponent, &itime2);
+		if (ret < 0)
+			return nullptr;
+		if (ret > 0 && itime > itime2)
 			continue;
- FOUND_COMPONENT:
 		piline = pcomponent->get_line("TZOFFSETTO");
 		if (piline == nullptr)
 			return NULL;
 		pvalue = piline->get_first_subvalue();
 		if (pvalue == nullptr)
 			return NULL;
-		if (strcasecmp(pcomponent->m_name.c_str(), "STANDARD") == 0) {
+		bool is_std = strcasecmp(pcomponent->m_name.c_str(), "STANDARD") == 0;
+		auto &onset = is_std ? itime_standard : itime_daylight;
+		if (is_std) {
 			b_standard = TRUE;
 			standard_offset = pvalue;
-			itime_standard = itime1;
 		} else {
 			b_daylight = TRUE;
 			daylight_offset = pvalue;
-			itime_daylight = itime1;
 		}
+		onset = itime1;
 		piline = pcomponent->get_line("RRULE");
 		if (NULL != piline) {
-			pvalue = piline->get_first_subvalue_by_name("FREQ");
-			if (pvalue == nullptr || strcasecmp(pvalue, "YEARLY") != 0)
+			if (!ical_tzcom_onset(*piline, itime1, itime.year,
+			    itime.month, &onset))
 				return NULL;
-			pvalue = piline->get_first_subvalue_by_name("BYDAY");
-			pvalue1 = piline->get_first_subvalue_by_name("BYMONTHDAY");
-			if ((pvalue == nullptr && pvalue1 == nullptr) ||
-			    (pvalue != nullptr && pvalue1 != nullptr))
-				return NULL;
-			pvalue2 = piline->get_first_subvalue_by_name("BYMONTH");
-			if (NULL == pvalue2) {
-				month = itime1.month;
-			} else {
-				month = strtol(pvalue2, nullptr, 0);
-				if (month < 1 || month > 12)
-					return NULL;
-			}
-			if (strcasecmp(pcomponent->m_name.c_str(), "STANDARD") == 0) {
-				itime_standard.year = itime.year;
-				itime_standard.month = month;
-			} else {
-				itime_daylight.year = itime.year;
-				itime_daylight.month = month;
-			}
-			if (NULL != pvalue) {
-				if (!ical_parse_byday(pvalue, &dayofweek, &weekorder))
-					return NULL;
-				if (weekorder > 5 || weekorder < -5 || 0 == weekorder)
-					return NULL;
-				dayofmonth = ical_get_dayofmonth(itime.year,
-						itime.month, weekorder, dayofweek);
-			} else {
-				dayofmonth = strtol(pvalue1, nullptr, 0);
-				if (abs(dayofmonth) < 1 || abs(dayofmonth) > 31)
-					return NULL;
-				if (dayofmonth < 0)
-					dayofmonth += ical_get_monthdays(
-								itime.year, month) + 1;
-				if (dayofmonth <= 0)
-					return NULL;
-			}
-			pvalue = piline->get_first_subvalue_by_name("BYHOUR");
-			if (NULL == pvalue) {
-				hour = itime1.hour;
-			} else {
-				hour = strtol(pvalue, nullptr, 0);
-				if (hour < 0 || hour > 23)
-					return NULL;
-			}
-			pvalue = piline->get_first_subvalue_by_name("BYMINUTE");
-			if (NULL == pvalue) {
-				minute = itime1.minute;
-			} else {
-				minute = strtol(pvalue, nullptr, 0);
-				if (minute < 0 || minute > 59)
-					return NULL;
-			}
-			pvalue = piline->get_first_subvalue_by_name("BYSECOND");
-			if (NULL == pvalue) {
-				second = itime1.second;
-			} else {
-				second = strtol(pvalue, nullptr, 0);
-				if (second < 0 || second > 59)
-					return NULL;
-			}
-			if (strcasecmp(pcomponent->m_name.c_str(), "STANDARD") == 0) {
-				itime_standard.day = dayofmonth;
-				itime_standard.hour = hour;
-				itime_standard.minute = minute;
-				itime_standard.second = second;
-				itime_standard.leap_second = 0;
-			} else {
-				itime_daylight.day = dayofmonth;
-				itime_daylight.hour = hour;
-				itime_daylight.minute = minute;
-				itime_daylight.second = second;
-				itime_daylight.leap_second = 0;
-			}
 		} else {
-			if (strcasecmp(pcomponent->m_name.c_str(), "STANDARD") == 0)
-				itime_standard.year = itime.year;
-			else
-				itime_daylight.year = itime.year;
+			onset.year = itime.year;
 		}
 		if (b_standard && b_daylight)
 			break;
@@ -1525,6 +1530,136 @@ bool ical_utc_to_datetime(const ical_component *ptz_component,
 	return false;
 }
 
+static time_t ical_itime_to_local(const ICAL_TIME &itime)
+{
+	struct tm tmp_tm{};
+	tmp_tm.tm_sec = itime.second;
+	tmp_tm.tm_min = itime.minute;
+	tmp_tm.tm_hour = itime.hour;
+	tmp_tm.tm_mday = itime.day;
+	tmp_tm.tm_mon = itime.month - 1;
+	tmp_tm.tm_year = itime.year - 1900;
+	return make_gmtime(&tmp_tm);
+}
+
+static void ical_local_to_itime(time_t t, ICAL_TIME *pitime)
+{
+	struct tm tmp_tm;
+	make_gmtm(t, &tmp_tm);
+	pitime->year = tmp_tm.tm_year + 1900;
+	pitime->month = tmp_tm.tm_mon + 1;
+	pitime->day = tmp_tm.tm_mday;
+	pitime->hour = tmp_tm.tm_hour;
+	pitime->minute = tmp_tm.tm_min;
+	pitime->second = tmp_tm.tm_sec;
+	pitime->leap_second = 0;
+}
+
+/*
+ * The result of ical_get_datetime_offset can only change at a DTSTART, just
+ * after an UNTIL, at the yearly onsets, or (for onsets on days that the
+ * month does not have) at the start of a month. Evaluating it at all those
+ * instants yields the complete list of changes.
+ */
+ical_tztable::ical_tztable(const ical_component &vtz, int first_year,
+    int last_year) : m_vtz(vtz)
+{
+	std::vector<time_t> cand;
+	ICAL_TIME itime{first_year, 1, 1};
+	m_first = ical_itime_to_local(itime);
+	itime.year = last_year + 1;
+	m_end = ical_itime_to_local(itime);
+	for (int y = first_year; y <= last_year; ++y) {
+		for (int m = 1; m <= 12; ++m) {
+			itime = {y, m, 1};
+			cand.push_back(ical_itime_to_local(itime));
+		}
+	}
+	for (const auto &comp : vtz.component_list) {
+		bool b_utc;
+		ICAL_TIME start, until;
+		auto piline = comp.get_line("DTSTART");
+		auto pvalue = piline != nullptr ? piline->get_first_subvalue() : nullptr;
+		if (pvalue == nullptr || !ical_parse_datetime(pvalue, &b_utc, &start))
+			continue;
+		cand.push_back(ical_itime_to_local(start));
+		if (ical_tzcom_until(comp, &until) > 0)
+			cand.push_back(ical_itime_to_local(until) + 1);
+		auto rrule = comp.get_line("RRULE");
+		for (int y = first_year; y <= last_year; ++y) {
+			ICAL_TIME onset = start;
+			onset.year = y;
+			if (rrule != nullptr &&
+			    !ical_tzcom_onset(*rrule, start, y, 0, &onset))
+				break;
+			cand.push_back(ical_itime_to_local(onset));
+		}
+	}
+	std::sort(cand.begin(), cand.end());
+	for (auto t : cand) {
+		if (t < m_first || t >= m_end ||
+		    (!m_change.empty() && m_change.back().local == t))
+			continue;
+		ical_local_to_itime(t, &itime);
+		change c{t, 0, false};
+		int hour, minute;
+		auto str_offset = ical_get_datetime_offset(vtz, itime);
+		if (str_offset != nullptr &&
+		    ical_parse_utc_offset(str_offset, &hour, &minute)) {
+			c.offset = 60*60*hour + 60*minute;
+			c.valid = true;
+		}
+		if (!m_change.empty() && m_change.back().valid == c.valid &&
+		    m_change.back().offset == c.offset)
+			continue;
+		m_change.push_back(c);
+	}
+	for (const auto &comp : vtz.component_list) {
+		int hour, minute;
+		if (strcasecmp(comp.m_name.c_str(), "STANDARD") != 0 &&
+		    strcasecmp(comp.m_name.c_str(), "DAYLIGHT") != 0)
+			break;
+		auto piline = comp.get_line("TZOFFSETTO");
+		auto pvalue = piline != nullptr ? piline->get_first_subvalue() : nullptr;
+		if (pvalue == nullptr || !ical_parse_utc_offset(pvalue, &hour, &minute))
+			break;
+		m_offset_to.push_back(60*60*hour + 60*minute);
+	}
+}
+
+bool ical_tztable::itime_to_utc(ICAL_TIME itime, time_t *ptime) const
+{
+	if (itime.leap_second >= 60 || itime.month < 1 || itime.month > 12 ||
+	    itime.day < 1 || itime.hour < 0 || itime.hour > 23 ||
+	    itime.minute < 0 || itime.minute > 59 ||
+	    itime.second < 0 || itime.second > 59 ||
+	    itime.day > static_cast<int>(ical_get_monthdays(itime.year, itime.month)))
+		return ical_itime_to_utc(&m_vtz, itime, ptime);
+	auto t = ical_itime_to_local(itime);
+	if (t < m_first || t >= m_end || m_change.empty())
+		return ical_itime_to_utc(&m_vtz, itime, ptime);
+	auto it = std::upper_bound(m_change.cbegin(), m_change.cend(), t,
+	          [](time_t v, const change &c) { return v < c.local; });
+	--it;
+	if (!it->valid)
+		return false;
+	*ptime = t + it->offset;
+	return true;
+}
+
+bool ical_tztable::utc_to_datetime(time_t utc_time, ICAL_TIME *pitime) const
+{
+	for (auto offset : m_offset_to) {
+		time_t tmp_time;
+		ical_local_to_itime(utc_time - offset, pitime);
+		if (!itime_to_utc(*pitime, &tmp_time))
+			return false;
+		if (tmp_time == utc_time)
+			return true;
+	}
+	return false;
+}
+
 static bool ical_parse_until(const ical_component *ptz_component,
 	const char *str_until, time_t *ptime)
 {
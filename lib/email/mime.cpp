@@ -20,6 +20,7 @@
 #include <gromox/mail.hpp>
 #include <gromox/mail_func.hpp>
 #include <gromox/mime.hpp>
+#include <gromox/mime_view.hpp>
 #include <gromox/scope.hpp>
 #include <gromox/util.hpp>
 
@@ -983,9 +984,8 @@ bool MIME::read_head(char *out_buff, size_t *plength) const
 bool MIME::read_content(char *out_buff, size_t *plength) const try
 {
 	auto pmime = this;
-	void *ptr;
-	size_t i, offset, max_length;
-	unsigned int buff_size;
+	size_t max_length;
+	char excess;
 	
 #ifdef _DEBUG_UMTA
 	if (out_buff == nullptr || plength == nullptr) {
@@ -1023,20 +1023,25 @@ bool MIME::read_content(char *out_buff, size_t *plength) const try
 			*plength = 0;
 			return false;
 		}
-		STREAM tmp_stream;
-		if (!reinterpret_cast<MAIL *>(pmime->content_begin)->serialize(&tmp_stream)) {
+		/* Serialize straight into @out_buff */
+		struct membuf {
+			char *p;
+			size_t size, ofs;
+		} mb{out_buff, max_length - 1, 0};
+		auto wr = +[](void *obj, const void *buf, size_t z) -> ssize_t {
+			auto &m = *static_cast<membuf *>(obj);
+			if (z > m.size - m.ofs)
+				return -1;
+			memcpy(&m.p[m.ofs], buf, z);
+			m.ofs += z;
+			return z;
+		};
+		if (!reinterpret_cast<MAIL *>(pmime->content_begin)->emit(wr, &mb)) {
 			*plength = 0;
 			return false;
 		}
-		offset = 0;
-		buff_size = STREAM_BLOCK_SIZE;
-		while ((ptr = tmp_stream.get_read_buf(&buff_size)) != nullptr) {
-			memcpy(out_buff + offset, ptr, buff_size);
-			offset += buff_size;
-			buff_size = STREAM_BLOCK_SIZE;
-		}
-		out_buff[offset] = '\0';
-		*plength = offset;
+		out_buff[mb.ofs] = '\0';
+		*plength = mb.ofs;
 		return true;
 	}
 	char encoding[256];
@@ -1053,57 +1058,48 @@ bool MIME::read_content(char *out_buff, size_t *plength) const try
 			encoding_type = mime_encoding::qp;
 	}
 	
-	auto pbuff = std::make_unique<char[]>(((pmime->content_length - 1) / (64 * 1024) + 1) * 64 * 1024);
 	/*
-	 * Newline before boundary string or end of mail should not be included
-	 * (the mention is hidden somewhere in RFC 2046,2049)
+	 * Decode directly from the message buffer. The decoder also drops the
+	 * newline before the boundary and undoes dot-stuffing.
 	 */
-	size_t tmp_len = pmime->content_length;
-	if (tmp_len >= 2 && newline_size(&pmime->content_begin[tmp_len-2], 2) == 2)
-		tmp_len -= 2;
-	else if (tmp_len >= 1 && newline_size(&pmime->content_begin[tmp_len-1], 1) == 1)
-		tmp_len -= 1;
-	size_t size = 0;
-	for (i=0; i<tmp_len; i++) {
-		if ('.' == pmime->content_begin[i]) {
-			if (0 == i) {
-				if (pmime->content_begin[1] == '.')
-					i ++;
-			} else {
-				if (i > 2 && pmime->content_begin[i-1] == '\n' &&
-				    pmime->content_begin[i-2] == '\r' &&
-				    pmime->content_begin[i+1] == '.')
-					i ++;
-			}
-		}
-		pbuff[size++] = pmime->content_begin[i];
-	}
-	
+	std::string_view raw(pmime->content_begin, pmime->content_length);
 	switch (encoding_type) {
-	case mime_encoding::base64:
-		if (decode64_ex(pbuff.get(), size, out_buff, max_length, plength) != 0) {
+	case mime_encoding::base64: {
+		mime_decoder dec(raw, encoding_type);
+		auto size = dec.read(out_buff, max_length - 1);
+		if (dec.read(&excess, 1) != 0) {
+			*plength = 0;
+			return false;
+		}
+		out_buff[size] = '\0';
+		*plength = size;
+		if (dec.error()) {
 			mlog(LV_DEBUG, "mime: failed to decode base64 mime content");
-			if (*plength == 0)
+			if (size == 0)
 				return false;
 		}
 		return true;
+	}
 	case mime_encoding::qp: {
-		auto qdlen = qp_decode_ex(out_buff, max_length, pbuff.get(), size);
-		if (qdlen < 0)
-			goto COPY_RAW_DATA;
-		*plength = qdlen;
+		mime_decoder dec(raw, encoding_type);
+		auto size = dec.read(out_buff, max_length - 1);
+		if (dec.read(&excess, 1) != 0)
+			break;
+		out_buff[size] = '\0';
+		*plength = size;
 		return true;
 	}
 	default:
- COPY_RAW_DATA:
-		if (max_length >= size) {
-			memcpy(out_buff, pbuff.get(), size);
-			*plength = size;
-			return true;
-		}
+		break;
+	}
+	mime_decoder dec(raw, mime_encoding::none);
+	auto size = dec.read(out_buff, max_length);
+	if (dec.read(&excess, 1) != 0) {
 		*plength = 0;
 		return false;
 	}
+	*plength = size;
+	return true;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-1973: Failed to allocate memory");
 	*plength = 0;
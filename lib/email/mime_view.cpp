@@ -0,0 +1,377 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <libHX/ctype_helper.h>
+#include <libHX/string.h>
+#include <gromox/mail_func.hpp>
+#include <gromox/mime_view.hpp>
+#include <gromox/util.hpp>
+
+namespace gromox {
+
+static inline bool b64_isalpha(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+	       (c >= '0' && c <= '9') || c == '+' || c == '/';
+}
+
+static inline unsigned int b64_value(unsigned char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	return c == '+' ? 62 : 63;
+}
+
+static inline unsigned int hex_value(unsigned char c)
+{
+	return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+mime_decoder::mime_decoder(std::string_view s, enum mime_encoding enc) :
+	m_enc(enc)
+{
+	/* Newline before the boundary is not part of the content (RFC 2046 §5.1.1) */
+	auto len = s.size();
+	if (len >= 2 && newline_size(&s[len-2], 2) == 2)
+		len -= 2;
+	else if (len >= 1 && newline_size(&s[len-1], 1) == 1)
+		len -= 1;
+	m_in = s.substr(0, len);
+	m_skip = m_in.size() >= 2 && m_in[0] == '.' && m_in[1] == '.' ? 0 : next_skip(0);
+}
+
+/*
+ * Position of the next dot that MIME::read_content drops: the first of two
+ * at the start of a line (SMTP dot-stuffing).
+ */
+size_t mime_decoder::next_skip(size_t from) const
+{
+	auto p = std::max(from, static_cast<size_t>(3));
+	if (p < 2 || p >= m_in.size())
+		return std::string_view::npos;
+	auto i = m_in.find("\r\n..", p - 2);
+	if (i == std::string_view::npos || i + 3 >= m_in.size())
+		return std::string_view::npos;
+	return i + 2;
+}
+
+size_t mime_decoder::step_qp(char *out, size_t len)
+{
+	auto stop = std::min(m_skip, m_in.size());
+	size_t produced = 0;
+	while (m_pos < stop && produced < len) {
+		auto c = m_in[m_pos];
+		if (c != '=') {
+			auto eq = m_in.find('=', m_pos);
+			auto n = std::min({eq, stop, m_pos + len - produced}) - m_pos;
+			memcpy(&out[produced], &m_in[m_pos], n);
+			produced += n;
+			m_pos += n;
+			continue;
+		}
+		if (m_pos + 2 < m_in.size() && HX_isxdigit(m_in[m_pos+1]) &&
+		    HX_isxdigit(m_in[m_pos+2])) {
+			out[produced++] = (hex_value(m_in[m_pos+1]) << 4) |
+			                  hex_value(m_in[m_pos+2]);
+			m_pos += 3;
+			continue;
+		}
+		/* soft line break, or a stray '=' which is dropped */
+		m_pos += 1 + newline_size(&m_in[m_pos+1], m_in.size() - m_pos - 1);
+	}
+	return produced;
+}
+
+size_t mime_decoder::step_base64(char *out, size_t len)
+{
+	auto stop = std::min(m_skip, m_in.size());
+	size_t produced = 0;
+	while (m_pos < stop && produced + 3 <= len) {
+		unsigned char c = m_in[m_pos++];
+		if (b64_isalpha(c)) {
+			m_quad[m_nquad++] = b64_value(c);
+			if (m_nquad < 4)
+				continue;
+			out[produced++] = (m_quad[0] << 2) | (m_quad[1] >> 4);
+			out[produced++] = (m_quad[1] << 4) | (m_quad[2] >> 2);
+			out[produced++] = (m_quad[2] << 6) | m_quad[3];
+			m_nquad = 0;
+			continue;
+		}
+		if (c != '=') {
+			if (c != '\r' && c != '\n' && c != ' ' && c != '\t')
+				m_error = true;
+			continue;
+		}
+		/*
+		 * Padding ends the data. Like decode64_ex, still fill the rest
+		 * of the group, so that stray characters in it count as error.
+		 */
+		m_done = true;
+		unsigned char last = 0;
+		unsigned int n = m_nquad + 1;
+		for (size_t i = m_pos, skip = m_skip; n < 4 && i < m_in.size(); ++i) {
+			if (i == skip) {
+				skip = next_skip(i + 2);
+				continue;
+			}
+			last = m_in[i];
+			if (b64_isalpha(last) || last == '=')
+				++n;
+			else if (last != '\r' && last != '\n' && last != ' ' && last != '\t')
+				m_error = true;
+		}
+		if (m_nquad == 3) {
+			out[produced++] = (m_quad[0] << 2) | (m_quad[1] >> 4);
+			out[produced++] = (m_quad[1] << 4) | (m_quad[2] >> 2);
+		} else if (m_nquad == 2 && last == '=') {
+			out[produced++] = (m_quad[0] << 2) | (m_quad[1] >> 4);
+		}
+		break;
+	}
+	return produced;
+}
+
+size_t mime_decoder::read(void *vbuf, size_t len)
+{
+	auto buf = static_cast<char *>(vbuf);
+	size_t produced = 0;
+	while (produced < len) {
+		if (m_outpos < m_nout) {
+			buf[produced++] = m_out[m_outpos++];
+			continue;
+		}
+		if (m_done || m_pos >= m_in.size())
+			break;
+		if (m_pos == m_skip) {
+			++m_pos;
+			m_skip = next_skip(m_pos + 1);
+			continue;
+		}
+		size_t n;
+		if (m_enc == mime_encoding::qp) {
+			n = step_qp(&buf[produced], len - produced);
+		} else if (m_enc == mime_encoding::base64) {
+			if (len - produced < 3) {
+				/* Too little room for a group; go through m_out. */
+				m_nout = step_base64(reinterpret_cast<char *>(m_out), 3);
+				m_outpos = 0;
+				if (m_nout == 0 && (m_done || m_pos >= m_in.size()))
+					break;
+				continue;
+			}
+			n = step_base64(&buf[produced], len - produced);
+		} else {
+			n = std::min(std::min(m_skip, m_in.size()) - m_pos, len - produced);
+			memcpy(&buf[produced], &m_in[m_pos], n);
+			m_pos += n;
+		}
+		produced += n;
+	}
+	return produced;
+}
+
+mime_view::mime_view(const char *data, size_t len) :
+	m_data(data), m_len(len)
+{
+	if (len == 0)
+		return;
+	MIME_FIELD f;
+	bool has_type = false;
+	size_t off = 0;
+	while (true) {
+		auto parsed = parse_mime_field(&data[off], len - off, &f);
+		if (parsed == 0) {
+			if (off == 0) {
+				/* old simplest unix style mail */
+				m_ctype = "text/plain";
+				return;
+			}
+			m_head_len = m_content_off = off;
+			break;
+		}
+		m_fields.push_back({off, parsed, f.name.size()});
+		off += parsed;
+		if (strcasecmp(f.name.c_str(), "Content-Type") == 0) {
+			char ctype[VALUE_LEN];
+			parse_field_value(f.value.c_str(), f.value.size(),
+				ctype, std::size(ctype), m_ctparams);
+			m_ctype = ctype;
+			has_type = true;
+		}
+		auto nl = newline_size(&data[off], len - off);
+		if (nl == 0)
+			continue;
+		m_head_len = off;
+		m_content_off = off + nl;
+		break;
+	}
+	if (!has_type)
+		m_ctype = "text/plain";
+	else if (strncasecmp(m_ctype.c_str(), "multipart/", 10) == 0 &&
+	    !locate_boundaries())
+		m_first_boundary = m_last_boundary = nullptr;
+}
+
+/* Same rules as mime_parse_multiple */
+bool mime_view::locate_boundaries()
+{
+	if (m_content_off >= m_len || !get_content_param("boundary", m_boundary))
+		return false;
+	if (m_boundary.size() > VALUE_LEN - 2)
+		m_boundary.resize(VALUE_LEN - 2);
+	if (m_boundary.size() <= 2)
+		return false;
+	auto q = m_boundary.find('"');
+	if (q != m_boundary.npos) {
+		auto e = m_boundary.find('"', q + 1);
+		if (e == m_boundary.npos)
+			return false;
+		m_boundary = m_boundary.substr(q + 1, e - q - 1);
+	}
+	auto blen = m_boundary.size();
+	auto begin = m_data + m_content_off, end = m_data + m_len;
+	if (static_cast<size_t>(end - begin) < blen + 3)
+		return false;
+	for (auto ptr = begin; ptr + blen + 2 < end; ++ptr) {
+		if (ptr[0] != '-' || ptr[1] != '-' ||
+		    strncmp(m_boundary.c_str(), &ptr[2], blen) != 0 ||
+		    newline_size(&ptr[blen+2], end - &ptr[blen+2]) == 0)
+			continue;
+		m_first_boundary = ptr;
+		break;
+	}
+	if (m_first_boundary == nullptr)
+		return false;
+	for (auto ptr = end - 1; ptr >= begin + blen + 3; --ptr) {
+		if (ptr[0] == '-' && ptr[-1] == '-' && ptr[-2-blen] == '-' &&
+		    ptr[-3-blen] == '-' &&
+		    strncasecmp(m_boundary.c_str(), ptr - 1 - blen, blen) == 0) {
+			m_last_boundary = ptr + 1;
+			return true;
+		}
+	}
+	m_last_boundary = end;
+	return m_last_boundary >= m_first_boundary + blen + 4;
+}
+
+bool mime_view::is_message() const
+{
+	return strcasecmp(m_ctype.c_str(), "message/rfc822") == 0;
+}
+
+bool mime_view::get_field(const char *tag, std::string &value,
+    unsigned int order) const try
+{
+	auto tlen = strlen(tag);
+	for (const auto &fl : m_fields) {
+		if (fl.name_len != tlen ||
+		    strncasecmp(tag, &m_data[fl.off], tlen) != 0 || order-- > 0)
+			continue;
+		MIME_FIELD f;
+		if (parse_mime_field(&m_data[fl.off], m_len - fl.off, &f) == 0)
+			return false;
+		value = std::move(f.value);
+		return true;
+	}
+	return false;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1758: ENOMEM");
+	return false;
+}
+
+unsigned int mime_view::get_field_num(const char *tag) const
+{
+	auto tlen = strlen(tag);
+	return std::count_if(m_fields.cbegin(), m_fields.cend(), [&](const field &fl) {
+		return fl.name_len == tlen &&
+		       strncasecmp(tag, &m_data[fl.off], tlen) == 0;
+	});
+}
+
+bool mime_view::get_content_param(const char *tag, std::string &value) const
+{
+	for (const auto &[k, v] : m_ctparams) {
+		if (strcasecmp(tag, k.c_str()) == 0) {
+			value = v;
+			return true;
+		}
+	}
+	return false;
+}
+
+enum mime_encoding mime_view::encoding() const
+{
+	std::string enc;
+	if (!get_field("Content-Transfer-Encoding", enc))
+		return mime_encoding::none;
+	char buf[256];
+	gx_strlcpy(buf, enc.c_str(), std::size(buf));
+	HX_strrtrim(buf);
+	HX_strltrim(buf);
+	if (strcasecmp(buf, "base64") == 0)
+		return mime_encoding::base64;
+	if (strcasecmp(buf, "quoted-printable") == 0)
+		return mime_encoding::qp;
+	return mime_encoding::unknown;
+}
+
+/* Same splitting as mail_retrieve_to_mime, one level deep */
+std::vector<mime_view> mime_view::parts() const
+{
+	std::vector<mime_view> out;
+	if (m_first_boundary == nullptr)
+		return out;
+	auto blen = m_boundary.size();
+	auto begin = m_first_boundary + blen + 2, end = m_last_boundary;
+	begin += newline_size(begin, end - begin);
+	auto last = begin, bufend = m_data + m_len;
+	for (auto ptr = begin; ptr < end; ++ptr) {
+		if (ptr[0] != '-' || ptr + 2 + blen >= bufend || ptr[1] != '-' ||
+		    strncmp(&ptr[2], m_boundary.c_str(), blen) != 0)
+			continue;
+		auto c = ptr[blen+2];
+		if (c != '\r' && c != '\n' && c != '-')
+			continue;
+		out.emplace_back(last, ptr - last);
+		if (c == '-' && ptr + blen + 3 < bufend && ptr[blen+3] == '-')
+			return out;
+		ptr += blen + 2;
+		ptr += newline_size(ptr, std::min(static_cast<ptrdiff_t>(2), bufend - ptr));
+		last = ptr;
+	}
+	auto ptr = last;
+	while (ptr < end && (*ptr == '\t' || *ptr == ' ' || *ptr == '\r' || *ptr == '\n'))
+		++ptr;
+	if (ptr < end)
+		/* some illegal multiple mimes haven't --boundary string-- */
+		out.emplace_back(last, end - last);
+	return out;
+}
+
+mime_view mime_view::message() const
+{
+	if (!is_message())
+		return {};
+	auto enc = encoding();
+	if (enc == mime_encoding::base64 || enc == mime_encoding::qp)
+		return {};
+	auto c = content();
+	auto len = c.size();
+	if (len >= 2 && newline_size(&c[len-2], 2) == 2)
+		len -= 2;
+	else if (len >= 1 && newline_size(&c[len-1], 1) == 1)
+		len -= 1;
+	return mime_view(c.data(), len);
+}
+
+}
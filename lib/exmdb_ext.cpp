@@ -1,4 +1,5 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
@@ -2411,7 +2412,8 @@ pack_result exmdb_ext_pull_request(const BINARY *pbin_in, exreq *&prequest)
 	case exmdb_callid::allocate_cn:
 	case exmdb_callid::vacuum:
 	case exmdb_callid::unload_store:
-	case exmdb_callid::purge_datafiles: {
+	case exmdb_callid::purge_datafiles:
+	case exmdb_callid::get_metrics: {
 		prequest = cu_alloc<exreq>();
 		if (prequest == nullptr)
 			return EXT_ERR_ALLOC;
@@ -2467,6 +2469,7 @@ pack_result exmdb_ext_push_request(const exreq *prequest, BINARY *pbin_out)
 	case exmdb_callid::vacuum:
 	case exmdb_callid::unload_store:
 	case exmdb_callid::purge_datafiles:
+	case exmdb_callid::get_metrics:
 		status = EXT_ERR_SUCCESS;
 		break;
 #define E(t) case exmdb_callid::t: status = exmdb_push(ext_push, *static_cast<const exreq_ ## t *>(prequest)); break;
@@ -3637,6 +3640,16 @@ static pack_result exmdb_push(EXT_PUSH &x, const exresp_autoreply_tsquery &d)
 	return x.p_uint64(d.tdiff);
 }
 
+static pack_result exmdb_pull(EXT_PULL &x, exresp_get_metrics &d)
+{
+	return x.g_str(&d.text);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_get_metrics &d)
+{
+	return x.p_str(d.text);
+}
+
 #define RSP_WITHOUT_ARGS \
 	E(ping_store) \
 	E(remove_store_properties) \
@@ -3768,7 +3781,8 @@ static pack_result exmdb_push(EXT_PUSH &x, const exresp_autoreply_tsquery &d)
 	E(check_contact_address) \
 	E(get_public_folder_unread_count) \
 	E(store_eid_to_user) \
-	E(autoreply_tsquery)
+	E(autoreply_tsquery) \
+	E(get_metrics)
 
 /* exmdb_callid::connect, exmdb_callid::listen_notification not included */
 /*
@@ -3796,11 +3810,51 @@ pack_result exmdb_ext_pull_response(const BINARY *pbin_in, exresp *presponse)
 }
 
 /* exmdb_callid::connect, exmdb_callid::listen_notification not included */
-pack_result exmdb_ext_push_response(const exresp *presponse, BINARY *pbin_out)
+/* Initial buffer size for responses that can get big */
+static uint32_t exmdb_resp_size_hint(const exresp *r)
 {
-	EXT_PUSH ext_push;
-	
-	if (!ext_push.init(nullptr, 0, EXT_FLAG_WCOUNT))
+	size_t z = 0;
+	switch (r->call_id) {
+	case exmdb_callid::query_table:
+		z = ext_push_estimate(static_cast<const exresp_query_table *>(r)->set);
+		break;
+	case exmdb_callid::read_message: {
+		auto m = static_cast<const exresp_read_message *>(r)->pmsgctnt;
+		if (m != nullptr)
+			z = ext_push_estimate(*m);
+		break;
+	}
+	case exmdb_callid::read_message_instance:
+		z = ext_push_estimate(static_cast<const exresp_read_message_instance *>(r)->msgctnt);
+		break;
+	case exmdb_callid::get_message_properties:
+		z = ext_push_estimate(static_cast<const exresp_get_message_properties *>(r)->propvals);
+		break;
+	case exmdb_callid::get_instance_properties:
+		z = ext_push_estimate(static_cast<const exresp_get_instance_properties *>(r)->propvals);
+		break;
+	case exmdb_callid::get_folder_properties:
+		z = ext_push_estimate(static_cast<const exresp_get_folder_properties *>(r)->propvals);
+		break;
+	case exmdb_callid::get_store_properties:
+		z = ext_push_estimate(static_cast<const exresp_get_store_properties *>(r)->propvals);
+		break;
+	default:
+		break;
+	}
+	return std::min(z + 16, static_cast<size_t>(UINT32_MAX));
+}
+
+/**
+ * Serialize @presponse into @ext_push, which is initialized here. If @flags
+ * contains EXT_FLAG_IOVREF, large values are only referenced (see
+ * EXT_PUSH::get_iov), and @presponse must stay around until they are sent.
+ */
+pack_result exmdb_ext_push_response(const exresp *presponse,
+    EXT_PUSH &ext_push, uint32_t flags)
+{
+	if (!ext_push.init(nullptr, exmdb_resp_size_hint(presponse),
+	    EXT_FLAG_WCOUNT | flags))
 		return EXT_ERR_ALLOC;
 	auto status = ext_push.p_uint8(static_cast<uint8_t>(exmdb_response::success));
 	if (status != EXT_ERR_SUCCESS)
@@ -3825,11 +3879,23 @@ pack_result exmdb_ext_push_response(const exresp *presponse, BINARY *pbin_out)
 	}
 	if (status != EXT_ERR_SUCCESS)
 		return status;
-	pbin_out->cb = ext_push.m_offset;
+	auto total = ext_push.total_size();
+	if (total > UINT32_MAX)
+		return EXT_ERR_FORMAT;
+	auto end = ext_push.m_offset;
 	ext_push.m_offset = 1;
-	status = ext_push.p_uint32(pbin_out->cb - sizeof(uint32_t) - 1);
+	status = ext_push.p_uint32(total - sizeof(uint32_t) - 1);
+	ext_push.m_offset = end;
+	return status;
+}
+
+pack_result exmdb_ext_push_response(const exresp *presponse, BINARY *pbin_out)
+{
+	EXT_PUSH ext_push;
+	auto status = exmdb_ext_push_response(presponse, ext_push, 0);
 	if (status != EXT_ERR_SUCCESS)
 		return status;
+	pbin_out->cb = ext_push.m_offset;
 	/* memory referenced by ext_push.data will be freed outside */
 	pbin_out->pb = ext_push.release();
 	return EXT_ERR_SUCCESS;
@@ -1,6 +1,13 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 // SPDX-FileCopyrightText: 2023 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <fmt/core.h>
 #include <fmt/format.h>
@@ -145,6 +152,40 @@ static std::optional<ical_component> tz_to_vtimezone(int year,
 	return com;
 }
 
+/*
+ * Compiled timezones, keyed by the PidLidTimeZoneStruct blob they were made
+ * from, since a calendar typically has only a handful of distinct ones.
+ */
+static constexpr size_t fb_tzcache_max = 256;
+static std::mutex g_fb_tzlock;
+static std::unordered_map<std::string, std::shared_ptr<const ical_tztable>> g_fb_tzcache;
+
+static std::shared_ptr<const ical_tztable> fb_tztable(const BINARY &bin) try
+{
+	std::string key(bin.pc, bin.cb);
+	std::unique_lock lk(g_fb_tzlock);
+	auto i = g_fb_tzcache.find(key);
+	if (i != g_fb_tzcache.end())
+		return i->second;
+	lk.unlock();
+	TIMEZONESTRUCT tz;
+	EXT_PULL ext_pull;
+	ext_pull.init(bin.pb, bin.cb, exmdb_rpc_alloc, EXT_FLAG_UTF16);
+	if (ext_pull.g_tzstruct(&tz) != EXT_ERR_SUCCESS)
+		return nullptr;
+	auto tzcom = tz_to_vtimezone(1600, "timezone", tz);
+	if (!tzcom.has_value())
+		return nullptr;
+	auto tzt = std::make_shared<const ical_tztable>(*tzcom);
+	lk.lock();
+	if (g_fb_tzcache.size() >= fb_tzcache_max)
+		g_fb_tzcache.clear();
+	g_fb_tzcache.emplace(std::move(key), tzt);
+	return tzt;
+} catch (const std::bad_alloc &) {
+	return nullptr;
+}
+
 static bool recurrencepattern_to_rrule(const ical_component *tzcom,
     time_t start_whole, const APPOINTMENT_RECUR_PAT &apr, ICAL_RRULE *irrule)
 {
@@ -221,18 +262,23 @@ static bool recurrencepattern_to_rrule(const ical_component *tzcom,
 	return ical_parse_rrule(tzcom, start_whole, &line.value_list, irrule);
 }
 
-static bool find_recur_times(const ical_component *tzcom,
+static bool find_recur_times(const ical_tztable *tzt,
     time_t start_whole, const APPOINTMENT_RECUR_PAT &apr,
     time_t start_time, time_t end_time, std::vector<event> &evlist)
 {
 	ICAL_RRULE irrule;
+	auto tzcom = tzt != nullptr ? &tzt->vtimezone() : nullptr;
+	auto to_utc = [&](const ICAL_TIME &itime, time_t *ut) {
+		return tzt != nullptr ? tzt->itime_to_utc(itime, ut) :
+		       ical_itime_to_utc(nullptr, itime, ut);
+	};
 
 	if (!recurrencepattern_to_rrule(tzcom, start_whole, apr, &irrule))
 		return false;
 	do {
 		ICAL_TIME itime = irrule.instance_itime;
 		time_t ut{}, utnz{};
-		if (!ical_itime_to_utc(tzcom, itime, &ut))
+		if (!to_utc(itime, &ut))
 			break;
 		if (ut < start_time)
 			continue;
@@ -252,13 +298,13 @@ static bool find_recur_times(const ical_component *tzcom,
 		auto ut = rop_util_rtime_to_unix(apr.pexceptioninfo[i].startdatetime);
 		ICAL_TIME itime;
 		if (!ical_utc_to_datetime(nullptr, ut, &itime) ||
-		    !ical_itime_to_utc(tzcom, itime, &ut) ||
+		    !to_utc(itime, &ut) ||
 		    ut < start_time || ut > end_time)
 			continue;
 		event event = {ut};
 		ut = rop_util_rtime_to_unix(apr.pexceptioninfo[i].enddatetime);
 		if (!ical_utc_to_datetime(nullptr, ut, &itime) ||
-		    !ical_itime_to_utc(tzcom, itime, &ut))
+		    !to_utc(itime, &ut))
 			continue;
 		event.end_time = ut;
 		event.ei = &apr.pexceptioninfo[i];
@@ -324,25 +370,70 @@ static bool goid_to_icaluid(BINARY *gobj, std::string &uid_buf)
 	return true;
 }
 
-bool get_freebusy(const char *username, const char *dir, time_t start_time,
-    time_t end_time, std::vector<freebusy_event> &fb_data)
-{
-	uint32_t permission = 0;
-	auto cal_eid = rop_util_make_eid_ex(1, PRIVATE_FID_CALENDAR);
+namespace {
+
+/* One busy interval of the materialized index, owning its strings */
+struct fb_slot {
+	time_t start = 0, end = 0;
+	uint32_t busy = 0;
+	bool meeting = false, recurring = false, exception = false;
+	bool reminder = false, priv = false;
+	std::string id;
+	std::optional<std::string> subject, location;
+};
+
+/*
+ * Busy intervals of one calendar folder over [win_start, win_end], with
+ * recurring series expanded, sorted by start time. @commit_time and
+ * @content_count are the folder state it was built from.
+ */
+struct fb_index {
+	uint64_t commit_time = 0;
+	uint32_t content_count = 0;
+	time_t win_start = 0, win_end = 0, max_len = 0, built = 0;
+	std::vector<fb_slot> slots;
+};
 
-	if (username != nullptr) {
-		if (!exmdb_client::get_folder_perm(dir, cal_eid, username, &permission))
-			return false;
-		if (!(permission & (frightsFreeBusySimple | frightsFreeBusyDetailed | frightsReadAny)))
-			return false;
-	} else {
-		permission = frightsFreeBusyDetailed | frightsReadAny;
-	}
+}
+
+/*
+ * The index covers a rolling window around the current time; queries
+ * outside of it are answered from a throwaway index for just that range.
+ */
+static constexpr time_t fb_window_past = 31 * 86400, fb_window_future = 183 * 86400;
+static constexpr size_t fb_cache_max = 1024;
+static std::mutex g_fb_lock;
+static std::unordered_map<std::string, std::shared_ptr<const fb_index>> g_fb_cache;
+
+static void fb_push(fb_index &idx, time_t start, time_t end, uint32_t busy,
+    const std::string &id, const char *subject, const char *location,
+    bool meeting, bool recurring, bool exception, bool reminder, bool priv)
+{
+	fb_slot s;
+	s.start = start;
+	s.end = end;
+	s.busy = busy;
+	s.meeting = meeting;
+	s.recurring = recurring;
+	s.exception = exception;
+	s.reminder = reminder;
+	s.priv = priv;
+	s.id = id;
+	if (subject != nullptr)
+		s.subject.emplace(subject);
+	if (location != nullptr)
+		s.location.emplace(location);
+	idx.slots.push_back(std::move(s));
+}
 
+/* Read the calendar and expand everything that touches [start_time, end_time]. */
+static bool fb_build(const char *dir, time_t start_time, time_t end_time,
+    fb_index &idx)
+{
+	auto cal_eid = rop_util_make_eid_ex(1, PRIVATE_FID_CALENDAR);
 	freebusy_tags ptag(dir);
 	auto start_nttime = rop_util_unix_to_nttime(start_time);
 	auto end_nttime   = rop_util_unix_to_nttime(end_time);
-	bool detailed     = permission & (frightsFreeBusyDetailed | frightsReadAny);
 	static constexpr uint8_t fixed_true = 1;
 
 	/* C1: apptstartwhole >= start && apptstartwhole <= end */
@@ -428,21 +519,17 @@ bool get_freebusy(const char *username, const char *dir, time_t start_time,
 
 		// non-recurring appointments
 		if (flag == nullptr || *flag == 0) {
-			fb_data.emplace_back(start_whole, end_whole, busy_type, uid_buf.data(),
-				subject, location, is_meeting, false, false, is_reminder, is_private, detailed);
+			fb_push(idx, start_whole, end_whole, busy_type, uid_buf,
+				subject, location, is_meeting, false, false, is_reminder, is_private);
 			continue;
 		}
 		// recurring appointments
 		EXT_PULL ext_pull;
-		std::optional<ical_component> tzcom;
+		std::shared_ptr<const ical_tztable> tzt;
 		auto bin = rows.pparray[i]->get<BINARY>(ptag.timezonestruct);
 		if (bin != nullptr) {
-			TIMEZONESTRUCT tz;
-			ext_pull.init(bin->pb, bin->cb, exmdb_rpc_alloc, EXT_FLAG_UTF16);
-			if (ext_pull.g_tzstruct(&tz) != EXT_ERR_SUCCESS)
-				continue;
-			tzcom = tz_to_vtimezone(1600, "timezone", tz);
-			if (!tzcom.has_value())
+			tzt = fb_tztable(*bin);
+			if (tzt == nullptr)
 				continue;
 		}
 
@@ -455,15 +542,15 @@ bool get_freebusy(const char *username, const char *dir, time_t start_time,
 			continue;
 
 		std::vector<event> event_list;
-		if (!find_recur_times(tzcom.has_value() ? &*tzcom : nullptr,
-		    start_whole, apprecurr, start_time, end_time, event_list))
+		if (!find_recur_times(tzt.get(), start_whole, apprecurr,
+		    start_time, end_time, event_list))
 			continue;
 
 		for (const auto &event : event_list) {
 			if (event.ei == nullptr || event.xe == nullptr) {
-				fb_data.emplace_back(event.start_time, event.end_time, busy_type,
-					uid_buf.data(), subject, location, is_meeting, TRUE, false,
-					is_reminder, is_private, detailed);
+				fb_push(idx, event.start_time, event.end_time, busy_type,
+					uid_buf, subject, location, is_meeting, true, false,
+					is_reminder, is_private);
 				continue;
 			}
 
@@ -473,9 +560,9 @@ bool get_freebusy(const char *username, const char *dir, time_t start_time,
 			auto ov_subj     = (event.ei->overrideflags & ARO_SUBJECT)     ? event.xe->subject : subject;
 			auto ov_location = (event.ei->overrideflags & ARO_LOCATION)    ? event.xe->location : location;
 
-			fb_data.emplace_back(event.start_time, event.end_time, ov_busy,
-				uid_buf.data(), ov_subj, ov_location, ov_meeting, TRUE, TRUE,
-				ov_reminder, is_private, detailed);
+			fb_push(idx, event.start_time, event.end_time, ov_busy,
+				uid_buf, ov_subj, ov_location, ov_meeting, true, true,
+				ov_reminder, is_private);
 		}
 	}
 
@@ -483,5 +570,117 @@ bool get_freebusy(const char *username, const char *dir, time_t start_time,
 	if (!exmdb_client::unload_table(dir, table_id))
 		return false;
 
+	std::sort(idx.slots.begin(), idx.slots.end(),
+		[](const fb_slot &a, const fb_slot &b) { return a.start < b.start; });
+	for (const auto &s : idx.slots)
+		idx.max_len = std::max(idx.max_len, s.end - s.start);
+	idx.win_start = start_time;
+	idx.win_end   = end_time;
 	return true;
-}
\ No newline at end of file
+}
+
+/* Copy into the RPC arena, which is where the pointers used to point to. */
+static char *fb_strdup(const std::string &s)
+{
+	auto p = static_cast<char *>(exmdb_rpc_alloc(s.size() + 1));
+	if (p != nullptr)
+		memcpy(p, s.c_str(), s.size() + 1);
+	return p;
+}
+
+/* Range scan: everything overlapping [start_time, end_time] */
+static void fb_scan(const fb_index &idx, time_t start_time, time_t end_time,
+    bool detailed, std::vector<freebusy_event> &fb_data)
+{
+	auto it = std::lower_bound(idx.slots.begin(), idx.slots.end(),
+	          start_time - idx.max_len,
+	          [](const fb_slot &s, time_t t) { return s.start < t; });
+	for (; it != idx.slots.end() && it->start <= end_time; ++it) {
+		const auto &s = *it;
+		if (s.end < start_time)
+			continue;
+		if (!detailed) {
+			fb_data.emplace_back(s.start, s.end, s.busy, nullptr, nullptr,
+				nullptr, false, false, false, false, false, false);
+			continue;
+		}
+		fb_data.emplace_back(s.start, s.end, s.busy, fb_strdup(s.id),
+			s.subject.has_value() ? fb_strdup(*s.subject) : nullptr,
+			s.location.has_value() ? fb_strdup(*s.location) : nullptr,
+			s.meeting, s.recurring, s.exception, s.reminder, s.priv, true);
+	}
+}
+
+/*
+ * Return the index for @dir if it is still current for the folder state
+ * (@commit_time, @count) and covers the query, otherwise rebuild it.
+ */
+static std::shared_ptr<const fb_index> fb_index_get(const char *dir,
+    uint64_t commit_time, uint32_t count, time_t start_time, time_t end_time)
+{
+	{
+		std::lock_guard lk(g_fb_lock);
+		auto i = g_fb_cache.find(dir);
+		if (i != g_fb_cache.end() && i->second->commit_time == commit_time &&
+		    i->second->content_count == count &&
+		    i->second->win_start <= start_time && end_time <= i->second->win_end)
+			return i->second;
+	}
+	auto now = time(nullptr);
+	auto idx = std::make_shared<fb_index>();
+	idx->commit_time = commit_time;
+	idx->content_count = count;
+	idx->built = now;
+	auto ws = now - now % 86400 - fb_window_past, we = ws + fb_window_past + fb_window_future;
+	if (start_time < ws || end_time > we) {
+		/* Not cacheable; just this once. */
+		if (!fb_build(dir, start_time, end_time, *idx))
+			return nullptr;
+		return idx;
+	}
+	if (!fb_build(dir, ws, we, *idx))
+		return nullptr;
+	std::lock_guard lk(g_fb_lock);
+	if (g_fb_cache.size() >= fb_cache_max && g_fb_cache.find(dir) == g_fb_cache.end()) {
+		auto old = std::min_element(g_fb_cache.begin(), g_fb_cache.end(),
+		           [](const auto &a, const auto &b) { return a.second->built < b.second->built; });
+		g_fb_cache.erase(old);
+	}
+	g_fb_cache[dir] = idx;
+	return idx;
+}
+
+bool get_freebusy(const char *username, const char *dir, time_t start_time,
+    time_t end_time, std::vector<freebusy_event> &fb_data) try
+{
+	uint32_t permission = 0;
+	auto cal_eid = rop_util_make_eid_ex(1, PRIVATE_FID_CALENDAR);
+
+	if (username != nullptr) {
+		if (!exmdb_client::get_folder_perm(dir, cal_eid, username, &permission))
+			return false;
+		if (!(permission & (frightsFreeBusySimple | frightsFreeBusyDetailed | frightsReadAny)))
+			return false;
+	} else {
+		permission = frightsFreeBusyDetailed | frightsReadAny;
+	}
+	bool detailed = permission & (frightsFreeBusyDetailed | frightsReadAny);
+
+	/* Any message write, move or deletion in the folder changes these. */
+	static constexpr uint32_t vtags[] = {PR_LOCAL_COMMIT_TIME_MAX, PR_CONTENT_COUNT};
+	static constexpr PROPTAG_ARRAY vtaglist = {std::size(vtags), deconst(vtags)};
+	TPROPVAL_ARRAY vals;
+	if (!exmdb_client::get_folder_properties(dir, CP_ACP, cal_eid, &vtaglist, &vals))
+		return false;
+	auto ct = vals.get<const uint64_t>(PR_LOCAL_COMMIT_TIME_MAX);
+	auto cc = vals.get<const uint32_t>(PR_CONTENT_COUNT);
+	auto idx = fb_index_get(dir, ct != nullptr ? *ct : 0,
+	           cc != nullptr ? *cc : 0, start_time, end_time);
+	if (idx == nullptr)
+		return false;
+	fb_scan(*idx, start_time, end_time, detailed, fb_data);
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1230: ENOMEM");
+	return false;
+}
@@ -0,0 +1,377 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Per-host load cache for a domain's directory data, shared between the
+ * address books of nsp (http) and zcore, so that only one of them has to
+ * query MySQL when a domain changes. Consumers decode the data into their own
+ * trees; the mapping itself is not what they serve lookups from.
+ *
+ * File layout (all integers little-endian; "ref" is a u32 offset + u32 length
+ * into the string pool):
+ *
+ *	header (HDR_SIZE bytes, see HDR_* below)
+ *	groups    {u32 id, ref name, ref title, u32 first_member, u32 nmembers}
+ *	users     {u32 id, u32 dtypx, u32 list_type, u32 hidden, u32 list_priv,
+ *	           ref username, ref maildir, u32 first_alias, u32 naliases,
+ *	           u32 first_prop, u32 nprops}
+ *	members   {u32 user_index}
+ *	aliases   {ref}
+ *	props     {u32 proptag, ref value}
+ *	idmap     {u32 user_id, u32 user_index}, sorted by user_id
+ *	string pool
+ */
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <libHX/io.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <gromox/endian.hpp>
+#include <gromox/fileio.h>
+#include <gromox/gal_snapshot.hpp>
+#include <gromox/util.hpp>
+
+namespace gromox {
+
+static constexpr char GAL_MAGIC[8] = {'G', 'X', 'G', 'A', 'L', 'S', 'N', 1};
+static constexpr uint32_t GAL_VERSION = 1;
+static constexpr size_t REF_SIZE = 8, GROUP_SIZE = 28, USER_SIZE = 52,
+	MEMBER_SIZE = 4, ALIAS_SIZE = REF_SIZE, PROP_SIZE = 12, IDMAP_SIZE = 8;
+enum {
+	HDR_VERSION = 8, HDR_DOMAIN = 12, HDR_GEN = 16, HDR_DIGEST = 24,
+	HDR_DOMINFO = 32, /* 3 refs */
+	HDR_GROUPS = 56, HDR_USERS = 64, HDR_MEMBERS = 72, HDR_ALIASES = 80,
+	HDR_PROPS = 88, /* each: u32 count, u32 offset */
+	HDR_IDMAP = 96, HDR_DOMUSERS = 100, /* u32 first, u32 count */
+	HDR_POOL = 108, /* u32 size, u32 offset */
+	HDR_SIZE = 128,
+};
+
+namespace {
+
+class gal_writer {
+	public:
+	void put_ref(std::string &sect, std::string_view s);
+	static void put32(std::string &sect, uint32_t v);
+	void add_user(const sql_user &);
+
+	std::string groups, users, members, aliases, props, pool;
+	std::vector<std::pair<uint32_t, uint32_t>> idmap;
+	uint32_t nusers = 0, naliases = 0, nprops = 0;
+};
+
+}
+
+void gal_writer::put32(std::string &sect, uint32_t v)
+{
+	char b[4];
+	cpu_to_le32p(b, v);
+	sect.append(b, sizeof(b));
+}
+
+void gal_writer::put_ref(std::string &sect, std::string_view s)
+{
+	put32(sect, pool.size());
+	put32(sect, s.size());
+	pool.append(s);
+}
+
+void gal_writer::add_user(const sql_user &u)
+{
+	put32(users, u.id);
+	put32(users, static_cast<uint32_t>(u.dtypx));
+	put32(users, static_cast<uint32_t>(u.list_type));
+	put32(users, u.hidden);
+	put32(users, u.list_priv);
+	put_ref(users, u.username);
+	put_ref(users, u.maildir);
+	put32(users, naliases);
+	put32(users, u.aliases.size());
+	for (const auto &a : u.aliases)
+		put_ref(aliases, a);
+	naliases += u.aliases.size();
+	put32(users, nprops);
+	put32(users, u.propvals.size());
+	for (const auto &[tag, val] : u.propvals) {
+		put32(props, tag);
+		put_ref(props, val);
+	}
+	nprops += u.propvals.size();
+	idmap.emplace_back(u.id, nusers);
+	put32(members, nusers++);
+}
+
+/**
+ * Write @d as generation @gen of @domain_id's snapshot in @dir, replacing
+ * the previous one atomically.
+ */
+errno_t gal_snapshot_write(const char *dir, unsigned int domain_id,
+    uint64_t gen, std::string_view digest, const gal_domain_data &d) try
+{
+	gal_writer w;
+	std::string hdr(HDR_SIZE, '\0');
+	memcpy(hdr.data(), GAL_MAGIC, sizeof(GAL_MAGIC));
+	cpu_to_le32p(&hdr[HDR_VERSION], GAL_VERSION);
+	cpu_to_le32p(&hdr[HDR_DOMAIN], domain_id);
+	cpu_to_le64p(&hdr[HDR_GEN], gen);
+	std::string refs;
+	w.put_ref(refs, digest);
+	w.put_ref(refs, d.info.name);
+	w.put_ref(refs, d.info.title);
+	w.put_ref(refs, d.info.address);
+	memcpy(&hdr[HDR_DIGEST], refs.data(), refs.size());
+
+	for (const auto &[grp, usrs] : d.groups) {
+		w.put32(w.groups, grp.id);
+		w.put_ref(w.groups, grp.name);
+		w.put_ref(w.groups, grp.title);
+		w.put32(w.groups, w.nusers);
+		w.put32(w.groups, usrs.size());
+		for (const auto &u : usrs)
+			w.add_user(u);
+	}
+	auto dom_first = w.nusers;
+	for (const auto &u : d.users)
+		w.add_user(u);
+	std::sort(w.idmap.begin(), w.idmap.end());
+	std::string idmap;
+	for (const auto &[id, idx] : w.idmap) {
+		w.put32(idmap, id);
+		w.put32(idmap, idx);
+	}
+
+	size_t off = HDR_SIZE;
+	auto sect = [&](unsigned int hoff, size_t count, const std::string &s) {
+		cpu_to_le32p(&hdr[hoff], count);
+		cpu_to_le32p(&hdr[hoff+4], off);
+		off += s.size();
+	};
+	sect(HDR_GROUPS, d.groups.size(), w.groups);
+	sect(HDR_USERS, w.nusers, w.users);
+	sect(HDR_MEMBERS, w.nusers, w.members);
+	sect(HDR_ALIASES, w.naliases, w.aliases);
+	sect(HDR_PROPS, w.nprops, w.props);
+	cpu_to_le32p(&hdr[HDR_IDMAP], off);
+	off += idmap.size();
+	cpu_to_le32p(&hdr[HDR_DOMUSERS], dom_first);
+	cpu_to_le32p(&hdr[HDR_DOMUSERS+4], w.nusers - dom_first);
+	cpu_to_le32p(&hdr[HDR_POOL], w.pool.size());
+	cpu_to_le32p(&hdr[HDR_POOL+4], off);
+	if (off + w.pool.size() > UINT32_MAX)
+		return EFBIG;
+
+	gromox::tmpfile tf;
+	auto fd = tf.open_linkable(dir, O_WRONLY | O_TRUNC);
+	if (fd < 0)
+		return -fd;
+	for (const auto *s : {&hdr, &w.groups, &w.users, &w.members,
+	     &w.aliases, &w.props, &idmap, &w.pool})
+		if (HXio_fullwrite(tf, s->data(), s->size()) < 0)
+			return errno;
+	return tf.link_to((std::string(dir) + "/" + std::to_string(domain_id) + ".gal").c_str());
+} catch (const std::bad_alloc &) {
+	return ENOMEM;
+}
+
+gal_snapshot::~gal_snapshot()
+{
+	if (m_base != nullptr)
+		munmap(const_cast<unsigned char *>(m_base), m_size);
+}
+
+std::unique_ptr<gal_snapshot> gal_snapshot::map(const char *path) try
+{
+	wrapfd fd = open(path, O_RDONLY);
+	struct stat sb;
+	if (fd.get() < 0 || fstat(fd.get(), &sb) != 0 ||
+	    static_cast<uint64_t>(sb.st_size) < HDR_SIZE)
+		return nullptr;
+	auto p = mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, fd.get(), 0);
+	if (p == MAP_FAILED)
+		return nullptr;
+	std::unique_ptr<gal_snapshot> snap(new gal_snapshot);
+	snap->m_base = static_cast<const unsigned char *>(p);
+	snap->m_size = sb.st_size;
+	if (!snap->validate()) {
+		mlog(LV_WARN, "W-1752: %s: not a usable GAL snapshot", path);
+		return nullptr;
+	}
+	return snap;
+} catch (const std::bad_alloc &) {
+	return nullptr;
+}
+
+bool gal_snapshot::validate()
+{
+	auto h = m_base;
+	if (memcmp(h, GAL_MAGIC, sizeof(GAL_MAGIC)) != 0 ||
+	    le32p_to_cpu(&h[HDR_VERSION]) != GAL_VERSION)
+		return false;
+	m_domain_id = le32p_to_cpu(&h[HDR_DOMAIN]);
+	m_gen = le64p_to_cpu(&h[HDR_GEN]);
+	m_pool_size = le32p_to_cpu(&h[HDR_POOL]);
+	uint64_t pool_off = le32p_to_cpu(&h[HDR_POOL+4]);
+	if (pool_off + m_pool_size > m_size)
+		return false;
+	m_pool = &h[pool_off];
+	auto sect = [&](unsigned int hoff, size_t recsize, size_t &count,
+	            const unsigned char *&ptr) {
+		count = le32p_to_cpu(&h[hoff]);
+		uint64_t off = le32p_to_cpu(&h[hoff+4]);
+		if (off + static_cast<uint64_t>(count) * recsize > pool_off)
+			return false;
+		ptr = &h[off];
+		return true;
+	};
+	if (!sect(HDR_GROUPS, GROUP_SIZE, m_ngroups, m_groups) ||
+	    !sect(HDR_USERS, USER_SIZE, m_nusers, m_users) ||
+	    !sect(HDR_MEMBERS, MEMBER_SIZE, m_nmembers, m_members) ||
+	    !sect(HDR_ALIASES, ALIAS_SIZE, m_naliases, m_aliases) ||
+	    !sect(HDR_PROPS, PROP_SIZE, m_nprops, m_props))
+		return false;
+	uint64_t idmap_off = le32p_to_cpu(&h[HDR_IDMAP]);
+	if (idmap_off + static_cast<uint64_t>(m_nusers) * IDMAP_SIZE > pool_off)
+		return false;
+	m_idmap = &h[idmap_off];
+	m_dom_first = le32p_to_cpu(&h[HDR_DOMUSERS]);
+	m_dom_count = le32p_to_cpu(&h[HDR_DOMUSERS+4]);
+	if (static_cast<uint64_t>(m_dom_first) + m_dom_count > m_nmembers)
+		return false;
+	m_dominfo = &h[HDR_DOMINFO];
+	return str(&h[HDR_DIGEST], m_digest);
+}
+
+bool gal_snapshot::str(const unsigned char *ref, std::string &out) const
+{
+	uint64_t off = le32p_to_cpu(ref), len = le32p_to_cpu(&ref[4]);
+	if (off + len > m_pool_size)
+		return false;
+	out.assign(reinterpret_cast<const char *>(&m_pool[off]), len);
+	return true;
+}
+
+ssize_t gal_snapshot::find_user(unsigned int id) const
+{
+	size_t lo = 0, hi = m_nusers;
+	while (lo < hi) {
+		auto mid = lo + (hi - lo) / 2;
+		auto v = le32p_to_cpu(&m_idmap[mid*IDMAP_SIZE]);
+		if (v == id)
+			return le32p_to_cpu(&m_idmap[mid*IDMAP_SIZE+4]);
+		if (v < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
+
+bool gal_snapshot::decode_user(size_t idx, sql_user &u) const
+{
+	if (idx >= m_nusers)
+		return false;
+	auto r = &m_users[idx*USER_SIZE];
+	u.id = le32p_to_cpu(&r[0]);
+	u.dtypx = static_cast<enum display_type>(le32p_to_cpu(&r[4]));
+	u.list_type = static_cast<enum mlist_type>(le32p_to_cpu(&r[8]));
+	u.hidden = le32p_to_cpu(&r[12]);
+	u.list_priv = le32p_to_cpu(&r[16]);
+	if (!str(&r[20], u.username) || !str(&r[28], u.maildir))
+		return false;
+	uint64_t first = le32p_to_cpu(&r[36]), count = le32p_to_cpu(&r[40]);
+	if (first + count > m_naliases)
+		return false;
+	u.aliases.resize(count);
+	for (size_t i = 0; i < count; ++i)
+		if (!str(&m_aliases[(first+i)*ALIAS_SIZE], u.aliases[i]))
+			return false;
+	first = le32p_to_cpu(&r[44]);
+	count = le32p_to_cpu(&r[48]);
+	if (first + count > m_nprops)
+		return false;
+	u.propvals.clear();
+	for (size_t i = 0; i < count; ++i) {
+		auto p = &m_props[(first+i)*PROP_SIZE];
+		if (!str(&p[4], u.propvals[le32p_to_cpu(p)]))
+			return false;
+	}
+	return true;
+}
+
+bool gal_snapshot::decode(gal_domain_data &d) const try
+{
+	auto members = [&](size_t first, size_t count, std::vector<sql_user> &out) {
+		if (first + count > m_nmembers)
+			return false;
+		out.resize(count);
+		for (size_t i = 0; i < count; ++i)
+			if (!decode_user(le32p_to_cpu(&m_members[(first+i)*MEMBER_SIZE]), out[i]))
+				return false;
+		return true;
+	};
+	if (!str(&m_dominfo[0], d.info.name) ||
+	    !str(&m_dominfo[REF_SIZE], d.info.title) ||
+	    !str(&m_dominfo[2*REF_SIZE], d.info.address))
+		return false;
+	d.groups.resize(m_ngroups);
+	for (size_t i = 0; i < m_ngroups; ++i) {
+		auto r = &m_groups[i*GROUP_SIZE];
+		auto &[grp, usrs] = d.groups[i];
+		grp.id = le32p_to_cpu(&r[0]);
+		if (!str(&r[4], grp.name) || !str(&r[12], grp.title) ||
+		    !members(le32p_to_cpu(&r[20]), le32p_to_cpu(&r[24]), usrs))
+			return false;
+	}
+	return members(m_dom_first, m_dom_count, d.users);
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1753: ENOMEM");
+	return false;
+}
+
+/**
+ * Obtain the directory data of @domain_id. If @dir holds a snapshot with the
+ * current @digest, it is used; otherwise the data is fetched with @fetch and
+ * a new snapshot generation is written. An flock on a per-domain lock file
+ * makes sure that only one process on the host runs @fetch for a given
+ * change; the others wait and then read its result.
+ */
+bool gal_snapshot_obtain(const char *dir, unsigned int domain_id,
+    const std::string &digest, const gal_fetch_fn &fetch,
+    gal_domain_data &out) try
+{
+	if (dir == nullptr || *dir == '\0' || digest.empty())
+		return fetch(domain_id, out);
+	auto path = std::string(dir) + "/" + std::to_string(domain_id) + ".gal";
+	auto snap = gal_snapshot::map(path.c_str());
+	if (snap != nullptr && snap->digest() == digest && snap->decode(out))
+		return true;
+	wrapfd lk = open((path + ".lock").c_str(), O_RDWR | O_CREAT, FMODE_PRIVATE);
+	if (lk.get() >= 0 && flock(lk.get(), LOCK_EX) == 0) {
+		snap = gal_snapshot::map(path.c_str());
+		out = {};
+		if (snap != nullptr && snap->digest() == digest && snap->decode(out))
+			return true;
+	}
+	out = {};
+	if (!fetch(domain_id, out))
+		return false;
+	auto err = gal_snapshot_write(dir, domain_id,
+	           snap != nullptr ? snap->generation() + 1 : 1, digest, out);
+	if (err != 0)
+		mlog(LV_WARN, "W-1754: %s: cannot write GAL snapshot: %s",
+		        path.c_str(), strerror(err));
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1755: ENOMEM");
+	return false;
+}
+
+}
@@ -1,4 +1,6 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#include <algorithm>
+#include <array>
 #include <climits>
 #include <cstdint>
 #include <cstdlib>
@@ -2111,13 +2113,103 @@ pack_result EXT_PULL::g_fb_a(FB_ARRAY *r)
 	return EXT_ERR_SUCCESS;
 }
 
+namespace {
+
+/*
+ * Per-thread cache of EXT_PUSH buffers, so that the serializer of a busy
+ * RPC thread does not start from a fresh 8K buffer (and realloc its way up)
+ * for every response. Class k holds buffers of exactly 8K<<k bytes, up to
+ * PUSHBUF_DEPTH of them; larger buffers are not retained.
+ */
+struct pushbuf_cache {
+	static constexpr size_t MIN = 8192;
+	static constexpr unsigned int CLASSES = 8, DEPTH = 2;
+
+	~pushbuf_cache();
+	static int size_class(size_t);
+	static size_t round_up(size_t);
+
+	std::array<std::array<void *, DEPTH>, CLASSES> slot{};
+	std::array<unsigned int, CLASSES> count{};
+};
+
+}
+
+static thread_local pushbuf_cache g_pushbuf_cache;
+
+pushbuf_cache::~pushbuf_cache()
+{
+	for (unsigned int k = 0; k < CLASSES; ++k)
+		for (unsigned int i = 0; i < count[k]; ++i)
+			free(slot[k][i]);
+}
+
+/* Class index if @z is exactly a class size, else -1 */
+int pushbuf_cache::size_class(size_t z)
+{
+	for (unsigned int k = 0; k < CLASSES; ++k)
+		if (z == MIN << k)
+			return k;
+	return -1;
+}
+
+size_t pushbuf_cache::round_up(size_t z)
+{
+	for (unsigned int k = 0; k < CLASSES; ++k)
+		if (z <= MIN << k)
+			return MIN << k;
+	return z;
+}
+
+static void *ext_pushbuf_get(size_t &z)
+{
+	auto &c = g_pushbuf_cache;
+	z = c.round_up(z);
+	auto k = c.size_class(z);
+	if (k >= 0 && c.count[k] > 0)
+		return c.slot[k][--c.count[k]];
+	return malloc(z);
+}
+
+/**
+ * Return a buffer that came out of an EXT_PUSH (via release(), or when it
+ * was initialized with pdata==nullptr and no custom EXT_BUFFER_MGT) to the
+ * calling thread's cache. @z must be the EXT_PUSH's m_alloc_size. Buffers
+ * that do not fit the cache are freed.
+ */
+void ext_pushbuf_put(void *p, size_t z)
+{
+	if (p == nullptr)
+		return;
+	auto &c = g_pushbuf_cache;
+	auto k = c.size_class(z);
+	if (k < 0 || c.count[k] >= c.DEPTH) {
+		free(p);
+		return;
+	}
+	c.slot[k][c.count[k]++] = p;
+}
+
 BOOL EXT_PUSH::init(void *pdata, uint32_t alloc_size,
     uint32_t flags, const EXT_BUFFER_MGT *mgt)
 {
 	const EXT_BUFFER_MGT default_mgt = {zalloc, realloc, free};
 	m_mgt = mgt != nullptr ? *mgt : default_mgt;
-	if (pdata == nullptr) {
+	m_refs.clear();
+	m_ref_bytes = 0;
+	if (pdata == nullptr && mgt == nullptr) {
+		size_t z = std::max(static_cast<size_t>(alloc_size), pushbuf_cache::MIN);
 		b_alloc = TRUE;
+		m_pooled = true;
+		m_udata = static_cast<uint8_t *>(ext_pushbuf_get(z));
+		if (m_udata == nullptr) {
+			m_alloc_size = 0;
+			return FALSE;
+		}
+		m_alloc_size = z;
+	} else if (pdata == nullptr) {
+		b_alloc = TRUE;
+		m_pooled = false;
 		m_alloc_size = 8192;
 		m_udata = static_cast<uint8_t *>(m_mgt.alloc(m_alloc_size));
 		if (m_udata == nullptr) {
@@ -2136,7 +2228,11 @@ BOOL EXT_PUSH::init(void *pdata, uint32_t alloc_size,
 
 EXT_PUSH::~EXT_PUSH()
 {
-	if (b_alloc)
+	if (!b_alloc)
+		return;
+	if (m_pooled)
+		ext_pushbuf_put(m_udata, m_alloc_size);
+	else
 		m_mgt.free(m_udata);
 }
 
@@ -2159,6 +2255,8 @@ BOOL EXT_PUSH::check_ovf(uint32_t extra_size)
 	if (alloc_size < m_alloc_size * 2)
 		/* Exponential growth policy, needed to reach amortized linear time (like std::string) */
 		alloc_size = m_alloc_size * 2;
+	if (m_pooled)
+		alloc_size = pushbuf_cache::round_up(alloc_size);
 	auto pdata = static_cast<uint8_t *>(m_mgt.realloc(m_udata, alloc_size));
 	if (pdata == nullptr)
 		return FALSE;
@@ -2171,10 +2269,49 @@ pack_result EXT_PUSH::advance(uint32_t size)
 {
 	if (!check_ovf(size))
 		return EXT_ERR_BUFSIZE;
+	/* Buffers from the cache are not zeroed */
+	memset(&m_udata[m_offset], 0, size);
 	m_offset += size;
 	return EXT_ERR_SUCCESS;
 }
 
+/**
+ * Under EXT_FLAG_IOVREF, append @n bytes at @pdata by reference: they are
+ * not copied into the buffer, but the caller has to keep them alive until
+ * the output from get_iov has been consumed. Otherwise same as p_bytes.
+ */
+pack_result EXT_PUSH::p_ref(const void *pdata, uint32_t n)
+{
+	if (!(m_flags & EXT_FLAG_IOVREF) || n < EXT_PUSH_REF_MIN)
+		return p_bytes(pdata, n);
+	try {
+		m_refs.push_back({m_offset, n, pdata});
+	} catch (const std::bad_alloc &) {
+		return EXT_ERR_ALLOC;
+	}
+	m_ref_bytes += n;
+	return EXT_ERR_SUCCESS;
+}
+
+/**
+ * Describe the serialized data as a list of iovecs, interleaving the buffer
+ * with the blocks added by p_ref.
+ */
+void EXT_PUSH::get_iov(std::vector<struct iovec> &iov) const
+{
+	iov.clear();
+	iov.reserve(2 * m_refs.size() + 1);
+	uint32_t pos = 0;
+	for (const auto &r : m_refs) {
+		if (r.offset > pos)
+			iov.push_back({&m_udata[pos], r.offset - pos});
+		iov.push_back({const_cast<void *>(r.data), r.size});
+		pos = r.offset;
+	}
+	if (m_offset > pos)
+		iov.push_back({&m_udata[pos], m_offset - pos});
+}
+
 pack_result EXT_PUSH::p_bytes(const void *pdata, uint32_t n)
 {
 	if (n == 0)
@@ -2266,7 +2403,7 @@ pack_result EXT_PUSH::p_bin(const BINARY &r)
 	}
 	if (r.cb == 0)
 		return EXT_ERR_SUCCESS;
-	return p_bytes(r.pb, r.cb);
+	return p_ref(r.pb, r.cb);
 }
 
 pack_result EXT_PUSH::p_bin_s(const BINARY &r)
@@ -2305,7 +2442,7 @@ pack_result EXT_PUSH::p_str(const char *pstr)
 			return p_uint8(0);
 		}
 	}
-	return p_bytes(pstr, len + 1);
+	return p_ref(pstr, len + 1);
 }
 
 pack_result EXT_PUSH::p_wstr(const char *pstr)
@@ -3523,6 +3660,7 @@ uint8_t *EXT_PUSH::release()
 	auto t = p->m_udata;
 	m_udata = nullptr;
 	p->b_alloc = false;
+	m_pooled = false;
 	m_offset = 0;
 	return t;
 }
@@ -3551,3 +3689,109 @@ bool oneoff_to_parts(EXT_PULL &ser, char *type, size_t tsize,
 	gx_strlcpy(addr, eid.pmail_address, asize);
 	return true;
 }
+
+template<typename T> static inline size_t ext_push_mvcount(const void *pv)
+{
+	return static_cast<const T *>(pv)->count;
+}
+
+/* Approximate packed size of one property value (for presizing buffers) */
+static size_t ext_push_estimate(uint16_t type, const void *pv)
+{
+	if (pv == nullptr)
+		return 1;
+	if ((type & MVI_FLAG) == MVI_FLAG)
+		type &= ~MVI_FLAG;
+	switch (type) {
+	case PT_SHORT:
+		return 2;
+	case PT_LONG:
+	case PT_ERROR:
+	case PT_FLOAT:
+		return 4;
+	case PT_BOOLEAN:
+		return 1;
+	case PT_CLSID:
+		return 16;
+	case PT_STRING8:
+	case PT_UNICODE:
+		return strlen(static_cast<const char *>(pv)) + 1;
+	case PT_OBJECT:
+	case PT_BINARY:
+		return 4 + static_cast<const BINARY *>(pv)->cb;
+	case PT_MV_SHORT:
+		return 4 + 2 * ext_push_mvcount<SHORT_ARRAY>(pv);
+	case PT_MV_LONG:
+		return 4 + 4 * ext_push_mvcount<LONG_ARRAY>(pv);
+	case PT_MV_FLOAT:
+		return 4 + 4 * ext_push_mvcount<FLOAT_ARRAY>(pv);
+	case PT_MV_DOUBLE:
+	case PT_MV_APPTIME:
+		return 4 + 8 * ext_push_mvcount<DOUBLE_ARRAY>(pv);
+	case PT_MV_I8:
+	case PT_MV_CURRENCY:
+	case PT_MV_SYSTIME:
+		return 4 + 8 * ext_push_mvcount<LONGLONG_ARRAY>(pv);
+	case PT_MV_CLSID:
+		return 4 + 16 * ext_push_mvcount<GUID_ARRAY>(pv);
+	case PT_MV_STRING8:
+	case PT_MV_UNICODE: {
+		auto &sa = *static_cast<const STRING_ARRAY *>(pv);
+		size_t z = 4;
+		for (size_t i = 0; i < sa.count; ++i)
+			z += strlen(sa.ppstr[i]) + 1;
+		return z;
+	}
+	case PT_MV_BINARY: {
+		auto &ba = *static_cast<const BINARY_ARRAY *>(pv);
+		size_t z = 4;
+		for (size_t i = 0; i < ba.count; ++i)
+			z += 4 + ba.pbin[i].cb;
+		return z;
+	}
+	case PT_SVREID:
+	case PT_SRESTRICTION:
+	case PT_ACTIONS:
+		return 64;
+	default:
+		return 8;
+	}
+}
+
+/**
+ * Quick estimate of the packed size, without any charset conversion or
+ * restriction walking, for use as the EXT_PUSH::init size hint so that
+ * large responses do not go through many rounds of realloc.
+ */
+size_t ext_push_estimate(const TPROPVAL_ARRAY &a)
+{
+	size_t z = 2;
+	for (size_t i = 0; i < a.count; ++i)
+		z += 4 + ext_push_estimate(PROP_TYPE(a.ppropval[i].proptag),
+		     a.ppropval[i].pvalue);
+	return z;
+}
+
+size_t ext_push_estimate(const TARRAY_SET &s)
+{
+	size_t z = 4;
+	for (size_t i = 0; i < s.count; ++i)
+		z += ext_push_estimate(*s.pparray[i]);
+	return z;
+}
+
+size_t ext_push_estimate(const MESSAGE_CONTENT &m)
+{
+	size_t z = ext_push_estimate(m.proplist) + 2;
+	if (m.children.prcpts != nullptr)
+		z += ext_push_estimate(*m.children.prcpts);
+	if (m.children.pattachments == nullptr)
+		return z;
+	auto &al = *m.children.pattachments;
+	for (size_t i = 0; i < al.count; ++i) {
+		z += ext_push_estimate(al.pplist[i]->proplist) + 1;
+		if (al.pplist[i]->pembedded != nullptr)
+			z += ext_push_estimate(*al.pplist[i]->pembedded);
+	}
+	return z;
+}
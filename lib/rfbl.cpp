@@ -1442,6 +1442,193 @@ std::string json_to_str(const Json::Value &jv)
 	return Json::writeString(swb, jv);
 }
 
+/*
+ * Compact binary form of a JSON tree, for caches that want to skip the text
+ * parser. A version byte is followed by the root value. Every value is a type
+ * byte and then a varint (integers, lengths, counts), 8 raw bytes (reals, in
+ * host order), or nothing. Object members are key length, key, value.
+ */
+enum {
+	JB_NULL, JB_FALSE, JB_TRUE, JB_INT, JB_UINT, JB_REAL, JB_STRING,
+	JB_ARRAY, JB_OBJECT,
+};
+
+static constexpr uint8_t JB_VERSION = 1;
+static constexpr unsigned int JB_MAXDEPTH = 64;
+
+static void jbin_putv(std::string &out, uint64_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		out += static_cast<char>(v | 0x80);
+	out += static_cast<char>(v);
+}
+
+static void jbin_puts(std::string &out, const char *b, const char *e)
+{
+	jbin_putv(out, e - b);
+	out.append(b, e - b);
+}
+
+static void jbin_put(std::string &out, const Json::Value &jv)
+{
+	switch (jv.type()) {
+	case Json::nullValue:
+		out += static_cast<char>(JB_NULL);
+		break;
+	case Json::booleanValue:
+		out += static_cast<char>(jv.asBool() ? JB_TRUE : JB_FALSE);
+		break;
+	case Json::intValue: {
+		auto v = jv.asInt64();
+		out += static_cast<char>(JB_INT);
+		/* zigzag, so that small negative numbers stay short */
+		jbin_putv(out, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+		break;
+	}
+	case Json::uintValue:
+		out += static_cast<char>(JB_UINT);
+		jbin_putv(out, jv.asUInt64());
+		break;
+	case Json::realValue: {
+		auto d = jv.asDouble();
+		out += static_cast<char>(JB_REAL);
+		out.append(reinterpret_cast<const char *>(&d), sizeof(d));
+		break;
+	}
+	case Json::stringValue: {
+		const char *b = nullptr, *e = nullptr;
+		jv.getString(&b, &e);
+		out += static_cast<char>(JB_STRING);
+		jbin_puts(out, b, e);
+		break;
+	}
+	case Json::arrayValue:
+		out += static_cast<char>(JB_ARRAY);
+		jbin_putv(out, jv.size());
+		for (const auto &e : jv)
+			jbin_put(out, e);
+		break;
+	case Json::objectValue:
+		out += static_cast<char>(JB_OBJECT);
+		jbin_putv(out, jv.size());
+		for (auto it = jv.begin(); it != jv.end(); ++it) {
+			auto key = it.name();
+			jbin_puts(out, key.data(), key.data() + key.size());
+			jbin_put(out, *it);
+		}
+		break;
+	}
+}
+
+std::string json_to_bin(const Json::Value &jv)
+{
+	std::string out;
+	out += static_cast<char>(JB_VERSION);
+	jbin_put(out, jv);
+	return out;
+}
+
+namespace {
+struct jbin_reader {
+	const uint8_t *p, *end;
+	bool getv(uint64_t &);
+	bool gets(const char *&, const char *&);
+};
+}
+
+bool jbin_reader::getv(uint64_t &v)
+{
+	v = 0;
+	for (unsigned int shift = 0; p < end && shift < 64; shift += 7) {
+		auto c = *p++;
+		v |= static_cast<uint64_t>(c & 0x7F) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+bool jbin_reader::gets(const char *&b, const char *&e)
+{
+	uint64_t len;
+	if (!getv(len) || len > static_cast<size_t>(end - p))
+		return false;
+	b = reinterpret_cast<const char *>(p);
+	e = b + len;
+	p += len;
+	return true;
+}
+
+static bool jbin_get(jbin_reader &r, Json::Value &jv, unsigned int depth)
+{
+	if (r.p >= r.end || depth > JB_MAXDEPTH)
+		return false;
+	uint64_t v;
+	const char *b, *e;
+	switch (*r.p++) {
+	case JB_NULL:
+		jv = Json::nullValue;
+		return true;
+	case JB_FALSE:
+	case JB_TRUE:
+		jv = r.p[-1] == JB_TRUE;
+		return true;
+	case JB_INT:
+		if (!r.getv(v))
+			return false;
+		jv = static_cast<Json::Value::Int64>((v >> 1) ^ (~(v & 1) + 1));
+		return true;
+	case JB_UINT:
+		if (!r.getv(v))
+			return false;
+		jv = static_cast<Json::Value::UInt64>(v);
+		return true;
+	case JB_REAL: {
+		double d;
+		if (static_cast<size_t>(r.end - r.p) < sizeof(d))
+			return false;
+		memcpy(&d, r.p, sizeof(d));
+		r.p += sizeof(d);
+		jv = d;
+		return true;
+	}
+	case JB_STRING:
+		if (!r.gets(b, e))
+			return false;
+		jv = Json::Value(b, e);
+		return true;
+	case JB_ARRAY:
+		/* every element takes at least one byte */
+		if (!r.getv(v) || v > static_cast<size_t>(r.end - r.p))
+			return false;
+		jv = Json::arrayValue;
+		for (Json::ArrayIndex i = 0; i < v; ++i)
+			if (!jbin_get(r, jv[i], depth + 1))
+				return false;
+		return true;
+	case JB_OBJECT:
+		if (!r.getv(v) || v > static_cast<size_t>(r.end - r.p))
+			return false;
+		jv = Json::objectValue;
+		for (uint64_t i = 0; i < v; ++i)
+			if (!r.gets(b, e) ||
+			    !jbin_get(r, jv[std::string(b, e)], depth + 1))
+				return false;
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool json_from_bin(std::string_view sv, Json::Value &jv)
+{
+	jbin_reader r{reinterpret_cast<const uint8_t *>(sv.data()),
+	              reinterpret_cast<const uint8_t *>(sv.data() + sv.size())};
+	if (r.p >= r.end || *r.p++ != JB_VERSION)
+		return false;
+	return jbin_get(r, jv, 0) && r.p == r.end;
+}
+
 errno_t parse_imap_seq(imap_seq_list &r, const char *s) try
 {
 	char *end = nullptr;
@@ -1539,14 +1726,25 @@ std::string iconvtext(const char *src, size_t src_size,
 {
 	if (strcasecmp(from, to) == 0)
 		return {reinterpret_cast<const char *>(src), src_size};
+	if (cset_ascii_compatible(from) && cset_ascii_compatible(to) &&
+	    str_isascii(src, src_size))
+		return {src, src_size};
+	if (strcasecmp(to, "utf-8") == 0) {
+		std::string out;
+		out.resize(3 * src_size);
+		auto ret = sbcs_to_utf8(from, src, src_size, out.data(), out.size(), true);
+		if (ret >= 0) {
+			out.resize(ret);
+			return out;
+		}
+	}
 	auto cs = to + "//IGNORE"s;
-	auto cd = iconv_open(cs.c_str(), from);
+	auto cd = iconv_cached(cs.c_str(), from);
 	if (cd == reinterpret_cast<iconv_t>(-1)) {
 		mlog(LV_ERR, "E-2116: iconv_open %s: %s",
 		        cs.c_str(), strerror(errno));
 		return "UNKNOWN_CHARSET";
 	}
-	auto cleanup = make_scope_exit([&]() { iconv_close(cd); });
 	char buffer[4096];
 	std::string out;
 
@@ -2,11 +2,17 @@
 // SPDX-FileCopyrightText: 2023 grommunio GmbH
 // This file is part of Gromox.
 #include <algorithm>
+#include <chrono>
 #include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
+#include <gromox/clock.hpp>
 #include <gromox/element_data.hpp>
 #include <gromox/exmdb_client.hpp>
 #include <gromox/exmdb_rpc.hpp>
@@ -49,11 +55,59 @@ struct rule_node {
 	NAMEDPROPERTY_INFO xcnames{}, xanames{};
 	RESTRICTION *cond = nullptr;
 	RULE_ACTIONS *act = nullptr;
-	/* XXX: Who frees this? */
 
 	bool operator<(const struct rule_node &o) const { return seq < o.seq; }
 };
 
+/**
+ * Aho-Corasick automaton over the FL_SUBSTRING patterns that the rules of a
+ * folder test against one string property, so that the property value is
+ * scanned once per message rather than once per rule.
+ *
+ * @out:	result slots (see rx_program) of the patterns ending in a node
+ */
+struct rx_matcher {
+	struct node {
+		std::vector<std::pair<uint8_t, uint32_t>> next; /* sorted */
+		std::vector<unsigned int> out;
+		uint32_t fail = 0;
+	};
+
+	void add(const char *pattern, unsigned int slot);
+	void finish();
+	void scan(const char *text, std::vector<uint8_t> &hits) const;
+
+	uint32_t proptag = 0;
+	bool icase = false;
+	std::vector<node> nodes{1};
+
+	private:
+	uint32_t child(uint32_t state, uint8_t c) const;
+	uint32_t step(uint32_t state, uint8_t c) const;
+};
+
+/**
+ * The enabled rules of one folder, loaded and decoded once and then shared
+ * by all deliveries until the folder's rule set changes.
+ *
+ * @arena:	storage of all conditions and actions in @rules
+ * @slots:	hoisted RES_CONTENT nodes and their index in rxparam::hits
+ * @rules_cn:	PR_RULES_CHANGE_NUM of the folder at load time
+ * @fai_count:	PR_ASSOC_CONTENT_COUNT of the folder at load time
+ */
+struct rx_program {
+	rx_program() = default;
+	NOMOVE(rx_program);
+
+	std::vector<rule_node> rules;
+	std::vector<rx_matcher> matchers;
+	std::unordered_map<const RESTRICTION_CONTENT *, unsigned int> slots;
+	std::vector<std::unique_ptr<char[]>> arena;
+	uint64_t rules_cn = 0;
+	uint32_t fai_count = 0;
+	time_point built;
+};
+
 struct folder_node {
 	std::string dir;
 	eid_t fid = 0;
@@ -75,6 +129,7 @@ struct rx_delete {
 /**
  * @ev_to:	Envelope-To, and thus also the rule executing identity
  * @cur:	current pointer to message
+ * @hits:	outcome of the hoisted substring tests (rx_program::slots)
  */
 struct rxparam {
 	const char *ev_from = nullptr, *ev_to = nullptr;
@@ -82,13 +137,28 @@ struct rxparam {
 	std::set<folder_node> loop_check;
 	MESSAGE_CONTENT *ctnt = nullptr;
 	bool del = false, exit = false;
+	const rx_program *prog = nullptr;
+	std::vector<uint8_t> hits;
 };
 
 using message_content_ptr = std::unique_ptr<MESSAGE_CONTENT, rx_delete>;
+using npid_map = std::vector<std::pair<uint16_t, uint16_t>>;
 
 }
 
+/*
+ * Rule programs by store, folder and OOF state. An entry is checked on
+ * every use against the folder's PR_RULES_CHANGE_NUM (bumped by the server
+ * whenever the rules table or an extended rule message is written) and
+ * PR_ASSOC_CONTENT_COUNT (extended rule messages deleted/moved). Entries
+ * are rebuilt after rx_cache_maxage in any case.
+ */
+static constexpr size_t rx_cache_max = 4096;
+static constexpr auto rx_cache_maxage = std::chrono::minutes(10);
 static unsigned int g_ruleproc_debug;
+static std::mutex g_rx_lock;
+static std::unordered_map<std::string, std::shared_ptr<const rx_program>> g_rx_cache;
+static thread_local rx_program *g_rx_arena;
 
 rule_node::rule_node(rule_node &&o) :
 	seq(o.seq), state(o.state), extended(o.extended), rule_id(o.rule_id),
@@ -120,6 +190,117 @@ rule_node &rule_node::operator=(rule_node &&o)
 	return *this;
 }
 
+static inline uint8_t rx_fold(uint8_t c)
+{
+	return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+uint32_t rx_matcher::child(uint32_t state, uint8_t c) const
+{
+	auto &nx = nodes[state].next;
+	auto it = std::lower_bound(nx.begin(), nx.end(), c,
+	          [](const auto &e, uint8_t v) { return e.first < v; });
+	return it != nx.end() && it->first == c ? it->second : 0;
+}
+
+void rx_matcher::add(const char *pattern, unsigned int slot)
+{
+	uint32_t state = 0;
+	for (auto p = reinterpret_cast<const uint8_t *>(pattern); *p != '\0'; ++p) {
+		uint8_t c = icase ? rx_fold(*p) : *p;
+		auto nxt = child(state, c);
+		if (nxt == 0) {
+			nxt = nodes.size();
+			auto &nx = nodes[state].next;
+			nx.emplace(std::lower_bound(nx.begin(), nx.end(), c,
+				[](const auto &e, uint8_t v) { return e.first < v; }), c, nxt);
+			nodes.emplace_back();
+		}
+		state = nxt;
+	}
+	nodes[state].out.push_back(slot);
+}
+
+/* Failure links, breadth-first; a node also reports the matches of its suffixes. */
+void rx_matcher::finish()
+{
+	std::vector<uint32_t> queue;
+	for (const auto &e : nodes[0].next)
+		queue.push_back(e.second);
+	for (size_t i = 0; i < queue.size(); ++i) {
+		auto u = queue[i];
+		for (const auto &[c, v] : nodes[u].next) {
+			auto f = nodes[u].fail;
+			while (f != 0 && child(f, c) == 0)
+				f = nodes[f].fail;
+			f = child(f, c);
+			nodes[v].fail = f;
+			nodes[v].out.insert(nodes[v].out.end(),
+				nodes[f].out.begin(), nodes[f].out.end());
+			queue.push_back(v);
+		}
+	}
+}
+
+uint32_t rx_matcher::step(uint32_t state, uint8_t c) const
+{
+	while (true) {
+		auto nxt = child(state, c);
+		if (nxt != 0 || state == 0)
+			return nxt;
+		state = nodes[state].fail;
+	}
+}
+
+void rx_matcher::scan(const char *text, std::vector<uint8_t> &hits) const
+{
+	uint32_t state = 0;
+	for (auto p = reinterpret_cast<const uint8_t *>(text); *p != '\0'; ++p) {
+		state = step(state, icase ? rx_fold(*p) : *p);
+		for (auto slot : nodes[state].out)
+			hits[slot] = true;
+	}
+}
+
+/* EXT_PULL allocator for decoding into the rx_program under construction */
+static void *rx_arena_alloc(size_t z)
+{
+	try {
+		auto &a = g_rx_arena->arena;
+		a.push_back(std::make_unique<char[]>(z));
+		return a.back().get();
+	} catch (const std::bad_alloc &) {
+		return nullptr;
+	}
+}
+
+/* Deep copy of an RPC result into the arena, by way of the wire format */
+static RESTRICTION *rx_dup(const RESTRICTION &src)
+{
+	EXT_PUSH ep;
+	if (!ep.init(nullptr, 0, 0) || ep.p_restriction(src) != EXT_ERR_SUCCESS)
+		return nullptr;
+	auto dst = static_cast<RESTRICTION *>(rx_arena_alloc(sizeof(RESTRICTION)));
+	if (dst == nullptr)
+		return nullptr;
+	EXT_PULL pl;
+	pl.init(ep.m_udata, ep.m_offset, rx_arena_alloc, 0);
+	return pl.g_restriction(dst) == EXT_ERR_SUCCESS ? dst : nullptr;
+}
+
+static RULE_ACTIONS *rx_dup(const RULE_ACTIONS &src)
+{
+	EXT_PUSH ep;
+	if (!ep.init(nullptr, 0, 0) || ep.p_rule_actions(src) != EXT_ERR_SUCCESS)
+		return nullptr;
+	auto dst = static_cast<RULE_ACTIONS *>(rx_arena_alloc(sizeof(RULE_ACTIONS)));
+	if (dst == nullptr)
+		return nullptr;
+	EXT_PULL pl;
+	pl.init(ep.m_udata, ep.m_offset, rx_arena_alloc, 0);
+	return pl.g_rule_actions(dst) == EXT_ERR_SUCCESS ? dst : nullptr;
+}
+
 static void rx_delete_local(PROPNAME_ARRAY &x)
 {
 	if (x.ppropname == nullptr)
@@ -225,6 +406,92 @@ static ec_error_t rx_npid_replace(rxparam &par, MESSAGE_CONTENT &ctnt,
 	return ecSuccess;
 }
 
+/*
+ * Extended rules carry their own table of named properties; translate the
+ * ids to those of the store @dir once, when the rule is loaded.
+ */
+static ec_error_t rx_npid_resolve(const char *dir,
+    const NAMEDPROPERTY_INFO &info, npid_map &map)
+{
+	if (info.count == 0)
+		return ecSuccess;
+	const PROPNAME_ARRAY names = {info.count, info.ppropname};
+	PROPID_ARRAY ids{};
+	auto cl_0 = make_scope_exit([&]() { free(ids.ppropid); });
+	if (!exmdb_client::get_named_propids(dir, TRUE, &names, &ids)) {
+		mlog(LV_DEBUG, "ruleproc: get_named_propids(%s) failed", dir);
+		return ecRpcFailed;
+	}
+	if (ids.count != info.count) {
+		mlog(LV_ERR, "ruleproc: np(rule) counts are fishy");
+		return ecError;
+	}
+	for (unsigned int i = 0; i < ids.count; ++i)
+		if (ids.ppropid[i] != 0)
+			map.emplace_back(info.ppropid[i], ids.ppropid[i]);
+	return ecSuccess;
+}
+
+static void rx_npid_retag(uint32_t &tag, const npid_map &map)
+{
+	if (PROP_ID(tag) < 0x8000)
+		return;
+	auto it = std::find_if(map.begin(), map.end(),
+	          [&](const auto &e) { return e.first == PROP_ID(tag); });
+	if (it != map.end())
+		tag = PROP_TAG(PROP_TYPE(tag), it->second);
+}
+
+static void rx_npid_retag(RESTRICTION &res, const npid_map &map)
+{
+	switch (res.rt) {
+	case RES_AND:
+	case RES_OR:
+		for (size_t i = 0; i < res.andor->count; ++i)
+			rx_npid_retag(res.andor->pres[i], map);
+		break;
+	case RES_NOT:
+		rx_npid_retag(res.xnot->res, map);
+		break;
+	case RES_CONTENT:
+		rx_npid_retag(res.cont->proptag, map);
+		rx_npid_retag(res.cont->propval.proptag, map);
+		break;
+	case RES_PROPERTY:
+		rx_npid_retag(res.prop->proptag, map);
+		rx_npid_retag(res.prop->propval.proptag, map);
+		break;
+	case RES_PROPCOMPARE:
+		rx_npid_retag(res.pcmp->proptag1, map);
+		rx_npid_retag(res.pcmp->proptag2, map);
+		break;
+	case RES_BITMASK:
+		rx_npid_retag(res.bm->proptag, map);
+		break;
+	case RES_SIZE:
+		rx_npid_retag(res.size->proptag, map);
+		break;
+	case RES_EXIST:
+		rx_npid_retag(res.exist->proptag, map);
+		break;
+	case RES_SUBRESTRICTION:
+		rx_npid_retag(res.sub->res, map);
+		break;
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		for (size_t i = 0; i < res.comment->count; ++i)
+			rx_npid_retag(res.comment->ppropval[i].proptag, map);
+		if (res.comment->pres != nullptr)
+			rx_npid_retag(*res.comment->pres, map);
+		break;
+	case RES_COUNT:
+		rx_npid_retag(res.count->sub_res, map);
+		break;
+	default:
+		break;
+	}
+}
+
 static ec_error_t rx_is_oof(const char *dir, bool *oof)
 {
 	static constexpr uint32_t tags[] = {PR_OOF_STATE};
@@ -282,8 +549,12 @@ static ec_error_t rx_load_std_rules(const char *dir, eid_t fid, bool oof,
 		rule.rule_id = *id;
 		rule.name = znul(row->get<const char>(PR_RULE_NAME));
 		rule.provider = znul(row->get<const char>(PR_RULE_PROVIDER));
-		rule.cond = row->get<RESTRICTION>(PR_RULE_CONDITION);
-		rule.act  = row->get<RULE_ACTIONS>(PR_RULE_ACTIONS);
+		auto cond = row->get<const RESTRICTION>(PR_RULE_CONDITION);
+		auto act  = row->get<const RULE_ACTIONS>(PR_RULE_ACTIONS);
+		if (cond != nullptr && (rule.cond = rx_dup(*cond)) == nullptr)
+			return ecError;
+		if (act != nullptr && (rule.act = rx_dup(*act)) == nullptr)
+			return ecError;
 		rule_list.push_back(std::move(rule));
 	}
 	return ecSuccess;
@@ -353,28 +624,41 @@ static ec_error_t rx_load_ext_rules(const char *dir, eid_t fid, bool oof,
 		if (act == nullptr || act->cb == 0)
 			continue;
 		EXT_PULL ep;
+		npid_map map;
 		if (cond != nullptr && cond->cb != 0) {
-			ep.init(cond->pb, cond->cb, exmdb_rpc_alloc,
+			ep.init(cond->pb, cond->cb, rx_arena_alloc,
 				EXT_FLAG_WCOUNT | EXT_FLAG_UTF16);
 			if (ep.g_namedprop_info(&rule.xcnames) != EXT_ERR_SUCCESS ||
 			    ep.g_restriction(&rule.xcond) != EXT_ERR_SUCCESS)
 				return ecError;
+			auto err = rx_npid_resolve(dir, rule.xcnames, map);
+			if (err != ecSuccess)
+				return err;
+			rx_npid_retag(rule.xcond, map);
 			rule.cond = &rule.xcond;
 		}
 		uint32_t version = 0;
-		ep.init(act->pb, act->cb, exmdb_rpc_alloc,
+		ep.init(act->pb, act->cb, rx_arena_alloc,
 			EXT_FLAG_WCOUNT | EXT_FLAG_UTF16);
 		if (ep.g_namedprop_info(&rule.xanames) != EXT_ERR_SUCCESS ||
 		    ep.g_uint32(&version) != EXT_ERR_SUCCESS ||
 		    version != 1 ||
 		    ep.g_ext_rule_actions(&rule.xact) != EXT_ERR_SUCCESS)
 			return ecError;
+		map.clear();
+		auto err = rx_npid_resolve(dir, rule.xanames, map);
+		if (err != ecSuccess)
+			return err;
+		for (size_t j = 0; j < rule.xact.count; ++j)
+			if (rule.xact.pblock[j].type == OP_TAG &&
+			    rule.xact.pblock[j].pdata != nullptr)
+				rx_npid_retag(static_cast<TAGGED_PROPVAL *>(rule.xact.pblock[j].pdata)->proptag, map);
 		rule_list.emplace_back(std::move(rule));
 	}
 	return ecSuccess;
 }
 
-static bool rx_eval_props(const MESSAGE_CONTENT *ct, const TPROPVAL_ARRAY &props, const RESTRICTION &res);
+static bool rx_eval_props(const MESSAGE_CONTENT *ct, const TPROPVAL_ARRAY &props, const RESTRICTION &res, const rxparam *par = nullptr);
 
 static bool rx_eval_msgsub(const MESSAGE_CHILDREN &ch, uint32_t tag,
     const RESTRICTION &res)
@@ -439,24 +723,33 @@ static bool rx_eval_sub(const MESSAGE_CONTENT *ct, uint32_t tag, const RESTRICTI
 	}
 }
 
+/**
+ * @par:	if set, @props is the message's own property list and hoisted
+ * 		substring tests are answered from @par->hits
+ */
 static bool rx_eval_props(const MESSAGE_CONTENT *ct, const TPROPVAL_ARRAY &props,
-    const RESTRICTION &res)
+    const RESTRICTION &res, const rxparam *par)
 {
 	switch (res.rt) {
 	case RES_OR:
 		for (size_t i = 0; i < res.andor->count; ++i)
-			if (rx_eval_props(ct, props, res.andor->pres[i]))
+			if (rx_eval_props(ct, props, res.andor->pres[i], par))
 				return true;
 		return false;
 	case RES_AND:
 		for (size_t i = 0; i < res.andor->count; ++i)
-			if (!rx_eval_props(ct, props, res.andor->pres[i]))
+			if (!rx_eval_props(ct, props, res.andor->pres[i], par))
 				return false;
 		return true;
 	case RES_NOT:
-		return !rx_eval_props(ct, props, res.xnot->res);
+		return !rx_eval_props(ct, props, res.xnot->res, par);
 	case RES_CONTENT: {
 		auto &rcon = *res.cont;
+		if (par != nullptr) {
+			auto i = par->prog->slots.find(&rcon);
+			if (i != par->prog->slots.end())
+				return par->hits[i->second];
+		}
 		return rcon.comparable() && rcon.eval(props.getval(rcon.proptag));
 	}
 	case RES_PROPERTY: {
@@ -495,15 +788,11 @@ static bool rx_eval_props(const MESSAGE_CONTENT *ct, const TPROPVAL_ARRAY &props
 	case RES_ANNOTATION:
 		if (res.comment->pres == nullptr)
 			return TRUE;
-		return rx_eval_props(ct, props, *res.comment->pres);
+		return rx_eval_props(ct, props, *res.comment->pres, par);
 	case RES_COUNT: {
+		/* Rule programs are shared, so no counting down in place. */
 		auto &rcnt = *res.count;
-		if (rcnt.count == 0)
-			return false;
-		if (!rx_eval_props(ct, props, rcnt.sub_res))
-			return false;
-		--rcnt.count;
-		return true;
+		return rcnt.count > 0 && rx_eval_props(ct, props, rcnt.sub_res, par);
 	}
 	case RES_NULL:
 		return true;
@@ -744,7 +1033,7 @@ static ec_error_t op_process(rxparam &par, const rule_node &rule)
 	if (rule.cond != nullptr) {
 		if (g_ruleproc_debug)
 			mlog(LV_DEBUG, "Rule_Condition %s", rule.cond->repr().c_str());
-		if (!rx_eval_props(par.ctnt, par.ctnt->proplist, *rule.cond))
+		if (!rx_eval_props(par.ctnt, par.ctnt->proplist, *rule.cond, &par))
 			return ecSuccess;
 	}
 	if (rule.state & ST_EXIT_LEVEL)
@@ -780,7 +1069,7 @@ static ec_error_t opx_process(rxparam &par, const rule_node &rule)
 	if (par.exit && !(rule.state & ST_ONLY_WHEN_OOF))
 		return ecSuccess;
 	if (rule.cond != nullptr &&
-	    !rx_eval_props(par.ctnt, par.ctnt->proplist, *rule.cond))
+	    !rx_eval_props(par.ctnt, par.ctnt->proplist, *rule.cond, &par))
 		return ecSuccess;
 	if (rule.state & ST_EXIT_LEVEL)
 		par.exit = true;
@@ -792,6 +1081,151 @@ static ec_error_t opx_process(rxparam &par, const rule_node &rule)
 	return ecSuccess;
 }
 
+/*
+ * Top-level substring tests of a condition. Those below RES_SUBRESTRICTION
+ * are evaluated against recipients/attachments and are left alone.
+ */
+static void rx_hoist_collect(const RESTRICTION &res,
+    std::vector<const RESTRICTION_CONTENT *> &v)
+{
+	switch (res.rt) {
+	case RES_AND:
+	case RES_OR:
+		for (size_t i = 0; i < res.andor->count; ++i)
+			rx_hoist_collect(res.andor->pres[i], v);
+		break;
+	case RES_NOT:
+		rx_hoist_collect(res.xnot->res, v);
+		break;
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		if (res.comment->pres != nullptr)
+			rx_hoist_collect(*res.comment->pres, v);
+		break;
+	case RES_COUNT:
+		rx_hoist_collect(res.count->sub_res, v);
+		break;
+	case RES_CONTENT: {
+		auto &rcon = *res.cont;
+		auto type = PROP_TYPE(rcon.proptag);
+		if ((rcon.fuzzy_level & 0xFFFF) == FL_SUBSTRING &&
+		    (type == PT_UNICODE || type == PT_STRING8) && rcon.comparable() &&
+		    rcon.propval.pvalue != nullptr &&
+		    *static_cast<const char *>(rcon.propval.pvalue) != '\0')
+			v.push_back(&rcon);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+/*
+ * Combine the substring tests on the same property (and with the same case
+ * sensitivity) into one matcher; a single pattern is left to
+ * RESTRICTION_CONTENT::eval.
+ */
+static void rx_hoist(rx_program &prog)
+{
+	std::vector<const RESTRICTION_CONTENT *> cand;
+	for (const auto &rule : prog.rules)
+		if (rule.cond != nullptr)
+			rx_hoist_collect(*rule.cond, cand);
+	std::map<std::pair<uint32_t, bool>, std::vector<const RESTRICTION_CONTENT *>> groups;
+	for (auto rcon : cand)
+		groups[{rcon->proptag, (rcon->fuzzy_level & (FL_IGNORECASE | FL_LOOSE)) != 0}].push_back(rcon);
+	for (const auto &[key, pats] : groups) {
+		if (pats.size() < 2)
+			continue;
+		rx_matcher m;
+		m.proptag = key.first;
+		m.icase = key.second;
+		for (auto rcon : pats) {
+			unsigned int slot = prog.slots.size();
+			prog.slots.emplace(rcon, slot);
+			m.add(static_cast<const char *>(rcon->propval.pvalue), slot);
+		}
+		m.finish();
+		prog.matchers.push_back(std::move(m));
+	}
+}
+
+/* Answer all hoisted substring tests for the message in one pass each */
+static void rx_scan(rxparam &par)
+{
+	par.hits.assign(par.prog->slots.size(), false);
+	for (const auto &m : par.prog->matchers) {
+		auto text = par.ctnt->proplist.get<const char>(m.proptag);
+		if (text != nullptr)
+			m.scan(text, par.hits);
+	}
+}
+
+static ec_error_t rx_compile(const char *dir, eid_t fid, bool oof,
+    rx_program &prog)
+{
+	g_rx_arena = &prog;
+	auto cl_0 = make_scope_exit([]() { g_rx_arena = nullptr; });
+	auto err = rx_load_std_rules(dir, fid, oof, prog.rules);
+	if (err != ecSuccess)
+		return err;
+	err = rx_load_ext_rules(dir, fid, oof, prog.rules);
+	if (err != ecSuccess)
+		return err;
+	std::sort(prog.rules.begin(), prog.rules.end());
+	rx_hoist(prog);
+	return ecSuccess;
+}
+
+/*
+ * Return the rule program for the folder, reusing the cached one when the
+ * folder says its rules have not changed since.
+ */
+static ec_error_t rx_program_get(const char *dir, eid_t fid, bool oof,
+    std::shared_ptr<const rx_program> &out)
+{
+	static constexpr uint32_t tags[] = {PR_RULES_CHANGE_NUM, PR_ASSOC_CONTENT_COUNT};
+	static constexpr PROPTAG_ARRAY pt = {std::size(tags), deconst(tags)};
+	TPROPVAL_ARRAY props{};
+	if (!exmdb_client::get_folder_properties(dir, CP_ACP, fid, &pt, &props))
+		return ecRpcFailed;
+	auto cn = props.get<const uint64_t>(PR_RULES_CHANGE_NUM);
+	auto cnt = props.get<const uint32_t>(PR_ASSOC_CONTENT_COUNT);
+	uint64_t rules_cn = cn != nullptr ? *cn : 0;
+	uint32_t fai_count = cnt != nullptr ? *cnt : 0;
+	auto key = std::string(dir) + ":" + std::to_string(uint64_t{fid}) + (oof ? ":oof" : "");
+	auto now = tp_now();
+	{
+		std::lock_guard lk(g_rx_lock);
+		auto i = g_rx_cache.find(key);
+		if (i != g_rx_cache.end() && i->second->rules_cn == rules_cn &&
+		    i->second->fai_count == fai_count &&
+		    now - i->second->built < rx_cache_maxage) {
+			out = i->second;
+			return ecSuccess;
+		}
+	}
+	auto prog = std::make_shared<rx_program>();
+	prog->rules_cn = rules_cn;
+	prog->fai_count = fai_count;
+	prog->built = now;
+	auto err = rx_compile(dir, fid, oof, *prog);
+	if (err != ecSuccess)
+		return err;
+	if (g_ruleproc_debug)
+		mlog(LV_DEBUG, "ruleproc: loaded %zu rules, %zu matchers for %s",
+			prog->rules.size(), prog->matchers.size(), key.c_str());
+	std::lock_guard lk(g_rx_lock);
+	if (g_rx_cache.size() >= rx_cache_max && g_rx_cache.find(key) == g_rx_cache.end()) {
+		auto old = std::min_element(g_rx_cache.begin(), g_rx_cache.end(),
+		           [](const auto &a, const auto &b) { return a.second->built < b.second->built; });
+		g_rx_cache.erase(old);
+	}
+	g_rx_cache[key] = prog;
+	out = std::move(prog);
+	return ecSuccess;
+}
+
 ec_error_t exmdb_local_rules_execute(const char *dir, const char *ev_from,
     const char *ev_to, eid_t folder_id, eid_t msg_id) try
 {
@@ -799,20 +1233,18 @@ ec_error_t exmdb_local_rules_execute(const char *dir, const char *ev_from,
 	auto err = rx_is_oof(dir, &oof);
 	if (err != ecSuccess)
 		return err;
-	std::vector<rule_node> rule_list;
-	err = rx_load_std_rules(dir, folder_id, oof, rule_list);
-	if (err != ecSuccess)
-		return err;
-	err = rx_load_ext_rules(dir, folder_id, oof, rule_list);
+	std::shared_ptr<const rx_program> prog;
+	err = rx_program_get(dir, folder_id, oof, prog);
 	if (err != ecSuccess)
 		return err;
-	std::sort(rule_list.begin(), rule_list.end());
 
 	rxparam par = {ev_from, ev_to, {{dir, folder_id}, msg_id}, {{dir, folder_id}}};
+	par.prog = prog.get();
 	if (!exmdb_client::read_message(par.cur.dir.c_str(), nullptr, CP_ACP,
 	    par.cur.mid, &par.ctnt))
 		return ecError;
-	for (auto &&rule : rule_list) {
+	rx_scan(par);
+	for (const auto &rule : prog->rules) {
 		err = rule.extended ? opx_process(par, rule) : op_process(par, rule);
 		if (err != ecSuccess)
 			return err;
@@ -3,6 +3,7 @@
 #include <chrono>
 #include <condition_variable>
 #include <csignal>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <memory>
@@ -21,14 +22,43 @@
 
 #define MAX_NOT_EMPTY_TIMES				10
 
+/* consecutive contexts a worker takes from its own deque before it
+ * looks at the shared run queues again */
+#define MAX_LOCAL_STREAK				16
+
 using namespace gromox;
 
 namespace {
+
+/*
+ * Run queue private to one worker. A context whose processing step returned
+ * tproc_status::cont is pushed here instead of going back through the locked
+ * TURNING list of contexts_pool. Only the owner pushes (at the bottom);
+ * the owner and idle workers alike take from the top, so the contexts of one
+ * deque are still served in FIFO order.
+ */
+struct local_deque {
+	static constexpr unsigned int SIZE = 64;
+
+	bool push(SCHEDULE_CONTEXT *);
+	SCHEDULE_CONTEXT *steal();
+	size_t size() const { return bottom.load(std::memory_order_acquire) - top.load(std::memory_order_acquire); }
+
+	std::atomic<size_t> top{0}, bottom{0};
+	std::atomic<SCHEDULE_CONTEXT *> slot[SIZE]{};
+};
+
 struct THR_DATA {
-	DOUBLE_LIST_NODE node;
-	BOOL notify_stop;
-	pthread_t id;
+	DOUBLE_LIST_NODE node{}, idle_node{};
+	gromox::atomic_bool notify_stop{false};
+	pthread_t id{};
+	unsigned int dq_index = 0;
+	bool is_idle = false; /* under g_idle_lock */
+	bool woken = false; /* under park_lock */
+	std::mutex park_lock;
+	std::condition_variable park_cond;
 };
+
 }
 
 static pthread_t g_scan_id;
@@ -37,12 +67,41 @@ static unsigned int g_threads_pool_min_num, g_threads_pool_max_num;
 static std::atomic<unsigned int> g_threads_pool_cur_thr_num;
 static DOUBLE_LIST g_threads_data_list;
 static THREADS_EVENT_PROC g_threads_event_proc;
-static std::mutex g_threads_pool_data_lock, g_threads_pool_cond_mutex;
-static std::condition_variable g_threads_pool_waken_cond;
+static std::mutex g_threads_pool_data_lock;
+/* one deque per potential worker; a worker owns the entry at dq_index */
+static std::unique_ptr<local_deque[]> g_deques;
+static std::unique_ptr<bool[]> g_deque_used; /* under g_threads_pool_data_lock */
+static std::atomic<size_t> g_local_queued;
+/* parked workers, most recently parked at the tail */
+static DOUBLE_LIST g_idle_list;
+static std::mutex g_idle_lock;
+static std::atomic<unsigned int> g_idle_num;
 
 static void *tpol_thrwork(void *);
 static void *tpol_scanwork(void *);
 
+bool local_deque::push(SCHEDULE_CONTEXT *ctx)
+{
+	auto b = bottom.load(std::memory_order_relaxed);
+	if (b - top.load(std::memory_order_acquire) >= SIZE)
+		return false;
+	slot[b % SIZE].store(ctx, std::memory_order_relaxed);
+	bottom.store(b + 1, std::memory_order_release);
+	return true;
+}
+
+SCHEDULE_CONTEXT *local_deque::steal()
+{
+	auto t = top.load(std::memory_order_acquire);
+	while (t < bottom.load(std::memory_order_acquire)) {
+		auto ctx = slot[t % SIZE].load(std::memory_order_relaxed);
+		if (top.compare_exchange_weak(t, t + 1,
+		    std::memory_order_acq_rel, std::memory_order_acquire))
+			return ctx;
+	}
+	return nullptr;
+}
+
 static tproc_status (*threads_pool_process_func)(schedule_context *);
 
 void threads_pool_init(unsigned int init_pool_num,
@@ -64,6 +123,38 @@ void threads_pool_init(unsigned int init_pool_num,
 	g_threads_pool_cur_thr_num = 0;
 	g_threads_event_proc = NULL;
 	double_list_init(&g_threads_data_list);
+	double_list_init(&g_idle_list);
+}
+
+/* Caller holds g_threads_pool_data_lock. */
+static THR_DATA *tpol_new_thrdata()
+{
+	unsigned int i;
+	for (i = 0; i < g_threads_pool_max_num; ++i)
+		if (!g_deque_used[i])
+			break;
+	if (i == g_threads_pool_max_num)
+		return nullptr;
+	auto pdata = new THR_DATA;
+	pdata->node.pdata = pdata;
+	pdata->idle_node.pdata = pdata;
+	pdata->id = (pthread_t)-1;
+	pdata->dq_index = i;
+	g_deque_used[i] = true;
+	return pdata;
+}
+
+/* Caller holds g_threads_pool_data_lock. */
+static void tpol_del_thrdata(THR_DATA *pdata)
+{
+	/* hand leftovers back to the shared run queues */
+	SCHEDULE_CONTEXT *pcontext;
+	while ((pcontext = g_deques[pdata->dq_index].steal()) != nullptr) {
+		--g_local_queued;
+		contexts_pool_put_context(pcontext, CONTEXT_TURNING);
+	}
+	g_deque_used[pdata->dq_index] = false;
+	delete pdata;
 }
 
 int threads_pool_run(const char *hint) try
@@ -71,6 +162,8 @@ int threads_pool_run(const char *hint) try
 	int created_thr_num;
 	
 	/* list is protected by g_threads_pool_data_lock */
+	g_deques = std::make_unique<local_deque[]>(g_threads_pool_max_num);
+	g_deque_used = std::make_unique<bool[]>(g_threads_pool_max_num);
 	g_notify_stop = false;
 	auto ret = pthread_create4(&g_scan_id, nullptr, tpol_scanwork, nullptr);
 	if (ret != 0) {
@@ -81,13 +174,12 @@ int threads_pool_run(const char *hint) try
 
 	created_thr_num = 0;
 	for (size_t i = 0; i < g_threads_pool_min_num; ++i) {
-		auto pdata = new THR_DATA;
-		pdata->node.pdata = pdata;
-		pdata->id = (pthread_t)-1;
-		pdata->notify_stop = FALSE;
+		std::unique_lock tpd_hold(g_threads_pool_data_lock);
+		auto pdata = tpol_new_thrdata();
 		ret = pthread_create4(&pdata->id, nullptr, tpol_thrwork, pdata);
 		if (ret != 0) {
 			mlog(LV_ERR, "threads_pool: failed to create a pool thread: %s", strerror(ret));
+			tpol_del_thrdata(pdata);
 			return -1;
 		} else {
 			char buf[32];
@@ -126,9 +218,11 @@ void threads_pool_stop()
 		pthr = (THR_DATA*)pnode->pdata;
 		thr_id = pthr->id;
 		/* notify this thread to exit */
-		pthr->notify_stop = TRUE;
-		/* wake up all thread waiting on the event */
-		g_threads_pool_waken_cond.notify_all();
+		pthr->notify_stop = true;
+		std::unique_lock park_hold(pthr->park_lock);
+		pthr->woken = true;
+		pthr->park_cond.notify_one();
+		park_hold.unlock();
 		pthread_kill(thr_id, SIGALRM); /* may be in nanosleep */
 		pthread_join(thr_id, NULL);
 		if (b_should_exit)
@@ -138,6 +232,9 @@ void threads_pool_stop()
 	g_threads_pool_max_num = 0;
 	g_threads_pool_cur_thr_num = 0;
 	g_threads_event_proc = NULL;
+	g_deques.reset();
+	g_deque_used.reset();
+	g_local_queued = 0;
 }
 
 int threads_pool_get_param(int type)
@@ -154,6 +251,74 @@ int threads_pool_get_param(int type)
 	}
 }
 
+/*
+ * Find the next context for @self: its own deque first, then the TURNING
+ * queues of contexts_pool, then the deques of the other workers.
+ */
+static SCHEDULE_CONTEXT *tpol_fetch(THR_DATA *self, unsigned int &streak)
+{
+	SCHEDULE_CONTEXT *pcontext = nullptr;
+	auto &own = g_deques[self->dq_index];
+	if (streak < MAX_LOCAL_STREAK && (pcontext = own.steal()) != nullptr) {
+		--g_local_queued;
+		++streak;
+		return pcontext;
+	}
+	streak = 0;
+	pcontext = contexts_pool_get_context(CONTEXT_TURNING);
+	if (pcontext != nullptr)
+		return pcontext;
+	if (g_local_queued == 0)
+		return nullptr;
+	for (size_t i = 0; i < g_threads_pool_max_num; ++i) {
+		pcontext = g_deques[(self->dq_index + i) % g_threads_pool_max_num].steal();
+		if (pcontext != nullptr) {
+			--g_local_queued;
+			return pcontext;
+		}
+	}
+	return nullptr;
+}
+
+/*
+ * Put @self on the idle list and sleep until threads_pool_wakeup_thread
+ * picks it, or for at most one second. The queues are checked once more
+ * after registering, so that a wakeup issued in between is not lost.
+ */
+static SCHEDULE_CONTEXT *tpol_park(THR_DATA *self, unsigned int &streak)
+{
+	std::unique_lock park_hold(self->park_lock);
+	self->woken = false;
+	park_hold.unlock();
+	std::unique_lock idle_hold(g_idle_lock);
+	double_list_append_as_tail(&g_idle_list, &self->idle_node);
+	self->is_idle = true;
+	++g_idle_num;
+	idle_hold.unlock();
+
+	auto pcontext = tpol_fetch(self, streak);
+	if (pcontext == nullptr) {
+		park_hold.lock();
+		self->park_cond.wait_for(park_hold, std::chrono::seconds(1),
+			[&]() { return self->woken || self->notify_stop; });
+		park_hold.unlock();
+	}
+	idle_hold.lock();
+	if (self->is_idle) {
+		double_list_remove(&g_idle_list, &self->idle_node);
+		self->is_idle = false;
+		--g_idle_num;
+	} else if (pcontext != nullptr) {
+		/*
+		 * A waker picked us after the fetch had already found work;
+		 * that wakeup was meant for another context, so pass it on.
+		 */
+		idle_hold.unlock();
+		threads_pool_wakeup_thread();
+	}
+	return pcontext;
+}
+
 static void *tpol_thrwork(void *pparam)
 {
 	THR_DATA *pdata;
@@ -161,7 +326,7 @@ static void *tpol_thrwork(void *pparam)
 	int max_contexts_per_thr;
 	int contexts_per_threads;
 	SCHEDULE_CONTEXT *pcontext;
-	
+	unsigned int streak = 0;
 	
 	pdata = (THR_DATA*)pparam;
 	max_contexts_per_thr = contexts_pool_get_param(CONTEXTS_PER_THR);
@@ -169,9 +334,10 @@ static void *tpol_thrwork(void *pparam)
 	if (g_threads_event_proc != nullptr)
 		g_threads_event_proc(THREAD_CREATE);
 	
+	auto &own = g_deques[pdata->dq_index];
 	cannot_served_times = 0;
 	while (!pdata->notify_stop) {
-		pcontext = contexts_pool_get_context(CONTEXT_TURNING);
+		pcontext = tpol_fetch(pdata, streak);
 		if (NULL == pcontext) {
 			if (MAX_TIMES_NOT_SERVED == cannot_served_times) {
 				std::unique_lock tpd_hold(g_threads_pool_data_lock);
@@ -180,7 +346,7 @@ static void *tpol_thrwork(void *pparam)
 				    (gpr = contexts_pool_get_param(CUR_VALID_CONTEXTS)) >= 0 &&
 				    g_threads_pool_cur_thr_num * contexts_per_threads > static_cast<size_t>(gpr)) {
 					double_list_remove(&g_threads_data_list, &pdata->node);
-					delete pdata;
+					tpol_del_thrdata(pdata);
 					g_threads_pool_cur_thr_num --;
 					tpd_hold.unlock();
 					if (g_threads_event_proc != nullptr)
@@ -192,14 +358,21 @@ static void *tpol_thrwork(void *pparam)
 				cannot_served_times ++;
 			}
 			/* wait context */
-			std::unique_lock tpc_hold(g_threads_pool_cond_mutex);
-			g_threads_pool_waken_cond.wait_for(tpc_hold, std::chrono::seconds(1));
-			continue;
+			pcontext = tpol_park(pdata, streak);
+			if (pcontext == nullptr)
+				continue;
 		}
 		cannot_served_times = 0;
 		switch (threads_pool_process_func(pcontext)) {
 		case tproc_status::cont:
-			contexts_pool_put_context(pcontext, CONTEXT_TURNING);
+			if (!own.push(pcontext)) {
+				contexts_pool_put_context(pcontext, CONTEXT_TURNING);
+				break;
+			}
+			++g_local_queued;
+			/* more than this worker will pick up next: get help */
+			if (own.size() > 1)
+				threads_pool_wakeup_thread();
 			break;
 		case tproc_status::idle:
 			contexts_pool_put_context(pcontext, CONTEXT_IDLING);
@@ -225,7 +398,7 @@ static void *tpol_thrwork(void *pparam)
 	
 	std::unique_lock tpd_hold(g_threads_pool_data_lock);
 	double_list_remove(&g_threads_data_list, &pdata->node);
-	delete pdata;
+	tpol_del_thrdata(pdata);
 	g_threads_pool_cur_thr_num --;
 	tpd_hold.unlock();
 	if (g_threads_event_proc != nullptr)
@@ -233,18 +406,37 @@ static void *tpol_thrwork(void *pparam)
 	return NULL;
 }
 
-void threads_pool_wakeup_thread()
+/* Wake up to @n parked workers, the most recently parked ones first. */
+void threads_pool_wakeup_threads(size_t n)
 {
 	if (g_notify_stop)
 		return;
-	g_threads_pool_waken_cond.notify_one();
+	while (n-- > 0 && g_idle_num > 0) {
+		std::unique_lock idle_hold(g_idle_lock);
+		auto pnode = double_list_pop_back(&g_idle_list);
+		if (pnode == nullptr)
+			return;
+		auto pdata = static_cast<THR_DATA *>(pnode->pdata);
+		pdata->is_idle = false;
+		--g_idle_num;
+		/*
+		 * Keep holding g_idle_lock: the worker passes through it on
+		 * the way out of tpol_park, so pdata stays valid until then.
+		 */
+		std::lock_guard park_hold(pdata->park_lock);
+		pdata->woken = true;
+		pdata->park_cond.notify_one();
+	}
+}
+
+void threads_pool_wakeup_thread()
+{
+	threads_pool_wakeup_threads(1);
 }
 
 void threads_pool_wakeup_all_threads()
 {
-	if (g_notify_stop)
-		return;
-	g_threads_pool_waken_cond.notify_all();
+	threads_pool_wakeup_threads(SIZE_MAX);
 }
 
 static void *tpol_scanwork(void *pparam)
@@ -254,7 +446,8 @@ static void *tpol_scanwork(void *pparam)
 	not_empty_times = 0;
 	while (!g_notify_stop) {
 		sleep(1);
-		if (contexts_pool_get_param(CUR_SCHEDULING_CONTEXTS) <= 1) {
+		if (contexts_pool_get_param(CUR_SCHEDULING_CONTEXTS) +
+		    g_local_queued.load() <= 1) {
 			not_empty_times = 0;
 			continue;
 		}
@@ -266,19 +459,20 @@ static void *tpol_scanwork(void *pparam)
 			continue;
 		THR_DATA *pdata;
 		try {
-			pdata = new THR_DATA;
+			pdata = tpol_new_thrdata();
 		} catch (const std::bad_alloc &) {
 			mlog(LV_DEBUG, "E-2368: ENOMEM");
 			not_empty_times = 0;
 			continue;
 		}
-		pdata->node.pdata = pdata;
-		pdata->id = (pthread_t)-1;
-		pdata->notify_stop = FALSE;
+		if (pdata == nullptr) {
+			not_empty_times = 0;
+			continue;
+		}
 		auto ret = pthread_create4(&pdata->id, nullptr, tpol_thrwork, pdata);
 		if (ret != 0) {
 			mlog(LV_WARN, "W-1445: failed to increase pool threads: %s", strerror(ret));
-			delete pdata;
+			tpol_del_thrdata(pdata);
 			not_empty_times = 0;
 			continue;
 		}
@@ -21,13 +21,16 @@
 #include <iconv.h>
 #include <pthread.h>
 #include <random>
+#include <string>
 #include <unistd.h>
+#include <vector>
 #include <json/reader.h>
 #include <libHX/ctype_helper.h>
 #include <libHX/string.h>
 #include <gromox/defs.h>
 #include <gromox/fileio.h>
 #include <gromox/util.hpp>
+#include "codec_simd.hpp"
 #if defined(__linux__)
 #	include <sys/random.h>
 #elif defined(__OpenBSD__)
@@ -228,6 +231,165 @@ void wchar_to_utf8(uint32_t wchar, char *zstring)
 	}
 }
 
+namespace {
+
+/*
+ * iconv_open is expensive (gconv module lookup and table loading), so every
+ * thread keeps its most recently used conversion descriptors around.
+ */
+struct iconv_cache {
+	struct entry {
+		std::string to, from;
+		iconv_t cd = iconv_t(-1);
+	};
+	~iconv_cache();
+	iconv_t get(const char *to, const char *from);
+
+	std::vector<entry> m_ent; /* most recently used first */
+};
+
+}
+
+static constexpr size_t ICONV_CACHE_MAX = 16;
+static thread_local iconv_cache g_iconv_cache;
+
+/* Windows-1252 0x80..0x9F; 0 marks the unassigned codes */
+static constexpr uint16_t cp1252_c1[] = {
+	0x20AC, 0, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+	0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0, 0x017D, 0,
+	0, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+	0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0, 0x017E, 0x0178,
+};
+
+iconv_cache::~iconv_cache()
+{
+	for (auto &e : m_ent)
+		iconv_close(e.cd);
+}
+
+iconv_t iconv_cache::get(const char *to, const char *from) try
+{
+	for (auto it = m_ent.begin(); it != m_ent.end(); ++it) {
+		if (strcasecmp(it->to.c_str(), to) != 0 ||
+		    strcasecmp(it->from.c_str(), from) != 0)
+			continue;
+		std::rotate(m_ent.begin(), it, it + 1);
+		auto cd = m_ent.front().cd;
+		/* back to the initial shift state */
+		iconv(cd, nullptr, nullptr, nullptr, nullptr);
+		return cd;
+	}
+	if (m_ent.capacity() == 0)
+		m_ent.reserve(ICONV_CACHE_MAX);
+	entry e{to, from};
+	e.cd = iconv_open(to, from);
+	if (e.cd == iconv_t(-1))
+		return e.cd;
+	if (m_ent.size() >= ICONV_CACHE_MAX) {
+		iconv_close(m_ent.back().cd);
+		m_ent.pop_back();
+	}
+	m_ent.insert(m_ent.begin(), std::move(e));
+	return m_ent.front().cd;
+} catch (const std::bad_alloc &) {
+	errno = ENOMEM;
+	return iconv_t(-1);
+}
+
+/**
+ * Obtain a conversion descriptor from the calling thread's cache, in its
+ * initial state. The descriptor must not be closed by the caller, and may only
+ * be used until the next call to iconv_cached() on the same thread.
+ */
+iconv_t gromox::iconv_cached(const char *to, const char *from)
+{
+	return g_iconv_cache.get(to, from);
+}
+
+bool gromox::str_isascii(const char *s, size_t len)
+{
+	uint64_t acc = 0;
+	for (; len >= 8; s += 8, len -= 8) {
+		uint64_t w;
+		memcpy(&w, s, sizeof(w));
+		acc |= w;
+	}
+	for (; len > 0; ++s, --len)
+		acc |= static_cast<unsigned char>(*s);
+	return (acc & UINT64_C(0x8080808080808080)) == 0;
+}
+
+/**
+ * Whether @cs maps the bytes 0x00..0x7F to US-ASCII, i.e. a pure-ASCII string
+ * converts to itself. Conservative; unknown charsets return false.
+ */
+bool gromox::cset_ascii_compatible(const char *cs)
+{
+	static constexpr const char *pfx[] = {
+		"utf-8", "utf8", "us-ascii", "ascii", "iso-8859-", "iso8859-",
+		"iso_8859-", "latin", "windows-125", "cp125", "koi8-", "gbk",
+		"gb2312", "gb18030", "big5", "euc-",
+	};
+	for (auto p : pfx)
+		if (strncasecmp(cs, p, strlen(p)) == 0)
+			return true;
+	return false;
+}
+
+static unsigned int cset_sbcs_kind(const char *cs)
+{
+	if (strcasecmp(cs, "iso-8859-1") == 0 || strcasecmp(cs, "iso8859-1") == 0 ||
+	    strcasecmp(cs, "iso_8859-1") == 0 || strcasecmp(cs, "latin1") == 0)
+		return 1;
+	if (strcasecmp(cs, "windows-1252") == 0 || strcasecmp(cs, "cp1252") == 0)
+		return 2;
+	return 0;
+}
+
+/**
+ * Convert @in from ISO-8859-1 or Windows-1252 (@cs) to UTF-8 without going
+ * through iconv. Unassigned Windows-1252 codes are dropped if @skip is set,
+ * and are an error otherwise (like iconv with and without //IGNORE).
+ *
+ * Returns the number of bytes written to @out (no NUL is added), -1 if @out is
+ * too small or on unassigned input, or -2 if @cs is not handled here.
+ */
+ssize_t gromox::sbcs_to_utf8(const char *cs, const char *in, size_t inlen,
+    char *out, size_t outmax, bool skip)
+{
+	auto kind = cset_sbcs_kind(cs);
+	if (kind == 0)
+		return -2;
+	size_t z = 0;
+	for (size_t i = 0; i < inlen; ++i) {
+		uint32_t c = static_cast<unsigned char>(in[i]);
+		if (c >= 0x80 && c < 0xA0 && kind == 2) {
+			c = cp1252_c1[c-0x80];
+			if (c == 0 && skip)
+				continue;
+			else if (c == 0)
+				return -1;
+		}
+		if (c < 0x80) {
+			if (z + 1 > outmax)
+				return -1;
+			out[z++] = c;
+		} else if (c < 0x800) {
+			if (z + 2 > outmax)
+				return -1;
+			out[z++] = 0xC0 | (c >> 6);
+			out[z++] = 0x80 | (c & 0x3F);
+		} else {
+			if (z + 3 > outmax)
+				return -1;
+			out[z++] = 0xE0 | (c >> 12);
+			out[z++] = 0x80 | ((c >> 6) & 0x3F);
+			out[z++] = 0x80 | (c & 0x3F);
+		}
+	}
+	return z;
+}
+
 static bool have_jpms()
 {
 	auto cd = iconv_open("UTF-8", "iso-2022-jp-ms");
@@ -248,6 +410,8 @@ static bool have_jpms()
  */
 const char* replace_iconv_charset(const char *charset)
 {
+	static const bool jpms = have_jpms();
+
 	if (strcasecmp(charset, "gb2312") == 0)
 		return "gbk";
 	else if (strcasecmp(charset, "ksc_560") == 0 ||
@@ -255,7 +419,7 @@ const char* replace_iconv_charset(const char *charset)
 	    strcasecmp(charset, "ks_c_5601-1987") == 0 ||
 	    strcasecmp(charset, "csksc56011987") == 0)
 		return "cp949";
-	else if (strcasecmp(charset, "iso-2022-jp") == 0 && have_jpms())
+	else if (strcasecmp(charset, "iso-2022-jp") == 0 && jpms)
 		return "iso-2022-jp-ms";
 	else if (strcasecmp(charset, "unicode-1-1-utf-7") == 0)
 		return "utf-7";
@@ -296,8 +460,22 @@ BOOL string_to_utf8(const char *charset, const char *in_string,
 	if (out_len > 0)
 		/* Leave room for \0 */
 		--out_len;
-	snprintf(tmp_charset, std::size(tmp_charset), "%s//IGNORE", replace_iconv_charset(charset));
-	conv_id = iconv_open("UTF-8", tmp_charset);
+	auto cs = replace_iconv_charset(charset);
+	if (cset_ascii_compatible(cs) && str_isascii(in_string, length)) {
+		if (length > out_len)
+			return FALSE;
+		memcpy(out_string, in_string, length + 1);
+		return TRUE;
+	}
+	auto ret = sbcs_to_utf8(cs, in_string, length, out_string, out_len, false);
+	if (ret == -1)
+		return FALSE;
+	if (ret >= 0) {
+		out_string[ret] = '\0';
+		return TRUE;
+	}
+	snprintf(tmp_charset, std::size(tmp_charset), "%s//IGNORE", cs);
+	conv_id = iconv_cached("UTF-8", tmp_charset);
 	if (conv_id == iconv_t(-1)) {
 		mlog(LV_ERR, "E-2108: iconv_open %s: %s",
 		        tmp_charset, strerror(errno));
@@ -306,11 +484,8 @@ BOOL string_to_utf8(const char *charset, const char *in_string,
 	pin = (char*)in_string;
 	pout = out_string;
 	auto in_len = length;
-	if (iconv(conv_id, &pin, &in_len, &pout, &out_len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
+	if (iconv(conv_id, &pin, &in_len, &pout, &out_len) == static_cast<size_t>(-1))
 		return FALSE;
-	}
-	iconv_close(conv_id);
 	if (orig_outlen > 0)
 		*pout = '\0';
 	return TRUE;
@@ -337,7 +512,13 @@ BOOL string_from_utf8(const char *charset, const char *in_string,
 	auto orig_outlen = out_len;
 	--out_len; /* Leave room for \0 */
 	auto cs = replace_iconv_charset(charset);
-	auto conv_id = iconv_open(cs, "UTF-8");
+	if (cset_ascii_compatible(cs) && str_isascii(in_string, length)) {
+		if (length > out_len)
+			return FALSE;
+		memcpy(out_string, in_string, length + 1);
+		return TRUE;
+	}
+	auto conv_id = iconv_cached(cs, "UTF-8");
 	if (conv_id == iconv_t(-1)) {
 		mlog(LV_ERR, "E-2109: iconv_open %s: %s", cs, strerror(errno));
 		return FALSE;
@@ -345,11 +526,8 @@ BOOL string_from_utf8(const char *charset, const char *in_string,
 	auto pin = const_cast<char *>(in_string);
 	auto pout = out_string;
 	auto in_len = length;
-	if (iconv(conv_id, &pin, &in_len, &pout, &out_len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
+	if (iconv(conv_id, &pin, &in_len, &pout, &out_len) == static_cast<size_t>(-1))
 		return FALSE;
-	}
-	iconv_close(conv_id);
 	if (orig_outlen > 0)
 		*pout = '\0';
 	return TRUE;
@@ -362,7 +540,7 @@ ssize_t utf8_to_utf16le(const char *src, void *dst, size_t len)
 	iconv_t conv_id;
 
 	len = std::min(len, static_cast<size_t>(SSIZE_MAX));
-	conv_id = iconv_open("UTF-16LE", "UTF-8");
+	conv_id = iconv_cached("UTF-16LE", "UTF-8");
 	if (conv_id == (iconv_t)-1) {
 		mlog(LV_ERR, "E-2110: iconv_open: %s", strerror(errno));
 		return -1;
@@ -372,13 +550,9 @@ ssize_t utf8_to_utf16le(const char *src, void *dst, size_t len)
 	in_len = strlen(src) + 1;
 	memset(dst, 0, len);
 	out_len = len;
-	if (iconv(conv_id, &pin, &in_len, &pout, &len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
+	if (iconv(conv_id, &pin, &in_len, &pout, &len) == static_cast<size_t>(-1))
 		return -1;
-	} else {
-		iconv_close(conv_id);
-		return out_len - len;
-	}
+	return out_len - len;
 }
 
 BOOL utf16le_to_utf8(const void *src, size_t src_len, char *dst, size_t len)
@@ -386,7 +560,7 @@ BOOL utf16le_to_utf8(const void *src, size_t src_len, char *dst, size_t len)
 	char *pin, *pout;
 	iconv_t conv_id;
 	
-	conv_id = iconv_open("UTF-8", "UTF-16LE");
+	conv_id = iconv_cached("UTF-8", "UTF-16LE");
 	if (conv_id == (iconv_t)-1) {
 		mlog(LV_ERR, "E-2111: iconv_open: %s", strerror(errno));
 		return false;
@@ -394,13 +568,9 @@ BOOL utf16le_to_utf8(const void *src, size_t src_len, char *dst, size_t len)
 	pin = (char*)src;
 	pout = dst;
 	memset(dst, 0, len);
-	if (iconv(conv_id, &pin, &src_len, &pout, &len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
+	if (iconv(conv_id, &pin, &src_len, &pout, &len) == static_cast<size_t>(-1))
 		return FALSE;
-	} else {
-		iconv_close(conv_id);
-		return TRUE;
-	}
+	return TRUE;
 }
 
 /*
@@ -593,6 +763,10 @@ int encode64(const void *vin, size_t inlen, char *out,
 	  return BUFOVER;
 
 	/* Do the work... */
+	auto done = b64_encode_blocks(in, inlen, out);
+	in += done;
+	inlen -= done;
+	out += done / 3 * 4;
 	while (inlen >= 3) {
 	  /* user provided max buffer size; make sure we don't go over it */
 		*out++ = basis_64[in[0] >> 2];
@@ -619,6 +793,14 @@ int encode64(const void *vin, size_t inlen, char *out,
 #define MAXLINE	76
 static char hextab[] = "0123456789ABCDEF";
 
+static inline void b64_encode_group(const uint8_t *in, char *out)
+{
+	out[0] = base64tab[(in[0] & 0xFC) >> 2];
+	out[1] = base64tab[((in[0] & 0x03) << 4) | ((in[1] & 0xF0) >> 4)];
+	out[2] = base64tab[((in[1] & 0x0F) << 2) | ((in[2] & 0xC0) >> 6)];
+	out[3] = base64tab[in[2] & 0x3F];
+}
+
 /*
  * BASE64-encode with newlines.
  * On success, 0 is returned and @_out is NUL-terminated (@outlen does count NUL)
@@ -628,12 +810,11 @@ int encode64_ex(const void *vin, size_t inlen, char *_out,
 {
 	auto _in = static_cast<const uint8_t *>(vin);
 	size_t inLen = inlen;
-	size_t i;
 	char* out = _out;
 	size_t outsize = (inLen+2)/3*4;		/* 3:4 conversion ratio */
 	size_t inpos  = 0;
 	size_t outPos = 0;
-	int c1, c2, c3;
+	int c1, c2;
 	int lineLen = 0;
 	const char* cp;
 	
@@ -642,15 +823,27 @@ int encode64_ex(const void *vin, size_t inlen, char *_out,
 	outsize += strlen(DW_EOL)*outsize/MAXLINE + 2;	/* Space for newlines and NUL */
 	if (outsize >= outmax)
 		return -1;
+	/*
+	 * Whole lines: 57 bytes make 76 characters. The vector kernel may
+	 * read up to 4 bytes ahead, hence the extra margin.
+	 */
+	while (inLen - inpos >= 57 + 4) {
+		auto done = b64_encode_blocks(&_in[inpos], 52, &out[outPos]);
+		inpos  += done;
+		outPos += done / 3 * 4;
+		for (; done < 57; done += 3) {
+			b64_encode_group(&_in[inpos], &out[outPos]);
+			inpos  += 3;
+			outPos += 4;
+		}
+		out[outPos++] = '\r';
+		out[outPos++] = '\n';
+	}
 	/* Get three characters at a time and encode them. */
-	for (i=0; i < inLen/3; ++i) {
-		c1 = _in[inpos++] & 0xFF;
-		c2 = _in[inpos++] & 0xFF;
-		c3 = _in[inpos++] & 0xFF;
-		out[outPos++] = base64tab[(c1 & 0xFC) >> 2];
-		out[outPos++] = base64tab[((c1 & 0x03) << 4) | ((c2 & 0xF0) >> 4)];
-		out[outPos++] = base64tab[((c2 & 0x0F) << 2) | ((c3 & 0xC0) >> 6)];
-		out[outPos++] = base64tab[c3 & 0x3F];
+	while (inLen - inpos >= 3) {
+		b64_encode_group(&_in[inpos], &out[outPos]);
+		inpos  += 3;
+		outPos += 4;
 		lineLen += 4;
 		if (lineLen >= MAXLINE-3) {
 			const char *cq = DW_EOL;
@@ -730,6 +923,12 @@ int decode64_ex(const char *_in, size_t inlen, void *vout,
 		return -1;
 	}
 	while (inpos < inLen) {
+		/* Runs of plain base64 characters (no whitespace or padding) */
+		auto done = b64_decode_blocks(&_in[inpos], inLen - inpos, &out[outPos]);
+		inpos  += done;
+		outPos += done / 4 * 3;
+		if (inpos >= inLen)
+			break;
 		a1 = a2 = a3 = a4 = 0;
 		while (inpos < inLen) {
 			a1 = _in[inpos++] & 0xFF;
@@ -890,6 +1089,24 @@ ssize_t qp_encode_ex(void *voutput, size_t outlen, const char *input, size_t len
 	outpos = 0;
 	linelen = 0;
 	while (inpos < length) {
+		/*
+		 * Copy runs of printable chars in one go, staying clear of
+		 * line starts (dot/From escaping), soft line breaks and
+		 * trailing spaces.
+		 */
+		if (linelen > 0 && linelen < MAXLINE - 4) {
+			auto k = qp_plain_span(&input[inpos],
+			         std::min(length - inpos, MAXLINE - 4 - linelen));
+			while (k > 0 && input[inpos+k-1] == ' ')
+				--k;
+			if (k > 0 && outpos + k < outlen) {
+				memcpy(&output[outpos], &input[inpos], k);
+				inpos   += k;
+				outpos  += k;
+				linelen += k;
+				continue;
+			}
+		}
 		auto ch = static_cast<unsigned char>(input[inpos++]);
 		/* '.' at beginning of line (special meaning in SMTPs) */
 		if (linelen == 0 && ch == '.') {
@@ -1032,6 +1249,13 @@ static size_t qp_decode(void *voutput, const char *input, size_t length,
 	bool mime_mode = qp_flags & QP_MIME_HEADER;
 	size_t i, cnt = 0;
 	for (i = 0; i < length; i++) {
+		auto k = qp_literal_span(&input[i], length - i, mime_mode);
+		if (k > 0) {
+			memcpy(&output[cnt], &input[i], k);
+			cnt += k;
+			i += k - 1;
+			continue;
+		}
 		char c = input[i];
 		switch (c) {
 		case '=': {
@@ -1079,7 +1303,12 @@ ssize_t qp_decode_ex(void *voutput, size_t out_len, const char *input,
 	int c;
 	size_t i, cnt = 0;
 	for (i = 0; i < length; i++) {
-
+		auto k = qp_literal_span(&input[i], length - i, false);
+		if (k > 0) {
+			cnt += k;
+			i += k - 1;
+			continue;
+		}
 		c = input[i];
 
 		switch (c) {
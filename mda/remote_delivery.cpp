@@ -2,10 +2,12 @@
 // SPDX-FileCopyrightText: 2021 grommunio GmbH
 #define _GNU_SOURCE 1
 #include <cerrno>
+#include <chrono>
 #include <cstdarg>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <poll.h>
@@ -16,6 +18,8 @@
 #include <libHX/ctype_helper.h>
 #include <libHX/socket.h>
 #include <libHX/string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 #include <gromox/config_file.hpp>
@@ -37,32 +41,68 @@ struct rd_delete {
 };
 
 struct rd_connection {
+	rd_connection() = default;
+	rd_connection(rd_connection &&o) noexcept { *this = std::move(o); }
 	~rd_connection() {
 		if (fd >= 0)
 			close(fd);
 	}
+	rd_connection &operator=(rd_connection &&) noexcept;
+
 	int fd = -1;
 	std::unique_ptr<SSL, rd_delete> tls;
+	std::string rbuf; /* received but not yet consumed */
+	/*
+	 * @reusable: the last transaction ended in a defined state, so the
+	 * session can take another one after RSET
+	 */
+	bool pipelining = false, reusable = false;
+	std::chrono::steady_clock::time_point last_use;
 };
 }
 
-static errno_t rd_starttls(rd_connection &&, const MESSAGE_CONTEXT *, std::string &);
+static errno_t rd_starttls(rd_connection &, const MESSAGE_CONTEXT *, std::string &);
 
 static constexpr unsigned int network_timeout = 180;
+/* A pooled session that does not answer RSET quickly is not worth waiting for */
+static constexpr unsigned int reuse_probe_timeout = 5;
 static std::unique_ptr<SSL_CTX, rd_delete> g_tls_ctx;
 static std::unique_ptr<std::mutex[]> g_tls_mutex_buf;
 static std::string g_mx_host;
 static uint16_t g_mx_port;
-static bool g_enable_tls;
+static bool g_enable_tls, g_enable_pipelining;
+static size_t g_pool_size;
+static std::chrono::seconds g_idle_timeout;
+static std::mutex g_pool_lock;
+static std::deque<rd_connection> g_pool; /* idle sessions, oldest first */
 DECLARE_HOOK_API();
 
 static constexpr cfg_directive remote_delivery_cfg_defaults[] = {
+	{"mx_connection_pool_size", "8", CFG_SIZE},
+	{"mx_connection_idle_timeout", "1min", CFG_TIME, "1s"},
 	{"mx_host", "::1"},
 	{"mx_port", "25", 0, "1", "65535"},
+	{"pipelining_support", "on", CFG_BOOL},
 	{"starttls_support", "on", CFG_BOOL},
 	CFG_TABLE_END,
 };
 
+rd_connection &rd_connection::operator=(rd_connection &&o) noexcept
+{
+	if (this == &o)
+		return *this;
+	tls.reset();
+	if (fd >= 0)
+		close(fd);
+	fd = std::exchange(o.fd, -1);
+	tls = std::move(o.tls);
+	rbuf = std::move(o.rbuf);
+	pipelining = o.pipelining;
+	reusable = o.reusable;
+	last_use = o.last_use;
+	return *this;
+}
+
 #ifdef OLD_SSL
 static void rd_ssl_locking(int mode, int n, const char *file, int line)
 {
@@ -138,62 +178,54 @@ static bool rd_send_cmd(const rd_connection &conn,
 	return w == clen;
 }
 
-static errno_t rd_get_response(const rd_connection &conn,
-    std::string &response, char want_code = '2')
+/**
+ * Read one (possibly multi-line) reply. With pipelining, the server may have
+ * sent several replies at once; whatever follows the first one is left in
+ * conn.rbuf for the next call.
+ */
+static errno_t rd_get_response(rd_connection &conn,
+    std::string &response, char want_code = '2',
+    unsigned int timeout = network_timeout)
 {
-	size_t offset = 0;
+	size_t scan = 0;
 	response.clear();
-	response.resize(512);
 
-	do {
-		struct pollfd pfd = {conn.fd, POLLIN};
-		if (poll(&pfd, 1, network_timeout * 1000) <= 0)
-			return ETIMEDOUT;
-		auto write_ptr = response.data() + offset;
-		auto space = response.size() - offset;
-		if (space < 256) {
-			response.resize(response.capacity() * 2);
-			space = response.size() - offset;
+	while (true) {
+		auto nl = conn.rbuf.find('\n', scan);
+		if (nl != conn.rbuf.npos) {
+			/* "xyz-text" continues a reply, "xyz text" ends it */
+			bool last = nl - scan < 4 || conn.rbuf[scan+3] != '-';
+			scan = nl + 1;
+			if (last)
+				break;
+			continue;
+		}
+		if (conn.rbuf.size() > 65536)
+			return EBADMSG;
+		if (conn.tls == nullptr || SSL_pending(conn.tls.get()) <= 0) {
+			struct pollfd pfd = {conn.fd, POLLIN};
+			if (poll(&pfd, 1, timeout * 1000) <= 0)
+				return ETIMEDOUT;
 		}
+		char buf[4096];
 		ssize_t have_read = conn.tls != nullptr ?
-		                    SSL_read(conn.tls.get(), write_ptr, space) :
-		                    read(conn.fd, write_ptr, space);
+		                    SSL_read(conn.tls.get(), buf, std::size(buf)) :
+		                    read(conn.fd, buf, std::size(buf));
 		if (have_read <= 0)
 			return ETIMEDOUT;
-		offset += static_cast<size_t>(have_read);
-		if (have_read >= 1 && write_ptr[have_read-1] != '\n')
-			/*
-			 * Remainder of current line still to be read, and
-			 * perhaps even more lines.
-			 */
-			continue;
-		if (offset >= 4 && response[3] == ' ')
-			/*
-			 * First line (it is complete now) in the entire
-			 * multigroup buffer is already the final line.
-			 */
-			break;
-		/* Scan for the last line of a ML group */
-		auto nl = response.c_str();
-		while ((nl = strchr(nl, '\n')) != nullptr) {
-			++nl;
-			if (nl[0] != '\0' && nl[1] != '\0' &&
-			    nl[2] != '\0' && nl[3] == ' ')
-				break;
-		}
-		if (nl != nullptr && nl[0] != '\0' && nl[1] != '\0' &&
-		    nl[2] != '\0' && nl[3] == ' ')
-			break;
-	} while (true);
-	response[offset] = '\0';
+		conn.rbuf.append(buf, have_read);
+	}
+	response.assign(conn.rbuf, 0, scan);
+	conn.rbuf.erase(0, scan);
 	HX_chomp(response.data());
 	response.resize(strlen(response.c_str()));
-	if (!HX_isdigit(response[1]) || !HX_isdigit(response[2]))
+	if (response.size() < 3 || !HX_isdigit(response[1]) ||
+	    !HX_isdigit(response[2]))
 		return EBADMSG;
 	return want_code != 0 && response[0] == want_code ? 0 : EBADMSG;
 }
 
-static errno_t rd_hello(const rd_connection &conn, const MESSAGE_CONTEXT *ctx,
+static errno_t rd_hello(rd_connection &conn, const MESSAGE_CONTEXT *ctx,
     std::string &response)
 {
 	char cmd[1024];
@@ -252,22 +284,17 @@ static errno_t rd_rcptto(rd_connection &conn, const MESSAGE_CONTEXT *ctx,
 	return 0;
 }
 
-static errno_t rd_data(rd_connection &&conn, const MESSAGE_CONTEXT *ctx, std::string &response)
+/* Message text and final dot, after the server has said 354. */
+static errno_t rd_data_body(rd_connection &conn, const MESSAGE_CONTEXT *ctx,
+    std::string &response)
 {
-	if (!rd_send_cmd(conn, "DATA\r\n", 6))
-		return ETIMEDOUT;
-	auto ret = rd_get_response(conn, response, '3');
-	if (ret == ETIMEDOUT)
-		return ret;
-	if (ret != 0)
-		return ret;
 	auto tls_write = +[](void *obj, const void *buf, size_t z) -> ssize_t {
 	                   	return SSL_write(static_cast<SSL *>(obj), buf, z);
 	                 };
 	bool did_data = conn.tls != nullptr ? ctx->mail.emit(tls_write, conn.tls.get()) :
 	                ctx->mail.to_file(conn.fd);
 	if (!did_data) {
-		ret = rd_get_response(conn, response);
+		auto ret = rd_get_response(conn, response);
 		if (ret == ETIMEDOUT)
 			return ret;
 		response += " (after DATA)";
@@ -275,19 +302,108 @@ static errno_t rd_data(rd_connection &&conn, const MESSAGE_CONTEXT *ctx, std::st
 	}
 	if (!rd_send_cmd(conn, ".\r\n", 3))
 		return ETIMEDOUT;
-	ret = rd_get_response(conn, response);
+	auto ret = rd_get_response(conn, response);
 	if (ret == ETIMEDOUT)
 		return ret;
+	conn.reusable = true;
 	if (ret != 0) {
 		response += " (after DOT)";
 		return ret;
 	}
 	mlog(LV_INFO, "remote_delivery: SMTP output to %s ok", g_mx_host.c_str());
-	rd_send_cmd(conn, "QUIT\r\n", 6);
 	return 0;
 }
 
-static errno_t rd_session_begin(rd_connection &&conn, const MESSAGE_CONTEXT *ctx,
+static errno_t rd_data(rd_connection &conn, const MESSAGE_CONTEXT *ctx, std::string &response)
+{
+	if (!rd_send_cmd(conn, "DATA\r\n", 6))
+		return ETIMEDOUT;
+	auto ret = rd_get_response(conn, response, '3');
+	if (ret == ETIMEDOUT)
+		return ret;
+	if (ret != 0) {
+		conn.reusable = true;
+		return ret;
+	}
+	return rd_data_body(conn, ctx, response);
+}
+
+/*
+ * RFC 2920: send MAIL, all RCPTs and DATA in one go, then collect the
+ * replies in order. All replies are read even after a failure so that the
+ * session stays in step.
+ */
+static errno_t rd_pipelined(rd_connection &conn, const MESSAGE_CONTEXT *ctx,
+    std::string &response)
+{
+	auto f = strcmp(ctx->ctrl.from, ENVELOPE_FROM_NULL) != 0 ? ctx->ctrl.from : "";
+	std::string cmd = "MAIL FROM: <"s + f + ">\r\n", other;
+	for (const auto &rcpt : ctx->ctrl.rcpt)
+		cmd += "RCPT TO: <" + rcpt + ">\r\n";
+	cmd += "DATA\r\n";
+	if (!rd_send_cmd(conn, cmd.c_str(), cmd.size()))
+		return ETIMEDOUT;
+	auto ret = rd_get_response(conn, response);
+	if (ret == ETIMEDOUT)
+		return ret;
+	if (ret != 0)
+		response += " (after MAIL)";
+	for (size_t i = 0; i < ctx->ctrl.rcpt.size(); ++i) {
+		auto r = rd_get_response(conn, ret == 0 ? response : other);
+		if (r == ETIMEDOUT)
+			return r;
+		if (r != 0 && ret == 0) {
+			response += " (after RCPT)";
+			ret = r;
+		}
+	}
+	auto r = rd_get_response(conn, ret == 0 ? response : other, '3');
+	if (r == ETIMEDOUT)
+		return r;
+	if (ret != 0) {
+		/*
+		 * If the server still went for DATA (some recipients were
+		 * accepted), there is no way back short of dropping the
+		 * connection.
+		 */
+		conn.reusable = r != 0;
+		return ret;
+	} else if (r != 0) {
+		conn.reusable = true;
+		return r;
+	}
+	return rd_data_body(conn, ctx, response);
+}
+
+/**
+ * Run one mail transaction on an established session. With @reset, the
+ * session is a reused one and gets an RSET first, with a short timeout; if
+ * that fails, ENOTCONN is returned and nothing has been submitted.
+ */
+static errno_t rd_transaction(rd_connection &conn, const MESSAGE_CONTEXT *ctx,
+    std::string &response, bool reset)
+{
+	conn.reusable = false;
+	if (reset && (!rd_send_cmd(conn, "RSET\r\n", 6) ||
+	    rd_get_response(conn, response, '2', reuse_probe_timeout) != 0))
+		return ENOTCONN;
+	if (ctx->ctrl.rcpt.empty()) {
+		conn.reusable = true;
+		return ENOENT;
+	}
+	if (conn.pipelining)
+		return rd_pipelined(conn, ctx, response);
+	auto ret = rd_mailfrom(conn, ctx, response);
+	if (ret == 0)
+		ret = rd_rcptto(conn, ctx, response);
+	if (ret != 0) {
+		conn.reusable = ret != ETIMEDOUT;
+		return ret;
+	}
+	return rd_data(conn, ctx, response);
+}
+
+static errno_t rd_session_begin(rd_connection &conn, const MESSAGE_CONTEXT *ctx,
     std::string &response)
 {
 	auto ret = rd_hello(conn, ctx, response);
@@ -296,17 +412,14 @@ static errno_t rd_session_begin(rd_connection &&conn, const MESSAGE_CONTEXT *ctx
 	if (g_enable_tls && conn.tls == nullptr &&
 	    (search_string(response.c_str(), "250-STARTTLS", response.size()) != nullptr ||
 	    search_string(response.c_str(), "250 STARTTLS", response.size()) != nullptr))
-		return rd_starttls(std::move(conn), ctx, response);
-	ret = rd_mailfrom(conn, ctx, response);
-	if (ret != 0)
-		return ret;
-	ret = rd_rcptto(conn, ctx, response);
-	if (ret != 0)
-		return ret;
-	return rd_data(std::move(conn), ctx, response);
+		return rd_starttls(conn, ctx, response);
+	conn.pipelining = g_enable_pipelining &&
+		(search_string(response.c_str(), "250-PIPELINING", response.size()) != nullptr ||
+		search_string(response.c_str(), "250 PIPELINING", response.size()) != nullptr);
+	return 0;
 }
 
-static errno_t rd_starttls(rd_connection &&conn, const MESSAGE_CONTEXT *ctx,
+static errno_t rd_starttls(rd_connection &conn, const MESSAGE_CONTEXT *ctx,
     std::string &response)
 {
 	if (!rd_send_cmd(conn, "STARTTLS\r\n", 10))
@@ -318,6 +431,8 @@ static errno_t rd_starttls(rd_connection &&conn, const MESSAGE_CONTEXT *ctx,
 		response += " (after STARTTLS)";
 		return EHOSTUNREACH;
 	}
+	/* Nothing sent in plaintext may be carried over (CVE-2011-0411) */
+	conn.rbuf.clear();
 	conn.tls.reset(SSL_new(g_tls_ctx.get()));
 	if (conn.tls == nullptr) {
 		mlog(LV_ERR, "E-1553: Could not create local TLS context");
@@ -329,11 +444,61 @@ static errno_t rd_starttls(rd_connection &&conn, const MESSAGE_CONTEXT *ctx,
 		        g_mx_host.c_str(), g_mx_port);
 		return EHOSTUNREACH;
 	}
-	return rd_session_begin(std::move(conn), ctx, response);
+	return rd_session_begin(conn, ctx, response);
+}
+
+/* Take the most recently used idle session, closing expired ones. */
+static rd_connection rd_pool_get()
+{
+	std::deque<rd_connection> stale;
+	rd_connection conn;
+	std::unique_lock lk(g_pool_lock);
+	auto limit = std::chrono::steady_clock::now() - g_idle_timeout;
+	while (!g_pool.empty() && g_pool.front().last_use < limit) {
+		stale.push_back(std::move(g_pool.front()));
+		g_pool.pop_front();
+	}
+	if (!g_pool.empty()) {
+		conn = std::move(g_pool.back());
+		g_pool.pop_back();
+	}
+	lk.unlock();
+	for (const auto &c : stale)
+		rd_send_cmd(c, "QUIT\r\n", 6);
+	return conn;
+}
+
+/* Keep the session for the next message, or end it. */
+static void rd_pool_put(rd_connection &&conn)
+{
+	if (!conn.reusable)
+		/* Mid-DATA or out of step: QUIT would not be understood */
+		return;
+	if (g_pool_size > 0) {
+		conn.last_use = std::chrono::steady_clock::now();
+		std::lock_guard lk(g_pool_lock);
+		if (g_pool.size() < g_pool_size) {
+			g_pool.push_back(std::move(conn));
+			return;
+		}
+	}
+	rd_send_cmd(conn, "QUIT\r\n", 6);
 }
 
 static errno_t rd_send_mail(const MESSAGE_CONTEXT *ctx, std::string &response)
 {
+	/*
+	 * Idle sessions may have been closed by the peer in the meantime;
+	 * the RSET in rd_transaction finds out before anything is submitted.
+	 */
+	for (auto conn = rd_pool_get(); conn.fd >= 0; conn = rd_pool_get()) {
+		auto ret = rd_transaction(conn, ctx, response, true);
+		if (ret == ENOTCONN)
+			continue;
+		rd_pool_put(std::move(conn));
+		return ret;
+	}
+
 	rd_connection conn;
 	conn.fd = HX_inet_connect(g_mx_host.c_str(), g_mx_port, 0);
 	if (conn.fd < 0) {
@@ -341,9 +506,19 @@ static errno_t rd_send_mail(const MESSAGE_CONTEXT *ctx, std::string &response)
 			g_mx_host.c_str(), g_mx_port, strerror(-conn.fd));
 		return EHOSTUNREACH;
 	}
+	/* Commands are batched already; do not let Nagle delay the DOT. */
+	static constexpr int flag = 1;
+	if (setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0)
+		mlog(LV_WARN, "W-1229: setsockopt: %s", strerror(errno));
 	auto ret = rd_get_response(conn, response);
-	if (ret == 0)
-		return rd_session_begin(std::move(conn), ctx, response);
+	if (ret == 0) {
+		ret = rd_session_begin(conn, ctx, response);
+		if (ret != 0)
+			return ret;
+		ret = rd_transaction(conn, ctx, response, false);
+		rd_pool_put(std::move(conn));
+		return ret;
+	}
 
 	if (ret == ETIMEDOUT)
 		return ret;
@@ -379,6 +554,9 @@ static hook_result remote_delivery_hook(MESSAGE_CONTEXT *ctx)
 static BOOL remote_delivery_entry(int request, void **apidata)
 {
 	if (request == PLUGIN_FREE) {
+		for (const auto &conn : g_pool)
+			rd_send_cmd(conn, "QUIT\r\n", 6);
+		g_pool.clear();
 		g_tls_ctx.reset();
 		g_tls_mutex_buf.reset();
 		return TRUE;
@@ -397,6 +575,9 @@ static BOOL remote_delivery_entry(int request, void **apidata)
 	g_mx_host = cfg_file->get_value("mx_host");
 	g_mx_port = cfg_file->get_ll("mx_port");
 	g_enable_tls = cfg_file->get_ll("starttls_support");
+	g_enable_pipelining = cfg_file->get_ll("pipelining_support");
+	g_pool_size = cfg_file->get_ll("mx_connection_pool_size");
+	g_idle_timeout = std::chrono::seconds(cfg_file->get_ll("mx_connection_idle_timeout"));
 	if (rd_run() != 0) {
 		mlog(LV_ERR, "remote_delivery: rd_run failed");
 		return false;
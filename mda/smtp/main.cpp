@@ -82,6 +82,7 @@ static constexpr cfg_directive smtp_cfg_defaults[] = {
 	{"lda_listen_tls_port", "0"},
 	{"lda_log_file", "-"},
 	{"lda_log_level", "4" /* LV_NOTICE */},
+	{"lda_reactor_num", "1", CFG_SIZE},
 	{"lda_thread_charge_num", "400", CFG_SIZE, "4"},
 	{"lda_thread_init_num", "5", CFG_SIZE},
 	{"listen_port", "lda_listen_port", CFG_ALIAS},
@@ -377,6 +378,7 @@ int main(int argc, const char **argv)
 		}
 	mlog(LV_INFO, "system: one thread is in charge of %d contexts",
 		thread_charge_num);
+	unsigned int reactor_num = g_config_file->get_ll("lda_reactor_num");
 	
 	unsigned int thread_init_num = g_config_file->get_ll("lda_thread_init_num");
 	if (thread_init_num * thread_charge_num > scfg.context_num) {
@@ -500,7 +502,7 @@ int main(int argc, const char **argv)
 	contexts_pool_init(smtp_parser_get_contexts_list(), scfg.context_num,
 		smtp_parser_get_context_socket,
 		smtp_parser_get_context_timestamp,
-		thread_charge_num, scfg.timeout);
+		thread_charge_num, scfg.timeout, reactor_num);
  
 	if (0 != contexts_pool_run()) { 
 		mlog(LV_ERR, "system: failed to start context pool");
@@ -125,6 +125,7 @@ static constexpr cfg_directive imap_cfg_defaults[] = {
 	{"imap_listen_tls_port", "0"},
 	{"imap_log_file", "-"},
 	{"imap_log_level", "4" /* LV_NOTICE */},
+	{"imap_reactor_num", "1", CFG_SIZE},
 	{"imap_rfc9051", "1", CFG_BOOL},
 	{"imap_support_starttls", "imap_support_tls", CFG_ALIAS},
 	{"imap_support_tls", "false", CFG_BOOL},
@@ -507,6 +508,7 @@ int main(int argc, const char **argv)
 	}
 	printf("[system]: one thread is in charge of %d contexts\n",
 		thread_charge_num);
+	unsigned int reactor_num = g_config_file->get_ll("imap_reactor_num");
 	
 	unsigned int thread_init_num = g_config_file->get_ll("imap_thread_init_num");
 	if (thread_init_num * thread_charge_num > context_num) {
@@ -633,7 +635,7 @@ int main(int argc, const char **argv)
 		context_num,
 		imap_parser_get_context_socket,
 		imap_parser_get_context_timestamp,
-		thread_charge_num, imap_conn_timeout); 
+		thread_charge_num, imap_conn_timeout, reactor_num);
  
 	if (0 != contexts_pool_run()) { 
 		printf("[system]: failed to run contexts pool\n");
@@ -100,6 +100,7 @@ static constexpr cfg_directive pop3_cfg_defaults[] = {
 	{"pop3_listen_tls_port", "0"},
 	{"pop3_log_file", "-"},
 	{"pop3_log_level", "4" /* LV_NOTICE */},
+	{"pop3_reactor_num", "1", CFG_SIZE},
 	{"pop3_support_stls", "pop3_support_tls", CFG_ALIAS},
 	{"pop3_support_tls", "false", CFG_BOOL},
 	{"pop3_thread_charge_num", "20", CFG_SIZE, "4"},
@@ -432,6 +433,7 @@ int main(int argc, const char **argv)
 	}
 	printf("[system]: one thread is in charge of %d contexts\n",
 		thread_charge_num);
+	unsigned int reactor_num = g_config_file->get_ll("pop3_reactor_num");
 
 	unsigned int thread_init_num = g_config_file->get_ll("pop3_thread_init_num");
 	if (thread_init_num * thread_charge_num > context_num) {
@@ -554,7 +556,7 @@ int main(int argc, const char **argv)
 	contexts_pool_init(pop3_parser_get_contexts_list(), context_num,
 		pop3_parser_get_context_socket,
 		pop3_parser_get_context_timestamp,
-		thread_charge_num, pop3_conn_timeout); 
+		thread_charge_num, pop3_conn_timeout, reactor_num);
  
 	if (0 != contexts_pool_run()) { 
 		printf("[system]: failed to run contexts pool\n");
@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Compare the vectorized base64/QP paths against the scalar ones on random
+ * input, then measure throughput of every available level.
+ * Usage: tests/codecbench [rounds [MiB]]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <gromox/util.hpp>
+
+using namespace gromox;
+using clk = std::chrono::steady_clock;
+
+namespace {
+struct result {
+	long long ret = 0;
+	size_t outlen = 0;
+	std::string out;
+	bool operator==(const result &o) const {
+		return ret == o.ret && outlen == o.outlen && out == o.out;
+	}
+	bool operator!=(const result &o) const { return !(*this == o); }
+};
+}
+
+static std::mt19937 g_rng(4);
+
+static std::string gen_binary(size_t z)
+{
+	std::string s(z, '\0');
+	for (auto &c : s)
+		c = g_rng();
+	return s;
+}
+
+/* Text with the things QP cares about: dots, From, spaces at EOL, =, _ */
+static std::string gen_text(size_t z)
+{
+	static const char *const frag[] = {
+		"\r\n", "\r\n.", "\r\nFrom ", " \r\n", "  ", "=", "_", "\t",
+		"\xc3\xa4", "\n", "\r", ".", "From", "=3D", "=\r\n", "=4", "=X",
+	};
+	std::string s;
+	while (s.size() < z) {
+		if (g_rng() % 4 == 0) {
+			s += frag[g_rng() % std::size(frag)];
+			continue;
+		}
+		auto n = g_rng() % 90;
+		for (size_t i = 0; i < n; ++i)
+			s += static_cast<char>(' ' + g_rng() % 95);
+	}
+	s.resize(z);
+	return s;
+}
+
+/* base64 with wrapping, optional junk and padding */
+static std::string gen_b64(size_t z)
+{
+	auto bin = gen_binary(z * 3 / 4 + 1);
+	std::string s(bin.size() * 2 + 8, '\0');
+	size_t ol = 0;
+	if (g_rng() % 2)
+		encode64_ex(bin.data(), bin.size(), s.data(), s.size(), &ol);
+	else
+		encode64(bin.data(), bin.size(), s.data(), s.size(), &ol);
+	s.resize(ol);
+	switch (g_rng() % 6) {
+	case 0: if (!s.empty()) s[g_rng() % s.size()] = " \t\r\n*=-"[g_rng() % 7]; break;
+	case 1: if (!s.empty()) s.insert(g_rng() % s.size(), " \r\n"); break;
+	case 2: s.resize(g_rng() % (s.size() + 1)); break;
+	}
+	return s;
+}
+
+static result run(unsigned int fn, const std::string &in)
+{
+	result r;
+	std::vector<char> buf(in.size() * 3 + 64);
+	switch (fn) {
+	case 0:
+		r.ret = encode64(in.data(), in.size(), buf.data(), buf.size(), &r.outlen);
+		break;
+	case 1:
+		r.ret = encode64_ex(in.data(), in.size(), buf.data(), buf.size(), &r.outlen);
+		break;
+	case 2:
+		r.ret = decode64_ex(in.data(), in.size(), buf.data(), buf.size(), &r.outlen);
+		break;
+	case 3:
+		r.ret = qp_encode_ex(buf.data(), buf.size(), in.data(), in.size());
+		break;
+	case 4:
+		r.ret = qp_decode_ex(buf.data(), buf.size(), in.data(), in.size());
+		break;
+	case 5:
+		r.ret = qp_decode_ex(buf.data(), buf.size(), in.data(), in.size(), QP_MIME_HEADER);
+		break;
+	case 6: {
+		/* tight output buffer */
+		auto z = qp_encoded_size_estimate(in.data(), in.size());
+		r.ret = qp_encode_ex(buf.data(), std::min(z + 1, buf.size()), in.data(), in.size());
+		break;
+	}
+	}
+	if (r.ret >= 0 && fn >= 3)
+		r.outlen = r.ret;
+	r.out.assign(buf.data(), r.ret >= 0 ? r.outlen : 0);
+	return r;
+}
+
+static const char *const fn_names[] = {
+	"encode64", "encode64_ex", "decode64_ex", "qp_encode_ex",
+	"qp_decode_ex", "qp_decode_ex(hdr)", "qp_encode_ex(tight)",
+};
+
+static std::string gen_input(unsigned int fn, size_t z)
+{
+	if (fn == 2)
+		return gen_b64(z);
+	if (fn >= 3 && g_rng() % 8 != 0)
+		return gen_text(z);
+	return gen_binary(z);
+}
+
+static bool fuzz(unsigned int rounds, unsigned int maxlevel)
+{
+	for (unsigned int i = 0; i < rounds; ++i) {
+		auto z = i < 600 ? i : g_rng() % (i % 16 == 0 ? 70000 : 600);
+		for (unsigned int fn = 0; fn < std::size(fn_names); ++fn) {
+			auto in = gen_input(fn, z);
+			codec_simd_level(0);
+			auto ref = run(fn, in);
+			for (unsigned int lv = 1; lv <= maxlevel; ++lv) {
+				codec_simd_level(lv);
+				if (run(fn, in) == ref)
+					continue;
+				fprintf(stderr, "%s: level %u differs from scalar, input size %zu\n",
+				        fn_names[fn], lv, in.size());
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void bench(unsigned int maxlevel, size_t z)
+{
+	auto bin = gen_binary(z), text = gen_text(z);
+	std::vector<char> b64(z * 2), out(z * 4);
+	size_t b64len = 0, ol = 0;
+	encode64_ex(bin.data(), bin.size(), b64.data(), b64.size(), &b64len);
+	std::vector<char> qp(z * 4);
+	auto qplen = qp_encode_ex(qp.data(), qp.size(), text.data(), text.size());
+	for (unsigned int lv = 0; lv <= maxlevel; ++lv) {
+		codec_simd_level(lv);
+		auto t0 = clk::now();
+		encode64(bin.data(), z, out.data(), out.size(), &ol);
+		auto t1 = clk::now();
+		encode64_ex(bin.data(), z, out.data(), out.size(), &ol);
+		auto t2 = clk::now();
+		decode64_ex(b64.data(), b64len, out.data(), out.size(), &ol);
+		auto t3 = clk::now();
+		qp_encode_ex(out.data(), out.size(), text.data(), z);
+		auto t4 = clk::now();
+		qp_decode_ex(out.data(), out.size(), qp.data(), qplen);
+		auto t5 = clk::now();
+		auto mbs = [&](clk::time_point a, clk::time_point b) {
+			return z / 1048576.0 / std::chrono::duration<double>(b - a).count();
+		};
+		printf("level %u MB/s: encode64 %.0f, encode64_ex %.0f, decode64_ex %.0f, "
+		       "qp_encode_ex %.0f, qp_decode_ex %.0f\n", lv,
+		       mbs(t0, t1), mbs(t1, t2), mbs(t2, t3), mbs(t3, t4), mbs(t4, t5));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int rounds = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 3000;
+	size_t mib = argc >= 3 ? strtoul(argv[2], nullptr, 0) : 32;
+	auto maxlevel = codec_simd_level(~0U);
+	printf("SIMD level available: %u\n", maxlevel);
+	if (!fuzz(rounds, maxlevel))
+		return EXIT_FAILURE;
+	bench(maxlevel, mib << 20);
+	codec_simd_level(~0U);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,344 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Exercise the dnsbl_filter resolver (cache, TTLs, timeouts, deduplication)
+ * against a scripted DNS responder on localhost.
+ *
+ * Usage: tests/dnsbltest
+ *        tests/dnsbltest scriptfile port   (only run the stub responder)
+ *
+ * Script lines: <address> <txt|nx|servfail|drop> <ttl> <delay_ms> [text]
+ * The responder answers TXT queries for <address> in the zone "bl.test".
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "../exch/dnsbl_resolver.hpp"
+
+using namespace gromox;
+using namespace std::chrono_literals;
+
+namespace {
+
+struct action {
+	std::string verb, text;
+	unsigned int ttl = 0, delay = 0;
+	unsigned int queries = 0;
+};
+
+class stub_dns {
+	public:
+	stub_dns(std::istream &, uint16_t port = 0);
+	~stub_dns();
+	uint16_t port() const { return m_port; }
+	unsigned int queries(const char *addr);
+	void run();
+
+	private:
+	void reply(const uint8_t *, size_t, const struct sockaddr_in &);
+
+	std::map<std::string, action> m_script; /* qname -> action */
+	std::mutex m_lock;
+	std::thread m_thr;
+	std::atomic<bool> m_stop{false};
+	int m_fd = -1;
+	uint16_t m_port = 0;
+};
+
+}
+
+static constexpr char zone[] = "bl.test";
+
+static std::string to_qname(const char *addr)
+{
+	static constexpr char txt[] = "0123456789abcdef";
+	struct in6_addr a;
+	if (inet_pton(AF_INET6, addr, &a) != 1)
+		return {};
+	std::string s;
+	for (unsigned int i = 16; i-- > 0; ) {
+		s += txt[a.s6_addr[i] & 0xF];
+		s += '.';
+		s += txt[(a.s6_addr[i] & 0xF0) >> 4];
+		s += '.';
+	}
+	return s + zone;
+}
+
+stub_dns::stub_dns(std::istream &script, uint16_t port)
+{
+	std::string line;
+	while (std::getline(script, line)) {
+		std::istringstream ls(line);
+		std::string addr;
+		action a;
+		if (!(ls >> addr >> a.verb >> a.ttl >> a.delay) || addr[0] == '#')
+			continue;
+		std::getline(ls >> std::ws, a.text);
+		m_script[to_qname(addr.c_str())] = std::move(a);
+	}
+	m_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in sa{};
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t sl = sizeof(sa);
+	if (m_fd < 0 || bind(m_fd, reinterpret_cast<struct sockaddr *>(&sa), sl) != 0 ||
+	    getsockname(m_fd, reinterpret_cast<struct sockaddr *>(&sa), &sl) != 0) {
+		perror("stub_dns");
+		exit(EXIT_FAILURE);
+	}
+	m_port = ntohs(sa.sin_port);
+	m_thr = std::thread([this]() { run(); });
+}
+
+stub_dns::~stub_dns()
+{
+	m_stop = true;
+	m_thr.join();
+	close(m_fd);
+}
+
+unsigned int stub_dns::queries(const char *addr)
+{
+	std::lock_guard lk(m_lock);
+	auto i = m_script.find(to_qname(addr));
+	return i != m_script.end() ? i->second.queries : 0;
+}
+
+void stub_dns::run()
+{
+	while (!m_stop) {
+		struct pollfd pfd = {m_fd, POLLIN};
+		if (poll(&pfd, 1, 50) <= 0)
+			continue;
+		uint8_t buf[512];
+		struct sockaddr_in from;
+		socklen_t fl = sizeof(from);
+		auto got = recvfrom(m_fd, buf, sizeof(buf), 0,
+		           reinterpret_cast<struct sockaddr *>(&from), &fl);
+		if (got > 12)
+			reply(buf, got, from);
+	}
+}
+
+static void put16(std::string &s, unsigned int v)
+{
+	s += static_cast<char>(v >> 8);
+	s += static_cast<char>(v);
+}
+
+static void put32(std::string &s, unsigned int v)
+{
+	put16(s, v >> 16);
+	put16(s, v);
+}
+
+void stub_dns::reply(const uint8_t *q, size_t qlen, const struct sockaddr_in &to)
+{
+	/* question name */
+	std::string qname;
+	size_t p = 12;
+	while (p < qlen && q[p] != 0) {
+		if (!qname.empty())
+			qname += '.';
+		qname.append(reinterpret_cast<const char *>(&q[p+1]), q[p]);
+		p += q[p] + 1;
+	}
+	p += 5;
+	if (p > qlen)
+		return;
+	action a;
+	{
+		std::lock_guard lk(m_lock);
+		auto i = m_script.find(qname);
+		if (i == m_script.end()) {
+			a.verb = "nx";
+			a.ttl = 60;
+		} else {
+			++i->second.queries;
+			a = i->second;
+		}
+	}
+	if (a.delay > 0)
+		std::this_thread::sleep_for(std::chrono::milliseconds(a.delay));
+	if (a.verb == "drop")
+		return;
+	unsigned int rcode = a.verb == "nx" ? 3 : a.verb == "servfail" ? 2 : 0;
+	std::string r(reinterpret_cast<const char *>(q), 2);
+	put16(r, 0x8180 | rcode);
+	put16(r, 1);
+	put16(r, a.verb == "txt" ? 1 : 0);
+	put16(r, a.verb == "nx" ? 1 : 0);
+	put16(r, 0);
+	r.append(reinterpret_cast<const char *>(&q[12]), p - 12);
+	if (a.verb == "txt") {
+		put16(r, 0xC00C);
+		put16(r, 16);
+		put16(r, 1);
+		put32(r, a.ttl);
+		put16(r, a.text.size() + 1);
+		r += static_cast<char>(a.text.size());
+		r += a.text;
+	} else if (a.verb == "nx") {
+		/* SOA with root mname/rname; minimum = script TTL */
+		put16(r, 0xC00C);
+		put16(r, 6);
+		put16(r, 1);
+		put32(r, 3600);
+		put16(r, 22);
+		r += '\0';
+		r += '\0';
+		put32(r, 1);
+		put32(r, 3600);
+		put32(r, 600);
+		put32(r, 86400);
+		put32(r, a.ttl);
+	}
+	sendto(m_fd, r.data(), r.size(), 0,
+	       reinterpret_cast<const struct sockaddr *>(&to), sizeof(to));
+}
+
+static unsigned int g_fails;
+
+#define EXPECT(cond) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: expectation failed: %s\n", __FILE__, __LINE__, #cond); \
+			++g_fails; \
+		} \
+	} while (false)
+
+static bool lookup(dnsbl_resolver &r, const char *addr, std::string &reason)
+{
+	struct in6_addr a;
+	inet_pton(AF_INET6, addr, &a);
+	reason.clear();
+	return r.check(a, reason);
+}
+
+static void run_tests()
+{
+	std::istringstream script(
+		"::ffff:127.0.0.2 txt 3600 0 listed for testing\n"
+		"::ffff:127.0.0.3 nx 1 0\n"
+		"::ffff:127.0.0.4 drop 0 0\n"
+		"::ffff:127.0.0.5 txt 3600 300 slow listing\n"
+		"::ffff:127.0.0.6 servfail 0 0\n"
+		"::ffff:127.0.0.7 txt 1 0 short-lived\n");
+	stub_dns dns(script);
+	dnsbl_resolver r;
+	char srv[32];
+	snprintf(srv, std::size(srv), "127.0.0.1:%u", dns.port());
+	EXPECT(r.set_servers(srv) == 1);
+	EXPECT(r.set_servers("300.0.0.1") == -EINVAL);
+	EXPECT(r.set_servers("fe80::1%lo [fe80::1%lo]:5353 fe80::1%nonexistent0") == 2);
+	snprintf(srv, std::size(srv), "300.0.0.1 127.0.0.1:%u", dns.port());
+	EXPECT(r.set_servers(srv) == 1);
+	r.m_zone = zone;
+	r.m_timeout = 200ms;
+	std::string reason;
+
+	/* positive answer, then served from cache */
+	EXPECT(!lookup(r, "::ffff:127.0.0.2", reason));
+	EXPECT(reason == "listed for testing; ");
+	EXPECT(!lookup(r, "::ffff:127.0.0.2", reason));
+	EXPECT(reason == "listed for testing; ");
+	EXPECT(dns.queries("::ffff:127.0.0.2") == 1);
+
+	/* NXDOMAIN, cached for the SOA minimum */
+	EXPECT(lookup(r, "::ffff:127.0.0.3", reason));
+	EXPECT(lookup(r, "::ffff:127.0.0.3", reason));
+	EXPECT(dns.queries("::ffff:127.0.0.3") == 1);
+	EXPECT(!lookup(r, "::ffff:127.0.0.7", reason));
+	std::this_thread::sleep_for(1100ms);
+	EXPECT(lookup(r, "::ffff:127.0.0.3", reason));
+	EXPECT(dns.queries("::ffff:127.0.0.3") == 2);
+	EXPECT(!lookup(r, "::ffff:127.0.0.7", reason));
+	EXPECT(dns.queries("::ffff:127.0.0.7") == 2);
+
+	/* no answer: fail open, and do not remember that */
+	auto t0 = std::chrono::steady_clock::now();
+	EXPECT(lookup(r, "::ffff:127.0.0.4", reason));
+	EXPECT(std::chrono::steady_clock::now() - t0 < 1s);
+	EXPECT(lookup(r, "::ffff:127.0.0.4", reason));
+	EXPECT(dns.queries("::ffff:127.0.0.4") == 2);
+	EXPECT(r.stats().timeouts == 2);
+
+	/* SERVFAIL: fail open */
+	EXPECT(lookup(r, "::ffff:127.0.0.6", reason));
+	EXPECT(r.stats().errors == 1);
+
+	/* concurrent lookups of one address share a single query */
+	r.m_timeout = 2s;
+	std::vector<std::thread> thr;
+	std::atomic<unsigned int> listed{0};
+	for (unsigned int i = 0; i < 8; ++i)
+		thr.emplace_back([&]() {
+			std::string rs;
+			if (!lookup(r, "::ffff:127.0.0.5", rs) && rs == "slow listing; ")
+				++listed;
+		});
+	for (auto &t : thr)
+		t.join();
+	EXPECT(listed == 8);
+	EXPECT(dns.queries("::ffff:127.0.0.5") == 1);
+	auto st = r.stats();
+	EXPECT(st.joined == 7);
+	printf("hits %llu, misses %llu, joined %llu, timeouts %llu, errors %llu\n",
+	       static_cast<unsigned long long>(st.hits),
+	       static_cast<unsigned long long>(st.misses),
+	       static_cast<unsigned long long>(st.joined),
+	       static_cast<unsigned long long>(st.timeouts),
+	       static_cast<unsigned long long>(st.errors));
+
+	/* failover from an unresponsive server; a full cache evicts the LRU entry */
+	dnsbl_resolver r2;
+	snprintf(srv, std::size(srv), "127.0.0.1:9 127.0.0.1:%u", dns.port());
+	EXPECT(r2.set_servers(srv) == 2);
+	r2.m_zone = zone;
+	r2.m_timeout = 400ms;
+	r2.m_cache_max = 1;
+	auto q2 = dns.queries("::ffff:127.0.0.2");
+	EXPECT(!lookup(r2, "::ffff:127.0.0.2", reason));
+	EXPECT(lookup(r2, "::ffff:127.0.0.3", reason));
+	EXPECT(lookup(r2, "::ffff:127.0.0.3", reason));
+	EXPECT(r2.stats().hits == 1);
+	EXPECT(!lookup(r2, "::ffff:127.0.0.2", reason));
+	EXPECT(dns.queries("::ffff:127.0.0.2") == q2 + 2);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc >= 3) {
+		std::ifstream script(argv[1]);
+		if (!script) {
+			perror(argv[1]);
+			return EXIT_FAILURE;
+		}
+		stub_dns dns(script, strtoul(argv[2], nullptr, 0));
+		printf("Answering for zone %s on 127.0.0.1:%u\n", zone, dns.port());
+		pause();
+		return EXIT_SUCCESS;
+	}
+	run_tests();
+	if (g_fails > 0) {
+		fprintf(stderr, "%u failures\n", g_fails);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
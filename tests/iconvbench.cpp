@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Check string_to_utf8/iconvtext against plain iconv for a set of charsets
+ * commonly seen in mail, and time them against an iconv_open per call.
+ * Usage: tests/iconvbench [iterations]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iconv.h>
+#include <string>
+#include <gromox/fileio.h>
+#include <gromox/util.hpp>
+
+using namespace gromox;
+using clk = std::chrono::steady_clock;
+
+namespace {
+struct sample {
+	const char *cset, *text;
+};
+}
+
+static const sample g_samples[] = {
+	{"us-ascii", "Re: [gromox] Meeting notes for Thursday, 10:00 UTC"},
+	{"utf-8", "Gr\xc3\xbc\xc3\x9f""e aus M\xc3\xbcnchen \xe2\x80\x93 \xe2\x82\xac 5"},
+	{"iso-8859-1", "Gr\xfc\xdf""e aus M\xfcnchen, \xa7 4 \xe0 \xe9t\xe9"},
+	{"iso-8859-1", "Subject: plain ASCII in a Latin-1 labelled header"},
+	{"windows-1252", "\x93Quoted\x94 \x96 \x80""5 \x85 na\xefve caf\xe9"},
+	{"windows-1252", "unassigned \x81\x8d\x8f\x90\x9d codes"},
+	{"iso-8859-2", "P\xf8\xedli\xb9 \xbelu\xbbou\xe8k\xfd k\xf9\xf2"},
+	{"iso-8859-15", "\xa4 10,- \xbc\xbd\xbe"},
+	{"koi8-r", "\xf0\xd2\xc9\xd7\xc5\xd4, \xcd\xc9\xd2"},
+	{"gb2312", "\xc4\xe3\xba\xc3\xa3\xac\xca\xc0\xbd\xe7"},
+	{"big5", "\xa7\x41\xa6\x6e"},
+	{"shift_jis", "\x82\xb1\x82\xf1\x82\xc9\x82\xbf\x82\xcd"},
+	{"iso-2022-jp", "\x1b$B$3$s$K$A$O\x1b(B world"},
+	{"euc-kr", "\xbe\xc8\xb3\xe7\xc7\xcf\xbc\xbc\xbf\xe4"},
+};
+
+/* Reference: what the code did before descriptors were cached */
+static std::string ref_to_utf8(const char *cs, const char *in, bool &ok)
+{
+	char tmp[64], out[1024];
+	snprintf(tmp, std::size(tmp), "%s//IGNORE", replace_iconv_charset(cs));
+	auto cd = iconv_open("UTF-8", tmp);
+	if (cd == iconv_t(-1)) {
+		ok = false;
+		return {};
+	}
+	auto pin = const_cast<char *>(in);
+	auto pout = out;
+	size_t il = strlen(in), ol = sizeof(out) - 1;
+	ok = iconv(cd, &pin, &il, &pout, &ol) != static_cast<size_t>(-1);
+	iconv_close(cd);
+	*pout = '\0';
+	return out;
+}
+
+static std::string ref_iconvtext(const char *in, size_t z, const char *from)
+{
+	auto cd = iconv_open("UTF-8//IGNORE", from);
+	if (cd == iconv_t(-1))
+		return "UNKNOWN_CHARSET";
+	std::string out;
+	char buf[4096];
+	while (z > 0) {
+		auto dst = buf;
+		size_t dz = sizeof(buf);
+		auto ret = iconv(cd, const_cast<char **>(&in), &z, &dst, &dz);
+		out.append(buf, sizeof(buf) - dz);
+		if (ret == static_cast<size_t>(-1) && dz == sizeof(buf) && z > 0) {
+			--z;
+			++in;
+		}
+	}
+	iconv_close(cd);
+	return out;
+}
+
+static bool check()
+{
+	bool pass = true;
+	for (const auto &s : g_samples) {
+		char out[1024];
+		bool ref_ok;
+		auto ref = ref_to_utf8(s.cset, s.text, ref_ok);
+		bool ok = string_to_utf8(s.cset, s.text, out, std::size(out));
+		if (ok != ref_ok || (ok && ref != out)) {
+			fprintf(stderr, "string_to_utf8 %s mismatch: \"%s\"(%d) vs \"%s\"(%d)\n",
+			        s.cset, out, ok, ref.c_str(), ref_ok);
+			pass = false;
+		}
+		auto a = iconvtext(s.text, strlen(s.text), s.cset, "UTF-8");
+		auto b = ref_iconvtext(s.text, strlen(s.text), s.cset);
+		if (a != b) {
+			fprintf(stderr, "iconvtext %s mismatch: \"%s\" vs \"%s\"\n",
+			        s.cset, a.c_str(), b.c_str());
+			pass = false;
+		}
+		/* short buffers must fail the same way */
+		for (size_t z = 1; z < 8; ++z) {
+			ref_ok = string_to_utf8(s.cset, s.text, out, z);
+			if (ref_ok && strlen(out) >= z) {
+				fprintf(stderr, "string_to_utf8 %s overflowed %zu\n", s.cset, z);
+				pass = false;
+			}
+		}
+	}
+	return pass;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int iter = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 20000;
+	if (!check())
+		return EXIT_FAILURE;
+	for (const auto &s : g_samples) {
+		char out[1024];
+		bool ok;
+		auto t0 = clk::now();
+		for (unsigned int i = 0; i < iter; ++i)
+			ref_to_utf8(s.cset, s.text, ok);
+		auto t1 = clk::now();
+		for (unsigned int i = 0; i < iter; ++i)
+			string_to_utf8(s.cset, s.text, out, std::size(out));
+		auto t2 = clk::now();
+		printf("%-14s  iconv_open/call: %7.1f ns  string_to_utf8: %7.1f ns\n", s.cset,
+		       std::chrono::duration<double, std::nano>(t1 - t0).count() / iter,
+		       std::chrono::duration<double, std::nano>(t2 - t1).count() / iter);
+	}
+	return EXIT_SUCCESS;
+}
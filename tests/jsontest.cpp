@@ -3,6 +3,7 @@
 // This file is part of Gromox.
 #include <cstdio>
 #include <cstring>
+#include <string_view>
 #include <json/value.h>
 #include <gromox/json.hpp>
 #include <gromox/mjson.hpp>
@@ -57,6 +58,25 @@ static int t_digest()
 	return EXIT_SUCCESS;
 }
 
+static int t_bin(const Json::Value &orig)
+{
+	auto bin = json_to_bin(orig);
+	Json::Value copy;
+	if (!json_from_bin(bin, copy) || copy != orig) {
+		fprintf(stderr, "binary roundtrip failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("binary digest: %zu bytes, text: %zu bytes\n",
+	       bin.size(), json_to_str(orig).size());
+	for (size_t i = 0; i < bin.size(); ++i) {
+		if (json_from_bin(std::string_view(bin.data(), i), copy)) {
+			fprintf(stderr, "truncated input (%zu bytes) accepted\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
 int main()
 {
 	Json::Value json;
@@ -70,5 +90,7 @@ int main()
 	m.enum_mime(enx, nullptr);
 	if (t_digest() != EXIT_SUCCESS)
 		return EXIT_FAILURE;
+	if (t_bin(json) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
 	return EXIT_SUCCESS;
 }
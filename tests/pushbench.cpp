@@ -0,0 +1,193 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Serialize representative exmdb payloads (a query_table row set and a
+ * message with a large attachment) with the old growth policy, with the
+ * pooled buffers plus size hint, and with EXT_FLAG_IOVREF, and check that
+ * all produce identical bytes.
+ * Usage: tests/pushbench [rounds]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <gromox/element_data.hpp>
+#include <gromox/ext_buffer.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/util.hpp>
+
+using namespace gromox;
+using clk = std::chrono::steady_clock;
+
+namespace {
+
+/* Owns everything the TPROPVAL_ARRAYs point to */
+struct payload {
+	std::vector<std::string> strs;
+	std::vector<BINARY> bins;
+	std::vector<std::vector<TAGGED_PROPVAL>> props;
+	std::vector<TPROPVAL_ARRAY> rows;
+	std::vector<TPROPVAL_ARRAY *> rowptrs;
+	std::string blob;
+	uint64_t i8 = 0x1d9f00012345678ULL;
+	uint32_t l32 = 0x1234;
+	TARRAY_SET set{};
+	ATTACHMENT_CONTENT atx{};
+	ATTACHMENT_CONTENT *atxp = &atx;
+	ATTACHMENT_LIST atl{};
+	MESSAGE_CONTENT msg{};
+};
+
+}
+
+static void make_rows(payload &p, unsigned int nrows)
+{
+	p.strs.reserve(2 * nrows);
+	p.bins.reserve(nrows);
+	p.props.reserve(nrows + 2);
+	p.rows.reserve(nrows + 2);
+	for (unsigned int i = 0; i < nrows; ++i) {
+		p.strs.push_back("Subject line of message number " + std::to_string(i));
+		p.strs.push_back("sender" + std::to_string(i % 97) + "@example.com");
+		p.bins.push_back(BINARY{46, {reinterpret_cast<uint8_t *>(p.strs[2*i].data())}});
+		p.props.push_back({
+			{PR_SUBJECT, p.strs[2*i].data()},
+			{PR_SENDER_SMTP_ADDRESS, p.strs[2*i+1].data()},
+			{PR_MESSAGE_DELIVERY_TIME, &p.i8},
+			{PR_MESSAGE_SIZE, &p.l32},
+			{PR_ENTRYID, &p.bins[i]},
+		});
+		auto &v = p.props.back();
+		p.rows.push_back({static_cast<uint16_t>(v.size()), v.data()});
+	}
+	for (auto &r : p.rows)
+		p.rowptrs.push_back(&r);
+	p.set = {nrows, p.rowptrs.data()};
+}
+
+static void make_message(payload &p, size_t blobsize)
+{
+	p.blob.assign(blobsize, '\0');
+	for (size_t i = 0; i < blobsize; ++i)
+		p.blob[i] = 'a' + i % 26;
+	p.bins.push_back(BINARY{static_cast<uint32_t>(blobsize),
+		{reinterpret_cast<uint8_t *>(p.blob.data())}});
+	p.props.push_back({{PR_ATTACH_NUM, &p.l32}, {PR_ATTACH_DATA_BIN, &p.bins.back()}});
+	auto &av = p.props.back();
+	p.atx.proplist = {static_cast<uint16_t>(av.size()), av.data()};
+	p.atl = {1, &p.atxp};
+	p.props.push_back({{PR_SUBJECT, p.strs[0].data()}, {PR_BODY, p.blob.data()}});
+	p.blob[blobsize / 2] = '\0'; /* PR_BODY takes the first half */
+	auto &mv = p.props.back();
+	p.msg.proplist = {static_cast<uint16_t>(mv.size()), mv.data()};
+	p.msg.children.prcpts = nullptr;
+	p.msg.children.pattachments = &p.atl;
+}
+
+template<typename F> static std::string push_plain(F &&fn)
+{
+	static const EXT_BUFFER_MGT mgt = {zalloc, realloc, free};
+	EXT_PUSH ep;
+	if (!ep.init(nullptr, 0, EXT_FLAG_WCOUNT, &mgt) || fn(ep) != pack_result::ok)
+		return {};
+	return std::string(ep.m_cdata, ep.m_offset);
+}
+
+template<typename F> static std::string push_hinted(size_t hint, F &&fn)
+{
+	EXT_PUSH ep;
+	if (!ep.init(nullptr, hint, EXT_FLAG_WCOUNT) || fn(ep) != pack_result::ok)
+		return {};
+	return std::string(ep.m_cdata, ep.m_offset);
+}
+
+template<typename F> static std::string push_iov(size_t hint, F &&fn, size_t *nref = nullptr)
+{
+	EXT_PUSH ep;
+	if (!ep.init(nullptr, hint, EXT_FLAG_WCOUNT | EXT_FLAG_IOVREF) ||
+	    fn(ep) != pack_result::ok)
+		return {};
+	std::vector<struct iovec> iov;
+	ep.get_iov(iov);
+	std::string out;
+	for (const auto &v : iov)
+		out.append(static_cast<const char *>(v.iov_base), v.iov_len);
+	if (nref != nullptr)
+		*nref = ep.m_refs.size();
+	return out;
+}
+
+/* Time only the serialization; the iov variant does not flatten. */
+template<typename F> static double bench(unsigned int rounds, F &&fn)
+{
+	auto t0 = clk::now();
+	for (unsigned int i = 0; i < rounds; ++i)
+		fn();
+	return std::chrono::duration<double, std::micro>(clk::now() - t0).count() / rounds;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int rounds = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 200;
+	unsigned int fails = 0;
+	payload p;
+	make_rows(p, 20000);
+	make_message(p, 8 << 20);
+
+	auto do_set = [&](EXT_PUSH &ep) { return ep.p_tarray_set(p.set); };
+	auto do_msg = [&](EXT_PUSH &ep) { return ep.p_msgctnt(p.msg); };
+	auto set_hint = ext_push_estimate(p.set);
+	auto msg_hint = ext_push_estimate(p.msg);
+
+	auto ref_set = push_plain(do_set), ref_msg = push_plain(do_msg);
+	size_t nref = 0;
+	if (ref_set.empty() || ref_msg.empty()) {
+		fprintf(stderr, "serialization failed\n");
+		return EXIT_FAILURE;
+	}
+	if (push_hinted(set_hint, do_set) != ref_set ||
+	    push_iov(set_hint, do_set) != ref_set) {
+		fprintf(stderr, "query_table payload: output differs\n");
+		++fails;
+	}
+	if (push_hinted(msg_hint, do_msg) != ref_msg ||
+	    push_iov(msg_hint, do_msg, &nref) != ref_msg || nref != 2) {
+		fprintf(stderr, "read_message payload: output differs (%zu refs)\n", nref);
+		++fails;
+	}
+	printf("query_table: %zu bytes (estimate %zu), read_message: %zu bytes (estimate %zu)\n",
+	       ref_set.size(), set_hint, ref_msg.size(), msg_hint);
+
+	auto run = [&](const char *name, auto &&fn, size_t hint) {
+		auto a = bench(rounds, [&]() {
+			static const EXT_BUFFER_MGT mgt = {zalloc, realloc, free};
+			EXT_PUSH ep;
+			ep.init(nullptr, 0, EXT_FLAG_WCOUNT, &mgt);
+			fn(ep);
+		});
+		auto b = bench(rounds, [&]() {
+			EXT_PUSH ep;
+			ep.init(nullptr, hint, EXT_FLAG_WCOUNT);
+			fn(ep);
+		});
+		auto c = bench(rounds, [&]() {
+			EXT_PUSH ep;
+			ep.init(nullptr, hint, EXT_FLAG_WCOUNT | EXT_FLAG_IOVREF);
+			fn(ep);
+			std::vector<struct iovec> iov;
+			ep.get_iov(iov);
+		});
+		printf("%-12s %10.1f µs realloc-from-8K, %10.1f µs pooled+hint, %10.1f µs iovref\n",
+		       name, a, b, c);
+	};
+	run("query_table", do_set, set_hint);
+	run("read_message", do_msg, msg_hint);
+	if (fails > 0) {
+		fprintf(stderr, "%u failures\n", fails);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,332 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Drive the remote_delivery hook against a local fake SMTP sink: session
+ * reuse, RSET recovery after the peer dropped an idle session, PIPELINING,
+ * and the throughput with and without session reuse.
+ * Usage: tests/smtpsink [messages]
+ */
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <unistd.h>
+#include <vector>
+#include <arpa/inet.h>
+#include <libHX/string.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <gromox/hook_common.h>
+
+using namespace gromox;
+using clk = std::chrono::steady_clock;
+
+namespace {
+
+/* Behaviour knobs and counters of the sink */
+struct sink_state {
+	std::atomic<bool> pipelining{true}, drop_after_tx{false};
+	std::atomic<unsigned int> connections{0}, messages{0}, batches{0};
+};
+
+}
+
+static sink_state g_sink;
+static int g_listen_fd = -1;
+static uint16_t g_sink_port;
+static char g_cfgdir[] = "/tmp/smtpsink.XXXXXX";
+static HOOK_FUNCTION g_remote_hook;
+static unsigned int g_fails;
+
+#define EXPECT(cond) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: expectation failed: %s\n", __FILE__, __LINE__, #cond); \
+			++g_fails; \
+		} \
+	} while (false)
+
+static bool sink_flush(int fd, std::string &out)
+{
+	auto ok = write(fd, out.data(), out.size()) == static_cast<ssize_t>(out.size());
+	out.clear();
+	return ok;
+}
+
+/*
+ * Replies are collected and sent once all buffered input is processed, like
+ * real servers do for pipelined commands.
+ */
+static void sink_session(int fd)
+{
+	++g_sink.connections;
+	std::string buf, out = "220 sink ESMTP\r\n";
+	bool in_data = false;
+	unsigned int rcpt_ok = 0;
+	while (true) {
+		if (!out.empty() && !sink_flush(fd, out))
+			break;
+		char rd[8192];
+		auto got = read(fd, rd, sizeof(rd));
+		if (got <= 0)
+			break;
+		buf.append(rd, got);
+		unsigned int cmds = 0;
+		size_t nl;
+		while ((nl = buf.find('\n')) != buf.npos) {
+			if (in_data) {
+				auto end = buf.find("\r\n.\r\n");
+				if (end == buf.npos)
+					break;
+				buf.erase(0, end + 5);
+				in_data = false;
+				++g_sink.messages;
+				out += "250 2.0.0 queued\r\n";
+				if (g_sink.drop_after_tx) {
+					sink_flush(fd, out);
+					close(fd);
+					return;
+				}
+				continue;
+			}
+			std::string line = buf.substr(0, nl + 1);
+			buf.erase(0, nl + 1);
+			++cmds;
+			if (strncasecmp(line.c_str(), "EHLO", 4) == 0) {
+				out += g_sink.pipelining ?
+				       "250-sink\r\n250-PIPELINING\r\n250 8BITMIME\r\n" :
+				       "250-sink\r\n250 8BITMIME\r\n";
+			} else if (strncasecmp(line.c_str(), "MAIL", 4) == 0) {
+				rcpt_ok = 0;
+				out += "250 2.1.0 ok\r\n";
+			} else if (strncasecmp(line.c_str(), "RCPT", 4) == 0) {
+				if (line.find("reject") != line.npos) {
+					out += "550 5.1.1 no such user\r\n";
+				} else {
+					++rcpt_ok;
+					out += "250 2.1.5 ok\r\n";
+				}
+			} else if (strncasecmp(line.c_str(), "DATA", 4) == 0) {
+				if (rcpt_ok == 0) {
+					out += "554 5.5.1 no valid recipients\r\n";
+				} else {
+					in_data = true;
+					/* the body may already sit in buf */
+					buf.insert(0, "\r\n");
+					out += "354 go ahead\r\n";
+				}
+			} else if (strncasecmp(line.c_str(), "RSET", 4) == 0) {
+				rcpt_ok = 0;
+				out += "250 2.0.0 ok\r\n";
+			} else if (strncasecmp(line.c_str(), "QUIT", 4) == 0) {
+				out += "221 2.0.0 bye\r\n";
+				sink_flush(fd, out);
+				close(fd);
+				return;
+			} else {
+				out += "502 5.5.2 unknown\r\n";
+			}
+		}
+		if (cmds > 1)
+			++g_sink.batches;
+	}
+	close(fd);
+}
+
+static void sink_start()
+{
+	g_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in sa{};
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t sl = sizeof(sa);
+	if (g_listen_fd < 0 ||
+	    bind(g_listen_fd, reinterpret_cast<struct sockaddr *>(&sa), sl) != 0 ||
+	    listen(g_listen_fd, 64) != 0 ||
+	    getsockname(g_listen_fd, reinterpret_cast<struct sockaddr *>(&sa), &sl) != 0) {
+		perror("sink");
+		exit(EXIT_FAILURE);
+	}
+	g_sink_port = ntohs(sa.sin_port);
+	std::thread([]() {
+		while (true) {
+			int fd = accept(g_listen_fd, nullptr, nullptr);
+			if (fd < 0)
+				continue;
+			std::thread(sink_session, fd).detach();
+		}
+	}).detach();
+}
+
+/* Minimal stand-in for the delivery_app service table */
+static BOOL fake_register_remote(HOOK_FUNCTION f)
+{
+	g_remote_hook = f;
+	return TRUE;
+}
+
+static const char *fake_host_id() { return "sinktest.example"; }
+static const char *fake_config_path() { return g_cfgdir; }
+
+static void *fake_query_service(const char *name, const std::type_info &)
+{
+	if (strcmp(name, "register_remote") == 0)
+		return reinterpret_cast<void *>(fake_register_remote);
+	if (strcmp(name, "get_host_ID") == 0)
+		return reinterpret_cast<void *>(fake_host_id);
+	if (strcmp(name, "get_config_path") == 0)
+		return reinterpret_cast<void *>(fake_config_path);
+	return nullptr;
+}
+
+static bool plugin_load(const char *extra)
+{
+	auto file = std::string(g_cfgdir) + "/remote_delivery.cfg";
+	auto fp = fopen(file.c_str(), "w");
+	if (fp == nullptr)
+		return false;
+	fprintf(fp, "mx_host=127.0.0.1\nmx_port=%u\nstarttls_support=off\n%s",
+	        g_sink_port, extra);
+	fclose(fp);
+	void *api[] = {reinterpret_cast<void *>(fake_query_service)};
+	return HOOK_LibMain(PLUGIN_INIT, api);
+}
+
+static void plugin_unload()
+{
+	HOOK_LibMain(PLUGIN_FREE, nullptr);
+	g_remote_hook = nullptr;
+}
+
+static void send_one(const char *rcpt2 = nullptr)
+{
+	static const char text[] =
+		"From: a@sinktest.example\r\nTo: b@sinktest.example\r\n"
+		"Subject: test\r\n\r\nhello\r\n";
+	MESSAGE_CONTEXT ctx;
+	std::vector<char> buf(text, text + sizeof(text) - 1);
+	if (!ctx.mail.load_from_str_move(buf.data(), buf.size())) {
+		++g_fails;
+		return;
+	}
+	gx_strlcpy(ctx.ctrl.from, "a@sinktest.example", std::size(ctx.ctrl.from));
+	ctx.ctrl.rcpt.emplace_back("b@sinktest.example");
+	if (rcpt2 != nullptr)
+		ctx.ctrl.rcpt.emplace_back(rcpt2);
+	g_remote_hook(&ctx);
+}
+
+/* Wait until the sink has seen everything that was sent. */
+static void settle(unsigned int want_msgs)
+{
+	for (unsigned int i = 0; i < 200 && g_sink.messages < want_msgs; ++i)
+		usleep(10000);
+}
+
+static double run_batch(unsigned int n)
+{
+	auto m0 = g_sink.messages.load();
+	auto t0 = clk::now();
+	for (unsigned int i = 0; i < n; ++i)
+		send_one();
+	auto dt = std::chrono::duration<double>(clk::now() - t0).count();
+	settle(m0 + n);
+	EXPECT(g_sink.messages == m0 + n);
+	return n / dt;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nmsg = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 500;
+	signal(SIGPIPE, SIG_IGN);
+	if (mkdtemp(g_cfgdir) == nullptr) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	sink_start();
+
+	/* session reuse with pipelining */
+	if (!plugin_load("")) {
+		fprintf(stderr, "plugin init failed\n");
+		return EXIT_FAILURE;
+	}
+	auto reuse_rate = run_batch(nmsg);
+	EXPECT(g_sink.connections == 1);
+	EXPECT(g_sink.batches >= nmsg - 1);
+
+	/* a rejected recipient after DATA was accepted forces a new session */
+	auto msgs = g_sink.messages.load(), conns = g_sink.connections.load();
+	send_one("reject@sinktest.example");
+	send_one();
+	settle(msgs + 1);
+	EXPECT(g_sink.messages == msgs + 1);
+	EXPECT(g_sink.connections == conns + 1);
+
+	/* the peer drops idle sessions; RSET notices and we reconnect */
+	g_sink.drop_after_tx = true;
+	msgs = g_sink.messages;
+	conns = g_sink.connections;
+	for (unsigned int i = 0; i < 5; ++i)
+		send_one();
+	settle(msgs + 5);
+	EXPECT(g_sink.messages == msgs + 5);
+	/* the first one still goes over the session from before */
+	EXPECT(g_sink.connections == conns + 4);
+	g_sink.drop_after_tx = false;
+
+	/* concurrent senders share the pool */
+	conns = g_sink.connections;
+	msgs = g_sink.messages;
+	std::vector<std::thread> thr;
+	for (unsigned int i = 0; i < 4; ++i)
+		thr.emplace_back([&]() {
+			for (unsigned int j = 0; j < nmsg / 4; ++j)
+				send_one();
+		});
+	for (auto &t : thr)
+		t.join();
+	settle(msgs + nmsg / 4 * 4);
+	EXPECT(g_sink.messages == msgs + nmsg / 4 * 4);
+	EXPECT(g_sink.connections - conns <= 4);
+	plugin_unload();
+
+	/* reuse without PIPELINING on the server side */
+	g_sink.pipelining = false;
+	if (!plugin_load("")) {
+		fprintf(stderr, "plugin init failed\n");
+		return EXIT_FAILURE;
+	}
+	conns = g_sink.connections;
+	auto batches = g_sink.batches.load();
+	auto serial_rate = run_batch(nmsg);
+	EXPECT(g_sink.connections == conns + 1);
+	EXPECT(g_sink.batches == batches);
+	plugin_unload();
+
+	/* old behaviour: one session per message, no pipelining */
+	if (!plugin_load("mx_connection_pool_size=0\npipelining_support=off\n")) {
+		fprintf(stderr, "plugin init failed\n");
+		return EXIT_FAILURE;
+	}
+	conns = g_sink.connections;
+	auto single_rate = run_batch(nmsg);
+	EXPECT(g_sink.connections == conns + nmsg);
+	plugin_unload();
+
+	printf("messages/s: %.0f with session reuse+pipelining, %.0f with reuse only, "
+	       "%.0f with one session per message\n", reuse_rate, serial_rate, single_rate);
+	auto file = std::string(g_cfgdir) + "/remote_delivery.cfg";
+	unlink(file.c_str());
+	rmdir(g_cfgdir);
+	if (g_fails > 0) {
+		fprintf(stderr, "%u failures\n", g_fails);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+/*
+ * Load/replay benchmark for the gromox-timer queue and state journal.
+ * Usage: tests/timerbench [count [statefile]]
+ */
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include "../tools/timer_queue.hpp"
+
+using clk = std::chrono::steady_clock;
+
+static double msec(clk::time_point a, clk::time_point b)
+{
+	return std::chrono::duration<double, std::milli>(b - a).count();
+}
+
+int main(int argc, char **argv)
+{
+	int count = argc >= 2 ? strtol(argv[1], nullptr, 0) : 1000000;
+	std::string path = argc >= 3 ? argv[2] : "timerbench.txt";
+	unlink(path.c_str());
+
+	timer_queue q;
+	timer_journal jn;
+	int last_tid = 0;
+	auto err = jn.load(path.c_str(), q, last_tid);
+	if (err == 0)
+		err = jn.open_append();
+	if (err != 0) {
+		fprintf(stderr, "%s: %s\n", path.c_str(), strerror(err));
+		return EXIT_FAILURE;
+	}
+
+	/* Spread over a week, in pseudo-random order */
+	auto t0 = clk::now();
+	for (int i = 1; i <= count; ++i) {
+		TIMER tmr;
+		tmr.t_id = i;
+		tmr.exec_time = 1700000000 + (i * 2654435761U) % (7 * 86400);
+		tmr.command = "/usr/libexec/gromox/cleaner -u user" + std::to_string(i) + "@example.com";
+		auto t = q.put(std::move(tmr));
+		if (jn.append(*t) != 0) {
+			perror("append");
+			return EXIT_FAILURE;
+		}
+	}
+	auto t1 = clk::now();
+	for (int i = 1; i <= count; i += 2) {
+		if (!q.cancel(i) || jn.append_result(i, "CANCEL") != 0) {
+			fprintf(stderr, "cancel %d failed\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+	auto t2 = clk::now();
+	size_t pending = count / 2;
+	if (q.size() != pending) {
+		fprintf(stderr, "expected %zu pending, got %zu\n", pending, q.size());
+		return EXIT_FAILURE;
+	}
+	printf("add %d: %.1f ms, cancel %d: %.1f ms\n", count, msec(t0, t1),
+	       (count + 1) / 2, msec(t1, t2));
+
+	timer_queue q2;
+	timer_journal jn2;
+	last_tid = 0;
+	t0 = clk::now();
+	err = jn2.load(path.c_str(), q2, last_tid);
+	t1 = clk::now();
+	if (err != 0 || q2.size() != pending || last_tid != count) {
+		fprintf(stderr, "replay: err=%d pending=%zu last_tid=%d\n",
+		        err, q2.size(), last_tid);
+		return EXIT_FAILURE;
+	}
+	printf("replay %zu records: %.1f ms\n", jn2.m_records, msec(t0, t1));
+
+	t0 = clk::now();
+	err = jn2.compact(q2);
+	t1 = clk::now();
+	if (err != 0) {
+		fprintf(stderr, "compact: %s\n", strerror(err));
+		return EXIT_FAILURE;
+	}
+	printf("compact to %zu records: %.1f ms\n", q2.size(), msec(t0, t1));
+
+	timer_queue q3;
+	timer_journal jn3;
+	last_tid = 0;
+	t0 = clk::now();
+	err = jn3.load(path.c_str(), q3, last_tid);
+	t1 = clk::now();
+	if (err != 0 || q3.size() != pending || jn3.m_records != pending) {
+		fprintf(stderr, "reload: err=%d pending=%zu\n", err, q3.size());
+		return EXIT_FAILURE;
+	}
+	printf("replay compacted: %.1f ms\n", msec(t0, t1));
+
+	/* Drain in time order */
+	TIMER tmr;
+	time_t prev = 0;
+	size_t n = 0;
+	t0 = clk::now();
+	while (q3.pop_due(INT64_MAX, tmr)) {
+		if (tmr.exec_time < prev || tmr.t_id % 2 != 0) {
+			fprintf(stderr, "bad order/item at %d\n", tmr.t_id);
+			return EXIT_FAILURE;
+		}
+		prev = tmr.exec_time;
+		++n;
+	}
+	t1 = clk::now();
+	if (n != pending) {
+		fprintf(stderr, "drained %zu, expected %zu\n", n, pending);
+		return EXIT_FAILURE;
+	}
+	printf("drain %zu: %.1f ms\n", n, msec(t0, t1));
+	unlink(path.c_str());
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Compare ical_tztable against ical_itime_to_utc/ical_utc_to_datetime on a
+ * few VTIMEZONEs, then time the expansion of recurring series with both.
+ * Usage: tests/tzbench [rounds]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <gromox/ical.hpp>
+
+using namespace gromox;
+using clk = std::chrono::steady_clock;
+
+static void add_rule(ical_component &tz, const char *name, const char *from,
+    const char *to, const char *dtstart, const char *byday,
+    const char *bymonth, const char *until = nullptr)
+{
+	auto &c = tz.append_comp(name);
+	c.append_line("TZOFFSETFROM", from);
+	c.append_line("TZOFFSETTO", to);
+	c.append_line("DTSTART", dtstart);
+	if (byday == nullptr)
+		return;
+	auto &line = c.append_line("RRULE");
+	line.append_value("FREQ", "YEARLY");
+	line.append_value("BYDAY", byday);
+	line.append_value("BYMONTH", bymonth);
+	if (until != nullptr)
+		line.append_value("UNTIL", until);
+}
+
+static std::vector<ical_component> make_zones()
+{
+	std::vector<ical_component> v;
+	/* What freebusy's tz_to_vtimezone produces for W. Europe */
+	auto &eu = v.emplace_back("VTIMEZONE");
+	eu.append_line("TZID", "eu");
+	add_rule(eu, "STANDARD", "+0200", "+0100", "16010101T030000", "-1SU", "10");
+	add_rule(eu, "DAYLIGHT", "+0100", "+0200", "16010101T020000", "-1SU", "3");
+	/* Southern hemisphere, DST across the turn of the year */
+	auto &au = v.emplace_back("VTIMEZONE");
+	au.append_line("TZID", "au");
+	add_rule(au, "STANDARD", "+1100", "+1000", "16010101T030000", "1SU", "4");
+	add_rule(au, "DAYLIGHT", "+1000", "+1100", "16010101T020000", "1SU", "10");
+	/* Rule change with UNTIL (US 2007) */
+	auto &us = v.emplace_back("VTIMEZONE");
+	us.append_line("TZID", "us");
+	add_rule(us, "DAYLIGHT", "-0500", "-0400", "19870405T020000", "1SU", "4", "20060402T070000Z");
+	add_rule(us, "STANDARD", "-0400", "-0500", "19671029T020000", "-1SU", "10", "20061029T060000Z");
+	add_rule(us, "DAYLIGHT", "-0500", "-0400", "20070311T020000", "2SU", "3");
+	add_rule(us, "STANDARD", "-0400", "-0500", "20071104T020000", "1SU", "11");
+	/* No DST */
+	auto &jp = v.emplace_back("VTIMEZONE");
+	jp.append_line("TZID", "jp");
+	add_rule(jp, "STANDARD", "+0900", "+0900", "16010101T000000", nullptr, nullptr);
+	return v;
+}
+
+static unsigned int verify(const ical_component &tz, const ical_tztable &tzt)
+{
+	unsigned int fails = 0;
+	/* 2003..2012, every 15 minutes, which hits all transitions */
+	for (time_t t = 1041379200; t < 1356998400; t += 900) {
+		ICAL_TIME itime, itime1, itime2;
+		ical_utc_to_datetime(nullptr, t, &itime);
+		time_t u1 = 0, u2 = 0;
+		bool r1 = ical_itime_to_utc(&tz, itime, &u1);
+		bool r2 = tzt.itime_to_utc(itime, &u2);
+		if (r1 != r2 || (r1 && u1 != u2)) {
+			if (fails++ < 5)
+				fprintf(stderr, "%s: itime_to_utc(%04d-%02d-%02d %02d:%02d) %d/%lld vs %d/%lld\n",
+				        tz.get_line("TZID")->get_first_subvalue(),
+				        itime.year, itime.month, itime.day, itime.hour,
+				        itime.minute, r1, static_cast<long long>(u1),
+				        r2, static_cast<long long>(u2));
+		}
+		r1 = ical_utc_to_datetime(&tz, t, &itime1);
+		r2 = tzt.utc_to_datetime(t, &itime2);
+		if (r1 != r2 || (r1 && itime1.twcompare(itime2) != 0)) {
+			if (fails++ < 5)
+				fprintf(stderr, "%s: utc_to_datetime(%lld) differs\n",
+				        tz.get_line("TZID")->get_first_subvalue(),
+				        static_cast<long long>(t));
+		}
+	}
+	return fails;
+}
+
+/* Expand a series and convert every occurrence to UTC, like freebusy does */
+template<typename F> static double expand(const ical_component &tz,
+    const char *freq, unsigned int count, F &&to_utc, time_t *sum)
+{
+	ical_line line("RRULE");
+	line.append_value("FREQ", freq);
+	line.append_value("COUNT", std::to_string(count));
+	ICAL_RRULE irrule;
+	/* 2024-01-01 09:30 local-ish */
+	if (!ical_parse_rrule(&tz, 1704101400, &line.value_list, &irrule))
+		return -1;
+	auto t0 = clk::now();
+	do {
+		time_t ut;
+		if (to_utc(irrule.instance_itime, &ut))
+			*sum += ut;
+	} while (irrule.iterate());
+	return std::chrono::duration<double, std::milli>(clk::now() - t0).count();
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int rounds = argc >= 2 ? strtoul(argv[1], nullptr, 0) : 10;
+	unsigned int fails = 0;
+	auto zones = make_zones();
+	for (const auto &tz : zones) {
+		auto t0 = clk::now();
+		ical_tztable tzt(tz);
+		auto d = std::chrono::duration<double, std::milli>(clk::now() - t0).count();
+		printf("%s: %zu change points, compiled in %.2f ms\n",
+		       tz.get_line("TZID")->get_first_subvalue(), tzt.size(), d);
+		fails += verify(tz, tzt);
+	}
+
+	for (const auto &tz : zones) {
+		ical_tztable tzt(tz);
+		struct { const char *freq; unsigned int count; } series[] =
+			{{"DAILY", 3650}, {"HOURLY", 8760}};
+		for (const auto &s : series) {
+			time_t sum1 = 0, sum2 = 0;
+			double a = 0, b = 0;
+			for (unsigned int i = 0; i < rounds; ++i) {
+				a += expand(tz, s.freq, s.count, [&](const ICAL_TIME &it, time_t *ut) {
+					return ical_itime_to_utc(&tz, it, ut);
+				}, &sum1);
+				b += expand(tz, s.freq, s.count, [&](const ICAL_TIME &it, time_t *ut) {
+					return tzt.itime_to_utc(it, ut);
+				}, &sum2);
+			}
+			if (sum1 != sum2) {
+				fprintf(stderr, "%s %s: results differ\n",
+				        tz.get_line("TZID")->get_first_subvalue(), s.freq);
+				++fails;
+			}
+			printf("%s %-6s x%u: %8.2f ms rule evaluation, %8.2f ms table\n",
+			       tz.get_line("TZID")->get_first_subvalue(), s.freq,
+			       s.count, a / rounds, b / rounds);
+		}
+	}
+	if (fails > 0) {
+		fprintf(stderr, "%u failures\n", fails);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
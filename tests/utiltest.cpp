@@ -3,12 +3,16 @@
 // This file is part of Gromox.
 #include <cstdio>
 #include <cstdlib>
+#include <unistd.h>
 #include <libHX/string.h>
 #include <gromox/endian.hpp>
 #include <gromox/ext_buffer.hpp>
+#include <gromox/gal_snapshot.hpp>
 #include <gromox/ical.hpp>
 #include <gromox/mapi_types.hpp>
+#include <gromox/mail.hpp>
 #include <gromox/mail_func.hpp>
+#include <gromox/mime_view.hpp>
 #include <gromox/msgchg_grouping.hpp>
 #include <gromox/paths.h>
 #include <gromox/propval.hpp>
@@ -225,6 +229,119 @@ static int t_seq()
 	return 0;
 }
 
+static int t_galsnap()
+{
+	char dir[] = "/tmp/galsnap.XXXXXX";
+	assert(mkdtemp(dir) != nullptr);
+	gal_domain_data d;
+	d.info = {"example.com", "Example", "Street 1"};
+	sql_user u;
+	u.id = 7;
+	u.username = "a@example.com";
+	u.aliases = {"b@example.com"};
+	u.propvals[PR_DISPLAY_NAME] = "A";
+	d.groups.emplace_back(sql_group{3, "g", "Group"}, std::vector<sql_user>{u});
+	u.id = 5;
+	u.dtypx = DT_DISTLIST;
+	u.username = "list@example.com";
+	d.users.push_back(u);
+	unsigned int fetches = 0;
+	auto fetch = [&](unsigned int, gal_domain_data &out) { ++fetches; out = d; return true; };
+	gal_domain_data r1, r2, r3;
+	assert(gal_snapshot_obtain(dir, 1, "d1", fetch, r1));
+	assert(gal_snapshot_obtain(dir, 1, "d1", fetch, r2));
+	assert(fetches == 1);
+	assert(r2.info.title == "Example" && r2.groups.size() == 1);
+	assert(r2.groups[0].first.title == "Group");
+	assert(r2.groups[0].second.size() == 1);
+	assert(r2.groups[0].second[0].aliases.size() == 1);
+	assert(r2.groups[0].second[0].propvals[PR_DISPLAY_NAME] == "A");
+	assert(r2.users.size() == 1 && r2.users[0].dtypx == DT_DISTLIST);
+	assert(gal_snapshot_obtain(dir, 1, "d2", fetch, r3));
+	assert(fetches == 2);
+	auto path = std::string(dir) + "/1.gal";
+	auto snap = gal_snapshot::map(path.c_str());
+	assert(snap != nullptr && snap->generation() == 2);
+	assert(snap->find_user(5) == 1 && snap->find_user(6) == -1);
+	unlink(path.c_str());
+	unlink((path + ".lock").c_str());
+	rmdir(dir);
+	return EXIT_SUCCESS;
+}
+
+static int t_mimeview()
+{
+	std::string eml =
+		"From: a@example.com\r\n"
+		"Subject: outer\r\n"
+		" folded\r\n"
+		"Delivered-To: x@example.com\r\n"
+		"Delivered-To: y@example.com\r\n"
+		"Content-Type: multipart/mixed; boundary=\"b1\"\r\n"
+		"\r\n"
+		"preamble\r\n"
+		"--b1\r\n"
+		"Content-Type: text/plain; charset=utf-8\r\n"
+		"Content-Transfer-Encoding: quoted-printable\r\n"
+		"\r\n"
+		"caf=C3=A9 =3D soft=\r\n"
+		"break, stray = sign\r\n"
+		"..dotted\r\n"
+		"--b1\r\n"
+		"Content-Type: multipart/alternative; boundary=alt2\r\n"
+		"\r\n"
+		"--alt2\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"Content-Transfer-Encoding: base64\r\n"
+		"\r\n"
+		"SGVsbG8sIHdv\r\n"
+		"cmxkIQ==\r\n"
+		"--alt2--\r\n"
+		"--b1\r\n"
+		"Content-Type: message/rfc822\r\n"
+		"\r\n"
+		"Subject: inner\r\n"
+		"\r\n"
+		"inner body\r\n"
+		"--b1--\r\n";
+	mime_view v(eml);
+	std::string val;
+	assert(v.get_field("Subject", val) && val == "outer folded");
+	assert(v.get_field_num("Delivered-To") == 2);
+	assert(v.get_field("delivered-to", val, 1) && val == "y@example.com");
+	auto parts = v.parts();
+	assert(v.is_multipart() && parts.size() == 3);
+	assert(parts[0].get_content_param("charset", val) && val == "utf-8");
+	auto alt = parts[1].parts();
+	assert(alt.size() == 1 && alt[0].encoding() == mime_encoding::base64);
+	auto inner = parts[2].message();
+	assert(inner.get_field("Subject", val) && val == "inner");
+
+	/* Decoded content must be what MIME::read_content produces */
+	std::string copy = eml;
+	MAIL mail;
+	assert(mail.load_from_str_move(copy.data(), copy.size()));
+	auto m1 = mail.get_head()->get_child();
+	assert(m1 != nullptr && m1->get_sibling() != nullptr);
+	auto m2 = m1->get_sibling()->get_child(), m3 = m1->get_sibling()->get_sibling();
+	assert(m2 != nullptr && m3 != nullptr);
+	const MIME *mimes[] = {m1, m2, m3};
+	const mime_view views[] = {parts[0], alt[0], parts[2]};
+	std::string decoded[3];
+	for (size_t i = 0; i < std::size(mimes); ++i) {
+		char buf[256], chunk[5];
+		size_t len = std::size(buf), n;
+		assert(mimes[i]->read_content(buf, &len));
+		auto dec = views[i].decoder();
+		while ((n = dec.read(chunk, std::size(chunk))) > 0)
+			decoded[i].append(chunk, n);
+		assert(decoded[i] == std::string_view(buf, len));
+	}
+	assert(decoded[0] == "caf\xc3\xa9 = softbreak, stray  sign\r\n.dotted");
+	assert(decoded[1] == "Hello, world!");
+	return EXIT_SUCCESS;
+}
+
 static int t_interval()
 {
 	const char *in = " 1 d 1 h 1 min 1 s ";
@@ -425,7 +542,7 @@ int main()
 		return EXIT_FAILURE;
 	using fpt = decltype(&t_interval);
 	fpt fct[] = {t_interval, t_id1, t_id2, t_id3, t_id4, t_id5, t_id6,
-	             t_id7, t_id8, t_id9, t_seq};
+	             t_id7, t_id8, t_id9, t_seq, t_galsnap, t_mimeview};
 	for (auto f : fct) {
 		ret = f();
 		if (ret != EXIT_SUCCESS)
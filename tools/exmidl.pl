@@ -12,7 +12,7 @@ our $gen_mode;
 );
 
 if ($gen_mode eq "CLN" || $gen_mode eq "SDP") {
-	print "#include <$_>\n" for qw(cstring utility gromox/exmdb_client.hpp gromox/exmdb_rpc.hpp);
+	print "#include <$_>\n" for qw(chrono cstring utility gromox/exmdb_client.hpp gromox/exmdb_rpc.hpp);
 	if ($gen_mode eq "SDP") {
 		print "#include <$_>\n" for qw(gromox/exmdb_common_util.hpp gromox/exmdb_ext.hpp gromox/exmdb_provider_client.hpp gromox/exmdb_server.hpp);
 	}
@@ -38,8 +38,10 @@ while (<STDIN>) {
 		print "\tif (!exmdb_client_check_local(dir, &xb_private))\n";
 		print "\t\treturn exmdb_client_remote::$func(".join(", ", @anames).");\n";
 		print "\texmdb_server::build_env(EM_LOCAL | (xb_private ? EM_PRIVATE : 0), dir);\n";
+		print "\tauto xbstart = std::chrono::steady_clock::now();\n";
 		print "\tauto xbresult = exmdb_server::$func(".join(", ", @anames).");\n";
 		print "\texmdb_server::free_env();\n";
+		print "\texmdb_rpc_stat_add(static_cast<uint8_t>(exmdb_callid::$func), std::chrono::steady_clock::now() - xbstart, xbresult, 0, 0);\n";
 		print "\treturn xbresult;\n";
 		print "}\n\n";
 		next;
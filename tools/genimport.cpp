@@ -434,10 +434,27 @@ int exm_deliver_msg(const char *target, MESSAGE_CONTENT *ct, unsigned int mode)
 	return EXIT_SUCCESS;
 }
 
-int exm_create_msg(uint64_t parent_fld, MESSAGE_CONTENT *ctnt)
+/**
+ * Reserve a range of @count message IDs for use with exm_create_msg.
+ * *@begin_eid is 0 if the store has run out of IDs.
+ */
+int exm_allocate_ids(uint32_t count, uint64_t *begin_eid)
+{
+	if (!exmdb_client::allocate_ids(g_storedir, count, begin_eid)) {
+		fprintf(stderr, "exm: allocate_ids RPC failed\n");
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * @msg_id:	message ID from exm_allocate_ids, or 0 to have one allocated
+ */
+int exm_create_msg(uint64_t parent_fld, MESSAGE_CONTENT *ctnt, uint64_t msg_id)
 {
-	uint64_t msg_id = 0, change_num = 0;
-	if (!exmdb_client::allocate_message_id(g_storedir, parent_fld, &msg_id)) {
+	uint64_t change_num = 0;
+	if (msg_id == 0 &&
+	    !exmdb_client::allocate_message_id(g_storedir, parent_fld, &msg_id)) {
 		fprintf(stderr, "exm: allocate_message_id RPC failed (timeout?)\n");
 		return -EIO;
 	} else if (!exmdb_client::allocate_cn(g_storedir, &change_num)) {
@@ -615,7 +632,7 @@ int gi_setup_from_dir()
 	return exmdb_client_run(PKGSYSCONFDIR);
 }
 
-int gi_setup()
+int gi_setup(unsigned int conn_max)
 {
 	auto sqh = sql_login();
 	if (sqh == nullptr)
@@ -633,7 +650,7 @@ int gi_setup()
 		return EXIT_FAILURE;
 	}
 	g_storedir = g_storedir_s.c_str();
-	exmdb_client_init(1, 0);
+	exmdb_client_init(conn_max, 0);
 	return exmdb_client_run(PKGSYSCONFDIR);
 }
 
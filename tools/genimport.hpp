@@ -102,8 +102,9 @@ extern int exm_set_change_keys(TPROPVAL_ARRAY *props, eid_t cn);
 extern int exm_create_folder(uint64_t parent_fld, TPROPVAL_ARRAY *props, bool o_excl, uint64_t *new_fld_id);
 extern int exm_permissions(eid_t, const std::vector<PERMISSION_DATA> &);
 extern int exm_deliver_msg(const char *target, MESSAGE_CONTENT *, unsigned int flags = 0);
-extern int exm_create_msg(uint64_t parent_fld, MESSAGE_CONTENT *);
+extern int exm_allocate_ids(uint32_t count, uint64_t *begin_eid);
+extern int exm_create_msg(uint64_t parent_fld, MESSAGE_CONTENT *, uint64_t msg_id = 0);
 extern void gi_setup_early(const char *dstmbox);
-extern int gi_setup();
+extern int gi_setup(unsigned int conn_max = 1);
 extern int gi_setup_from_dir();
 extern void gi_shutdown();
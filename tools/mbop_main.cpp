@@ -424,7 +424,7 @@ static int help()
 	fprintf(stderr, "Usage: gromox-mbop [global-options] command [command-args...]\n");
 	fprintf(stderr, "Global options:\n");
 	fprintf(stderr, "\t-u emailaddr/-d directory    Name of/path to mailbox\n");
-	fprintf(stderr, "Commands:\n\tclear-photo clear-profile delmsg emptyfld purge-datafiles recalc-sizes unload vacuum\n");
+	fprintf(stderr, "Commands:\n\tclear-photo clear-profile delmsg emptyfld metrics purge-datafiles recalc-sizes unload vacuum\n");
 	return EXIT_FAILURE;
 }
 
@@ -471,6 +471,15 @@ static bool recalc_sizes(const char *dir)
 	return true;
 }
 
+static bool metrics(const char *dir)
+{
+	char *text = nullptr;
+	if (!exmdb_client::get_metrics(dir, &text))
+		return false;
+	fputs(znul(text), stdout);
+	return true;
+}
+
 static int main(int argc, const char **argv)
 {
 	bool ok = false;
@@ -484,6 +493,8 @@ static int main(int argc, const char **argv)
 		ok = exmdb_client::vacuum(g_storedir);
 	else if (strcmp(argv[0], "recalc-sizes") == 0)
 		ok = recalc_sizes(g_storedir);
+	else if (strcmp(argv[0], "metrics") == 0)
+		ok = metrics(g_storedir);
 	else
 		return -EINVAL;
 	if (!ok) {
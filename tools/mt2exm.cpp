@@ -1,15 +1,23 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 // SPDX-FileCopyrightText: 2021 grommunio GmbH
 // This file is part of Gromox.
+#include <atomic>
 #include <cerrno>
+#include <chrono>
 #include <climits>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <unistd.h>
 #include <utility>
+#include <vector>
 #include <libHX/io.h>
 #include <libHX/option.h>
+#include <libHX/string.h>
 #include <gromox/endian.hpp>
 #include <gromox/exmdb_rpc.hpp>
 #include <gromox/ext_buffer.hpp>
@@ -28,6 +36,15 @@ struct ob_desc {
 	parent_desc parent;
 };
 
+/* A message packet on its way from the reader to the writers */
+struct msg_job {
+	ob_desc obd;
+	std::unique_ptr<char[]> buf;
+	size_t offset = 0, size = 0;
+	uint64_t fid_to = 0;
+	std::vector<uint64_t> mids; /* one per --repeat iteration */
+};
+
 }
 
 using propididmap_t = std::unordered_map<uint16_t, uint16_t>;
@@ -39,7 +56,27 @@ static propididmap_t g_thru_name_map;
 static uint8_t g_splice;
 static unsigned int g_oexcl = 1, g_anchor_folder, g_repeat_iter = 1;
 static unsigned int g_do_delivery, g_skip_notif, g_skip_rules, g_twostep;
-static unsigned int g_continuous_mode;
+static unsigned int g_continuous_mode, g_jobs = 4;
+
+/*
+ * Messages are converted and written by g_jobs worker threads, so that
+ * several write_message RPCs are in flight while the main thread keeps
+ * reading the stream. Folders and named property definitions are still
+ * handled by the reader in stream order.
+ */
+static std::mutex g_name_lock; /* protects g_src_name_map, g_thru_name_map */
+static std::mutex g_work_lock;
+static std::condition_variable g_work_cond, g_space_cond;
+static std::deque<msg_job> g_work_queue;
+static bool g_work_eof;
+static std::atomic<bool> g_work_abort;
+static std::atomic<int> g_work_ret{EXIT_SUCCESS};
+/* Message IDs are reserved in ranges rather than with one RPC per message */
+static uint64_t g_mid_next, g_mid_end;
+static constexpr uint32_t MID_BATCH = 1024;
+static std::atomic<uint64_t> g_stat_msgs, g_stat_bytes;
+static std::atomic<time_t> g_stat_last;
+static std::chrono::steady_clock::time_point g_stat_start;
 
 static const char *strerror_eof(int e)
 {
@@ -77,6 +114,7 @@ static constexpr HXoption g_options_table[] = {
 	{nullptr, 'B', HXTYPE_STRING, nullptr, nullptr, cb_anchor_folder, 0, "Placement position for unanchored messages", "NAME"},
 	{nullptr, 'D', HXTYPE_NONE, &g_do_delivery, nullptr, nullptr, 0, "Use delivery mode"},
 	{nullptr, 'c', HXTYPE_NONE, &g_continuous_mode, {}, {}, 0, "Continuous operation mode (do not stop on errors)"},
+	{nullptr, 'j', HXTYPE_UINT, &g_jobs, {}, {}, 0, "Number of messages to convert and write concurrently (default: 4)", "N"},
 	{nullptr, 'p', HXTYPE_NONE, &g_show_props, nullptr, nullptr, 0, "Show properties in detail (if -t)"},
 	{nullptr, 't', HXTYPE_NONE, &g_show_tree, nullptr, nullptr, 0, "Show tree-based analysis of the archive"},
 	{nullptr, 'u', HXTYPE_STRING, &g_username, nullptr, nullptr, 0, "Username of store to import to", "EMAILADDR"},
@@ -176,6 +214,7 @@ static void exm_adjust_staticprops(TPROPVAL_ARRAY &props)
 
 static void exm_adjust_namedprops(TPROPVAL_ARRAY &props)
 {
+	std::lock_guard lk(g_name_lock);
 	for (size_t i = 0; i < props.count; ++i) {
 		auto old_tag = props.ppropval[i].proptag;
 		if (PROP_ID(old_tag) < 0x8000)
@@ -310,20 +349,15 @@ static int exm_folder(const ob_desc &obd, TPROPVAL_ARRAY &props,
 	return 0;
 }
 
-static int exm_message(const ob_desc &obd, MESSAGE_CONTENT &ctnt)
+static int exm_message(const msg_job &job, MESSAGE_CONTENT &ctnt)
 {
+	auto &obd = job.obd;
 	if (g_show_tree)
 		printf("exm: Message %lxh (parent=%llxh)\n",
 			static_cast<unsigned long>(obd.nid),
 			static_cast<unsigned long long>(obd.parent.folder_id));
 	if (g_show_tree && g_show_props)
 		gi_dump_msgctnt(0, ctnt);
-	auto folder_it = g_folder_map.find(obd.parent.folder_id);
-	if (!g_do_delivery && folder_it == g_folder_map.end()) {
-		fprintf(stderr, "PF-1123: unknown parent folder %llxh\n",
-		        static_cast<unsigned long long>(obd.parent.folder_id));
-		return 0;
-	}
 	exm_adjust_propids(ctnt);
 	if (g_show_tree && g_show_props) {
 		tree(0);
@@ -334,7 +368,7 @@ static int exm_message(const ob_desc &obd, MESSAGE_CONTENT &ctnt)
 		for (auto i = 0U; i < g_repeat_iter; ++i) {
 			if (i > 0 && i % 1024 == 0)
 				fprintf(stderr, "mt2exm repeat %u/%u\n", i, g_repeat_iter);
-			auto ret = exm_create_msg(folder_it->second.fid_to, &ctnt);
+			auto ret = exm_create_msg(job.fid_to, &ctnt, job.mids[i]);
 			if (ret != EXIT_SUCCESS)
 				return ret;
 		}
@@ -357,10 +391,95 @@ static int exm_message(const ob_desc &obd, MESSAGE_CONTENT &ctnt)
 	return EXIT_SUCCESS;
 }
 
-static int exm_packet(const void *buf, size_t bufsize)
+static uint64_t exm_next_mid()
+{
+	if (g_mid_next == g_mid_end) {
+		uint64_t begin = 0;
+		if (exm_allocate_ids(MID_BATCH, &begin) != 0)
+			throw YError("PG-1142: allocate_ids RPC failed");
+		if (begin == 0)
+			throw YError("PG-1143: store has run out of message IDs");
+		g_mid_next = rop_util_get_gc_value(begin);
+		g_mid_end  = g_mid_next + MID_BATCH;
+	}
+	return rop_util_make_eid_ex(1, g_mid_next++);
+}
+
+static void exm_report(bool force)
+{
+	using namespace std::chrono;
+	auto now = time(nullptr), prev = g_stat_last.load();
+	if (!force && (now < prev + 10 ||
+	    !g_stat_last.compare_exchange_strong(prev, now)))
+		return;
+	auto secs = duration<double>(steady_clock::now() - g_stat_start).count();
+	if (secs <= 0)
+		return;
+	uint64_t msgs = g_stat_msgs, bytes = g_stat_bytes;
+	char total[32], rate[32];
+	HX_unit_size(total, std::size(total), bytes, 0, 0);
+	HX_unit_size(rate, std::size(rate), bytes / secs, 0, 0);
+	fprintf(stderr, "mt2exm: %llu messages (%.1f/s), %sB (%sB/s)\n",
+	        static_cast<unsigned long long>(msgs), msgs / secs, total, rate);
+}
+
+static void exm_worker()
+{
+	std::unique_lock lk(g_work_lock);
+	while (true) {
+		g_work_cond.wait(lk, []() { return g_work_eof || !g_work_queue.empty(); });
+		if (g_work_queue.empty())
+			break;
+		auto job = std::move(g_work_queue.front());
+		g_work_queue.pop_front();
+		lk.unlock();
+		g_space_cond.notify_one();
+		if (g_work_abort) {
+			/* Drain without importing or counting */
+			lk.lock();
+			continue;
+		}
+		int ret = EXIT_SUCCESS;
+		bool fatal = false;
+		try {
+			EXT_PULL ep;
+			ep.init(&job.buf[job.offset], job.size - job.offset, zalloc, EXT_FLAG_WCOUNT);
+			MESSAGE_CONTENT ctnt{};
+			auto cl_0 = make_scope_exit([&]() { message_content_free_internal(&ctnt); });
+			if (ep.g_msgctnt(&ctnt) != EXT_ERR_SUCCESS)
+				throw YError("PG-1119");
+			ret = exm_message(job, ctnt);
+		} catch (const std::exception &e) {
+			fprintf(stderr, "mt2exm: Exception: %s\n", e.what());
+			ret = EXIT_FAILURE;
+			fatal = true;
+		}
+		if (ret != EXIT_SUCCESS && (fatal || !g_continuous_mode)) {
+			int exp = EXIT_SUCCESS;
+			g_work_ret.compare_exchange_strong(exp, ret);
+			g_work_abort = true;
+		} else if (ret == EXIT_SUCCESS) {
+			++g_stat_msgs;
+			g_stat_bytes += job.size;
+			exm_report(false);
+		}
+		lk.lock();
+	}
+}
+
+static void exm_enqueue(msg_job &&job)
+{
+	std::unique_lock lk(g_work_lock);
+	g_space_cond.wait(lk, []() { return g_work_queue.size() < 4 * g_jobs || g_work_abort; });
+	g_work_queue.push_back(std::move(job));
+	lk.unlock();
+	g_work_cond.notify_one();
+}
+
+static int exm_packet(std::unique_ptr<char[]> &&buf, size_t bufsize)
 {
 	EXT_PULL ep;
-	ep.init(buf, bufsize, zalloc, EXT_FLAG_WCOUNT);
+	ep.init(buf.get(), bufsize, zalloc, EXT_FLAG_WCOUNT);
 	ob_desc obd;
 	uint32_t type = 0, parent_type = 0;
 	if (ep.g_uint32(&type) != EXT_ERR_SUCCESS ||
@@ -374,6 +493,7 @@ static int exm_packet(const void *buf, size_t bufsize)
 		if (ep.g_propname(&propname) != pack_result::success)
 			throw YError("PG-1138");
 		try {
+			std::lock_guard lk(g_name_lock);
 			g_src_name_map.insert_or_assign(obd.nid, propname);
 		} catch (const std::bad_alloc &) {
 			free(propname.pname);
@@ -409,11 +529,25 @@ static int exm_packet(const void *buf, size_t bufsize)
 			throw YError("PG-1122: %s", strerror(-ret));
 		return 0;
 	} else if (obd.mapitype == MAPI_MESSAGE) {
-		MESSAGE_CONTENT ctnt{};
-		auto cl_0 = make_scope_exit([&]() { message_content_free_internal(&ctnt); });
-		if (ep.g_msgctnt(&ctnt) != EXT_ERR_SUCCESS)
-			throw YError("PG-1119");
-		return exm_message(obd, ctnt);
+		msg_job job;
+		if (!g_do_delivery) {
+			auto folder_it = g_folder_map.find(obd.parent.folder_id);
+			if (folder_it == g_folder_map.end()) {
+				fprintf(stderr, "PF-1123: unknown parent folder %llxh\n",
+				        static_cast<unsigned long long>(obd.parent.folder_id));
+				return 0;
+			}
+			job.fid_to = folder_it->second.fid_to;
+			/* Taken in stream order, so a folder's messages keep their order */
+			for (unsigned int i = 0; i < g_repeat_iter; ++i)
+				job.mids.push_back(exm_next_mid());
+		}
+		job.obd    = std::move(obd);
+		job.offset = ep.m_offset;
+		job.size   = bufsize;
+		job.buf    = std::move(buf);
+		exm_enqueue(std::move(job));
+		return 0;
 	}
 	throw YError("PG-1117: unknown obd.mapitype %u", static_cast<unsigned int>(obd.mapitype));
 }
@@ -451,11 +585,29 @@ int main(int argc, const char **argv) try
 		return EXIT_FAILURE;
 	gi_setup_early(g_username);
 	exm_read_base_maps();
-	if (gi_setup() != EXIT_SUCCESS)
+	if (g_show_tree || g_jobs == 0)
+		/* keep the tree output readable */
+		g_jobs = 1;
+	if (gi_setup(g_jobs + 1) != EXIT_SUCCESS)
 		return EXIT_FAILURE;
 	auto cl_0 = make_scope_exit(gi_shutdown);
+	g_stat_start = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	auto stop_workers = [&]() {
+		{
+			std::lock_guard lk(g_work_lock);
+			g_work_eof = true;
+		}
+		g_work_cond.notify_all();
+		for (auto &t : workers)
+			t.join();
+		workers.clear();
+	};
+	auto cl_1 = make_scope_exit([&]() { stop_workers(); });
+	for (unsigned int i = 0; i < g_jobs; ++i)
+		workers.emplace_back(exm_worker);
 	int iret = EXIT_SUCCESS;
-	while (true) {
+	while (!g_work_abort) {
 		uint64_t xsize = 0;
 		errno = 0;
 		auto ret = HXio_fullread(STDIN_FILENO, &xsize, sizeof(xsize));
@@ -469,12 +621,16 @@ int main(int argc, const char **argv) try
 		ret = HXio_fullread(STDIN_FILENO, buf.get(), xsize);
 		if (ret < 0 || static_cast<size_t>(ret) != xsize)
 			throw YError("PG-1006: %s", strerror_eof(errno));
-		auto pkret = exm_packet(buf.get(), xsize);
+		auto pkret = exm_packet(std::move(buf), xsize);
 		if (pkret != EXIT_SUCCESS && !g_continuous_mode) {
 			iret = pkret;
 			break;
 		}
 	}
+	stop_workers();
+	if (iret == EXIT_SUCCESS)
+		iret = g_work_ret;
+	exm_report(true);
 	gi_dump_thru_map(g_thru_name_map);
 	return iret;
 } catch (const std::exception &e) {
@@ -32,6 +32,7 @@
 #include <gromox/paths.h>
 #include <gromox/scope.hpp>
 #include <gromox/util.hpp>
+#include "timer_queue.hpp"
 
 #define COMMAND_LENGTH		512
 
@@ -54,18 +55,6 @@ struct CONNECTION_NODE {
 	char line[1024]{};
 };
 
-struct TIMER {
-	int t_id;
-	time_t exec_time;
-	std::string command;
-};
-
-struct srcitem {
-	int tid;
-	long exectime;
-	char command[512];
-} __attribute__((packed));
-
 }
 
 static constexpr auto POLLIN_SET =
@@ -73,11 +62,10 @@ static constexpr auto POLLIN_SET =
 static gromox::atomic_bool g_notify_stop;
 static unsigned int g_threads_num;
 static std::atomic<int> g_last_tid;
-static int g_list_fd = -1;
-static std::string g_list_path;
+static timer_journal g_journal;
 static std::vector<std::string> g_acl_list;
 static std::list<CONNECTION_NODE> g_connection_list, g_connection_list1;
-static std::list<TIMER> g_exec_list;
+static timer_queue g_exec_list;
 static std::mutex g_list_lock, g_connection_lock, g_cond_mutex;
 static std::condition_variable g_waken_cond;
 static char *opt_config_file;
@@ -108,8 +96,6 @@ static void execute_timer(TIMER *ptimer);
 
 static int parse_line(char *pbuff, const char* cmdline, char** argv);
 
-static void encode_line(const char *in, char *out);
-
 static BOOL read_mark(CONNECTION_NODE *pconnection);
 
 static void term_handler(int signo);
@@ -140,78 +126,22 @@ ssize_t CONNECTION_NODE::sk_write(const char *s, size_t z)
 	return ret;
 }
 
-static void save_timers(time_t &last_cltime, const time_t &cur_time)
+static void save_timers()
 {
-	close(g_list_fd);
-	auto pfile = list_file_initd(g_list_path.c_str(), "/", "%d%l%s:512");
-	if (pfile == nullptr) {
-		g_list_fd = open(g_list_path.c_str(), O_APPEND | O_WRONLY);
-		if (g_list_fd < 0)
-			fprintf(stderr, "open %s: %s\n", g_list_path.c_str(), strerror(errno));
-		return;
-	}
-	auto item_num = pfile->get_size();
-	auto pitem = static_cast<srcitem *>(pfile->get_list());
-	for (size_t i = 0; i < item_num; ++i) {
-		if (pitem[i].exectime != 0)
-			continue;
-		for (size_t j = 0; j < item_num; ++j) {
-			if (i == j)
-				continue;
-			if (pitem[i].tid == pitem[j].tid) {
-				pitem[j].exectime = 0;
-				break;
-			}
-		}
-	}
-	auto temp_path = g_list_path + ".tmp";
-	auto temp_fd = open(temp_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, FMODE_PRIVATE);
-	if (temp_fd >= 0) {
-		for (size_t i = 0; i < item_num; ++i) {
-			if (pitem[i].exectime == 0)
-				continue;
-			char temp_line[2048];
-			auto temp_len = gx_snprintf(temp_line, std::size(temp_line), "%d\t%ld\t",
-				   pitem[i].tid, pitem[i].exectime);
-			encode_line(pitem[i].command, temp_line + temp_len);
-			temp_len = strlen(temp_line);
-			temp_line[temp_len] = '\n';
-			++temp_len;
-			if (HXio_fullwrite(temp_fd, temp_line, temp_len) < 0)
-				fprintf(stderr, "write %s: %s\n", temp_path.c_str(), strerror(errno));
-		}
-		close(temp_fd);
-		if (remove(g_list_path.c_str()) < 0 && errno != ENOENT)
-			fprintf(stderr, "W-1403: remove %s: %s\n",
-			        g_list_path.c_str(), strerror(errno));
-		if (rename(temp_path.c_str(), g_list_path.c_str()) < 0)
-			fprintf(stderr, "E-1404: rename %s %s: %s\n",
-			        temp_path.c_str(), g_list_path.c_str(), strerror(errno));
+	auto err = g_journal.compact(g_exec_list);
+	if (err != 0)
+		fprintf(stderr, "E-1761: compacting %s: %s\n",
+		        g_journal.m_path.c_str(), strerror(err));
+	if (g_journal.m_fd < 0) {
+		err = g_journal.open_append();
+		if (err != 0)
+			fprintf(stderr, "open %s: %s\n", g_journal.m_path.c_str(), strerror(err));
 	}
-	last_cltime = cur_time;
-	g_list_fd = open(g_list_path.c_str(), O_APPEND | O_WRONLY);
-	if (g_list_fd < 0)
-		fprintf(stderr, "open %s: %s\n", g_list_path.c_str(), strerror(errno));
-}
-
-static TIMER *put_timer(TIMER &&ptimer)
-{
-	for (auto pos = g_exec_list.begin(); pos != g_exec_list.end(); ++pos) {
-		if (pos->exec_time <= ptimer.exec_time)
-			continue;
-		std::list<TIMER> stash;
-		stash.push_back(std::move(ptimer));
-		g_exec_list.splice(pos, stash, stash.begin());
-		return &*pos;
-	}
-	g_exec_list.push_back(std::move(ptimer));
-	return &g_exec_list.back();
 }
 
 int main(int argc, const char **argv)
 {
 	time_t cur_time;
-	time_t last_cltime;
 	pthread_t thr_accept_id{};
 	std::vector<pthread_t> thr_ids;
 
@@ -235,7 +165,7 @@ int main(int argc, const char **argv)
 		return EXIT_FAILURE;
 
 	mlog_init(pconfig->get_value("timer_log_file"), pconfig->get_ll("timer_log_level"));
-	g_list_path = pconfig->get_value("timer_state_path");
+	auto state_path = pconfig->get_value("timer_state_path");
 	uint16_t listen_port = pconfig->get_ll("timer_listen_port");
 	auto listen_ip = pconfig->get_value("timer_listen_ip");
 	printf("[system]: listen address is [%s]:%hu\n",
@@ -255,52 +185,22 @@ int main(int argc, const char **argv)
 	if (switch_user_exec(*pconfig, argv) != 0)
 		return EXIT_FAILURE;
 
-	auto pfile = list_file_initd(g_list_path.c_str(), "/", "%d%l%s:512");
-	if (NULL == pfile) {
+	int last_tid = 0;
+	auto err = g_journal.load(state_path, g_exec_list, last_tid);
+	if (err != 0) {
 		printf("[system]: Failed to read timers from %s: %s\n",
-		       g_list_path.c_str(), strerror(errno));
+		       state_path, strerror(err));
 		return EXIT_FAILURE;
 	}
-
-	auto item_num = pfile->get_size();
-	auto pitem = static_cast<srcitem *>(pfile->get_list());
-	for (size_t i = 0; i < item_num; ++i) {
-		if (pitem[i].exectime != 0)
-			continue;
-		for (size_t j = 0; j < item_num; ++j) {
-			if (i == j)
-				continue;
-			if (pitem[i].tid == pitem[j].tid) {
-				pitem[j].exectime = 0;
-				break;
-			}
-		}
-	}
-
-	time(&cur_time);
-
-	for (size_t i = 0; i < item_num; ++i) {
-		if (pitem[i].tid > g_last_tid)
-			g_last_tid = pitem[i].tid;
-		if (pitem[i].exectime == 0)
-			continue;
-		try {
-			TIMER tmr;
-			tmr.t_id = pitem[i].tid;
-			tmr.exec_time = pitem[i].exectime;
-			tmr.command = pitem[i].command;
-			put_timer(std::move(tmr));
-		} catch (std::bad_alloc &) {
-		}
-	}
-	pfile.reset();
-
-	g_list_fd = open(g_list_path.c_str(), O_CREAT | O_APPEND | O_WRONLY, FMODE_PRIVATE);
-	if (g_list_fd < 0) {
-		printf("[system]: Failed to open %s: %s\n", g_list_path.c_str(), strerror(errno));
+	g_last_tid = last_tid;
+	printf("[system]: %zu timers pending\n", g_exec_list.size());
+	/* shed executed and cancelled entries right away */
+	if (g_journal.need_compact(g_exec_list.size()))
+		save_timers();
+	if (g_journal.m_fd < 0 && (err = g_journal.open_append()) != 0) {
+		printf("[system]: Failed to open %s: %s\n", state_path, strerror(err));
 		return EXIT_FAILURE;
 	}
-	auto cl_1 = make_scope_exit([&]() { close(g_list_fd); });
 
 	thr_ids.reserve(g_threads_num);
 	auto cl_2 = make_scope_exit([&]() {
@@ -329,7 +229,7 @@ int main(int argc, const char **argv)
 	auto hosts_allow = pconfig->get_value("timer_hosts_allow");
 	if (hosts_allow != nullptr)
 		g_acl_list = gx_split(hosts_allow, ' ');
-	auto err = list_file_read_fixedstrings("timer_acl.txt",
+	err = list_file_read_fixedstrings("timer_acl.txt",
 	           pconfig->get_value("config_file_path"), g_acl_list);
 	if (err == ENOENT) {
 	} else if (err != 0) {
@@ -358,7 +258,6 @@ int main(int argc, const char **argv)
 	});
 	
 	pthread_setname_np(thr_accept_id, "accept");
-	time(&last_cltime);
 	setup_sigalrm();
 	sact.sa_handler = term_handler;
 	sact.sa_flags   = SA_RESTART;
@@ -369,16 +268,11 @@ int main(int argc, const char **argv)
 	while (!g_notify_stop) {
 		std::unique_lock li_hold(g_list_lock);
 		time(&cur_time);
-		for (auto ptimer = g_exec_list.begin(); ptimer != g_exec_list.end(); ) {
-			if (ptimer->exec_time > cur_time)
-				break;
-			std::list<TIMER> stash;
-			stash.splice(stash.end(), g_exec_list, ptimer++);
-			execute_timer(&stash.front());
-		}
-
-		if (cur_time - last_cltime > 7 * 86400)
-			save_timers(last_cltime, cur_time);
+		TIMER tmr;
+		while (g_exec_list.pop_due(cur_time, tmr))
+			execute_timer(&tmr);
+		if (g_journal.need_compact(g_exec_list.size()))
+			save_timers();
 		li_hold.unlock();
 		sleep(1);
 
@@ -444,7 +338,6 @@ static void *tmr_acceptwork(void *param)
 
 static void execute_timer(TIMER *ptimer)
 {
-	int len;
 	int status;
 	pid_t pid;
 	char result[1024];
@@ -470,9 +363,9 @@ static void execute_timer(TIMER *ptimer)
 		strcpy(result, "FORMAT-ERROR");
 	}
 
-	len = sprintf(temp_buff, "%d\t0\t%s\n", ptimer->t_id, result);
-	if (HXio_fullwrite(g_list_fd, temp_buff, len) < 0)
-		fprintf(stderr, "write to timerlist: %s\n", strerror(errno));
+	auto err = g_journal.append_result(ptimer->t_id, result);
+	if (err != 0)
+		fprintf(stderr, "write to timerlist: %s\n", strerror(err));
 }
 
 static void *tmr_thrwork(void *param)
@@ -509,19 +402,12 @@ static void *tmr_thrwork(void *param)
 				pconnection->sk_write("FALSE 1\r\n");
 				continue;
 			}
-			bool removed_timer = false;
 			std::unique_lock li_hold(g_list_lock);
-			for (auto pos = g_exec_list.begin(); pos != g_exec_list.end(); ++pos) {
-				auto ptimer = &*pos;
-				if (t_id == ptimer->t_id) {
-					temp_len = sprintf(temp_line, "%d\t0\tCANCEL\n",
-								ptimer->t_id);
-					g_exec_list.erase(pos);
-					removed_timer = true;
-					if (HXio_fullwrite(g_list_fd, temp_line, temp_len) < 0)
-						fprintf(stderr, "write to timerlist: %s\n", strerror(errno));
-					break;
-				}
+			bool removed_timer = g_exec_list.cancel(t_id);
+			if (removed_timer) {
+				auto err = g_journal.append_result(t_id, "CANCEL");
+				if (err != 0)
+					fprintf(stderr, "write to timerlist: %s\n", strerror(err));
 			}
 			li_hold.unlock();
 			pconnection->sk_write(removed_timer ? "TRUE\r\n" : "FALSE\r\n");
@@ -549,18 +435,20 @@ static void *tmr_thrwork(void *param)
 				continue;
 			}
 
+			auto t_id = tmr.t_id;
 			std::unique_lock li_hold(g_list_lock);
-			auto ptimer = put_timer(std::move(tmr));
-
-			temp_len = sprintf(temp_line, "%d\t%lld\t", ptimer->t_id,
-			           static_cast<long long>(ptimer->exec_time));
-			encode_line(ptimer->command.c_str(), temp_line + temp_len);
-			temp_len = strlen(temp_line);
-			temp_line[temp_len++] = '\n';
-			if (HXio_fullwrite(g_list_fd, temp_line, temp_len) < 0)
-				fprintf(stderr, "write to timerlist: %s\n", strerror(errno));
+			try {
+				auto ptimer = g_exec_list.put(std::move(tmr));
+				auto err = g_journal.append(*ptimer);
+				if (err != 0)
+					fprintf(stderr, "write to timerlist: %s\n", strerror(err));
+			} catch (const std::bad_alloc &) {
+				li_hold.unlock();
+				pconnection->sk_write("FALSE 3\r\n");
+				continue;
+			}
 			li_hold.unlock();
-			temp_len = sprintf(temp_line, "TRUE %d\r\n", ptimer->t_id);
+			temp_len = sprintf(temp_line, "TRUE %d\r\n", t_id);
 			pconnection->sk_write(temp_line, temp_len);
 		} else if (0 == strcasecmp(pconnection->line, "QUIT")) {
 			pconnection->sk_write("BYE\r\n");
@@ -676,17 +564,3 @@ static int parse_line(char *pbuff, const char* cmdline, char** argv)
     argv[argc] = NULL;
     return argc;
 }
-
-static void encode_line(const char *in, char *out)
-{
-	int len, i, j;
-
-	len = strlen(in);
-	for (i=0, j=0; i<len; i++, j++) {
-		if (' ' == in[i] || '\\' == in[i] || '\t' == in[i] || '#' == in[i]) {
-			out[j++] = '\\';
-		}
-		out[j] = in[i];
-	}
-	out[j] = '\0';
-}
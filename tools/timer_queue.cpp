@@ -0,0 +1,237 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <libHX/io.h>
+#include <gromox/defs.h>
+#include <gromox/fileio.h>
+#include <gromox/scope.hpp>
+#include <gromox/util.hpp>
+#include "timer_queue.hpp"
+
+/* dead journal lines tolerated before compaction, on top of one per pending timer */
+#define COMPACT_SLACK 4096
+
+using namespace gromox;
+
+const TIMER *timer_queue::put(TIMER &&tmr)
+{
+	auto old = m_index.find(tmr.t_id);
+	if (old != m_index.end()) {
+		m_queue.erase(old->second);
+		m_index.erase(old);
+	}
+	auto id = tmr.t_id;
+	auto it = m_queue.insert(std::move(tmr)).first;
+	try {
+		m_index.emplace(id, it);
+	} catch (const std::bad_alloc &) {
+		m_queue.erase(it);
+		throw;
+	}
+	return &*it;
+}
+
+bool timer_queue::cancel(int t_id)
+{
+	auto it = m_index.find(t_id);
+	if (it == m_index.end())
+		return false;
+	m_queue.erase(it->second);
+	m_index.erase(it);
+	return true;
+}
+
+/* Take the earliest timer out of the queue if it is due at @now. */
+bool timer_queue::pop_due(time_t now, TIMER &out)
+{
+	if (m_queue.empty() || m_queue.begin()->exec_time > now)
+		return false;
+	auto node = m_queue.extract(m_queue.begin());
+	m_index.erase(node.value().t_id);
+	out = std::move(node.value());
+	return true;
+}
+
+void timer_encode_line(const char *in, char *out)
+{
+	int len, i, j;
+
+	len = strlen(in);
+	for (i=0, j=0; i<len; i++, j++) {
+		if (' ' == in[i] || '\\' == in[i] || '\t' == in[i] || '#' == in[i]) {
+			out[j++] = '\\';
+		}
+		out[j] = in[i];
+	}
+	out[j] = '\0';
+}
+
+static inline bool tq_blank(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+static inline bool tq_eol(char c)
+{
+	return c == '\0' || c == '#' || c == '\r' || c == '\n';
+}
+
+/*
+ * Parse one "%d%l%s:512" record the way list_file(3) would, but without
+ * its fixed-size item array, which would cost 524 bytes per journal line.
+ */
+static bool tq_parse_line(char *line, int &tid, long long &exectime,
+    std::string &command)
+{
+	auto p = line;
+	while (tq_blank(*p))
+		++p;
+	if (tq_eol(*p))
+		return false;
+	tid = strtol(p, &p, 0);
+	while (tq_blank(*p))
+		++p;
+	if (tq_eol(*p))
+		return false;
+	exectime = strtoll(p, &p, 0);
+	while (tq_blank(*p))
+		++p;
+	if (tq_eol(*p))
+		return false;
+	command.clear();
+	while (!tq_blank(*p) && !tq_eol(*p)) {
+		if (*p == '\\') {
+			++p;
+			if (!tq_blank(*p) && *p != '#' && *p != '\\')
+				return false;
+		}
+		command += *p++;
+	}
+	if (command.size() > 511)
+		command.resize(511);
+	return true;
+}
+
+timer_journal::~timer_journal()
+{
+	if (m_fd >= 0)
+		close(m_fd);
+}
+
+/**
+ * Replay the state file at @path into @q. A missing file is not an error.
+ * @last_tid is raised to the highest ID seen in the file.
+ */
+int timer_journal::load(const char *path, timer_queue &q, int &last_tid) try
+{
+	m_path = path;
+	m_records = 0;
+	std::unique_ptr<FILE, file_deleter> fp(fopen(path, "r"));
+	if (fp == nullptr)
+		return errno == ENOENT ? 0 : errno;
+	char *line = nullptr;
+	size_t linesize = 0;
+	auto cl_0 = make_scope_exit([&]() { free(line); });
+	std::string command;
+	while (getline(&line, &linesize, fp.get()) >= 0) {
+		int tid = 0;
+		long long exectime = 0;
+		if (!tq_parse_line(line, tid, exectime, command))
+			continue;
+		++m_records;
+		if (tid > last_tid)
+			last_tid = tid;
+		if (exectime == 0) {
+			q.cancel(tid);
+			continue;
+		}
+		TIMER tmr;
+		tmr.t_id = tid;
+		tmr.exec_time = exectime;
+		tmr.command = command;
+		q.put(std::move(tmr));
+	}
+	return 0;
+} catch (const std::bad_alloc &) {
+	return ENOMEM;
+}
+
+int timer_journal::open_append()
+{
+	if (m_fd >= 0)
+		close(m_fd);
+	m_fd = open(m_path.c_str(), O_CREAT | O_APPEND | O_WRONLY, FMODE_PRIVATE);
+	return m_fd >= 0 ? 0 : errno;
+}
+
+bool timer_journal::need_compact(size_t pending) const
+{
+	return m_records > 2 * pending + COMPACT_SLACK;
+}
+
+static int tq_format(const TIMER &tmr, char *buf)
+{
+	auto len = sprintf(buf, "%d\t%lld\t", tmr.t_id,
+	           static_cast<long long>(tmr.exec_time));
+	timer_encode_line(tmr.command.c_str(), buf + len);
+	len = strlen(buf);
+	buf[len++] = '\n';
+	return len;
+}
+
+/* Rewrite the state file to contain just the pending timers of @q. */
+int timer_journal::compact(const timer_queue &q) try
+{
+	auto temp_path = m_path + ".tmp";
+	wrapfd temp_fd = open(temp_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, FMODE_PRIVATE);
+	if (temp_fd.get() < 0)
+		return errno;
+	std::string buf;
+	char temp_line[2048];
+	for (const auto &tmr : q) {
+		buf.append(temp_line, tq_format(tmr, temp_line));
+		if (buf.size() < 65536)
+			continue;
+		if (HXio_fullwrite(temp_fd.get(), buf.data(), buf.size()) < 0)
+			return errno;
+		buf.clear();
+	}
+	if (HXio_fullwrite(temp_fd.get(), buf.data(), buf.size()) < 0)
+		return errno;
+	auto ret = temp_fd.close_wr();
+	if (ret != 0)
+		return ret;
+	if (rename(temp_path.c_str(), m_path.c_str()) < 0) {
+		ret = errno;
+		fprintf(stderr, "E-1404: rename %s %s: %s\n",
+		        temp_path.c_str(), m_path.c_str(), strerror(ret));
+		return ret;
+	}
+	m_records = q.size();
+	return open_append();
+} catch (const std::bad_alloc &) {
+	return ENOMEM;
+}
+
+int timer_journal::append(const TIMER &tmr)
+{
+	char temp_line[2048];
+	auto len = tq_format(tmr, temp_line);
+	++m_records;
+	return HXio_fullwrite(m_fd, temp_line, len) < 0 ? errno : 0;
+}
+
+int timer_journal::append_result(int t_id, const char *result)
+{
+	char temp_line[256];
+	auto len = snprintf(temp_line, std::size(temp_line), "%d\t0\t%s\n", t_id, result);
+	++m_records;
+	return HXio_fullwrite(m_fd, temp_line, len) < 0 ? errno : 0;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <ctime>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+struct TIMER {
+	int t_id = 0;
+	time_t exec_time = 0;
+	std::string command;
+};
+
+/*
+ * Pending timers ordered by execution time (ties broken by ID, i.e. in
+ * order of creation), plus an index by ID so that CANCEL does not have to
+ * walk the queue.
+ */
+class timer_queue {
+	struct tm_less {
+		bool operator()(const TIMER &a, const TIMER &b) const {
+			return a.exec_time < b.exec_time ||
+			       (a.exec_time == b.exec_time && a.t_id < b.t_id);
+		}
+	};
+	using set_type = std::set<TIMER, tm_less>;
+
+	public:
+	const TIMER *put(TIMER &&);
+	bool cancel(int t_id);
+	bool pop_due(time_t now, TIMER &);
+	size_t size() const { return m_index.size(); }
+	set_type::const_iterator begin() const { return m_queue.cbegin(); }
+	set_type::const_iterator end() const { return m_queue.cend(); }
+
+	private:
+	set_type m_queue;
+	std::unordered_map<int, set_type::iterator> m_index;
+};
+
+/*
+ * The state file is an append-only log of "<id> <time> <command>" lines for
+ * added timers and "<id> 0 <result>" lines for executed or cancelled ones.
+ * It is rewritten to just the pending timers once the dead lines outnumber
+ * them, which bounds replay time at startup to O(pending).
+ */
+struct timer_journal {
+	~timer_journal();
+	int load(const char *path, timer_queue &, int &last_tid);
+	int open_append();
+	int compact(const timer_queue &);
+	int append(const TIMER &);
+	int append_result(int t_id, const char *result);
+	bool need_compact(size_t pending) const;
+
+	std::string m_path;
+	int m_fd = -1;
+	size_t m_records = 0;
+};
+
+extern void timer_encode_line(const char *in, char *out);